@@ -48,6 +48,27 @@ Java_com_ravencoin_core_BRCoreMerkleBlock_createJniCoreMerkleBlock
     return (jlong) block;
 }
 
+/*
+ * Class:     com_ravencoin_core_BRCoreMerkleBlock
+ * Method:    createJniCoreMerkleBlockTrusted
+ * Signature: ([B)J
+ */
+JNIEXPORT jlong JNICALL
+Java_com_ravencoin_core_BRCoreMerkleBlock_createJniCoreMerkleBlockTrusted
+        (JNIEnv *env, jclass thisClass,
+         jbyteArray blockArray) {
+
+    int blockLength   = (*env)->GetArrayLength(env, blockArray);
+    jbyte *blockBytes = (*env)->GetByteArrayElements(env, blockArray, 0);
+
+    assert (NULL != blockBytes);
+    // Restores blockHash and height without X16R; returns 0 if the checksum doesn't match
+    BRMerkleBlock *block = BRMerkleBlockParseTrusted((const uint8_t *) blockBytes, (size_t) blockLength);
+    (*env)->ReleaseByteArrayElements(env, blockArray, blockBytes, JNI_ABORT);
+
+    return (jlong) block;
+}
+
 /*
  * Class:     com_ravencoin_core_BRCoreMerkleBlock
  * Method:    createJniCoreMerkleBlockEmpty
@@ -206,6 +227,27 @@ JNIEXPORT jbyteArray JNICALL Java_com_ravencoin_core_BRCoreMerkleBlock_serialize
     return byteArray;
 }
 
+/*
+ * Class:     com_ravencoin_core_BRCoreMerkleBlock
+ * Method:    serializeTrusted
+ * Signature: ()[B
+ */
+JNIEXPORT jbyteArray JNICALL Java_com_ravencoin_core_BRCoreMerkleBlock_serializeTrusted
+        (JNIEnv *env, jobject thisObject) {
+    BRMerkleBlock *block = (BRMerkleBlock *) getJNIReference(env, thisObject);
+
+    size_t      byteArraySize     = BRMerkleBlockSerializeTrusted(block, NULL, 0);
+    jbyteArray  byteArray         = (*env)->NewByteArray (env, (jsize) byteArraySize);
+    jbyte      *byteArrayElements = (*env)->GetByteArrayElements (env, byteArray, JNI_FALSE);
+
+    BRMerkleBlockSerializeTrusted(block, (uint8_t *) byteArrayElements, byteArraySize);
+
+    // Ensure ELEMENTS 'written' back to byteArray
+    (*env)->ReleaseByteArrayElements (env, byteArray, byteArrayElements, JNI_COMMIT);
+
+    return byteArray;
+}
+
 
 /*
  * Class:     com_ravencoin_core_BRCoreMerkleBlock
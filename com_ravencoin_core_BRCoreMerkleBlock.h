@@ -15,6 +15,14 @@ extern "C" {
 JNIEXPORT jlong JNICALL Java_com_ravencoin_core_BRCoreMerkleBlock_createJniCoreMerkleBlock
   (JNIEnv *, jclass, jbyteArray, jint);
 
+/*
+ * Class:     com_ravencoin_core_BRCoreMerkleBlock
+ * Method:    createJniCoreMerkleBlockTrusted
+ * Signature: ([B)J
+ */
+JNIEXPORT jlong JNICALL Java_com_ravencoin_core_BRCoreMerkleBlock_createJniCoreMerkleBlockTrusted
+  (JNIEnv *, jclass, jbyteArray);
+
 /*
  * Class:     com_ravencoin_core_BRCoreMerkleBlock
  * Method:    createJniCoreMerkleBlockEmpty
@@ -103,6 +111,14 @@ JNIEXPORT jlong JNICALL Java_com_ravencoin_core_BRCoreMerkleBlock_getHeight
 JNIEXPORT jbyteArray JNICALL Java_com_ravencoin_core_BRCoreMerkleBlock_serialize
   (JNIEnv *, jobject);
 
+/*
+ * Class:     com_ravencoin_core_BRCoreMerkleBlock
+ * Method:    serializeTrusted
+ * Signature: ()[B
+ */
+JNIEXPORT jbyteArray JNICALL Java_com_ravencoin_core_BRCoreMerkleBlock_serializeTrusted
+  (JNIEnv *, jobject);
+
 /*
  * Class:     com_ravencoin_core_BRCoreMerkleBlock
  * Method:    isValid
@@ -219,22 +219,21 @@ size_t BRScriptPushData(uint8_t *script, size_t scriptLen, const uint8_t *data,
 // we are unable to correctly sign later, then the entire wallet balance after that point would become stuck with the
 // current coin selection code
 
-// writes the ravencoin address for a scriptPubKey to addr
-// returns the number of bytes written, or addrLen needed if addr is NULL
-size_t BRAddressFromScriptPubKey(char *addr, size_t addrLen, const uint8_t *script, size_t scriptLen)
+// writes the address id for a scriptPubKey to id and returns true on success (no base58check encoding is done)
+int BRAddressIDFromScriptPubKey(BRAddressID *id, const uint8_t *script, size_t scriptLen)
 {
+    assert(id != NULL);
     assert(script != NULL || scriptLen == 0);
     if (! script || scriptLen == 0 || scriptLen > MAX_SCRIPT_LENGTH) return 0;
     
-    uint8_t data[21];
     const uint8_t *elems[BRScriptElements(NULL, 0, script, scriptLen)], *d = NULL;
     size_t count = BRScriptElements(elems, sizeof(elems) / sizeof(*elems), script, scriptLen), l = 0;
     
-    data[0] = RAVENCOIN_PUBKEY_ADDRESS;
+    id->version = RAVENCOIN_PUBKEY_ADDRESS;
 #if TESTNET
-    data[0] = RAVENCOIN_PUBKEY_ADDRESS_TEST;
+    id->version = RAVENCOIN_PUBKEY_ADDRESS_TEST;
 #elif REGTEST
-    data[0] = RAVENCOIN_PUBKEY_ADDRESS_REGTEST;
+    id->version = RAVENCOIN_PUBKEY_ADDRESS_REGTEST;
 #endif
     
     // elements count doesn't trigger for regular tx =5 for assets tx it's =8
@@ -243,29 +242,39 @@ size_t BRAddressFromScriptPubKey(char *addr, size_t addrLen, const uint8_t *scri
         // pay-to-pubkey-hash scriptPubKey
         d = BRScriptData(elems[2], &l);
         if (l != 20) d = NULL;
-        if (d) memcpy(&data[1], d, 20);
+        if (d) memcpy(&id->hash, d, 20);
     }
 #warning TODO: doesn't support PSH count for assets tx will be >3
     else if (count == 3 && *elems[0] == OP_HASH160 && *elems[1] == 20 && *elems[2] == OP_EQUAL) {
         // pay-to-script-hash scriptPubKey
-        data[0] = RAVENCOIN_SCRIPT_ADDRESS;
+        id->version = RAVENCOIN_SCRIPT_ADDRESS;
 #if TESTNET
-        data[0] = RAVENCOIN_SCRIPT_ADDRESS_TEST;
+        id->version = RAVENCOIN_SCRIPT_ADDRESS_TEST;
 #elif REGTEST
-        data[0] = RAVENCOIN_SCRIPT_ADDRESS_REGTEST;
+        id->version = RAVENCOIN_SCRIPT_ADDRESS_REGTEST;
 #endif
         d = BRScriptData(elems[1], &l);
         if (l != 20) d = NULL;
-        if (d) memcpy(&data[1], d, 20);
+        if (d) memcpy(&id->hash, d, 20);
     }
     else if (count == 2 && (*elems[0] == 65 || *elems[0] == 33) && *elems[1] == OP_CHECKSIG) {
         // pay-to-pubkey scriptPubKey
         d = BRScriptData(elems[0], &l);
         if (l != 65 && l != 33) d = NULL;
-        if (d) Hash160(&data[1], d, l);
+        if (d) Hash160(&id->hash, d, l);
     }
+    
+    return (d) ? 1 : 0;
+}
 
-    return (d) ? BRBase58CheckEncode(addr, addrLen, data, sizeof(data)) : 0;
+// writes the ravencoin address for a scriptPubKey to addr
+// returns the number of bytes written, or addrLen needed if addr is NULL
+size_t BRAddressFromScriptPubKey(char *addr, size_t addrLen, const uint8_t *script, size_t scriptLen)
+{
+    BRAddressID id;
+    
+    assert(script != NULL || scriptLen == 0);
+    return (BRAddressIDFromScriptPubKey(&id, script, scriptLen)) ? BRAddressFromID(addr, addrLen, &id) : 0;
 }
 
 // writes the ravencoin address for a scriptSig to addr
@@ -356,6 +365,36 @@ size_t BRAddressScriptPubKey(uint8_t *script, size_t scriptLen, const char *addr
     return r;
 }
 
+// writes the address id for addr to id and returns true on success
+int BRAddressIDFromAddress(BRAddressID *id, const char *addr)
+{
+    uint8_t data[21];
+    int r = 0;
+    
+    assert(id != NULL);
+    assert(addr != NULL);
+    r = (BRBase58CheckDecode(data, sizeof(data), addr) == 21);
+    
+    if (r) {
+        id->version = data[0];
+        memcpy(&id->hash, &data[1], 20);
+    }
+    
+    return r;
+}
+
+// writes the ravencoin address for id to addr
+// returns the number of bytes written, or addrLen needed if addr is NULL
+size_t BRAddressFromID(char *addr, size_t addrLen, const BRAddressID *id)
+{
+    uint8_t data[21];
+    
+    assert(id != NULL);
+    data[0] = id->version;
+    memcpy(&data[1], &id->hash, 20);
+    return BRBase58CheckEncode(addr, addrLen, data, sizeof(data));
+}
+
 // returns true if addr is a valid ravencoin address
 int BRAddressIsValid(const char *addr)
 {
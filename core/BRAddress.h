@@ -12,6 +12,7 @@
 
 #include "BRCrypto.h"
 #include "BRScript.h"
+#include "BRInt.h"
 #include <string.h>
 #include <stddef.h>
 #include <inttypes.h>
@@ -70,6 +71,22 @@ typedef struct {
 // returns the number of bytes written, or addrLen needed if addr is NULL
 size_t BRAddressFromScriptPubKey(char *addr, size_t addrLen, const uint8_t *script, size_t scriptLen);
 
+// hash160 of the public key or redeem script an address pays to, and the address version byte giving its script type
+typedef struct {
+    UInt160 hash;
+    uint8_t version;
+} BRAddressID;
+
+// writes the address id for a scriptPubKey to id and returns true on success (no base58check encoding is done)
+int BRAddressIDFromScriptPubKey(BRAddressID *id, const uint8_t *script, size_t scriptLen);
+
+// writes the address id for addr to id and returns true on success
+int BRAddressIDFromAddress(BRAddressID *id, const char *addr);
+
+// writes the ravencoin address for id to addr
+// returns the number of bytes written, or addrLen needed if addr is NULL
+size_t BRAddressFromID(char *addr, size_t addrLen, const BRAddressID *id);
+
 // writes the RAVENCOIN address for a scriptSig to addr
 // returns the number of bytes written, or addrLen needed if addr is NULL
 size_t BRAddressFromScriptSig(char *addr, size_t addrLen, const uint8_t *script, size_t scriptLen);
@@ -97,6 +114,20 @@ inline static int BRAddressEq(const void *addr, const void *otherAddr)
             strncmp((const char *)addr, (const char *)otherAddr, sizeof(BRAddress)) == 0);
 }
 
+// returns a hash value for an address id suitable for use in a hashtable
+inline static size_t BRAddressIDHash(const void *id)
+{
+    // hash160 is already uniformly distributed
+    return (size_t)(((const BRAddressID *)id)->hash.u32[0] ^ ((const BRAddressID *)id)->version);
+}
+
+// true if id and otherId are equal
+inline static int BRAddressIDEq(const void *id, const void *otherId)
+{
+    return (id == otherId || (UInt160Eq(((const BRAddressID *)id)->hash, ((const BRAddressID *)otherId)->hash) &&
+                              ((const BRAddressID *)id)->version == ((const BRAddressID *)otherId)->version));
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -10,11 +10,16 @@
 #include "BRBIP44Sequence.h"
 #include "BRCrypto.h"
 #include "BRBase58.h"
+#include "BRParallel.h"
 #include <string.h>
 #include <assert.h>
+#include <stdlib.h>
 
 #define BIP32_SEED_KEY "Bitcoin seed"
 
+#define PUBKEY_DERIVE_MAX_THREADS 8  // upper bound on worker threads used to derive a batch of public keys
+#define PUBKEY_DERIVE_MIN_BATCH   16 // minimum keys per worker, smaller batches are derived on the calling thread
+
 #ifdef TESTNET
 #define BIP32_XPRV     "\x04\x88\xAD\xE4" //
 #define BIP32_XPUB     "\x04\x88\xB2\x1E" //
@@ -64,6 +69,25 @@ static void _CKDpriv(UInt256 *k, UInt256 *c, uint32_t i) {
     mem_clean(buf, sizeof(buf));
 }
 
+// CKDpriv for a non-hardened child of a parent whose public key K = point(k) is already known, deriving many children
+// of the same node this way saves the point multiplication for K each time
+static void _CKDprivChild(UInt256 *k, UInt256 *c, const BRECPoint *K, uint32_t i) {
+    uint8_t buf[sizeof(BRECPoint) + sizeof(i)];
+    UInt512 I;
+
+    assert((i & BIP32_HARD) == 0);
+    memcpy(buf, K, sizeof(*K));
+    UInt32SetBE(&buf[sizeof(BRECPoint)], i);
+
+    HMAC(&I, SHA512, sizeof(UInt512), c, sizeof(*c), buf, sizeof(buf)); // I = HMAC-SHA512(c, P(k) || i)
+
+    BRSecp256k1ModAdd(k, (UInt256 *) &I); // k = IL + k (mod n)
+    *c = *(UInt256 *)&I.u8[sizeof(UInt256)]; // c = IR
+
+    var_clean(&I);
+    mem_clean(buf, sizeof(buf));
+}
+
 // Public parent key -> public child key
 //
 // CKDpub((Kpar, cpar), i) -> (Ki, ci) computes a child extended public key from the parent extended public key.
@@ -165,22 +189,73 @@ BRMasterPubKey BRBIP44MasterPubKey(const void *seed, size_t seedLen, uint32_t co
 // returns number of bytes written, or pubKeyLen needed if pubKey is NULL
 size_t BRBIP32PubKey(uint8_t *pubKey, size_t pubKeyLen, BRMasterPubKey mpk, uint32_t chain, uint32_t index)
 {
-    UInt256 chainCode = mpk.chainCode;
-    
     assert(memcmp(&mpk, &MASTER_PUBKEY_NONE, sizeof(mpk)) != 0);
     
     if (pubKey && sizeof(BRECPoint) <= pubKeyLen) {
-        *(BRECPoint *)pubKey = *(BRECPoint *)mpk.pubKey;
+        BRChainPubKey cpk = BRBIP32ChainPubKey(mpk, chain);
+        
+        BRBIP32ChainChildPubKey(pubKey, pubKeyLen, &cpk, index);
+        var_clean(&cpk.chainCode);
+    }
+    
+    return (! pubKey || sizeof(BRECPoint) <= pubKeyLen) ? sizeof(BRECPoint) : 0;
+}
 
-        _CKDpub((BRECPoint *)pubKey, &chainCode, chain); // path N(m/0H/chain)
-        _CKDpub((BRECPoint *)pubKey, &chainCode, index); // index'th key in chain
+// returns the extended public key for path N(m/0H/chain)
+BRChainPubKey BRBIP32ChainPubKey(BRMasterPubKey mpk, uint32_t chain)
+{
+    BRChainPubKey cpk;
+    
+    assert(memcmp(&mpk, &MASTER_PUBKEY_NONE, sizeof(mpk)) != 0);
+    cpk.chainCode = mpk.chainCode;
+    *(BRECPoint *)cpk.pubKey = *(BRECPoint *)mpk.pubKey;
+    _CKDpub((BRECPoint *)cpk.pubKey, &cpk.chainCode, chain); // path N(m/0H/chain)
+    return cpk;
+}
 
+// writes the public key for path N(m/0H/chain/index) to pubKey, given cpk for N(m/0H/chain)
+// returns number of bytes written, or pubKeyLen needed if pubKey is NULL
+size_t BRBIP32ChainChildPubKey(uint8_t *pubKey, size_t pubKeyLen, const BRChainPubKey *cpk, uint32_t index)
+{
+    UInt256 chainCode;
+    
+    assert(cpk != NULL);
+    
+    if (pubKey && sizeof(BRECPoint) <= pubKeyLen) {
+        chainCode = cpk->chainCode;
+        *(BRECPoint *)pubKey = *(const BRECPoint *)cpk->pubKey;
+        _CKDpub((BRECPoint *)pubKey, &chainCode, index); // index'th key in chain
         var_clean(&chainCode);
     }
     
     return (! pubKey || sizeof(BRECPoint) <= pubKeyLen) ? sizeof(BRECPoint) : 0;
 }
 
+typedef struct {
+    BRECPoint *pubKeys;
+    const BRChainPubKey *cpk;
+    uint32_t index;
+} _PubKeyDeriveJob;
+
+static void _BIP32ChainPubKeyListRoutine(void *info, size_t start, size_t end)
+{
+    const _PubKeyDeriveJob *job = info;
+    
+    for (size_t i = start; i < end; i++) {
+        BRBIP32ChainChildPubKey(job->pubKeys[i].p, sizeof(job->pubKeys[i]), job->cpk, job->index + (uint32_t)i);
+    }
+}
+
+// writes the public keys for paths N(m/0H/chain/index) through N(m/0H/chain/index + count - 1) to pubKeys, given cpk
+// for N(m/0H/chain), spreading larger batches across worker threads
+void BRBIP32ChainPubKeyList(BRECPoint *pubKeys, size_t count, const BRChainPubKey *cpk, uint32_t index)
+{
+    assert(pubKeys != NULL || count == 0);
+    assert(cpk != NULL);
+    BRParallelRanges(_BIP32ChainPubKeyListRoutine, &(_PubKeyDeriveJob) { pubKeys, cpk, index }, count,
+                     PUBKEY_DERIVE_MIN_BATCH, PUBKEY_DERIVE_MAX_THREADS);
+}
+
 // sets the private key for path m/0H/chain/index to key
 void BRBIP32PrivKey(BRKey *key, const void *seed, size_t seedLen, uint32_t chain, uint32_t index) {
     BRBIP32PrivKeyPath(key, seed, seedLen, 3, 0 | BIP32_HARD, chain, index);
@@ -191,6 +266,7 @@ void BRBIP32PrivKeyList(BRKey *keys, size_t keysCount, const void *seed, size_t
                         const uint32_t *indexes) {
     UInt512 I;
     UInt256 secret, chainCode, s, c;
+    BRECPoint K;
     
     assert(keys != NULL || keysCount == 0);
     assert(seed != NULL || seedLen == 0);
@@ -204,11 +280,15 @@ void BRBIP32PrivKeyList(BRKey *keys, size_t keysCount, const void *seed, size_t
 
         _CKDpriv(&secret, &chainCode, 0 | BIP32_HARD); // path m/0H
         _CKDpriv(&secret, &chainCode, chain); // path m/0H/chain
+        BRSecp256k1PointGen(&K, &secret); // public key of the chain node, shared by every key derived from it
     
         for (size_t i = 0; i < keysCount; i++) {
             s = secret;
             c = chainCode;
-            _CKDpriv(&s, &c, indexes[i]); // index'th key in chain
+
+            if (indexes[i] & BIP32_HARD) _CKDpriv(&s, &c, indexes[i]); // index'th key in chain
+            else _CKDprivChild(&s, &c, &K, indexes[i]);
+
             BRKeySetSecret(&keys[i], &s, 1);
         }
         
@@ -221,6 +301,7 @@ void BRBIP44PrivKeyList(BRKey *keys, size_t keysCount, const void *seed, size_t
                         uint32_t account, uint32_t chain, const uint32_t *indexes) {
     UInt512 I;
     UInt256 secret, chainCode, s, c;
+    BRECPoint K;
 
     assert(keys != NULL || keysCount == 0);
     assert(seed != NULL || seedLen == 0);
@@ -235,12 +316,16 @@ void BRBIP44PrivKeyList(BRKey *keys, size_t keysCount, const void *seed, size_t
             _CKDpriv(&secret, &chainCode, BIP44_PURPOSE | BIP32_HARD); // path m/44H
             _CKDpriv(&secret, &chainCode, coinType      | BIP32_HARD); // path m/44H/coinType'
             _CKDpriv(&secret, &chainCode, account       | BIP32_HARD); // path m/44H/coinType'/account'
+            _CKDpriv(&secret, &chainCode, chain); // path m/44'/coinType'/account'/chain
+            BRSecp256k1PointGen(&K, &secret); // public key of the chain node, shared by every key derived from it
 
         for (size_t i = 0; i < keysCount; i++) {
             s = secret;
             c = chainCode;
-            _CKDpriv(&s, &c, chain); // path m/44'/coinType'/account'/chain
-            _CKDpriv(&s, &c, indexes[i]); // path m/44'/coinType'/account'/chain/index
+
+            // path m/44'/coinType'/account'/chain/index
+            if (indexes[i] & BIP32_HARD) _CKDpriv(&s, &c, indexes[i]);
+            else _CKDprivChild(&s, &c, &K, indexes[i]);
 
             BRKeySetSecret(&keys[i], &s, 1);
         }
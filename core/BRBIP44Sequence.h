@@ -61,6 +61,23 @@ BRMasterPubKey BRBIP44MasterPubKey(const void *seed, size_t seedLen, uint32_t co
 // returns number of bytes written, or pubKeyLen needed if pubKey is NULL
 size_t BRBIP32PubKey(uint8_t *pubKey, size_t pubKeyLen, BRMasterPubKey mpk, uint32_t chain, uint32_t index);
 
+// extended public key for path N(m/0H/chain), keeping it saves a CKDpub step for every key derived in the chain
+typedef struct {
+    UInt256 chainCode;
+    uint8_t pubKey[33];
+} BRChainPubKey;
+
+// returns the extended public key for path N(m/0H/chain)
+BRChainPubKey BRBIP32ChainPubKey(BRMasterPubKey mpk, uint32_t chain);
+
+// writes the public key for path N(m/0H/chain/index) to pubKey, given cpk for N(m/0H/chain)
+// returns number of bytes written, or pubKeyLen needed if pubKey is NULL
+size_t BRBIP32ChainChildPubKey(uint8_t *pubKey, size_t pubKeyLen, const BRChainPubKey *cpk, uint32_t index);
+
+// writes the public keys for paths N(m/0H/chain/index) through N(m/0H/chain/index + count - 1) to pubKeys, given cpk
+// for N(m/0H/chain), spreading larger batches across worker threads
+void BRBIP32ChainPubKeyList(BRECPoint *pubKeys, size_t count, const BRChainPubKey *cpk, uint32_t index);
+
 // sets the private key for path m/0H/chain/index to key
 void BRBIP32PrivKey(BRKey *key, const void *seed, size_t seedLen, uint32_t chain, uint32_t index);
 
@@ -83,21 +83,13 @@ static const CheckPoint RegTestCheckpoints[] = {
 };
 
 static int MainNetVerifyDifficulty(const BRMerkleBlock *block, const BRSet *blockSet) {
-    const BRMerkleBlock *previous, *b = NULL;
-    uint32_t i;
+    const BRMerkleBlock *previous;
 
     assert(block != NULL);
     assert(blockSet != NULL);
 
-    // check if we hit a difficulty transition, and find previous transition block
-    if ((block->height % BLOCK_DIFFICULTY_INTERVAL) == 0) {
-        for (i = 0, b = block; b && i < BLOCK_DIFFICULTY_INTERVAL; i++) {
-            b = BRSetGet(blockSet, &b->prevBlock);
-        }
-    }
-
     previous = BRSetGet(blockSet, &block->prevBlock);
-    return BRMerkleBlockVerifyDifficulty(block, previous, (b) ? b->timestamp : 0);
+    return (previous) ? BRMerkleBlockVerifyDifficulty(block, previous, blockSet, NULL) : 0;
 }
 
 static int TestNetVerifyDifficulty(const BRMerkleBlock *block, const BRSet *blockSet) {
@@ -113,19 +113,22 @@ void SHA1(void *md20, const void *data, size_t len)
 #define s2(x) (ror32((x), 7) ^ ror32((x), 18) ^ ((x) >> 3))
 #define s3(x) (ror32((x), 17) ^ ror32((x), 19) ^ ((x) >> 10))
 
+static const uint32_t _sha256K[] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t _sha256IV[] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                      0x1f83d9ab, 0x5be0cd19 }; // initial buffer values
+
 static void _SHA256Compress(uint32_t *r, const uint32_t *x)
 {
-    static const uint32_t k[] = {
-        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
-        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
-        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
-        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
-    };
-    
     int i;
     uint32_t a = r[0], b = r[1], c = r[2], d = r[3], e = r[4], f = r[5], g = r[6], h = r[7], t1, t2, w[64];
     
@@ -133,7 +136,7 @@ static void _SHA256Compress(uint32_t *r, const uint32_t *x)
     for (; i < 64; i++) w[i] = s3(w[i - 2]) + w[i - 7] + s2(w[i - 15]) + w[i - 16];
     
     for (i = 0; i < 64; i++) {
-        t1 = h + s1(e) + ch(e, f, g) + k[i] + w[i];
+        t1 = h + s1(e) + ch(e, f, g) + _sha256K[i] + w[i];
         t2 = s0(a) + maj(a, b, c);
         h = g, g = f, f = e, e = d + t1, d = c, c = b, b = a, a = t1 + t2;
     }
@@ -143,25 +146,232 @@ static void _SHA256Compress(uint32_t *r, const uint32_t *x)
     mem_clean(w, sizeof(w));
 }
 
+// portable sha-256 transform of consecutive 64 byte blocks
+static void _SHA256CompressBlocks(uint32_t *r, const uint8_t *data, size_t blocks)
+{
+    uint32_t x[16];
+
+    for (; blocks > 0; blocks--, data += 64) {
+        memcpy(x, data, 64);
+        _SHA256Compress(r, x);
+    }
+
+    mem_clean(x, sizeof(x));
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+
+// four sha-256 rounds with the x86 sha extensions, k points to the four round constants
+#define sha256ni_rnds4(abef, cdgh, m, k) do {\
+    __m128i _t = _mm_add_epi32((m), _mm_loadu_si128((const __m128i *)(k)));\
+    (cdgh) = _mm_sha256rnds2_epu32((cdgh), (abef), _t);\
+    (abef) = _mm_sha256rnds2_epu32((abef), (cdgh), _mm_shuffle_epi32(_t, 0x0e));\
+} while (0)
+
+// next four message schedule words, m0 holds the words from 16 rounds back and is replaced
+#define sha256ni_sched(m0, m1, m2, m3)\
+    ((m0) = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32((m0), (m1)), _mm_alignr_epi8((m3), (m2), 4)), (m3)))
+
+// sha-256 transform using the x86 sha extensions (sha-ni)
+__attribute__((target("sha,sse4.1")))
+static void _SHA256CompressSHANI(uint32_t *r, const uint8_t *data, size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL); // big endian words
+    __m128i abef, cdgh, t, abefSave, cdghSave, m0, m1, m2, m3;
+    int i;
+
+    t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&r[0]), 0xb1); // cdab
+    cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&r[4]), 0x1b); // efgh
+    abef = _mm_alignr_epi8(t, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, t, 0xf0);
+
+    for (; blocks > 0; blocks--, data += 64) {
+        abefSave = abef, cdghSave = cdgh;
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&data[0]), mask);
+        sha256ni_rnds4(abef, cdgh, m0, &_sha256K[0]);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&data[16]), mask);
+        sha256ni_rnds4(abef, cdgh, m1, &_sha256K[4]);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&data[32]), mask);
+        sha256ni_rnds4(abef, cdgh, m2, &_sha256K[8]);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&data[48]), mask);
+        sha256ni_rnds4(abef, cdgh, m3, &_sha256K[12]);
+
+        for (i = 16; i < 64; i += 16) {
+            sha256ni_sched(m0, m1, m2, m3);
+            sha256ni_rnds4(abef, cdgh, m0, &_sha256K[i]);
+            sha256ni_sched(m1, m2, m3, m0);
+            sha256ni_rnds4(abef, cdgh, m1, &_sha256K[i + 4]);
+            sha256ni_sched(m2, m3, m0, m1);
+            sha256ni_rnds4(abef, cdgh, m2, &_sha256K[i + 8]);
+            sha256ni_sched(m3, m0, m1, m2);
+            sha256ni_rnds4(abef, cdgh, m3, &_sha256K[i + 12]);
+        }
+
+        abef = _mm_add_epi32(abef, abefSave);
+        cdgh = _mm_add_epi32(cdgh, cdghSave);
+    }
+
+    t = _mm_shuffle_epi32(abef, 0x1b); // feba
+    cdgh = _mm_shuffle_epi32(cdgh, 0xb1); // dchg
+    _mm_storeu_si128((__m128i *)&r[0], _mm_blend_epi16(t, cdgh, 0xf0)); // dcba
+    _mm_storeu_si128((__m128i *)&r[4], _mm_alignr_epi8(cdgh, t, 8)); // hgfe
+}
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SHA256_WAYS 8
+
+// eight independent sha-256 states or message words, one per lane, using compiler vector extensions so the same code
+// builds for sse2, avx2 or neon
+typedef uint32_t _sha256Vec __attribute__((vector_size(4*SHA256_WAYS)));
+
+// sha-256 transform of one block in each lane, w holds the first 16 message words and is used for the schedule
+__attribute__((always_inline))
+static inline void _SHA256CompressWays(_sha256Vec *r, _sha256Vec *w)
+{
+    _sha256Vec a = r[0], b = r[1], c = r[2], d = r[3], e = r[4], f = r[5], g = r[6], h = r[7], t1, t2;
+    int i;
+
+    for (i = 16; i < 64; i++) w[i] = s3(w[i - 2]) + w[i - 7] + s2(w[i - 15]) + w[i - 16];
+
+    for (i = 0; i < 64; i++) {
+        t1 = h + s1(e) + ch(e, f, g) + _sha256K[i] + w[i];
+        t2 = s0(a) + maj(a, b, c);
+        h = g, g = f, f = e, e = d + t1, d = c, c = b, b = a, a = t1 + t2;
+    }
+
+    r[0] += a, r[1] += b, r[2] += c, r[3] += d, r[4] += e, r[5] += f, r[6] += g, r[7] += h;
+}
+
+// double-sha-256 of SHA256_WAYS consecutive 64 byte messages, one per lane
+__attribute__((always_inline))
+static inline void _SHA256_2_64Ways(uint8_t *md32, const uint8_t *data)
+{
+    _sha256Vec r[8], w[64], zero = { 0 };
+    uint32_t x;
+    int i, j;
+
+    for (i = 0; i < 16; i++) {
+        for (j = 0; j < SHA256_WAYS; j++) memcpy(&x, &data[j*64 + i*4], sizeof(x)), w[i][j] = be32(x);
+    }
+
+    for (i = 0; i < 8; i++) r[i] = zero + _sha256IV[i];
+    _SHA256CompressWays(r, w);
+    for (i = 0; i < 16; i++) w[i] = zero; // padding block of a 64 byte message
+    w[0] += 0x80000000, w[15] += 512;
+    _SHA256CompressWays(r, w);
+
+    for (i = 0; i < 8; i++) w[i] = r[i], r[i] = zero + _sha256IV[i];
+    for (i = 8; i < 16; i++) w[i] = zero; // padding of the 32 byte first digest
+    w[8] += 0x80000000, w[15] += 256;
+    _SHA256CompressWays(r, w);
+
+    for (i = 0; i < 8; i++) {
+        for (j = 0; j < SHA256_WAYS; j++) x = be32(r[i][j]), memcpy(&md32[j*32 + i*4], &x, sizeof(x));
+    }
+}
+
+static void _SHA256_2_64Vec(uint8_t *md32, const uint8_t *data)
+{
+    _SHA256_2_64Ways(md32, data);
+}
+
+#if SHA256_X86
+__attribute__((target("avx2")))
+static void _SHA256_2_64AVX2(uint8_t *md32, const uint8_t *data)
+{
+    _SHA256_2_64Ways(md32, data);
+}
+#endif
+#endif
+
+// sha-256 implementations in order of preference, each used only if the cpu supports it
+static const struct {
+    const char *name;
+    void (*compress)(uint32_t *r, const uint8_t *data, size_t blocks);
+    void (*md64Ways)(uint8_t *md32, const uint8_t *data); // double-sha-256 of SHA256_WAYS 64 byte messages, or NULL
+} _sha256Impls[] = {
+    { "scalar", _SHA256CompressBlocks, NULL },
+#ifdef SHA256_WAYS
+    { "vector", _SHA256CompressBlocks, _SHA256_2_64Vec },
+#endif
+#if SHA256_X86
+    { "avx2", _SHA256CompressBlocks, _SHA256_2_64AVX2 },
+    { "sha-ni", _SHA256CompressSHANI, NULL },
+#endif
+};
+
+static volatile int _sha256Impl = -1;
+
+static int _SHA256ImplSupported(const char *name)
+{
+    int r = 1;
+
+#if SHA256_X86
+    unsigned int a, b, c, d, sse41 = 0, avx = 0, avx2 = 0, sha = 0;
+    uint32_t xcr0Lo, xcr0Hi;
+
+    if (__get_cpuid(1, &a, &b, &c, &d)) {
+        sse41 = (c >> 19) & 1;
+
+        if (((c >> 27) & 1) && ((c >> 28) & 1)) { // osxsave and avx, check that the os saves ymm registers
+            __asm__ ("xgetbv" : "=a"(xcr0Lo), "=d"(xcr0Hi) : "c"(0));
+            avx = ((xcr0Lo & 6) == 6);
+        }
+    }
+
+    if (__get_cpuid_count(7, 0, &a, &b, &c, &d)) avx2 = avx && ((b >> 5) & 1), sha = sse41 && ((b >> 29) & 1);
+    if (strcmp(name, "avx2") == 0) r = avx2;
+    if (strcmp(name, "sha-ni") == 0) r = sha;
+#endif
+
+    return r;
+}
+
+// index of the fastest sha-256 implementation the cpu supports, detected on first use
+static int _SHA256Impl(void)
+{
+    int i = _sha256Impl;
+
+    if (i < 0) {
+        i = sizeof(_sha256Impls)/sizeof(*_sha256Impls) - 1;
+        while (i > 0 && ! _SHA256ImplSupported(_sha256Impls[i].name)) i--;
+        _sha256Impl = i;
+    }
+
+    return i;
+}
+
+// selects a sha-256 implementation by index, or autodetects it again if impl is negative, returns the name of the
+// implementation now used, or NULL if impl isn't supported on this cpu
+const char *SHA256ImplementationTest(int impl)
+{
+    if (impl >= (int)(sizeof(_sha256Impls)/sizeof(*_sha256Impls))) return NULL;
+    if (impl >= 0 && ! _SHA256ImplSupported(_sha256Impls[impl].name)) return NULL;
+    _sha256Impl = impl;
+    return _sha256Impls[_SHA256Impl()].name;
+}
+
 void SHA224(void *md28, const void *data, size_t len) {
     size_t i;
     uint32_t x[16], buf[] = { 0xc1059ed8, 0x367cd507, 0x3070dd17, 0xf70e5939, 0xffc00b31, 0x68581511,
                               0x64f98fa7, 0xbefa4fa4 }; // initial buffer values
+    void (*compress)(uint32_t *, const uint8_t *, size_t) = _sha256Impls[_SHA256Impl()].compress;
 
     assert(md28 != NULL);
     assert(data != NULL || len == 0);
 
-    for (i = 0; i < len; i += 64) { // process data in 64 byte blocks
-        memcpy(x, (const uint8_t *)data + i, (i + 64 < len) ? 64 : len - i);
-        if (i + 64 > len) break;
-        _SHA256Compress(buf, x);
-    }
-
-    memset((uint8_t *)x + (len - i), 0, 64 - (len - i)); // clear remainder of x
+    i = len - len % 64;
+    compress(buf, data, len / 64); // process data in 64 byte blocks
+    memset(x, 0, 64); // clear x
+    if (len > i) memcpy(x, (const uint8_t *)data + i, len - i);
     ((uint8_t *)x)[len - i] = 0x80; // append padding
-    if (len - i >= 56) _SHA256Compress(buf, x), memset(x, 0, 64); // length goes to next block
+    if (len - i >= 56) compress(buf, (const uint8_t *)x, 1), memset(x, 0, 64); // length goes to next block
     x[14] = be32((uint32_t)(len >> 29)), x[15] = be32((uint32_t)(len << 3)); // append length in bits
-    _SHA256Compress(buf, x); // finalize
+    compress(buf, (const uint8_t *)x, 1); // finalize
     for (i = 0; i < 7; i++) buf[i] = be32(buf[i]); // endian swap
     memcpy(md28, buf, 28); // write to md
     mem_clean(x, sizeof(x));
@@ -171,29 +381,76 @@ void SHA224(void *md28, const void *data, size_t len) {
 void SHA256(void *md32, const void *data, size_t len)
 {
     size_t i;
-    uint32_t x[16], buf[] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c,
-                              0x1f83d9ab, 0x5be0cd19 }; // initial buffer values
+    uint32_t x[16], buf[8];
+    void (*compress)(uint32_t *, const uint8_t *, size_t) = _sha256Impls[_SHA256Impl()].compress;
     
     assert(md32 != NULL);
     assert(data != NULL || len == 0);
 
-    for (i = 0; i < len; i += 64) { // process data in 64 byte blocks
-        memcpy(x, (const uint8_t *)data + i, (i + 64 < len) ? 64 : len - i);
-        if (i + 64 > len) break;
-        _SHA256Compress(buf, x);
-    }
-    
-    memset((uint8_t *)x + (len - i), 0, 64 - (len - i)); // clear remainder of x
+    memcpy(buf, _sha256IV, sizeof(buf));
+    i = len - len % 64;
+    compress(buf, data, len / 64); // process data in 64 byte blocks
+    memset(x, 0, 64); // clear x
+    if (len > i) memcpy(x, (const uint8_t *)data + i, len - i);
     ((uint8_t *)x)[len - i] = 0x80; // append padding
-    if (len - i >= 56) _SHA256Compress(buf, x), memset(x, 0, 64); // length goes to next block
+    if (len - i >= 56) compress(buf, (const uint8_t *)x, 1), memset(x, 0, 64); // length goes to next block
     x[14] = be32((uint32_t)(len >> 29)), x[15] = be32((uint32_t)(len << 3)); // append length in bits
-    _SHA256Compress(buf, x); // finalize
+    compress(buf, (const uint8_t *)x, 1); // finalize
     for (i = 0; i < 8; i++) buf[i] = be32(buf[i]); // endian swap
     memcpy(md32, buf, 32); // write to md
     mem_clean(x, sizeof(x));
     mem_clean(buf, sizeof(buf));
 }
 
+void SHA256Init(BRSHA256Context *ctx)
+{
+    assert(ctx != NULL);
+    memcpy(ctx->buf, _sha256IV, sizeof(_sha256IV));
+    ctx->len = 0;
+}
+
+void SHA256Update(BRSHA256Context *ctx, const void *data, size_t len)
+{
+    size_t i = 0, used, n;
+    void (*compress)(uint32_t *, const uint8_t *, size_t) = _sha256Impls[_SHA256Impl()].compress;
+
+    assert(ctx != NULL);
+    assert(data != NULL || len == 0);
+    used = (size_t)(ctx->len % 64);
+    ctx->len += len;
+
+    if (used > 0) { // fill the partial block left by the previous update
+        n = (64 - used < len) ? 64 - used : len;
+        memcpy((uint8_t *)ctx->x + used, data, n);
+        i = n;
+        if (used + n < 64) return;
+        compress(ctx->buf, (const uint8_t *)ctx->x, 1);
+    }
+
+    if (len - i >= 64) compress(ctx->buf, (const uint8_t *)data + i, (len - i) / 64); // process 64 byte blocks
+    i = len - (len - i) % 64;
+    if (len > i) memcpy(ctx->x, (const uint8_t *)data + i, len - i);
+}
+
+// writes the digest to md32 and wipes ctx
+void SHA256Final(BRSHA256Context *ctx, void *md32)
+{
+    size_t i, used;
+    void (*compress)(uint32_t *, const uint8_t *, size_t) = _sha256Impls[_SHA256Impl()].compress;
+
+    assert(ctx != NULL);
+    assert(md32 != NULL);
+    used = (size_t)(ctx->len % 64);
+    memset((uint8_t *)ctx->x + used, 0, 64 - used); // clear remainder of x
+    ((uint8_t *)ctx->x)[used] = 0x80; // append padding
+    if (used >= 56) compress(ctx->buf, (const uint8_t *)ctx->x, 1), memset(ctx->x, 0, 64); // length to next block
+    ctx->x[14] = be32((uint32_t)(ctx->len >> 29)), ctx->x[15] = be32((uint32_t)(ctx->len << 3)); // length in bits
+    compress(ctx->buf, (const uint8_t *)ctx->x, 1); // finalize
+    for (i = 0; i < 8; i++) ctx->buf[i] = be32(ctx->buf[i]); // endian swap
+    memcpy(md32, ctx->buf, 32); // write to md
+    mem_clean(ctx, sizeof(*ctx));
+}
+
 // double-sha-256 = sha-256(sha-256(x))
 void SHA256_2(void *md32, const void *data, size_t len)
 {
@@ -205,6 +462,50 @@ void SHA256_2(void *md32, const void *data, size_t len)
     SHA256(md32, t, sizeof(t));
 }
 
+// double-sha-256 of a 64 byte message using precomputed padding blocks
+static void _SHA256_2_64(uint8_t *md32, const uint8_t *data, void (*compress)(uint32_t *, const uint8_t *, size_t))
+{
+    static const uint8_t pad64[64] = { 0x80, [62] = 0x02 }; // padding block with the 512 bit message length
+    uint8_t x[64] = { [32] = 0x80, [62] = 0x01 }; // first digest and its padding with the 256 bit length
+    uint32_t buf[8];
+    int i;
+
+    memcpy(buf, _sha256IV, sizeof(buf));
+    compress(buf, data, 1);
+    compress(buf, pad64, 1);
+    for (i = 0; i < 8; i++) buf[i] = be32(buf[i]); // endian swap
+    memcpy(x, buf, 32);
+    memcpy(buf, _sha256IV, sizeof(buf));
+    compress(buf, x, 1);
+    for (i = 0; i < 8; i++) buf[i] = be32(buf[i]); // endian swap
+    memcpy(md32, buf, 32);
+    mem_clean(x, sizeof(x));
+    mem_clean(buf, sizeof(buf));
+}
+
+// double-sha-256 of count consecutive 64 byte messages, such as pairs of merkle tree nodes, md32 receives count 32 byte
+// digests and may be the same buffer as data
+void SHA256_2_64(void *md32, const void *data, size_t count)
+{
+    int impl = _SHA256Impl();
+    size_t i = 0;
+
+    assert(md32 != NULL);
+    assert(data != NULL || count == 0);
+
+#ifdef SHA256_WAYS
+    if (_sha256Impls[impl].md64Ways) {
+        for (; i + SHA256_WAYS <= count; i += SHA256_WAYS) {
+            _sha256Impls[impl].md64Ways((uint8_t *)md32 + i*32, (const uint8_t *)data + i*64);
+        }
+    }
+#endif
+
+    for (; i < count; i++) {
+        _SHA256_2_64((uint8_t *)md32 + i*32, (const uint8_t *)data + i*64, _sha256Impls[impl].compress);
+    }
+}
+
 int GetNibble(const uint8_t *data, int index)
 {
     index = 63 - index;
@@ -227,13 +528,10 @@ void trim512to256(void* in_512, void* out_256)
     memcpy((void*)out_256, (void*)in_512, 32);
 }
 
-void X16R(void *md32, const void *data, size_t len)
+// hashes len bytes of in with the X16R primitive given by hashSelection, or the X16Rv2 variant of it if v2 is true,
+// and writes the 512bit result to out, which may be the same buffer as in
+static void _X16RRound(int hashSelection, int v2, const void *in, size_t len, uint8_t *out)
 {
-    assert(md32 != NULL);
-    assert(data != NULL || len == 0);
-    
-    int hashSelection;
-    
     sph_blake512_context     ctx_blake;      //0
     sph_bmw512_context       ctx_bmw;        //1
     sph_groestl512_context   ctx_groestl;    //2
@@ -250,254 +548,164 @@ void X16R(void *md32, const void *data, size_t len)
     sph_shabal512_context    ctx_shabal;     //D
     sph_whirlpool_context    ctx_whirlpool;  //E
     sph_sha512_context       ctx_sha512;     //F
-        
-    uint8_t *PrevBlockHash = (uint8_t*) &(data[4]);
-    
-    uint8_t hash_temp[64];
-    
-    for (int i=0;i<16;i++)
-    {
-        const void *toHash;
-        size_t lenToHash;
-        if (i == 0) {
-            toHash = data;
-            lenToHash = len;
-        } else {
-            toHash = hash_temp;
-            lenToHash = 64;
-        }
-        
-        hashSelection = GetHashSelection(PrevBlockHash, i);
-        
-        switch(hashSelection) {
-            case 0:
-                sph_blake512_init(&ctx_blake);
-                sph_blake512 (&ctx_blake, toHash, lenToHash);
-                sph_blake512_close(&ctx_blake, hash_temp);
-                break;
-            case 1:
-                sph_bmw512_init(&ctx_bmw);
-                sph_bmw512 (&ctx_bmw, toHash, lenToHash);
-                sph_bmw512_close(&ctx_bmw, hash_temp);
-                break;
-            case 2:
-                sph_groestl512_init(&ctx_groestl);
-                sph_groestl512 (&ctx_groestl, toHash, lenToHash);
-                sph_groestl512_close(&ctx_groestl, hash_temp);
-                break;
-            case 3:
-                sph_jh512_init(&ctx_jh);
-                sph_jh512 (&ctx_jh, toHash, lenToHash);
-                sph_jh512_close(&ctx_jh, hash_temp);
-                break;
-            case 4:
-                sph_keccak512_init(&ctx_keccak);
-                sph_keccak512 (&ctx_keccak, toHash, lenToHash);
-                sph_keccak512_close(&ctx_keccak, hash_temp);
-                break;
-            case 5:
-                sph_skein512_init(&ctx_skein);
-                sph_skein512 (&ctx_skein, toHash, lenToHash);
-                sph_skein512_close(&ctx_skein, hash_temp);
-                break;
-            case 6:
-                sph_luffa512_init(&ctx_luffa);
-                sph_luffa512 (&ctx_luffa, toHash, lenToHash);
-                sph_luffa512_close(&ctx_luffa, hash_temp);
-                break;
-            case 7:
-                sph_cubehash512_init(&ctx_cubehash);
-                sph_cubehash512 (&ctx_cubehash, toHash, lenToHash);
-                sph_cubehash512_close(&ctx_cubehash, hash_temp);
-                break;
-            case 8:
-                sph_shavite512_init(&ctx_shavite);
-                sph_shavite512(&ctx_shavite, toHash, lenToHash);
-                sph_shavite512_close(&ctx_shavite, hash_temp);
-                break;
-            case 9:
-                sph_simd512_init(&ctx_simd);
-                sph_simd512 (&ctx_simd, toHash, lenToHash);
-                sph_simd512_close(&ctx_simd, hash_temp);
-                break;
-            case 10:
-                sph_echo512_init(&ctx_echo);
-                sph_echo512 (&ctx_echo, toHash, lenToHash);
-                sph_echo512_close(&ctx_echo, hash_temp);
-                break;
-            case 11:
-                sph_hamsi512_init(&ctx_hamsi);
-                sph_hamsi512 (&ctx_hamsi, toHash, lenToHash);
-                sph_hamsi512_close(&ctx_hamsi, hash_temp);
-                break;
-            case 12:
-                sph_fugue512_init(&ctx_fugue);
-                sph_fugue512 (&ctx_fugue, toHash, lenToHash);
-                sph_fugue512_close(&ctx_fugue, hash_temp);
-                break;
-            case 13:
-                sph_shabal512_init(&ctx_shabal);
-                sph_shabal512 (&ctx_shabal, toHash, lenToHash);
-                sph_shabal512_close(&ctx_shabal, hash_temp);
-                break;
-            case 14:
-                sph_whirlpool_init(&ctx_whirlpool);
-                sph_whirlpool(&ctx_whirlpool, toHash, lenToHash);
-                sph_whirlpool_close(&ctx_whirlpool, hash_temp);
-                break;
-            case 15:
-                sph_sha512_init(&ctx_sha512);
-                sph_sha512 (&ctx_sha512, toHash, lenToHash);
-                sph_sha512_close(&ctx_sha512, hash_temp);
-                break;
-        }
+    sph_tiger_context        ctx_tiger;
+
+    if (v2 && (hashSelection == 4 || hashSelection == 6 || hashSelection == 15)) { // tiger192 goes first
+        sph_tiger_init(&ctx_tiger);
+        sph_tiger(&ctx_tiger, in, len);
+        sph_tiger_close(&ctx_tiger, out);
+        memset(out + 24, 0, 40);
+        in = out;
+        len = 64;
+    }
+
+    switch(hashSelection) {
+        case 0:
+            sph_blake512_init(&ctx_blake);
+            sph_blake512 (&ctx_blake, in, len);
+            sph_blake512_close(&ctx_blake, out);
+            break;
+        case 1:
+            sph_bmw512_init(&ctx_bmw);
+            sph_bmw512 (&ctx_bmw, in, len);
+            sph_bmw512_close(&ctx_bmw, out);
+            break;
+        case 2:
+            sph_groestl512_init(&ctx_groestl);
+            sph_groestl512 (&ctx_groestl, in, len);
+            sph_groestl512_close(&ctx_groestl, out);
+            break;
+        case 3:
+            sph_jh512_init(&ctx_jh);
+            sph_jh512 (&ctx_jh, in, len);
+            sph_jh512_close(&ctx_jh, out);
+            break;
+        case 4:
+            sph_keccak512_init(&ctx_keccak);
+            sph_keccak512 (&ctx_keccak, in, len);
+            sph_keccak512_close(&ctx_keccak, out);
+            break;
+        case 5:
+            sph_skein512_init(&ctx_skein);
+            sph_skein512 (&ctx_skein, in, len);
+            sph_skein512_close(&ctx_skein, out);
+            break;
+        case 6:
+            sph_luffa512_init(&ctx_luffa);
+            sph_luffa512 (&ctx_luffa, in, len);
+            sph_luffa512_close(&ctx_luffa, out);
+            break;
+        case 7:
+            sph_cubehash512_init(&ctx_cubehash);
+            sph_cubehash512 (&ctx_cubehash, in, len);
+            sph_cubehash512_close(&ctx_cubehash, out);
+            break;
+        case 8:
+            sph_shavite512_init(&ctx_shavite);
+            sph_shavite512(&ctx_shavite, in, len);
+            sph_shavite512_close(&ctx_shavite, out);
+            break;
+        case 9:
+            sph_simd512_init(&ctx_simd);
+            sph_simd512 (&ctx_simd, in, len);
+            sph_simd512_close(&ctx_simd, out);
+            break;
+        case 10:
+            sph_echo512_init(&ctx_echo);
+            sph_echo512 (&ctx_echo, in, len);
+            sph_echo512_close(&ctx_echo, out);
+            break;
+        case 11:
+            sph_hamsi512_init(&ctx_hamsi);
+            sph_hamsi512 (&ctx_hamsi, in, len);
+            sph_hamsi512_close(&ctx_hamsi, out);
+            break;
+        case 12:
+            sph_fugue512_init(&ctx_fugue);
+            sph_fugue512 (&ctx_fugue, in, len);
+            sph_fugue512_close(&ctx_fugue, out);
+            break;
+        case 13:
+            sph_shabal512_init(&ctx_shabal);
+            sph_shabal512 (&ctx_shabal, in, len);
+            sph_shabal512_close(&ctx_shabal, out);
+            break;
+        case 14:
+            sph_whirlpool_init(&ctx_whirlpool);
+            sph_whirlpool(&ctx_whirlpool, in, len);
+            sph_whirlpool_close(&ctx_whirlpool, out);
+            break;
+        case 15:
+            sph_sha512_init(&ctx_sha512);
+            sph_sha512 (&ctx_sha512, in, len);
+            sph_sha512_close(&ctx_sha512, out);
+            break;
     }
-    
-    trim512to256(hash_temp, md32);
 }
 
-// add tiger192 before keccak, luffa and sha512
-void X16Rv2(void *md32, const void *data, size_t len)
+// the 16 rounds of X16R, or of X16Rv2 if v2 is true, each with the primitive the prevBlock nibbles select for it
+static void _X16R(void *md32, const void *data, size_t len, int v2)
 {
+    uint8_t hash[64];
+
     assert(md32 != NULL);
     assert(data != NULL || len == 0);
 
-    int hashSelection;
-
-    sph_blake512_context     ctx_blake;      //0
-    sph_bmw512_context       ctx_bmw;        //1
-    sph_groestl512_context   ctx_groestl;    //2
-    sph_jh512_context        ctx_jh;         //3
-    sph_keccak512_context    ctx_keccak;     //4
-    sph_skein512_context     ctx_skein;      //5
-    sph_luffa512_context     ctx_luffa;      //6
-    sph_cubehash512_context  ctx_cubehash;   //7
-    sph_shavite512_context   ctx_shavite;    //8
-    sph_simd512_context      ctx_simd;       //9
-    sph_echo512_context      ctx_echo;       //A
-    sph_hamsi512_context     ctx_hamsi;      //B
-    sph_fugue512_context     ctx_fugue;      //C
-    sph_shabal512_context    ctx_shabal;     //D
-    sph_whirlpool_context    ctx_whirlpool;  //E
-    sph_sha512_context       ctx_sha512;     //F
-
-    sph_tiger_context        ctx_tiger;
+    for (int i = 0; i < 16; i++) {
+        _X16RRound(GetHashSelection((const uint8_t *)data + 4, i), v2, (i == 0) ? data : hash, (i == 0) ? len : 64,
+                   hash);
+    }
 
-    uint8_t *PrevBlockHash = (uint8_t*) &(data[4]);
+    trim512to256(hash, md32);
+}
 
-    uint8_t hash_temp[64];
+void X16R(void *md32, const void *data, size_t len)
+{
+    _X16R(md32, data, len, 0);
+}
 
-    for (int i=0;i<16;i++)
-    {
-        const void *toHash;
-        size_t lenToHash;
-        if (i == 0) {
-            toHash = data;
-            lenToHash = len;
-        } else {
-            toHash = hash_temp;
-            lenToHash = 64;
-        }
+// add tiger192 before keccak, luffa and sha512
+void X16Rv2(void *md32, const void *data, size_t len)
+{
+    _X16R(md32, data, len, 1);
+}
 
-        hashSelection = GetHashSelection(PrevBlockHash, i);
-
-        switch(hashSelection) {
-            case 0:
-                sph_blake512_init(&ctx_blake);
-                sph_blake512 (&ctx_blake, toHash, lenToHash);
-                sph_blake512_close(&ctx_blake, hash_temp);
-                break;
-            case 1:
-                sph_bmw512_init(&ctx_bmw);
-                sph_bmw512 (&ctx_bmw, toHash, lenToHash);
-                sph_bmw512_close(&ctx_bmw, hash_temp);
-                break;
-            case 2:
-                sph_groestl512_init(&ctx_groestl);
-                sph_groestl512 (&ctx_groestl, toHash, lenToHash);
-                sph_groestl512_close(&ctx_groestl, hash_temp);
-                break;
-            case 3:
-                sph_jh512_init(&ctx_jh);
-                sph_jh512 (&ctx_jh, toHash, lenToHash);
-                sph_jh512_close(&ctx_jh, hash_temp);
-                break;
-            case 4:
-                sph_tiger_init(&ctx_tiger);
-                sph_tiger(&ctx_tiger, toHash, lenToHash);
-                sph_tiger_close(&ctx_tiger, hash_temp);
-                memset(hash_temp + 24, 0, 40);
-                sph_keccak512_init(&ctx_keccak);
-                sph_keccak512 (&ctx_keccak, hash_temp, 64);
-                sph_keccak512_close(&ctx_keccak, hash_temp);
-                break;
-            case 5:
-                sph_skein512_init(&ctx_skein);
-                sph_skein512 (&ctx_skein, toHash, lenToHash);
-                sph_skein512_close(&ctx_skein, hash_temp);
-                break;
-            case 6:
-                sph_tiger_init(&ctx_tiger);
-                sph_tiger(&ctx_tiger, toHash, lenToHash);
-                sph_tiger_close(&ctx_tiger, hash_temp);
-                memset(hash_temp + 24, 0, 40);
-                sph_luffa512_init(&ctx_luffa);
-                sph_luffa512 (&ctx_luffa, hash_temp, 64);
-                sph_luffa512_close(&ctx_luffa, hash_temp);
-                break;
-            case 7:
-                sph_cubehash512_init(&ctx_cubehash);
-                sph_cubehash512 (&ctx_cubehash, toHash, lenToHash);
-                sph_cubehash512_close(&ctx_cubehash, hash_temp);
-                break;
-            case 8:
-                sph_shavite512_init(&ctx_shavite);
-                sph_shavite512(&ctx_shavite, toHash, lenToHash);
-                sph_shavite512_close(&ctx_shavite, hash_temp);
-                break;
-            case 9:
-                sph_simd512_init(&ctx_simd);
-                sph_simd512 (&ctx_simd, toHash, lenToHash);
-                sph_simd512_close(&ctx_simd, hash_temp);
-                break;
-            case 10:
-                sph_echo512_init(&ctx_echo);
-                sph_echo512 (&ctx_echo, toHash, lenToHash);
-                sph_echo512_close(&ctx_echo, hash_temp);
-                break;
-            case 11:
-                sph_hamsi512_init(&ctx_hamsi);
-                sph_hamsi512 (&ctx_hamsi, toHash, lenToHash);
-                sph_hamsi512_close(&ctx_hamsi, hash_temp);
-                break;
-            case 12:
-                sph_fugue512_init(&ctx_fugue);
-                sph_fugue512 (&ctx_fugue, toHash, lenToHash);
-                sph_fugue512_close(&ctx_fugue, hash_temp);
-                break;
-            case 13:
-                sph_shabal512_init(&ctx_shabal);
-                sph_shabal512 (&ctx_shabal, toHash, lenToHash);
-                sph_shabal512_close(&ctx_shabal, hash_temp);
-                break;
-            case 14:
-                sph_whirlpool_init(&ctx_whirlpool);
-                sph_whirlpool(&ctx_whirlpool, toHash, lenToHash);
-                sph_whirlpool_close(&ctx_whirlpool, hash_temp);
-                break;
-            case 15:
-                sph_tiger_init(&ctx_tiger);
-                sph_tiger(&ctx_tiger, toHash, lenToHash);
-                sph_tiger_close(&ctx_tiger, hash_temp);
-                memset(hash_temp + 24, 0, 40);
-                sph_sha512_init(&ctx_sha512);
-                sph_sha512 (&ctx_sha512, hash_temp, 64);
-                sph_sha512_close(&ctx_sha512, hash_temp);
-                break;
+// computes md32[i] = X16R(data[i], len[i]) for count independent messages, or X16Rv2() for the messages where v2[i]
+// is true (v2 may be NULL)
+// each of the 16 rounds runs over the whole batch grouped by hash algorithm, so all messages using the same primitive
+// in a round are hashed back to back and its code and lookup tables stay hot in cache
+void X16RBatch(void *md32[], const void *data[], const size_t len[], const int v2[], size_t count)
+{
+    uint8_t _hashes[(count*64 <= 0x1000) ? count*64 : 0],
+            *hashes = (count*64 <= 0x1000) ? _hashes : malloc(count*64);
+    size_t _order[(count*sizeof(size_t) <= 0x1000) ? count : 0],
+           *order = (count*sizeof(size_t) <= 0x1000) ? _order : malloc(count*sizeof(size_t));
+    size_t i, j, n, start[17];
+
+    assert(md32 != NULL || count == 0);
+    assert(data != NULL || count == 0);
+    assert(len != NULL || count == 0);
+    assert(hashes != NULL);
+    assert(order != NULL);
+
+    for (int round = 0; round < 16; round++) {
+        memset(start, 0, sizeof(start));
+
+        // sort the messages by the algorithm they use this round
+        for (i = 0; i < count; i++) start[GetHashSelection((const uint8_t *)data[i] + 4, round) + 1]++;
+        for (j = 1; j < 17; j++) start[j] += start[j - 1];
+        for (i = 0; i < count; i++) order[start[GetHashSelection((const uint8_t *)data[i] + 4, round)]++] = i;
+
+        for (n = 0; n < count; n++) {
+            i = order[n];
+            _X16RRound(GetHashSelection((const uint8_t *)data[i] + 4, round), (v2 && v2[i]),
+                       (round == 0) ? data[i] : &hashes[i*64], (round == 0) ? len[i] : 64, &hashes[i*64]);
         }
     }
 
-    trim512to256(hash_temp, md32);
+    for (i = 0; i < count; i++) trim512to256(&hashes[i*64], md32[i]);
+    if (hashes != _hashes) free(hashes);
+    if (order != _order) free(order);
 }
 
 // bitwise right rotation
@@ -599,6 +807,59 @@ void SHA512(void *md64, const void *data, size_t len)
     mem_clean(buf, sizeof(buf));
 }
 
+void SHA512Init(BRSHA512Context *ctx)
+{
+    static const uint64_t buf[] = { 0x6a09e667f3bcc908, 0xbb67ae8584caa73b, 0x3c6ef372fe94f82b, 0xa54ff53a5f1d36f1,
+                                    0x510e527fade682d1, 0x9b05688c2b3e6c1f, 0x1f83d9abfb41bd6b, 0x5be0cd19137e2179 };
+
+    assert(ctx != NULL);
+    memcpy(ctx->buf, buf, sizeof(buf));
+    ctx->len = 0;
+}
+
+void SHA512Update(BRSHA512Context *ctx, const void *data, size_t len)
+{
+    size_t i = 0, used, n;
+
+    assert(ctx != NULL);
+    assert(data != NULL || len == 0);
+    used = (size_t)(ctx->len % 128);
+    ctx->len += len;
+
+    if (used > 0) { // fill the partial block left by the previous update
+        n = (128 - used < len) ? 128 - used : len;
+        memcpy((uint8_t *)ctx->x + used, data, n);
+        i = n;
+        if (used + n < 128) return;
+        _SHA512Compress(ctx->buf, ctx->x);
+    }
+
+    for (; i + 128 <= len; i += 128) { // process data in 128 byte blocks
+        memcpy(ctx->x, (const uint8_t *)data + i, 128);
+        _SHA512Compress(ctx->buf, ctx->x);
+    }
+
+    if (len > i) memcpy(ctx->x, (const uint8_t *)data + i, len - i);
+}
+
+// writes the digest to md64 and wipes ctx
+void SHA512Final(BRSHA512Context *ctx, void *md64)
+{
+    size_t i, used;
+
+    assert(ctx != NULL);
+    assert(md64 != NULL);
+    used = (size_t)(ctx->len % 128);
+    memset((uint8_t *)ctx->x + used, 0, 128 - used); // clear remainder of x
+    ((uint8_t *)ctx->x)[used] = 0x80; // append padding
+    if (used >= 112) _SHA512Compress(ctx->buf, ctx->x), memset(ctx->x, 0, 128); // length goes to next block
+    ctx->x[14] = 0, ctx->x[15] = be64(ctx->len*8); // append length in bits
+    _SHA512Compress(ctx->buf, ctx->x); // finalize
+    for (i = 0; i < 8; i++) ctx->buf[i] = be64(ctx->buf[i]); // endian swap
+    memcpy(md64, ctx->buf, 64); // write to md
+    mem_clean(ctx, sizeof(*ctx));
+}
+
 // basic ripemd functions
 #define f(x, y, z) ((x) ^ (y) ^ (z))
 #define g(x, y, z) (((x) & (y)) | (~(x) & (z)))
@@ -791,6 +1052,40 @@ uint32_t Murmur3_32(const void *data, size_t len, uint32_t seed)
     return h;
 }
 
+// sets ictx and octx to the hmac-sha512 inner and outer hash states after the key xor ipad and key xor opad blocks, so
+// any number of macs with the same key can be computed from them
+static void _HMACSHA512Init(BRSHA512Context *ictx, BRSHA512Context *octx, const void *key, size_t keyLen)
+{
+    uint64_t k[16];
+    size_t i;
+
+    memset(k, 0, sizeof(k));
+    if (keyLen > sizeof(k)) SHA512(k, key, keyLen);
+    else if (keyLen > 0) memcpy(k, key, keyLen);
+    for (i = 0; i < 16; i++) k[i] ^= 0x3636363636363636;
+    SHA512Init(ictx);
+    SHA512Update(ictx, k, sizeof(k));
+    for (i = 0; i < 16; i++) k[i] ^= 0x3636363636363636 ^ 0x5c5c5c5c5c5c5c5c;
+    SHA512Init(octx);
+    SHA512Update(octx, k, sizeof(k));
+    mem_clean(k, sizeof(k));
+}
+
+// hmac-sha512 of data resumed from the key states set by _HMACSHA512Init()
+static void _HMACSHA512(void *mac64, const BRSHA512Context *ictx, const BRSHA512Context *octx, const void *data,
+                        size_t dataLen)
+{
+    BRSHA512Context ctx = *ictx;
+    uint8_t md[64];
+
+    SHA512Update(&ctx, data, dataLen);
+    SHA512Final(&ctx, md);
+    ctx = *octx;
+    SHA512Update(&ctx, md, sizeof(md));
+    SHA512Final(&ctx, mac64);
+    mem_clean(md, sizeof(md));
+}
+
 // HMAC(key, data) = hash((key xor opad) || hash((key xor ipad) || data))
 // opad = 0x5c5c5c...5c5c
 // ipad = 0x363636...3636
@@ -807,6 +1102,16 @@ void HMAC(void *mac, void (*hash)(void *, const void *, size_t), size_t hashLen,
     assert(key != NULL || keyLen == 0);
     assert(data != NULL || dataLen == 0);
     
+    if (hash == SHA512 && hashLen == 64) { // no need to copy the key blocks and data into one buffer
+        BRSHA512Context ictx, octx;
+
+        _HMACSHA512Init(&ictx, &octx, key, keyLen);
+        _HMACSHA512(mac, &ictx, &octx, data, dataLen);
+        mem_clean(&ictx, sizeof(ictx));
+        mem_clean(&octx, sizeof(octx));
+        return;
+    }
+
     if (keyLen > blockLen) hash(k, key, keyLen), key = k, keyLen = sizeof(k);
     memset(kipad, 0, blockLen);
     memcpy(kipad, key, keyLen);
@@ -1069,6 +1374,54 @@ size_t Chacha20Poly1305AEADDecrypt(void *out, size_t outLen, const void *key32,
     return outLen;
 }
 
+// pbkdf2-hmac-sha512, the key states are computed once, and each round after the first is one inner and one outer
+// compression of a single padded block
+static void _PBKDF2SHA512(void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt, size_t saltLen,
+                          unsigned rounds)
+{
+    BRSHA512Context ictx, octx, ctx;
+    uint64_t U[16], V[16], T[8], buf[8];
+    uint32_t i, j;
+    unsigned r;
+
+    _HMACSHA512Init(&ictx, &octx, pw, pwLen);
+    memset(U, 0, sizeof(U)); // a 64 byte message after the 128 byte key block, padded to the end of its block
+    ((uint8_t *)U)[64] = 0x80;
+    U[15] = be64((uint64_t)(128 + 64)*8);
+    memcpy(V, U, sizeof(V));
+
+    for (i = 0; i < (dkLen + 63)/64; i++) {
+        j = be32(i + 1);
+        ctx = ictx;
+        SHA512Update(&ctx, salt, saltLen);
+        SHA512Update(&ctx, &j, sizeof(j));
+        SHA512Final(&ctx, U);
+        ctx = octx;
+        SHA512Update(&ctx, U, 64);
+        SHA512Final(&ctx, U); // U1 = hmac_sha512(pw, salt || be32(i))
+        memcpy(T, U, sizeof(T));
+
+        for (r = 1; r < rounds; r++) { // Urounds = hmac_sha512(pw, Urounds-1)
+            memcpy(buf, ictx.buf, sizeof(buf));
+            _SHA512Compress(buf, U);
+            for (j = 0; j < 8; j++) V[j] = be64(buf[j]);
+            memcpy(buf, octx.buf, sizeof(buf));
+            _SHA512Compress(buf, V);
+            for (j = 0; j < 8; j++) U[j] = be64(buf[j]), T[j] ^= U[j]; // Ti = U1 ^ U2 ^ ... ^ Urounds
+        }
+
+        // dk = T1 || T2 || ... || Tdklen/hlen
+        memcpy((uint8_t *)dk + i*64, T, (i*64 + 64 <= dkLen) ? 64 : dkLen % 64);
+    }
+
+    mem_clean(&ictx, sizeof(ictx));
+    mem_clean(&octx, sizeof(octx));
+    mem_clean(U, sizeof(U));
+    mem_clean(V, sizeof(V));
+    mem_clean(T, sizeof(T));
+    mem_clean(buf, sizeof(buf));
+}
+
 // dk = T1 || T2 || ... || Tdklen/hlen
 // Ti = U1 xor U2 xor ... xor Urounds
 // U1 = hmac_hash(pw, salt || be32(i))
@@ -1088,6 +1441,11 @@ void PBKDF2(void *dk, size_t dkLen, void (*hash)(void *, const void *, size_t),
     assert(salt != NULL || saltLen == 0);
     assert(rounds > 0);
     
+    if (hash == SHA512 && hashLen == 64) { // hmac key states are computed once instead of every round
+        _PBKDF2SHA512(dk, dkLen, pw, pwLen, salt, saltLen, rounds);
+        return;
+    }
+
     memcpy(s, salt, saltLen);
     
     for (i = 0; i < (dkLen + hashLen - 1)/hashLen; i++) {
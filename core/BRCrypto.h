@@ -24,19 +24,53 @@ void SHA1(void *md20, const void *data, size_t len);
 
 void SHA256(void *md32, const void *data, size_t len);
 
+// incremental sha-256, a context can be copied to resume hashing from the same midstate with different suffixes
+typedef struct {
+    uint32_t buf[8], x[16];
+    uint64_t len;
+} BRSHA256Context;
+
+void SHA256Init(BRSHA256Context *ctx);
+
+void SHA256Update(BRSHA256Context *ctx, const void *data, size_t len);
+
+// writes the digest to md32 and wipes ctx
+void SHA256Final(BRSHA256Context *ctx, void *md32);
+
 void SHA224(void *md28, const void *data, size_t len);
 
 void X16R(void *md32, const void *data, size_t len);
 
 void X16Rv2(void *md32, const void *data, size_t len);
 
+// computes md32[i] = X16R(data[i], len[i]) for count independent messages, or X16Rv2() for the messages where v2[i]
+// is true (v2 may be NULL)
+void X16RBatch(void *md32[], const void *data[], const size_t len[], const int v2[], size_t count);
+
 // double-sha-256 = sha-256(sha-256(x))
 void SHA256_2(void *md32, const void *data, size_t len);
 
+// double-sha-256 of count consecutive 64 byte messages, such as pairs of merkle tree nodes, md32 receives count 32 byte
+// digests and may be the same buffer as data
+void SHA256_2_64(void *md32, const void *data, size_t count);
+
 void SHA384(void *md48, const void *data, size_t len);
 
 void SHA512(void *md64, const void *data, size_t len);
 
+// incremental sha-512, a context can be copied to resume hashing from the same midstate with different suffixes
+typedef struct {
+    uint64_t buf[8], x[16];
+    uint64_t len;
+} BRSHA512Context;
+
+void SHA512Init(BRSHA512Context *ctx);
+
+void SHA512Update(BRSHA512Context *ctx, const void *data, size_t len);
+
+// writes the digest to md64 and wipes ctx
+void SHA512Final(BRSHA512Context *ctx, void *md64);
+
 // ripemd-160: http://homes.esat.kuleuven.be/~bosselae/ripemd160.html
 void RMD160(void *md20, const void *data, size_t len);
 
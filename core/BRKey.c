@@ -25,6 +25,7 @@
 #endif
 #define DETERMINISTIC          1
 #define USE_BASIC_CONFIG       1
+#define USE_ECMULT_STATIC_PRECOMPUTATION 1 // signing tables are generated by gen_context.c and linked read-only
 #define ENABLE_MODULE_RECOVERY 1
 
 #pragma clang diagnostic push
@@ -36,16 +37,41 @@
 #pragma clang diagnostic ignored "-Wconditional-uninitialized"
 #pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
 #include "secp256k1/src/basic-config.h"
+#if defined(__SIZEOF_INT128__) && ! defined(SECP256K1_FORCE_32BIT) // use 64bit limbs where 128bit products are native
+#undef USE_FIELD_10X26
+#undef USE_SCALAR_8X32
+#define HAVE___INT128          1
+#define USE_FIELD_5X52         1
+#define USE_SCALAR_4X64        1
+// the field asm runs out of registers under asan, other builds can define SECP256K1_NO_ASM to keep to plain C as well
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer) && ! defined(SECP256K1_NO_ASM)
+#define SECP256K1_NO_ASM       1
+#endif
+#endif
+#if defined(__SANITIZE_ADDRESS__) && ! defined(SECP256K1_NO_ASM)
+#define SECP256K1_NO_ASM       1
+#endif
+#if defined(__x86_64__) && defined(__GNUC__) && ! defined(SECP256K1_NO_ASM)
+#define USE_ASM_X86_64         1
+#endif
+#endif
 #include "secp256k1/src/secp256k1.c"
 #pragma clang diagnostic pop
 #pragma GCC diagnostic pop
 
-static secp256k1_context *_ctx = NULL;
-static pthread_once_t _ctx_once = PTHREAD_ONCE_INIT;
+static secp256k1_context *_ctx = NULL, *_vctx = NULL;
+static pthread_once_t _ctx_once = PTHREAD_ONCE_INIT, _vctx_once = PTHREAD_ONCE_INIT;
 
 static void _ctx_init()
 {
-    _ctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN | SECP256K1_CONTEXT_VERIFY);
+    _ctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN);
+}
+
+// the verify context has to build its ecmult tables at runtime, so it's only created once a caller needs it
+static void _vctx_init()
+{
+    _vctx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
 }
 
 // adds 256bit big endian ints a and b (mod secp256k1 order) and stores the result in a
@@ -83,10 +109,10 @@ int BRSecp256k1PointAdd(BRECPoint *p, const UInt256 *i)
     secp256k1_pubkey pubkey;
     size_t pLen = sizeof(*p);
     
-    pthread_once(&_ctx_once, _ctx_init);
-    return (secp256k1_ec_pubkey_parse(_ctx, &pubkey, (const unsigned char *)p, sizeof(*p)) &&
-            secp256k1_ec_pubkey_tweak_add(_ctx, &pubkey, (const unsigned char *)i) &&
-            secp256k1_ec_pubkey_serialize(_ctx, (unsigned char *)p, &pLen, &pubkey, SECP256K1_EC_COMPRESSED));
+    pthread_once(&_vctx_once, _vctx_init);
+    return (secp256k1_ec_pubkey_parse(_vctx, &pubkey, (const unsigned char *)p, sizeof(*p)) &&
+            secp256k1_ec_pubkey_tweak_add(_vctx, &pubkey, (const unsigned char *)i) &&
+            secp256k1_ec_pubkey_serialize(_vctx, (unsigned char *)p, &pLen, &pubkey, SECP256K1_EC_COMPRESSED));
 }
 
 // multiplies secp256k1 ec-point p by 256bit big endian int i and stores the result in p
@@ -96,10 +122,10 @@ int BRSecp256k1PointMul(BRECPoint *p, const UInt256 *i)
     secp256k1_pubkey pubkey;
     size_t pLen = sizeof(*p);
     
-    pthread_once(&_ctx_once, _ctx_init);
-    return (secp256k1_ec_pubkey_parse(_ctx, &pubkey, (const unsigned char *)p, sizeof(*p)) &&
-            secp256k1_ec_pubkey_tweak_mul(_ctx, &pubkey, (const unsigned char *)i) &&
-            secp256k1_ec_pubkey_serialize(_ctx, (unsigned char *)p, &pLen, &pubkey, SECP256K1_EC_COMPRESSED));
+    pthread_once(&_vctx_once, _vctx_init);
+    return (secp256k1_ec_pubkey_parse(_vctx, &pubkey, (const unsigned char *)p, sizeof(*p)) &&
+            secp256k1_ec_pubkey_tweak_mul(_vctx, &pubkey, (const unsigned char *)i) &&
+            secp256k1_ec_pubkey_serialize(_vctx, (unsigned char *)p, &pLen, &pubkey, SECP256K1_EC_COMPRESSED));
 }
 
 // returns true if privKey is a valid private key
@@ -307,6 +333,7 @@ size_t BRKeySign(const BRKey *key, void *sig, size_t sigLen, UInt256 md)
     secp256k1_ecdsa_signature s;
     
     assert(key != NULL);
+    pthread_once(&_ctx_once, _ctx_init);
     
     if (secp256k1_ecdsa_sign(_ctx, &s, md.u8, key->secret.u8, secp256k1_nonce_function_rfc6979, NULL)) {
         if (! secp256k1_ecdsa_signature_serialize_der(_ctx, sig, &sigLen, &s)) sigLen = 0;
@@ -329,10 +356,11 @@ int BRKeyVerify(BRKey *key, UInt256 md, const void *sig, size_t sigLen)
     assert(sigLen > 0);
     
     len = BRKeyPubKey(key, NULL, 0);
+    pthread_once(&_vctx_once, _vctx_init);
     
-    if (len > 0 && secp256k1_ec_pubkey_parse(_ctx, &pk, key->pubKey, len) &&
-        secp256k1_ecdsa_signature_parse_der(_ctx, &s, sig, sigLen)) {
-        if (secp256k1_ecdsa_verify(_ctx, &s, md.u8, &pk) == 1) r = 1; // success is 1, all other values are fail
+    if (len > 0 && secp256k1_ec_pubkey_parse(_vctx, &pk, key->pubKey, len) &&
+        secp256k1_ecdsa_signature_parse_der(_vctx, &s, sig, sigLen)) {
+        if (secp256k1_ecdsa_verify(_vctx, &s, md.u8, &pk) == 1) r = 1; // success is 1, all other values are fail
     }
     
     return r;
@@ -356,6 +384,8 @@ size_t BRKeyCompactSign(const BRKey *key, void *compactSig, size_t sigLen, UInt2
     assert(key != NULL);
     assert(sigLen >= 65 || compactSig == NULL);
 
+    pthread_once(&_ctx_once, _ctx_init);
+
     if (! UInt256IsZero(key->secret)) { // can't sign with a public key
         if (compactSig && sigLen >= 65 &&
             secp256k1_ecdsa_sign_recoverable(_ctx, &s, md.u8, key->secret.u8, secp256k1_nonce_function_rfc6979, NULL) &&
@@ -385,10 +415,11 @@ int BRKeyRecoverPubKey(BRKey *key, UInt256 md, const void *compactSig, size_t si
     if (sigLen == 65) {
         if (((uint8_t *)compactSig)[0] - 27 >= 4) compressed = 1;
         recid = (((uint8_t *)compactSig)[0] - 27) % 4;
+        pthread_once(&_vctx_once, _vctx_init);
         
-        if (secp256k1_ecdsa_recoverable_signature_parse_compact(_ctx, &s, (const uint8_t *)compactSig + 1, recid) &&
-            secp256k1_ecdsa_recover(_ctx, &pk, &s, md.u8) &&
-            secp256k1_ec_pubkey_serialize(_ctx, pubKey, &len, &pk,
+        if (secp256k1_ecdsa_recoverable_signature_parse_compact(_vctx, &s, (const uint8_t *)compactSig + 1, recid) &&
+            secp256k1_ecdsa_recover(_vctx, &pk, &s, md.u8) &&
+            secp256k1_ec_pubkey_serialize(_vctx, pubKey, &len, &pk,
                                           (compressed ? SECP256K1_EC_COMPRESSED : SECP256K1_EC_UNCOMPRESSED))) {
             r = BRKeySetPubKey(key, pubKey, len);
         }
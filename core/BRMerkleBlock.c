@@ -9,6 +9,7 @@
 
 #include "BRMerkleBlock.h"
 #include "BRAddress.h"
+#include "BRParallel.h"
 #include <stdlib.h>
 #include <inttypes.h>
 #include <string.h>
@@ -26,7 +27,10 @@
 #define TARGET_TIMESPAN   ((14*24*6) * 60) // the targeted timespan between difficulty target adjustments   // 2016 ravencoin blocks
 #define DGW_TARGET_TIMESPAN   (1 * 60) // the targeted timespan between difficulty target adjustments       // 1 ravencoin block
 
-inline static int _ceil_log2(int x) {
+#define HEADER_HASH_MAX_THREADS 8  // upper bound on worker threads used to hash a batch of headers
+#define HEADER_HASH_MIN_BATCH   64 // minimum headers per worker, smaller batches are hashed on the calling thread
+
+inline static int _ceil_log2(uint32_t x) {
     int r = (x & (x - 1)) ? 1 : 0;
 
     while ((x >>= 1) != 0) r++;
@@ -81,31 +85,152 @@ BRMerkleBlock *BRMerkleBlockCopy(const BRMerkleBlock *block) {
     *cpy = *block;
     cpy->hashes = NULL;
     cpy->flags = NULL;
+    cpy->matchedHashes = NULL;
     BRMerkleBlockSetTxHashes(cpy, block->hashes, block->hashesCount, block->flags, block->flagsLen);
+    cpy->treeState = block->treeState;
+    cpy->matchedCount = block->matchedCount;
+    cpy->matchedHashes = (block->matchedHashes) ? malloc(block->matchedCount*sizeof(UInt256)) : NULL;
+    assert(cpy->matchedHashes != NULL || block->matchedHashes == NULL || block->matchedCount == 0);
+    if (cpy->matchedHashes) memcpy(cpy->matchedHashes, block->matchedHashes, block->matchedCount*sizeof(UInt256));
     return cpy;
 }
 
-// buf must contain either a serialized merkleblock or header
-// returns a merkle block struct that must be freed by calling MerkleBlockFree()
-BRMerkleBlock *BRMerkleBlockParse(const uint8_t *buf, size_t bufLen) {
+// reads the 80 byte block header fields from buf, returns the number of bytes read
+static size_t _MerkleBlockParseHeader(BRMerkleBlock *block, const uint8_t *buf) {
+    size_t off = 0;
+
+    block->version = UInt32GetLE(&buf[off]);
+    off += sizeof(uint32_t);
+    block->prevBlock = UInt256Get(&buf[off]);
+    off += sizeof(UInt256);
+    block->merkleRoot = UInt256Get(&buf[off]);
+    off += sizeof(UInt256);
+    block->timestamp = UInt32GetLE(&buf[off]);
+    off += sizeof(uint32_t);
+    block->target = UInt32GetLE(&buf[off]);
+    off += sizeof(uint32_t);
+    block->nonce = UInt32GetLE(&buf[off]);
+    off += sizeof(uint32_t);
+    return off;
+}
+
+// sets blockHash to the proof-of-work hash of the 80 byte header in buf, X16Rv2 after its activation time
+static void _MerkleBlockSetHash(BRMerkleBlock *block, const uint8_t *buf) {
+    if (block->timestamp < X16RV2ActivationTime) X16R(&block->blockHash, buf, 80);
+    else X16Rv2(&block->blockHash, buf, 80);
+}
+
+#define MERKLE_HASH_BATCH 16 // node pairs hashed together through SHA256_2_64()
+
+typedef struct {
+    UInt256 md;
+    size_t left, right; // child node indexes, SIZE_MAX for a leaf, or for a missing right branch
+    int depth;
+} _MerkleNode;
+
+typedef struct {
+    size_t parent; // node index of the parent, SIZE_MAX for the merkle root
+    uint32_t pos;
+    int depth, right;
+} _MerkleVisit;
+
+// walks the partial merkle tree once in depth-first order using an explicit stack, then hashes it a row at a time from
+// the bottom up, so the node pairs of a row are double-sha256'd together
+// writes up to *count matched tx hashes to txHashes, sets *count to the number matched
+// returns true if the tree hashes to merkleRoot
+// NOTE: a missing right branch is only allowed where the row has an odd number of nodes, and duplicate hashes in any
+// other pair of branches make the tree invalid to defend against (CVE-2012-2459)
+static int _MerkleBlockWalk(const BRMerkleBlock *block, UInt256 *txHashes, size_t *count) {
+    const size_t hashesCount = (block->hashes) ? block->hashesCount : 0;
+    const size_t flagsLen = (block->flags) ? block->flagsLen : 0;
+    const int height = _ceil_log2(block->totalTx);
+    const size_t max = (flagsLen*8 < hashesCount*2 + height*2 + 1) ? flagsLen*8 : hashesCount*2 + height*2 + 1;
+    _MerkleNode _nodes[(sizeof(_MerkleNode)*max <= 0x1000) ? max : 0],
+                *nodes = (sizeof(_MerkleNode)*max <= 0x1000) ? _nodes : malloc(max*sizeof(*nodes));
+    _MerkleVisit stack[height + 2], v;
+    UInt256 pairs[MERKLE_HASH_BATCH*2];
+    size_t batch[MERKLE_HASH_BATCH], i, j, k, n = 0, sp = 0, hashIdx = 0, flagIdx = 0, matched = 0;
+    uint64_t width;
+    int depth, flag, r = (max > 0);
+
+    assert(nodes != NULL || max == 0);
+    if (r) stack[sp++] = (_MerkleVisit) { SIZE_MAX, 0, 0, 0 };
+
+    while (r && sp > 0) {
+        v = stack[--sp];
+
+        if (flagIdx / 8 >= flagsLen || hashIdx >= hashesCount || n >= max) {
+            r = 0; // ran out of flags or hashes before the tree was complete
+            break;
+        }
+
+        flag = (block->flags[flagIdx / 8] & (1 << (flagIdx % 8)));
+        flagIdx++;
+        nodes[n].left = nodes[n].right = SIZE_MAX;
+        nodes[n].depth = v.depth;
+        if (v.parent != SIZE_MAX && v.right) nodes[v.parent].right = n;
+        else if (v.parent != SIZE_MAX) nodes[v.parent].left = n;
+
+        if (!flag || v.depth == height) {
+            nodes[n].md = block->hashes[hashIdx++];
+
+            if (flag) { // leaf
+                if (txHashes && matched < *count) txHashes[matched] = nodes[n].md;
+                matched++;
+            }
+        } else {
+            // rows have (totalTx + 2^(height - depth) - 1) >> (height - depth) nodes
+            width = ((uint64_t)block->totalTx + ((uint64_t)1 << (height - v.depth - 1)) - 1) >> (height - v.depth - 1);
+            if ((uint64_t)v.pos*2 + 1 < width) stack[sp++] = (_MerkleVisit) { n, v.pos*2 + 1, v.depth + 1, 1 };
+            stack[sp++] = (_MerkleVisit) { n, v.pos*2, v.depth + 1, 0 };
+        }
+
+        n++;
+    }
+
+    for (depth = height - 1; r && depth >= 0; depth--) {
+        for (i = 0, k = 0; r && i <= n; i++) {
+            if (i < n && (nodes[i].depth != depth || nodes[i].left == SIZE_MAX)) continue;
+
+            if (i < n) {
+                pairs[k*2] = nodes[nodes[i].left].md;
+                pairs[k*2 + 1] = (nodes[i].right != SIZE_MAX) ? nodes[nodes[i].right].md : pairs[k*2];
+                if (nodes[i].right != SIZE_MAX && UInt256Eq(pairs[k*2], pairs[k*2 + 1])) r = 0;
+                batch[k++] = i;
+            }
+
+            if (k == MERKLE_HASH_BATCH || (i == n && k > 0)) {
+                SHA256_2_64(pairs, pairs, k);
+                for (j = 0; j < k; j++) nodes[batch[j]].md = pairs[j];
+                k = 0;
+            }
+        }
+    }
+
+    if (r && ! UInt256Eq(nodes[0].md, block->merkleRoot)) r = 0;
+    if (nodes != _nodes) free(nodes);
+    *count = matched;
+    return r;
+}
+
+// walks the partial merkle tree of a parsed block, caching the matched tx hashes and whether the tree is valid
+static void _MerkleBlockSetTree(BRMerkleBlock *block) {
+    size_t count = (block->hashes) ? block->hashesCount : 0;
+
+    if (block->matchedHashes) free(block->matchedHashes);
+    block->matchedHashes = (count > 0) ? malloc(count*sizeof(UInt256)) : NULL;
+    assert(block->matchedHashes != NULL || count == 0);
+    block->treeState = (_MerkleBlockWalk(block, block->matchedHashes, &count)) ? 1 : -1;
+    block->matchedCount = count;
+}
+
+// parses a serialized merkleblock or header without setting blockHash
+static BRMerkleBlock *_MerkleBlockParse(const uint8_t *buf, size_t bufLen) {
     BRMerkleBlock *block = (buf && 80 <= bufLen) ? BRMerkleBlockNew() : NULL;
     size_t off = 0, len = 0;
 
-    assert(buf != NULL || bufLen == 0);
-
     if (block) {
-        block->version = UInt32GetLE(&buf[off]);
-        off += sizeof(uint32_t);
-        block->prevBlock = UInt256Get(&buf[off]);
-        off += sizeof(UInt256);
-        block->merkleRoot = UInt256Get(&buf[off]);
-        off += sizeof(UInt256);
-        block->timestamp = UInt32GetLE(&buf[off]);
-        off += sizeof(uint32_t);
-        block->target = UInt32GetLE(&buf[off]);
-        off += sizeof(uint32_t);
-        block->nonce = UInt32GetLE(&buf[off]);
-        off += sizeof(uint32_t);
+        off += _MerkleBlockParseHeader(block, buf);
 
         if (off + sizeof(uint32_t) <= bufLen) {
             block->totalTx = UInt32GetLE(&buf[off]);
@@ -121,17 +246,129 @@ BRMerkleBlock *BRMerkleBlockParse(const uint8_t *buf, size_t bufLen) {
             len = block->flagsLen;
             block->flags = (off + len <= bufLen) ? malloc(len) : NULL;
             if (block->flags) memcpy(block->flags, &buf[off], len);
+            _MerkleBlockSetTree(block);
         }
+    }
+
+    return block;
+}
+
+// buf must contain either a serialized merkleblock or header
+// returns a merkle block struct that must be freed by calling MerkleBlockFree()
+BRMerkleBlock *BRMerkleBlockParse(const uint8_t *buf, size_t bufLen) {
+    BRMerkleBlock *block;
+
+    assert(buf != NULL || bufLen == 0);
+    block = _MerkleBlockParse(buf, bufLen);
+    if (block) _MerkleBlockSetHash(block, buf);
+    return block;
+}
+
+// buf must contain a block serialized with MerkleBlockSerializeTrusted(), its blockHash and height are restored without
+// computing the proof-of-work hash, PeerManagerNew() checks the blocks it's given with MerkleBlockVerifyHashes() later
+// returns a merkle block struct that must be freed by calling MerkleBlockFree(), or NULL if the checksum is wrong
+BRMerkleBlock *BRMerkleBlockParseTrusted(const uint8_t *buf, size_t bufLen) {
+    BRMerkleBlock *block = NULL;
+    size_t off = bufLen - MERKLE_BLOCK_TRUSTED_LENGTH;
+    UInt256 md;
+
+    assert(buf != NULL || bufLen == 0);
 
-        if(block->timestamp < X16RV2ActivationTime)
-            X16R(&block->blockHash, buf, 80);
-        else
-            X16Rv2(&block->blockHash, buf, 80);
+    if (buf && 80 + MERKLE_BLOCK_TRUSTED_LENGTH <= bufLen) {
+        SHA256(&md, buf, bufLen - sizeof(uint32_t));
+        if (memcmp(&buf[bufLen - sizeof(uint32_t)], &md, sizeof(uint32_t)) == 0) block = _MerkleBlockParse(buf, off);
+    }
+
+    if (block) {
+        block->blockHash = UInt256Get(&buf[off]);
+        block->height = UInt32GetLE(&buf[off + sizeof(UInt256)]);
     }
 
     return block;
 }
 
+typedef struct {
+    BRMerkleBlock **blocks;
+    const uint8_t *buf;
+    size_t headerLen;
+} _HeaderHashJob;
+
+static void _MerkleBlockHashHeadersRoutine(void *info, size_t start, size_t end) {
+    const _HeaderHashJob *job = info;
+    size_t i, count = end - start;
+    void **md32 = malloc(count * sizeof(*md32));
+    const void **data = malloc(count * sizeof(*data));
+    size_t *len = malloc(count * sizeof(*len));
+    int *v2 = malloc(count * sizeof(*v2));
+
+    assert(md32 != NULL && data != NULL && len != NULL && v2 != NULL);
+
+    for (i = 0; i < count; i++) {
+        md32[i] = &job->blocks[start + i]->blockHash;
+        data[i] = &job->buf[job->headerLen * (start + i)];
+        len[i] = 80;
+        v2[i] = (job->blocks[start + i]->timestamp >= X16RV2ActivationTime);
+    }
+
+    X16RBatch(md32, data, len, v2, count); // hashes the job's headers a round at a time, grouped by algorithm
+    free(md32);
+    free(data);
+    free(len);
+    free(v2);
+}
+
+// parses count consecutive block headers of headerLen bytes each (81 for the entries of a "headers" message) into
+// blocks, in order, spreading the X16R/X16Rv2 hashing across worker threads
+// the first assumedCount headers aren't hashed, they take their blockHash from the prevBlock of the header after them
+// returns the number of headers parsed, each of which must be freed by calling MerkleBlockFree()
+size_t BRMerkleBlockParseHeaders(BRMerkleBlock *blocks[], size_t count, const uint8_t *buf, size_t bufLen,
+                                 size_t headerLen, size_t assumedCount) {
+    size_t i;
+
+    assert(blocks != NULL || count == 0);
+    assert(buf != NULL || bufLen == 0);
+    assert(headerLen >= 80);
+
+    if (!buf || count > bufLen / headerLen) count = (buf) ? bufLen / headerLen : 0;
+
+    for (i = 0; i < count; i++) { // header fields are cheap to parse, so do that up front on this thread
+        blocks[i] = BRMerkleBlockNew();
+        _MerkleBlockParseHeader(blocks[i], &buf[headerLen * i]);
+    }
+
+    if (assumedCount >= count) assumedCount = (count > 0) ? count - 1 : 0; // the last header is always hashed
+    for (i = 0; i < assumedCount; i++) blocks[i]->blockHash = blocks[i + 1]->prevBlock;
+    BRParallelRanges(_MerkleBlockHashHeadersRoutine,
+                     &(_HeaderHashJob) { &blocks[assumedCount], &buf[headerLen * assumedCount], headerLen },
+                     count - assumedCount, HEADER_HASH_MIN_BATCH, HEADER_HASH_MAX_THREADS);
+    return count;
+}
+
+// true if the blockHash of each of count blocks is the proof-of-work hash of its header, the hashing is spread across
+// worker threads, for checking blocks restored with MerkleBlockParseTrusted() off the startup path
+// returns the number of blocks, from the start of blocks, with a correct blockHash
+size_t BRMerkleBlockVerifyHashes(BRMerkleBlock *blocks[], size_t count) {
+    uint8_t *buf = malloc(count * 80 + 1);
+    BRMerkleBlock **hashed = malloc((count + 1) * sizeof(*hashed));
+    size_t i, n;
+
+    assert(blocks != NULL || count == 0);
+    assert(buf != NULL && hashed != NULL);
+    for (i = 0; i < count; i++) BRMerkleBlockSerialize(&(BRMerkleBlock) { .version = blocks[i]->version,
+        .prevBlock = blocks[i]->prevBlock, .merkleRoot = blocks[i]->merkleRoot, .timestamp = blocks[i]->timestamp,
+        .target = blocks[i]->target, .nonce = blocks[i]->nonce }, &buf[80 * i], 80);
+    n = count = BRMerkleBlockParseHeaders(hashed, count, buf, count * 80, 80, 0);
+
+    for (i = count; i > 0; i--) {
+        if (! UInt256Eq(hashed[i - 1]->blockHash, blocks[i - 1]->blockHash)) n = i - 1;
+        BRMerkleBlockFree(hashed[i - 1]);
+    }
+
+    free(hashed);
+    free(buf);
+    return n;
+}
+
 // returns number of bytes written to buf, or total bufLen needed if buf is NULL (block->height is not serialized)
 size_t BRMerkleBlockSerialize(const BRMerkleBlock *block, uint8_t *buf, size_t bufLen) {
     size_t off = 0, len = 80;
@@ -172,38 +409,39 @@ size_t BRMerkleBlockSerialize(const BRMerkleBlock *block, uint8_t *buf, size_t b
     return (!buf || len <= bufLen) ? len : 0;
 }
 
-static size_t _MerkleBlockTxHashesR(const BRMerkleBlock *block, UInt256 *txHashes, size_t hashesCount, size_t *idx,
-                                    size_t *hashIdx, size_t *flagIdx, int depth) {
-    uint8_t flag;
-
-    if (*flagIdx / 8 < block->flagsLen && *hashIdx < block->hashesCount) {
-        flag = (block->flags[*flagIdx / 8] & (1 << (*flagIdx % 8)));
-        (*flagIdx)++;
+// serializes block followed by its blockHash, height and a checksum, for restoring it with MerkleBlockParseTrusted()
+// returns number of bytes written to buf, or total bufLen needed if buf is NULL
+size_t BRMerkleBlockSerializeTrusted(const BRMerkleBlock *block, uint8_t *buf, size_t bufLen) {
+    size_t off = BRMerkleBlockSerialize(block, NULL, 0), len = off + MERKLE_BLOCK_TRUSTED_LENGTH;
+    UInt256 md;
 
-        if (!flag || depth == _ceil_log2(block->totalTx)) {
-            if (flag && *idx < hashesCount) {
-                if (txHashes) txHashes[*idx] = block->hashes[*hashIdx]; // leaf
-                (*idx)++;
-            }
-
-            (*hashIdx)++;
-        } else {
-            _MerkleBlockTxHashesR(block, txHashes, hashesCount, idx, hashIdx, flagIdx, depth + 1); // left branch
-            _MerkleBlockTxHashesR(block, txHashes, hashesCount, idx, hashIdx, flagIdx, depth + 1); // right branch
-        }
+    if (buf && len <= bufLen) {
+        BRMerkleBlockSerialize(block, buf, off);
+        UInt256Set(&buf[off], block->blockHash);
+        UInt32SetLE(&buf[off + sizeof(UInt256)], block->height);
+        SHA256(&md, buf, len - sizeof(uint32_t));
+        memcpy(&buf[len - sizeof(uint32_t)], &md, sizeof(uint32_t));
     }
 
-    return *idx;
+    return (!buf || len <= bufLen) ? len : 0;
 }
 
 // populates txHashes with the matched tx hashes in the block
 // returns number of hashes written, or the total hashesCount needed if txHashes is NULL
 size_t BRMerkleBlockTxHashes(const BRMerkleBlock *block, UInt256 *txHashes, size_t hashesCount) {
-    size_t idx = 0, hashIdx = 0, flagIdx = 0;
+    size_t count = hashesCount;
 
     assert(block != NULL);
 
-    return _MerkleBlockTxHashesR(block, txHashes, (txHashes) ? hashesCount : SIZE_MAX, &idx, &hashIdx, &flagIdx, 0);
+    if (block->treeState == 0) { // tree wasn't walked when the block was parsed
+        _MerkleBlockWalk(block, txHashes, &count);
+        if (txHashes && count > hashesCount) count = hashesCount;
+    } else if (txHashes) {
+        count = (block->matchedCount < hashesCount) ? block->matchedCount : hashesCount;
+        if (count > 0) memcpy(txHashes, block->matchedHashes, count*sizeof(*txHashes));
+    } else count = block->matchedCount;
+
+    return count;
 }
 
 // sets the hashes and flags fields for a block created with MerkleBlockNew()
@@ -219,31 +457,12 @@ void BRMerkleBlockSetTxHashes(BRMerkleBlock *block, const UInt256 *hashes, size_
     if (block->flags) free(block->flags);
     block->flags = (flagsLen > 0) ? malloc(flagsLen) : NULL;
     if (block->flags) memcpy(block->flags, flags, flagsLen);
-}
-
-// recursively walks the merkle tree to calculate the merkle root
-// NOTE: this merkle tree design has a security vulnerability (CVE-2012-2459), which can be defended against by
-// considering the merkle root invalid if there are duplicate hashes in any rows with an even number of elements
-static UInt256 _MerkleBlockRootR(const BRMerkleBlock *block, size_t *hashIdx, size_t *flagIdx, int depth) {
-    uint8_t flag;
-    UInt256 hashes[2], md = UINT256_ZERO;
-
-    if (*flagIdx / 8 < block->flagsLen && *hashIdx < block->hashesCount) {
-        flag = (block->flags[*flagIdx / 8] & (1 << (*flagIdx % 8)));
-        (*flagIdx)++;
-
-        if (flag && depth != _ceil_log2(block->totalTx)) {
-            hashes[0] = _MerkleBlockRootR(block, hashIdx, flagIdx, depth + 1); // left branch
-            hashes[1] = _MerkleBlockRootR(block, hashIdx, flagIdx, depth + 1); // right branch
-
-            if (!UInt256IsZero(hashes[0]) && !UInt256Eq(hashes[0], hashes[1])) {
-                if (UInt256IsZero(hashes[1])) hashes[1] = hashes[0]; // if right branch is missing, dup left branch
-                SHA256_2(&md, hashes, sizeof(hashes));
-            } else *hashIdx = SIZE_MAX; // defend against (CVE-2012-2459)
-        } else md = block->hashes[(*hashIdx)++]; // leaf
-    }
-
-    return md;
+    block->hashesCount = hashesCount;
+    block->flagsLen = flagsLen;
+    if (block->matchedHashes) free(block->matchedHashes);
+    block->matchedHashes = NULL;
+    block->matchedCount = 0;
+    block->treeState = 0;
 }
 
 // true if merkle tree and timestamp are valid, and proof-of-work matches the stated difficulty target
@@ -256,12 +475,13 @@ int BRMerkleBlockIsValid(const BRMerkleBlock *block, uint32_t currentTime) {
     // bit is the sign, and the remaining 23bits is the value after having been right shifted by (size - 3)*8 bits
     static const uint32_t maxsize = MAX_PROOF_OF_WORK >> 24, maxtarget = MAX_PROOF_OF_WORK & 0x00ffffff;
     const uint32_t size = block->target >> 24, target = block->target & 0x00ffffff;
-    size_t hashIdx = 0, flagIdx = 0;
-    UInt256 merkleRoot = _MerkleBlockRootR(block, &hashIdx, &flagIdx, 0), t = UINT256_ZERO;
+    size_t count = 0;
+    UInt256 t = UINT256_ZERO;
     int r = 1;
 
-    // check if merkle root is correct
-    if (block->totalTx > 0 && !UInt256Eq(merkleRoot, block->merkleRoot)) r = 0;
+    // check if merkle root is correct, walking the tree here if it wasn't walked when the block was parsed
+    if (block->totalTx > 0 && block->treeState < 0) r = 0;
+    if (block->totalTx > 0 && block->treeState == 0 && !_MerkleBlockWalk(block, NULL, &count)) r = 0;
 
     // check if timestamp is too far in future
     if (block->timestamp > currentTime + BLOCK_MAX_TIME_DRIFT) r = 0;
@@ -294,106 +514,82 @@ int MerkleBlockContainsTxHash(const BRMerkleBlock *block, UInt256 txHash) {
     return r;
 }
 
-// verifies the block difficulty target is correct for the block's position in the chain
-// transitionTime is the timestamp of the block at the previous difficulty transition
-// transitionTime may be 0 if block->height is not a multiple of BLOCK_DIFFICULTY_INTERVAL
-//
-// The difficulty target algorithm works as follows:
-// The target must be the same as in the previous block unless the block's height is a multiple of 2016. Every 2016
-// blocks there is a difficulty transition where a new difficulty is calculated. The new target is the previous target
-// multiplied by the time between the last transition block's timestamp and this one (in seconds), divided by the
-// targeted time between transitions (14*24*60*60 seconds). If the new difficulty is more than 4x or less than 1/4 of
-// the previous difficulty, the change is limited to either 4x or 1/4. There is also a minimum difficulty value
-// intuitively named MAX_PROOF_OF_WORK... since larger values are less difficult.
-int BRMerkleBlockVerifyDifficulty(const BRMerkleBlock *block, const BRMerkleBlock *previous, const BRSet *blocks) {
-    int r = 1;
+// rebuilds dgw so that it ends at previous, walking back through blocks (verifiedCount is preserved)
+void BRDarkGravityWaveInit(BRDarkGravityWave *dgw, const BRMerkleBlock *previous, const BRSet *blocks) {
+    const BRMerkleBlock *b;
+    uint32_t i = DGW_PAST_BLOCKS;
 
-    assert(block != NULL);
+    assert(dgw != NULL);
     assert(previous != NULL);
     assert(blocks != NULL);
 
-    if (!previous || !UInt256Eq(block->prevBlock, previous->blockHash) || block->height != previous->height + 1) r = 0;
+    dgw->blockHash = previous->blockHash;
+    dgw->targetSum = UINT256_ZERO;
+    dgw->height = previous->height;
 
-    if (block->height >= DGW_START_BLOCK) {
+    // walk back over up to DGW_PAST_BLOCKS blocks, the genesis block is never part of the window
+    for (b = BRSetGet(blocks, previous); b && b->height > 0 && i > 0; b = BRSetGet(blocks, &b->prevBlock)) {
+        i--;
+        dgw->targets[i] = b->target;
+        dgw->timestamps[i] = b->timestamp;
+        dgw->targetSum = add(dgw->targetSum, setCompact(b->target));
+    }
 
-        int32_t DGWTarget = DarkGravityWaveTarget(previous, blocks);
-        int32_t diff = block->target - DGWTarget;
+    dgw->start = i;
+    dgw->count = DGW_PAST_BLOCKS - i;
+}
 
-        {
-            static int pastCount = 0;
-            if (pastCount < DGW_PAST_BLOCKS) {
-#if TESTNET
-    // TODO: implement testnet difficulty rule check
-    return r; // don't worry about difficulty on testnet for now
-#elif REGTEST
-    // TODO: implement regtest difficulty rule check
-    return r; // don't worry about difficulty on regtest for now
-#endif
-                if (block->height == 338778) r = block->target == 0x1b07cf3a ? 1 : 0;
-            } else {
-                r = (abs(diff) < 2) ? 1 : 0;
-            }
-            pastCount++;
-        }
+// adds block to the end of the window, dropping the oldest block once the window is full
+// block->prevBlock must be the last block added to dgw
+void BRDarkGravityWaveAddBlock(BRDarkGravityWave *dgw, const BRMerkleBlock *block) {
+    uint32_t i;
+
+    assert(dgw != NULL);
+    assert(block != NULL);
+    assert(UInt256Eq(block->prevBlock, dgw->blockHash));
+
+    if (dgw->count == DGW_PAST_BLOCKS) {
+        dgw->targetSum = subtract(dgw->targetSum, setCompact(dgw->targets[dgw->start]));
+        dgw->start = (dgw->start + 1) % DGW_PAST_BLOCKS;
+        dgw->count--;
     }
-    return r;
-}
 
-int DarkGravityWaveTarget(const BRMerkleBlock *previous, const BRSet *blockSet) {
+    i = (dgw->start + dgw->count) % DGW_PAST_BLOCKS;
+    dgw->targets[i] = block->target;
+    dgw->timestamps[i] = block->timestamp;
+    dgw->targetSum = add(dgw->targetSum, setCompact(block->target));
+    dgw->count++;
+    dgw->blockHash = block->blockHash;
+    dgw->height = block->height;
+}
 
-    BRMerkleBlock *previousBlock = BRSetGet(blockSet, previous);
+// returns the compact difficulty target required for the block following the last block added to dgw
+uint32_t BRDarkGravityWaveTarget(const BRDarkGravityWave *dgw) {
+    uint32_t last, compact;
+    int32_t nActualTimespan, nTargetTimespan;
+    UInt256 sumTargets, darkTarget;
 
-    int32_t nActualTimespan = 0;
-    int64_t lastBlockTime = 0;
-    int32_t blockCount = 0;
-    UInt256 sumTargets = UINT256_ZERO;
+    assert(dgw != NULL);
 
-    if (!previousBlock || previousBlock->height == 0 || previousBlock->height < DGW_START_BLOCK) {
+    if (dgw->count == 0 || dgw->height == 0 || dgw->height < DGW_START_BLOCK) {
         // This is the first block or the height is < transition block
         // Return minimal required work.
         return MAX_PROOF_OF_WORK;
     }
 
-    BRMerkleBlock *currentBlock = previousBlock;
-
-    // loop over the past 180 blocks
-    for (blockCount = 1; currentBlock && currentBlock->height > 0 && blockCount <= DGW_PAST_BLOCKS; blockCount++) {
-
-        // Calculate average difficulty based on the blockSet we iterate over
-        if (blockCount <= DGW_PAST_BLOCKS) {
-            UInt256 currentTarget = setCompact(currentBlock->target);
+    last = (dgw->start + dgw->count - 1) % DGW_PAST_BLOCKS;
 
-            if (blockCount == 1) {
-                sumTargets = add(currentTarget, currentTarget);
-            } else {
-                sumTargets = add(sumTargets, currentTarget);
-            }
-        }
+    // the target of the last block is counted twice
+    sumTargets = add(dgw->targetSum, setCompact(dgw->targets[last]));
 
-        // If this is the second iteration (LastBlockTime was set)
-        if (lastBlockTime > 0) {
-            // Calculate time difference between previous block and current block
-            int64_t currentBlockTime = currentBlock->timestamp;
-            int64_t diff = ((lastBlockTime) - (currentBlockTime));
-            // Increment the actual timespan
-            nActualTimespan += diff;
-        }
-        // Set lastBlockTime to the block time for the block in current iteration
-        lastBlockTime = currentBlock->timestamp;
-
-        if (previousBlock == NULL) {
-            assert(currentBlock);
-            break;
-        }
-        currentBlock = BRSetGet(blockSet, &currentBlock->prevBlock);
-    }
-
-    UInt256 blockCount256 = ((UInt256) {.u64 = {blockCount, 0, 0, 0}});
     // darkTarget is the difficulty
-    UInt256 darkTarget = divide(sumTargets, blockCount256);
+    darkTarget = divide(sumTargets, ((UInt256) {.u64 = {dgw->count + 1, 0, 0, 0}}));
+
+    // nActualTimespan is the time it took to generate the blocks in the window
+    nActualTimespan = (int32_t)((int64_t)dgw->timestamps[last] - (int64_t)dgw->timestamps[dgw->start]);
 
     // nTargetTimespan is the time that the CountBlocks should have taken to be generated.
-    int32_t nTargetTimespan = (blockCount - 1) * DGW_TARGET_TIMESPAN;
+    nTargetTimespan = (int32_t)dgw->count * DGW_TARGET_TIMESPAN;
 
     // Limit the re-adjustment to 3x or 0.33x
     // We don't want to increase/decrease diff too much.
@@ -405,7 +601,7 @@ int DarkGravityWaveTarget(const BRMerkleBlock *previous, const BRSet *blockSet)
     // Calculate the new difficulty based on actual and target timespan.
     darkTarget = divide(multiplyThis32(darkTarget, nActualTimespan), ((UInt256) {.u64 = {nTargetTimespan, 0, 0, 0}}));
 
-    uint32_t compact = getCompact(darkTarget);
+    compact = getCompact(darkTarget);
 
     // Change to minimal diff if calculated value is less
     if (compact > MAX_PROOF_OF_WORK) {
@@ -415,11 +611,71 @@ int DarkGravityWaveTarget(const BRMerkleBlock *previous, const BRSet *blockSet)
     return compact; // return new DGW diff
 }
 
+// verifies the block difficulty target is correct for the block's position in the chain
+// dgw is the DarkGravityWave window of the chain, it's rebuilt from blocks if it doesn't end at previous
+// dgw may be NULL, in which case the window is computed from blocks
+//
+// Before DGW activation the difficulty target is not checked. After activation the target must be within rounding of
+// the DarkGravityWave target computed over the previous DGW_PAST_BLOCKS blocks. The first DGW_PAST_BLOCKS blocks
+// verified against a window are not checked, since a chain restored from a checkpoint doesn't have a full window yet.
+int BRMerkleBlockVerifyDifficulty(const BRMerkleBlock *block, const BRMerkleBlock *previous, const BRSet *blocks,
+                                  BRDarkGravityWave *dgw) {
+    BRDarkGravityWave window;
+    int r = 1;
+
+    assert(block != NULL);
+    assert(previous != NULL);
+    assert(blocks != NULL);
+
+    if (!previous || !UInt256Eq(block->prevBlock, previous->blockHash) || block->height != previous->height + 1) r = 0;
+
+    if (block->height >= DGW_START_BLOCK) {
+        if (!dgw) {
+            window.verifiedCount = DGW_PAST_BLOCKS;
+            BRDarkGravityWaveInit(&window, previous, blocks);
+            dgw = &window;
+        }
+        else if (!UInt256Eq(dgw->blockHash, previous->blockHash)) {
+            BRDarkGravityWaveInit(dgw, previous, blocks); // window is on another branch, or behind
+        }
+
+        int32_t DGWTarget = BRDarkGravityWaveTarget(dgw);
+        int32_t diff = block->target - DGWTarget;
+
+        if (dgw->verifiedCount < DGW_PAST_BLOCKS) {
+#if TESTNET
+    // TODO: implement testnet difficulty rule check
+    return r; // don't worry about difficulty on testnet for now
+#elif REGTEST
+    // TODO: implement regtest difficulty rule check
+    return r; // don't worry about difficulty on regtest for now
+#endif
+            if (block->height == 338778) r = block->target == 0x1b07cf3a ? 1 : 0;
+        } else {
+            r = (abs(diff) < 2) ? 1 : 0;
+        }
+
+        dgw->verifiedCount++;
+    }
+
+    return r;
+}
+
+// returns the compact difficulty target required for the block following previous, computed from blockSet
+int DarkGravityWaveTarget(const BRMerkleBlock *previous, const BRSet *blockSet) {
+    BRDarkGravityWave dgw;
+
+    if (!BRSetContains(blockSet, previous)) return MAX_PROOF_OF_WORK;
+    BRDarkGravityWaveInit(&dgw, previous, blockSet);
+    return BRDarkGravityWaveTarget(&dgw);
+}
+
 // frees memory allocated by MerkleBlockParse
 void BRMerkleBlockFree(BRMerkleBlock *block) {
     assert(block != NULL);
 
     if (block->hashes) free(block->hashes);
     if (block->flags) free(block->flags);
+    if (block->matchedHashes) free(block->matchedHashes);
     free(block);
 }
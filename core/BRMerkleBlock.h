@@ -26,6 +26,8 @@ extern "C" {
 
 #define DGW_PAST_BLOCKS                     180
 
+#define MERKLE_BLOCK_TRUSTED_LENGTH         (32 + 4 + 4) // blockHash, height and checksum after a trusted serialization
+
 #ifdef TESTNET
 #define DGW_START_BLOCK             0
 #define X16RV2_START_BLOCK          0 // change once we have a value
@@ -55,10 +57,13 @@ typedef struct {
     uint8_t *flags;
     size_t flagsLen;
     uint32_t height;
+    UInt256 *matchedHashes; // matched tx hashes, cached when MerkleBlockParse() walks the partial merkle tree
+    size_t matchedCount;
+    int treeState; // 1 if the cached tree walk matched merkleRoot, -1 if it didn't, 0 if the tree hasn't been walked
 } BRMerkleBlock;
 
 #define BR_MERKLE_BLOCK_NONE\
-    ((const BRMerkleBlock) { UINT256_ZERO, 0, UINT256_ZERO, UINT256_ZERO, 0, 0, 0, 0, NULL, 0, NULL, 0, 0 })
+    ((const BRMerkleBlock) { UINT256_ZERO, 0, UINT256_ZERO, UINT256_ZERO, 0, 0, 0, 0, NULL, 0, NULL, 0, 0, NULL, 0, 0 })
 
 // returns a newly allocated merkle block struct that must be freed by calling MerkleBlockFree()
 BRMerkleBlock *BRMerkleBlockNew(void);
@@ -70,9 +75,30 @@ BRMerkleBlock *BRMerkleBlockCopy(const BRMerkleBlock *block);
 // returns a merkle block struct that must be freed by calling MerkleBlockFree()
 BRMerkleBlock *BRMerkleBlockParse(const uint8_t *buf, size_t bufLen);
 
+// buf must contain a block serialized with MerkleBlockSerializeTrusted(), its blockHash and height are restored without
+// computing the proof-of-work hash, PeerManagerNew() checks the blocks it's given with MerkleBlockVerifyHashes() later
+// returns a merkle block struct that must be freed by calling MerkleBlockFree(), or NULL if the checksum is wrong
+BRMerkleBlock *BRMerkleBlockParseTrusted(const uint8_t *buf, size_t bufLen);
+
+// parses count consecutive block headers of headerLen bytes each (81 for the entries of a "headers" message) into
+// blocks, in order, spreading the X16R/X16Rv2 hashing across worker threads
+// the first assumedCount headers aren't hashed, they take their blockHash from the prevBlock of the header after them
+// returns the number of headers parsed, each of which must be freed by calling MerkleBlockFree()
+size_t BRMerkleBlockParseHeaders(BRMerkleBlock *blocks[], size_t count, const uint8_t *buf, size_t bufLen,
+                                 size_t headerLen, size_t assumedCount);
+
+// true if the blockHash of each of count blocks is the proof-of-work hash of its header, the hashing is spread across
+// worker threads, for checking blocks restored with MerkleBlockParseTrusted() off the startup path
+// returns the number of blocks, from the start of blocks, with a correct blockHash
+size_t BRMerkleBlockVerifyHashes(BRMerkleBlock *blocks[], size_t count);
+
 // returns number of bytes written to buf, or total bufLen needed if buf is NULL (block->height is not serialized)
 size_t BRMerkleBlockSerialize(const BRMerkleBlock *block, uint8_t *buf, size_t bufLen);
 
+// serializes block followed by its blockHash, height and a checksum, for restoring it with MerkleBlockParseTrusted()
+// returns number of bytes written to buf, or total bufLen needed if buf is NULL
+size_t BRMerkleBlockSerializeTrusted(const BRMerkleBlock *block, uint8_t *buf, size_t bufLen);
+
 // populates txHashes with the matched tx hashes in the block
 // returns number of tx hashes written, or the total hashesCount needed if txHashes is NULL
 size_t BRMerkleBlockTxHashes(const BRMerkleBlock *block, UInt256 *txHashes, size_t hashesCount);
@@ -89,11 +115,34 @@ int BRMerkleBlockIsValid(const BRMerkleBlock *block, uint32_t currentTime);
 // true if the given tx hash is known to be included in the block
 int MerkleBlockContainsTxHash(const BRMerkleBlock *block, UInt256 txHash);
 
+// rolling DarkGravityWave window over the targets and timestamps of the last DGW_PAST_BLOCKS blocks in a chain
+typedef struct {
+    UInt256 blockHash; // hash of the last block added to the window
+    UInt256 targetSum; // sum of the expanded targets in the window
+    uint32_t targets[DGW_PAST_BLOCKS];
+    uint32_t timestamps[DGW_PAST_BLOCKS];
+    uint32_t height; // height of the last block added to the window
+    uint32_t start, count; // ring buffer position of the oldest block, and number of blocks in the window
+    uint32_t verifiedCount; // number of blocks verified against the window
+} BRDarkGravityWave;
+
+// rebuilds dgw so that it ends at previous, walking back through blocks (verifiedCount is preserved)
+void BRDarkGravityWaveInit(BRDarkGravityWave *dgw, const BRMerkleBlock *previous, const BRSet *blocks);
+
+// adds block to the end of the window, dropping the oldest block once the window is full
+// block->prevBlock must be the last block added to dgw
+void BRDarkGravityWaveAddBlock(BRDarkGravityWave *dgw, const BRMerkleBlock *block);
+
+// returns the compact difficulty target required for the block following the last block added to dgw
+uint32_t BRDarkGravityWaveTarget(const BRDarkGravityWave *dgw);
+
 // verifies the block difficulty target is correct for the block's position in the chain
-// transitionTime is the timestamp of the block at the previous difficulty transition
-// transitionTime may be 0 if block->height is not a multiple of BLOCK_DIFFICULTY_INTERVAL
-int BRMerkleBlockVerifyDifficulty(const BRMerkleBlock *block, const BRMerkleBlock *previous, const BRSet *blocks);
+// dgw is the DarkGravityWave window of the chain, it's rebuilt from blocks if it doesn't end at previous
+// dgw may be NULL, in which case the window is computed from blocks
+int BRMerkleBlockVerifyDifficulty(const BRMerkleBlock *block, const BRMerkleBlock *previous, const BRSet *blocks,
+                                  BRDarkGravityWave *dgw);
 
+// returns the compact difficulty target required for the block following previous, computed from blockSet
 int DarkGravityWaveTarget(const BRMerkleBlock *previous, const BRSet *blockSet);
 
 // returns a hash value for block suitable for use in a hashtable
@@ -0,0 +1,73 @@
+//
+//  BRParallel.h
+//
+//  Copyright (c) 2018 ravencoin core team
+//
+
+#ifndef BRParallel_h
+#define BRParallel_h
+
+#include <stddef.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// internal, not part of the public api: splits a batch of independent items across worker threads
+//
+// threads are started for each batch rather than kept in a pool. callers only hand over batches whose per item work
+// (X16R hashing, EC point multiplication, signing) dwarfs thread startup, and a batch under minBatch items runs on the
+// calling thread without starting any. the calling thread always takes the first range itself, and runs the range of
+// any worker that can't be started, so every item is done by the time BRParallelRanges() returns
+
+typedef struct {
+    void (*routine)(void *info, size_t start, size_t end);
+    void *info;
+    size_t start, end;
+} _BRParallelJob;
+
+inline static void *_BRParallelRoutine(void *arg) {
+    const _BRParallelJob *job = arg;
+
+    job->routine(job->info, job->start, job->end);
+    return NULL;
+}
+
+// calls routine(info, start, end) for consecutive ranges that together cover items 0 through count - 1, using up to
+// maxThreads threads, no more than there are cpus, with at least minBatch items each
+inline static void BRParallelRanges(void (*routine)(void *info, size_t start, size_t end), void *info, size_t count,
+                                    size_t minBatch, size_t maxThreads) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t i, threadCount = count / minBatch, started = 1;
+
+    assert(routine != NULL);
+    assert(minBatch > 0);
+    if (threadCount > maxThreads) threadCount = maxThreads;
+    if (cpus > 0 && threadCount > (size_t) cpus) threadCount = (size_t) cpus;
+    if (threadCount < 1) threadCount = 1;
+
+    _BRParallelJob jobs[threadCount];
+    pthread_t threads[threadCount];
+
+    for (i = 0; i < threadCount; i++) {
+        jobs[i] = (_BRParallelJob) { routine, info, count * i / threadCount, count * (i + 1) / threadCount };
+    }
+
+    for (i = 1; i < threadCount; i++) {
+        if (pthread_create(&threads[i], NULL, _BRParallelRoutine, &jobs[i]) != 0) break;
+        started++;
+    }
+
+    for (i = started; i < threadCount; i++) _BRParallelRoutine(&jobs[i]);
+    _BRParallelRoutine(&jobs[0]);
+    for (i = 1; i < started; i++) pthread_join(threads[i], NULL);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BRParallel_h
@@ -21,9 +21,16 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define PEER_EVENT_LOOP    1
+#endif
+
 #define HEADER_LENGTH      24
 #define MAX_MSG_LENGTH     0x02000000
 #define MAX_GETDATA_HASHES 50000
@@ -33,6 +40,14 @@
 #define LOCAL_HOST         ((UInt128) { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0x7f, 0x00, 0x00, 0x01 })
 #define CONNECT_TIMEOUT    3.0
 #define MESSAGE_TIMEOUT    10.0
+#define ASSUME_VALID_WINDOW      BLOCK_DIFFICULTY_INTERVAL // headers this close below the assumevalid block are hashed
+#define ASSUME_VALID_WINDOW_TIME (7*24*60*60)              // as are headers timestamped within a week of it
+#define RECV_BUFFER_LENGTH 0x10000  // least free space kept in a receive buffer before each read
+#define RECV_BUFFER_MAX    0x400000 // receive buffers that grew past this for a large message are shrunk once drained
+#define LOOP_TICK          0.25 // seconds per slot of the event loop timer wheel
+#define LOOP_WHEEL_SLOTS   256  // deadlines past the end of the wheel are rechecked once per revolution
+#define LOOP_MAX_EVENTS    64
+#define LOOP_MAX_QUEUED    (MAX_MSG_LENGTH*2) // unsent bytes a peer may fall behind by before it's disconnected
 
 // the standard blockchain download protocol works as follows (for SPV mode):
 // - local peer sends getblocks
@@ -79,10 +94,11 @@ typedef struct {
     uint64_t nonce, feePerKb;
     char *useragent;
     uint32_t version, lastblock, earliestKeyTime, currentBlockHeight;
+    uint32_t assumeValidTipHeight, assumeValidHeight, assumeValidTime;
     double startTime, pingTime;
     volatile double disconnectTime, mempoolTime;
     int sentVerack, gotVerack, sentGetaddr, sentFilter, sentGetdata, sentMempool, sentGetblocks;
-    UInt256 lastBlockHash;
+    UInt256 lastBlockHash, assumeValidTip;
     BRMerkleBlock *currentBlock;
     UInt256 *currentBlockTxHashes, *knownBlockHashes, *knownTxHashes;
     BRSet *knownTxHashSet;
@@ -103,6 +119,8 @@ typedef struct {
 
     void (*relayedBlock)(void *info, BRMerkleBlock *block);
 
+    size_t (*blockInv)(void *info, UInt256 blockHashes[], size_t blockCount);
+
     void (*notfound)(void *info, const UInt256 txHashes[], size_t txCount, const UInt256 blockHashes[],
                      size_t blockCount);
 
@@ -127,8 +145,26 @@ typedef struct {
     // RVN End
 
     pthread_t thread;
+    BRPeerEventLoop *loop; // if set, the peer is serviced by this shared event loop instead of its own thread
+    int loopSocket, connecting, waitingForOut;
+    volatile int loopError;
+    double msgTimeout;
+    BRPeer *wheelNext, *wheelPrev; // other peers in the same timer wheel slot
+    size_t wheelSlot; // SIZE_MAX when the peer isn't in the timer wheel
+    uint8_t *inBuf, *outBuf; // received input and queued output, of which the first inOff and outOff bytes are done
+    size_t inOff, outOff;
+    pthread_mutex_t outLock;
 } BRPeerContext;
 
+struct BRPeerEventLoopStruct {
+    int epollFd, wakeFd;
+    volatile int stop;
+    uint64_t tick; // next timer wheel tick to expire, a tick is LOOP_TICK seconds since the epoch
+    BRPeer *wheel[LOOP_WHEEL_SLOTS], **due;
+    pthread_mutex_t lock;
+    pthread_t thread;
+};
+
 void PeerSendVersionMessage(BRPeer *peer);
 
 void PeerSendVerackMessage(BRPeer *peer);
@@ -157,6 +193,27 @@ static void _PeerAddKnownTxHashes(const BRPeer *peer, const UInt256 *txHashes, s
     }
 }
 
+// fails any pending ping and mempool requests and notifies the owner, the peer may be freed when this returns
+static void _PeerDidDisconnect(BRPeer *peer, int error) {
+    BRPeerContext *ctx = (BRPeerContext *) peer;
+
+    ctx->status = BRPeerStatusDisconnected;
+    peer_log(peer, "disconnected");
+
+    while (array_count(ctx->pongCallback) > 0) {
+        void (*pongCallback)(void *, int) = ctx->pongCallback[0];
+        void *pongInfo = ctx->pongInfo[0];
+
+        array_rm(ctx->pongCallback, 0);
+        array_rm(ctx->pongInfo, 0);
+        if (pongCallback) pongCallback(pongInfo, 0);
+    }
+
+    if (ctx->mempoolCallback) ctx->mempoolCallback(ctx->mempoolInfo, 0);
+    ctx->mempoolCallback = NULL;
+    if (ctx->disconnected) ctx->disconnected(ctx->info, error);
+}
+
 static void _PeerDidConnect(BRPeer *peer) {
     BRPeerContext *ctx = (BRPeerContext *) peer;
 
@@ -477,7 +534,8 @@ static int _PeerAcceptInvMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen
             if (blockCount == 1 && UInt256Eq(ctx->lastBlockHash, UInt256Get(blocks[0]))) blockCount = 0;
             if (blockCount == 1) ctx->lastBlockHash = UInt256Get(blocks[0]);
 
-            UInt256 hash, blockHashes[blockCount], txHashes[txCount];
+            UInt256 hash, first = UINT256_ZERO, last = UINT256_ZERO, blockHashes[blockCount], txHashes[txCount];
+            size_t invCount;
 
             for (i = 0; i < blockCount; i++) {
                 blockHashes[i] = UInt256Get(blocks[i]);
@@ -490,6 +548,11 @@ static int _PeerAcceptInvMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen
             }
 
             if (ctx->needsFilterUpdate) blockCount = 0;
+            invCount = blockCount;
+            if (invCount > 0) first = blockHashes[0], last = blockHashes[invCount - 1];
+
+            // let the owner hand part of a getblocks response to other peers, the rest is requested from this peer
+            if (blockCount > 1 && ctx->blockInv) blockCount = ctx->blockInv(ctx->info, blockHashes, blockCount);
 
             for (i = 0, j = 0; i < txCount; i++) {
                 hash = UInt256Get(transactions[i]);
@@ -503,8 +566,8 @@ static int _PeerAcceptInvMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen
             if (j > 0 || blockCount > 0) BRPeerSendGetdata(peer, txHashes, j, blockHashes, blockCount);
 
             // to improve chain download performance, if we received 500 block hashes, request the next 500 block hashes
-            if (blockCount >= 500) {
-                UInt256 locators[] = {blockHashes[blockCount - 1], blockHashes[0]};
+            if (invCount >= 500) {
+                UInt256 locators[] = {last, first};
 
                 BRPeerSendGetblocks(peer, locators, 2, UINT256_ZERO);
             }
@@ -523,7 +586,7 @@ static int _PeerAcceptInvMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen
 
 static int _PeerAcceptTxMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen) {
     BRPeerContext *ctx = (BRPeerContext *) peer;
-    BRTransaction *tx = BRTransactionParse(msg, msgLen);
+    BRTransaction *tx = BRTransactionParseLazy(msg, msgLen);
     UInt256 txHash;
     int r = 1;
 
@@ -592,47 +655,65 @@ static int _PeerAcceptHeadersMessage(BRPeer *peer, const uint8_t *msg, size_t ms
 
         if (count >= 2000 ||
             (timestamp > 0 && timestamp + 7 * 24 * 60 * 60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime)) {
-            size_t last = 0;
+            size_t i, last = 0, assumed = 0;
             time_t now = time(NULL);
             UInt256 locators[2];
+            BRMerkleBlock **blocks = malloc(count * sizeof(*blocks));
 
-            if(timestamp >= X16RV2ActivationTime) {
-                X16Rv2(&locators[0], &msg[off + 81 * (count - 1)], 80);
-                X16Rv2(&locators[1], &msg[off], 80);
-            } else {
-                X16R(&locators[0], &msg[off + 81 * (count - 1)], 80);
-                X16R(&locators[1], &msg[off], 80);
+            // headers are only assumed while the batch extends the hashed chain tip, so that their heights are known
+            if (ctx->assumeValidTime > 0 && count > 0 && ! UInt256Eq(UInt256Get(&msg[off + 4]), ctx->assumeValidTip)) {
+                peer_log(peer, "headers don't extend assumevalid tip %s, hashing all headers",
+                         u256_hex_encode(ctx->assumeValidTip));
+                ctx->assumeValidTime = 0;
             }
 
+            // a leading run of headers, well below the assumevalid block by both height and timestamp, is linked by
+            // prevBlock instead of being hashed, every header from the first one that isn't is hashed
+            while (ctx->assumeValidTime > 0 && assumed < count &&
+                   ctx->assumeValidTipHeight + assumed + 1 + ASSUME_VALID_WINDOW < ctx->assumeValidHeight &&
+                   UInt32GetLE(&msg[off + 81 * assumed + 68]) + ASSUME_VALID_WINDOW_TIME < ctx->assumeValidTime)
+                assumed++;
+
+            // hash the whole batch up front, the locators below come from the already hashed headers
+            assert(blocks != NULL);
+            count = BRMerkleBlockParseHeaders(blocks, count, &msg[off], msgLen - off, 81, assumed);
+
+            if (ctx->assumeValidTime > 0 && count > 0) { // the last header of a batch is always hashed
+                ctx->assumeValidTip = blocks[count - 1]->blockHash;
+                ctx->assumeValidTipHeight += (uint32_t) count;
+
+                if (ctx->assumeValidTipHeight + 1 + ASSUME_VALID_WINDOW >= ctx->assumeValidHeight) {
+                    peer_log(peer, "reached assumevalid window at height %" PRIu32, ctx->assumeValidTipHeight);
+                    ctx->assumeValidTime = 0;
+                }
+            }
+            locators[0] = blocks[count - 1]->blockHash;
+            locators[1] = blocks[0]->blockHash;
+
             if (timestamp > 0 && timestamp + 7 * 24 * 60 * 60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime) {
                 // request blocks for the remainder of the chain
-                timestamp = (++last < count) ? UInt32GetLE(&msg[off + 81 * last + 68]) : 0;
+                timestamp = (++last < count) ? blocks[last]->timestamp : 0;
 
                 while (timestamp > 0 && timestamp + 7 * 24 * 60 * 60 + BLOCK_MAX_TIME_DRIFT < ctx->earliestKeyTime) {
-                    timestamp = (++last < count) ? UInt32GetLE(&msg[off + 81 * last + 68]) : 0;
-                }
-
-                if(timestamp >= X16RV2ActivationTime) {
-                    X16Rv2(&locators[0], &msg[off + 81 * (last - 1)], 80);
-                }
-                else {
-                    X16R(&locators[0], &msg[off + 81 * (last - 1)], 80);
+                    timestamp = (++last < count) ? blocks[last]->timestamp : 0;
                 }
 
+                locators[0] = blocks[last - 1]->blockHash;
                 BRPeerSendGetblocks(peer, locators, 2, UINT256_ZERO);
             } else BRPeerSendGetheaders(peer, locators, 2, UINT256_ZERO);
 
-            for (size_t i = 0; r && i < count; i++) {
-                BRMerkleBlock *block = BRMerkleBlockParse(&msg[off + 81 * i], 81);
-
-                if (!BRMerkleBlockIsValid(block, (uint32_t) now)) {
-                    peer_log(peer, "invalid block header: %s", u256_hex_encode(block->blockHash));
-                    BRMerkleBlockFree(block);
+            for (i = 0; r && i < count; i++) {
+                if (!BRMerkleBlockIsValid(blocks[i], (uint32_t) now)) {
+                    peer_log(peer, "invalid block header: %s", u256_hex_encode(blocks[i]->blockHash));
+                    BRMerkleBlockFree(blocks[i]);
                     r = 0;
                 } else if (ctx->relayedBlock) {
-                    ctx->relayedBlock(ctx->info, block);
-                } else BRMerkleBlockFree(block);
+                    ctx->relayedBlock(ctx->info, blocks[i]);
+                } else BRMerkleBlockFree(blocks[i]);
             }
+
+            while (i < count) BRMerkleBlockFree(blocks[i++]); // free any headers left over after an invalid one
+            free(blocks);
         } else {
             peer_log(peer, "non-standard headers message, %zu is fewer header(s) than expected", count);
             r = 0;
@@ -967,6 +1048,27 @@ static int _PeerAcceptMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen, c
     return r;
 }
 
+// fills in the socket address of peer for the given domain, returns its length
+static socklen_t _PeerSocketAddress(const BRPeer *peer, int domain, struct sockaddr_storage *addr) {
+    socklen_t addrLen;
+
+    memset(addr, 0, sizeof(*addr));
+
+    if (domain == PF_INET6) {
+        ((struct sockaddr_in6 *) addr)->sin6_family = AF_INET6;
+        ((struct sockaddr_in6 *) addr)->sin6_addr = *(struct in6_addr *) &peer->address;
+        ((struct sockaddr_in6 *) addr)->sin6_port = htons(peer->port);
+        addrLen = sizeof(struct sockaddr_in6);
+    } else {
+        ((struct sockaddr_in *) addr)->sin_family = AF_INET;
+        ((struct sockaddr_in *) addr)->sin_addr = *(struct in_addr *) &peer->address.u32[3];
+        ((struct sockaddr_in *) addr)->sin_port = htons(peer->port);
+        addrLen = sizeof(struct sockaddr_in);
+    }
+
+    return addrLen;
+}
+
 static int _PeerOpenSocket(BRPeer *peer, int domain, double timeout, int *error) {
     BRPeerContext *ctx = (BRPeerContext *) peer;
     struct sockaddr_storage addr;
@@ -995,19 +1097,7 @@ static int _PeerOpenSocket(BRPeer *peer, int domain, double timeout, int *error)
     }
 
     if (r) {
-        memset(&addr, 0, sizeof(addr));
-
-        if (domain == PF_INET6) {
-            ((struct sockaddr_in6 *) &addr)->sin6_family = AF_INET6;
-            ((struct sockaddr_in6 *) &addr)->sin6_addr = *(struct in6_addr *) &peer->address;
-            ((struct sockaddr_in6 *) &addr)->sin6_port = htons(peer->port);
-            addrLen = sizeof(struct sockaddr_in6);
-        } else {
-            ((struct sockaddr_in *) &addr)->sin_family = AF_INET;
-            ((struct sockaddr_in *) &addr)->sin_addr = *(struct in_addr *) &peer->address.u32[3];
-            ((struct sockaddr_in *) &addr)->sin_port = htons(peer->port);
-            addrLen = sizeof(struct sockaddr_in);
-        }
+        addrLen = _PeerSocketAddress(peer, domain, &addr);
 
         if (connect(ctx->socket, (struct sockaddr *) &addr, addrLen) < 0) err = errno;
 
@@ -1038,6 +1128,116 @@ static int _PeerOpenSocket(BRPeer *peer, int domain, double timeout, int *error)
     return r;
 }
 
+// returns the offset of the first message header in buf at or after off, or of the first byte that could still begin
+// one once more input arrives, memchr skips ahead between candidates for the first byte of the magic number
+static size_t _PeerFindHeader(uint32_t magicNumber, const uint8_t *buf, size_t off, size_t len) {
+    uint8_t magic[sizeof(uint32_t)];
+    const uint8_t *p;
+
+    UInt32SetLE(magic, magicNumber);
+
+    while (off + sizeof(magic) <= len) {
+        p = memchr(&buf[off], magic[0], len - off);
+        if (! p) return len;
+        off = p - buf;
+        if (off + sizeof(magic) > len || memcmp(p, magic, sizeof(magic)) == 0) break;
+        off++;
+    }
+
+    return off;
+}
+
+// makes room in the receive buffer of peer for at least RECV_BUFFER_LENGTH more bytes, and for the whole of a message
+// whose header was already received, so every payload can be accepted in place without being copied out first
+static void _PeerRecvReserve(BRPeer *peer) {
+    BRPeerContext *ctx = (BRPeerContext *) peer;
+    size_t len, frameLen, need = RECV_BUFFER_LENGTH;
+
+    if (! ctx->inBuf) array_new(ctx->inBuf, RECV_BUFFER_LENGTH);
+    len = array_count(ctx->inBuf) - ctx->inOff;
+
+    if (len == 0) { // everything was parsed, start over at the beginning of the buffer
+        array_count(ctx->inBuf) = ctx->inOff = 0;
+        if (array_capacity(ctx->inBuf) > RECV_BUFFER_MAX) array_set_capacity(ctx->inBuf, RECV_BUFFER_LENGTH);
+    } else if (len >= HEADER_LENGTH) { // the header was checked when parsed, make room for the rest of its message
+        frameLen = HEADER_LENGTH + UInt32GetLE(&ctx->inBuf[ctx->inOff + 16]);
+        if (frameLen <= HEADER_LENGTH + MAX_MSG_LENGTH && frameLen > len + need) need = frameLen - len;
+    }
+
+    if (array_count(ctx->inBuf) + need > array_capacity(ctx->inBuf)) {
+        memmove(ctx->inBuf, &ctx->inBuf[ctx->inOff], len); // move the unparsed bytes to the front
+        array_count(ctx->inBuf) = len;
+        ctx->inOff = 0;
+        if (len + need > array_capacity(ctx->inBuf)) array_set_capacity(ctx->inBuf, len + need);
+    }
+}
+
+// accepts every complete message in the receive buffer of peer, returns an errno.h code on a protocol error, pending is
+// set if a header was received whose payload is still incomplete
+static int _PeerRecvFrames(BRPeer *peer, int *pending) {
+    BRPeerContext *ctx = (BRPeerContext *) peer;
+    size_t off = ctx->inOff, len = array_count(ctx->inBuf);
+    int error = 0;
+
+    while (!error && ctx->socket >= 0) {
+        off = _PeerFindHeader(ctx->magicNumber, ctx->inBuf, off, len);
+        if (len - off < HEADER_LENGTH) break;
+
+        const uint8_t *header = &ctx->inBuf[off];
+        const char *type = (const char *) (&header[4]);
+        uint32_t msgLen = UInt32GetLE(&header[16]), checksum = UInt32GetLE(&header[20]);
+        UInt256 hash;
+
+        if (header[15] != 0) { // verify header type field is NULL terminated
+            peer_log(peer, "malformed message header: type not NULL terminated");
+            error = EPROTO;
+        } else if (msgLen > MAX_MSG_LENGTH) { // check message length
+            peer_log(peer, "error reading %s, message length %" PRIu32 " is too long", type, msgLen);
+            error = EPROTO;
+        } else if (len - off - HEADER_LENGTH < msgLen) {
+            break; // wait for the rest of the payload
+        } else {
+            SHA256_2(&hash, &header[HEADER_LENGTH], msgLen);
+
+            if (UInt32GetLE(&hash) != checksum) { // verify checksum
+                peer_log(peer, "error reading %s, invalid checksum %x, expected %x, payload length:%" PRIu32
+                         ", SHA256_2:%s", type, UInt32GetLE(&hash), checksum, msgLen, u256_hex_encode(hash));
+                error = EPROTO;
+            } else if (!_PeerAcceptMessage(peer, &header[HEADER_LENGTH], msgLen, type)) error = EPROTO;
+
+            off += HEADER_LENGTH + msgLen;
+        }
+    }
+
+    ctx->inOff = off;
+    *pending = (len - off >= HEADER_LENGTH);
+    return error;
+}
+
+// sends header and payload, starting off bytes in, with one vectored write so the payload is never copied, returns the
+// number of bytes sent, or -1 and sets errno
+static ssize_t _PeerSendFrame(int socket, const uint8_t *header, const uint8_t *msg, size_t msgLen, size_t off,
+                              int flags) {
+    struct iovec iov[2];
+    struct msghdr hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = iov;
+
+    if (off < HEADER_LENGTH) {
+        iov[hdr.msg_iovlen].iov_base = (void *) &header[off];
+        iov[hdr.msg_iovlen++].iov_len = HEADER_LENGTH - off;
+        off = HEADER_LENGTH;
+    }
+
+    if (off < HEADER_LENGTH + msgLen) {
+        iov[hdr.msg_iovlen].iov_base = (void *) &msg[off - HEADER_LENGTH];
+        iov[hdr.msg_iovlen++].iov_len = HEADER_LENGTH + msgLen - off;
+    }
+
+    return sendmsg(socket, &hdr, flags);
+}
+
 static void *_peerThreadRoutine(void *arg) {
     BRPeer *peer = arg;
     BRPeerContext *ctx = arg;
@@ -1047,120 +1247,428 @@ static void *_peerThreadRoutine(void *arg) {
 
         if (_PeerOpenSocket(peer, PF_INET6, CONNECT_TIMEOUT, &error)) {
             struct timeval tv;
-            double time = 0, msgTimeout;
-            uint8_t header[HEADER_LENGTH], *payload = malloc(0x1000);
-            size_t len = 0, payloadLen = 0x1000;
+            double time = 0, msgTimeout = DBL_MAX;
+            size_t count;
             ssize_t n = 0;
+            int pending = 0;
 
-            assert(payload != NULL);
             gettimeofday(&tv, NULL);
             ctx->startTime = tv.tv_sec + (double) tv.tv_usec / 1000000;
             PeerSendVersionMessage(peer);
 
-            while (ctx->socket >= 0 && !error) {
-                len = 0;
-                socket = ctx->socket;
-
-                while (socket >= 0 && !error && len < HEADER_LENGTH) {
-                    n = read(socket, &header[len], sizeof(header) - len);
-                    if (n > 0) len += n;
-                    if (n == 0) error = ECONNRESET;
-                    if (n < 0 && errno != EWOULDBLOCK) error = errno;
-                    gettimeofday(&tv, NULL);
-                    time = tv.tv_sec + (double) tv.tv_usec / 1000000;
-                    if (!error && time >= ctx->disconnectTime) error = ETIMEDOUT;
-
-                    if (!error && time >= ctx->mempoolTime) {
-                        peer_log(peer, "done waiting for mempool response");
-                        BRPeerSendPing(peer, ctx->mempoolInfo, ctx->mempoolCallback);
-                        ctx->mempoolCallback = NULL;
-                        ctx->mempoolTime = DBL_MAX;
-                    }
-
-                    while (sizeof(uint32_t) <= len && UInt32GetLE(header) != ctx->magicNumber) {
-                        memmove(header, &header[1], --len); // consume one byte at a time until we find the magic number
-                    }
-
-                    socket = ctx->socket;
+            while (!error && (socket = ctx->socket) >= 0) {
+                _PeerRecvReserve(peer);
+                count = array_count(ctx->inBuf);
+                n = read(socket, &ctx->inBuf[count], array_capacity(ctx->inBuf) - count);
+                if (n > 0) array_count(ctx->inBuf) = count + n;
+                if (n == 0) error = ECONNRESET;
+                if (n < 0 && errno != EWOULDBLOCK) error = errno;
+                gettimeofday(&tv, NULL);
+                time = tv.tv_sec + (double) tv.tv_usec / 1000000;
+                if (!error && time >= ctx->disconnectTime) error = ETIMEDOUT;
+
+                if (!error && time >= ctx->mempoolTime) {
+                    peer_log(peer, "done waiting for mempool response");
+                    BRPeerSendPing(peer, ctx->mempoolInfo, ctx->mempoolCallback);
+                    ctx->mempoolCallback = NULL;
+                    ctx->mempoolTime = DBL_MAX;
                 }
 
                 if (error) {
                     peer_log(peer, "%s", strerror(error));
-                } else if (header[15] != 0) { // verify header type field is NULL terminated
-                    peer_log(peer, "malformed message header: type not NULL terminated");
-                    error = EPROTO;
-                } else if (len == HEADER_LENGTH) {
-                    const char *type = (const char *) (&header[4]);
-                    uint32_t msgLen = UInt32GetLE(&header[16]);
-                    uint32_t checksum = UInt32GetLE(&header[20]);
-                    UInt256 hash;
-
-                    if (msgLen > MAX_MSG_LENGTH) { // check message length
-                        peer_log(peer, "error reading %s, message length %"
-                                PRIu32
-                                " is too long", type, msgLen);
-                        error = EPROTO;
-                    } else {
-                        if (msgLen > payloadLen) payload = realloc(payload, (payloadLen = msgLen));
-                        assert(payload != NULL);
-                        len = 0;
-                        socket = ctx->socket;
-                        msgTimeout = time + MESSAGE_TIMEOUT;
-
-                        while (socket >= 0 && !error && len < msgLen) {
-                            n = read(socket, &payload[len], msgLen - len);
-                            if (n > 0) len += n;
-                            if (n == 0) error = ECONNRESET;
-                            if (n < 0 && errno != EWOULDBLOCK) error = errno;
-                            gettimeofday(&tv, NULL);
-                            time = tv.tv_sec + (double) tv.tv_usec / 1000000;
-                            if (n > 0) msgTimeout = time + MESSAGE_TIMEOUT;
-                            if (!error && time >= msgTimeout) error = ETIMEDOUT;
-                            socket = ctx->socket;
-                        }
-
-                        if (error) {
-                            peer_log(peer, "%s", strerror(error));
-                        } else if (len == msgLen) {
-                            SHA256_2(&hash, payload, msgLen);
-
-                            if (UInt32GetLE(&hash) != checksum) { // verify checksum
-                                peer_log(peer, "error reading %s, invalid checksum %x, expected %x, payload length:%"
-                                        PRIu32
-                                        ", SHA256_2:%s", type, UInt32GetLE(&hash), checksum, msgLen,
-                                         u256_hex_encode(hash));
-                                error = EPROTO;
-                            } else if (!_PeerAcceptMessage(peer, payload, msgLen, type)) error = EPROTO;
-                        }
-                    }
+                } else if (n > 0) { // any progress on a pending payload restarts its timeout
+                    error = _PeerRecvFrames(peer, &pending);
+                    msgTimeout = (pending) ? time + MESSAGE_TIMEOUT : DBL_MAX;
+                } else if (time >= msgTimeout) {
+                    error = ETIMEDOUT;
+                    peer_log(peer, "%s", strerror(error));
                 }
             }
-
-            free(payload);
         }
 
         socket = ctx->socket;
         ctx->socket = -1;
-        ctx->status = BRPeerStatusDisconnected;
         if (socket >= 0) close(socket);
-        peer_log(peer, "disconnected");
+        if (ctx->inBuf) array_clear(ctx->inBuf);
+        ctx->inOff = 0;
+        _PeerDidDisconnect(peer, error);
+    pthread_cleanup_pop(1);
+    return NULL; // detached threads don't need to return a value
+}
 
-        while (array_count(ctx->pongCallback) > 0) {
-            void (*pongCallback)(void *, int) = ctx->pongCallback[0];
-            void *pongInfo = ctx->pongInfo[0];
+#if PEER_EVENT_LOOP
 
-            array_rm(ctx->pongCallback, 0);
-            array_rm(ctx->pongInfo, 0);
-            if (pongCallback) pongCallback(pongInfo, 0);
+inline static double _LoopTime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + (double) tv.tv_usec / 1000000;
+}
+
+static void _PeerLoopWake(BRPeerEventLoop *loop) {
+    uint64_t one = 1;
+    ssize_t n = write(loop->wakeFd, &one, sizeof(one)); // only fails if the counter is already non-zero
+
+    (void) n;
+}
+
+// removes peer from the timer wheel, loop->lock must be held
+static void _PeerLoopUnschedule(BRPeerEventLoop *loop, BRPeerContext *ctx) {
+    if (ctx->wheelSlot == SIZE_MAX) return;
+    if (ctx->wheelPrev) ((BRPeerContext *) ctx->wheelPrev)->wheelNext = ctx->wheelNext;
+    else loop->wheel[ctx->wheelSlot] = ctx->wheelNext;
+    if (ctx->wheelNext) ((BRPeerContext *) ctx->wheelNext)->wheelPrev = ctx->wheelPrev;
+    ctx->wheelNext = ctx->wheelPrev = NULL;
+    ctx->wheelSlot = SIZE_MAX;
+}
+
+// puts peer in the timer wheel slot of its earliest deadline, loop->lock must be held
+static void _PeerLoopSchedule(BRPeerEventLoop *loop, BRPeerContext *ctx) {
+    double deadline = ctx->disconnectTime;
+    uint64_t tick = loop->tick + LOOP_WHEEL_SLOTS - 1;
+    size_t slot;
+
+    if (ctx->mempoolTime < deadline) deadline = ctx->mempoolTime;
+    if (ctx->msgTimeout < deadline) deadline = ctx->msgTimeout;
+    if (ctx->socket < 0 || ctx->loopError) deadline = 0; // close on the next tick
+    if (deadline / LOOP_TICK + 1 < tick) tick = (uint64_t) (deadline / LOOP_TICK) + 1; // first tick after deadline
+    if (tick < loop->tick) tick = loop->tick;
+    _PeerLoopUnschedule(loop, ctx);
+    slot = tick % LOOP_WHEEL_SLOTS;
+    ctx->wheelNext = loop->wheel[slot];
+    if (ctx->wheelNext) ((BRPeerContext *) ctx->wheelNext)->wheelPrev = &ctx->peer;
+    loop->wheel[slot] = &ctx->peer;
+    ctx->wheelSlot = slot;
+}
+
+// call whenever a deadline of peer may have moved earlier, set wake to have the loop look at peer right away
+static void _PeerLoopReschedule(BRPeer *peer, int wake) {
+    BRPeerContext *ctx = (BRPeerContext *) peer;
+    BRPeerEventLoop *loop = ctx->loop;
+
+    if (loop) {
+        pthread_mutex_lock(&loop->lock);
+        if (ctx->wheelSlot != SIZE_MAX) _PeerLoopSchedule(loop, ctx); // peers being expired are rescheduled after
+        pthread_mutex_unlock(&loop->lock);
+        if (wake) _PeerLoopWake(loop);
+    }
+}
+
+// sends as much queued output as the socket takes without blocking, ctx->outLock must be held
+static int _PeerLoopFlush(BRPeer *peer) {
+    BRPeerContext *ctx = (BRPeerContext *) peer;
+    size_t count = array_count(ctx->outBuf);
+    struct epoll_event event;
+    int waiting, error = 0;
+    ssize_t n;
+
+    while (!error && ctx->outOff < count) {
+        n = send(ctx->loopSocket, &ctx->outBuf[ctx->outOff], count - ctx->outOff, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n >= 0) ctx->outOff += n;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        else if (errno != EINTR) error = errno;
+    }
+
+    if (ctx->outOff == count || ctx->outOff > count / 2) { // drop the output that was sent
+        memmove(ctx->outBuf, &ctx->outBuf[ctx->outOff], count - ctx->outOff);
+        array_count(ctx->outBuf) = count - ctx->outOff;
+        ctx->outOff = 0;
+    }
+
+    waiting = (ctx->outOff < array_count(ctx->outBuf)); // only ask for writability while output is queued
+
+    if (!error && waiting != ctx->waitingForOut) {
+        event.events = EPOLLIN | (waiting ? EPOLLOUT : 0);
+        event.data.ptr = peer;
+        if (epoll_ctl(ctx->loop->epollFd, EPOLL_CTL_MOD, ctx->loopSocket, &event) < 0) error = errno;
+        else ctx->waitingForOut = waiting;
+    }
+
+    return error;
+}
+
+// sends a framed message to peer, queueing whatever the socket doesn't take right away, can be called from any thread
+static void _PeerLoopSend(BRPeer *peer, const uint8_t *header, const uint8_t *msg, size_t msgLen) {
+    BRPeerContext *ctx = (BRPeerContext *) peer;
+    size_t count, off = 0;
+    ssize_t n;
+    int error = 0;
+
+    pthread_mutex_lock(&ctx->outLock);
+    count = (ctx->outBuf) ? array_count(ctx->outBuf) : 0;
+
+    if (ctx->socket < 0 || ctx->loopSocket < 0 || ctx->connecting) {
+        error = ENOTCONN;
+    } else if (count - ctx->outOff + HEADER_LENGTH + msgLen > LOOP_MAX_QUEUED) {
+        error = ENOBUFS;
+    } else {
+        if (ctx->outOff == count) { // nothing else is queued, so send straight from the caller's buffers
+            n = _PeerSendFrame(ctx->loopSocket, header, msg, msgLen, 0, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n > 0) off = n;
+            else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) error = errno;
         }
 
-        if (ctx->mempoolCallback) ctx->mempoolCallback(ctx->mempoolInfo, 0);
-        ctx->mempoolCallback = NULL;
-        if (ctx->disconnected) ctx->disconnected(ctx->info, error);
-    pthread_cleanup_pop(1);
-    return NULL; // detached threads don't need to return a value
+        if (!error && off < HEADER_LENGTH + msgLen) { // queue the rest
+            if (count + HEADER_LENGTH + msgLen - off > array_capacity(ctx->outBuf)) {
+                array_set_capacity(ctx->outBuf, (count + HEADER_LENGTH + msgLen - off) * 3 / 2);
+            }
+
+            if (off < HEADER_LENGTH) {
+                memcpy(&ctx->outBuf[count], &header[off], HEADER_LENGTH - off);
+                count += HEADER_LENGTH - off;
+                off = HEADER_LENGTH;
+            }
+
+            if (off < HEADER_LENGTH + msgLen) {
+                memcpy(&ctx->outBuf[count], &msg[off - HEADER_LENGTH], HEADER_LENGTH + msgLen - off);
+                count += HEADER_LENGTH + msgLen - off;
+            }
+
+            array_count(ctx->outBuf) = count;
+            error = _PeerLoopFlush(peer);
+        }
+    }
+
+    pthread_mutex_unlock(&ctx->outLock);
+
+    if (error) {
+        peer_log(peer, "%s", strerror(error));
+        BRPeerDisconnect(peer);
+    }
+}
+
+// closes the socket of peer and notifies its owner, runs on the loop thread, peer may be freed when this returns
+static void _PeerLoopClose(BRPeer *peer, int error) {
+    BRPeerContext *ctx = (BRPeerContext *) peer;
+    BRPeerEventLoop *loop = ctx->loop;
+    void (*threadCleanup)(void *) = ctx->threadCleanup;
+    void *info = ctx->info;
+
+    pthread_mutex_lock(&loop->lock);
+    _PeerLoopUnschedule(loop, ctx);
+    pthread_mutex_unlock(&loop->lock);
+    pthread_mutex_lock(&ctx->outLock);
+
+    if (ctx->loopSocket >= 0) {
+        epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, ctx->loopSocket, NULL);
+        close(ctx->loopSocket);
+    }
+
+    ctx->socket = ctx->loopSocket = -1;
+    ctx->connecting = ctx->waitingForOut = 0;
+    ctx->msgTimeout = DBL_MAX;
+    array_clear(ctx->outBuf);
+    if (ctx->inBuf) array_clear(ctx->inBuf);
+    ctx->inOff = ctx->outOff = 0;
+    pthread_mutex_unlock(&ctx->outLock);
+    if (error) peer_log(peer, "%s", strerror(error));
+    _PeerDidDisconnect(peer, error);
+    threadCleanup(info); // there's no peer thread to terminate, but the owner may still have per-peer cleanup to do
+}
+
+// accepts every complete message received by peer, and keeps its message timeout while a payload is pending
+static int _PeerLoopParse(BRPeer *peer) {
+    BRPeerContext *ctx = (BRPeerContext *) peer;
+    int pending = 0, error = _PeerRecvFrames(peer, &pending);
+
+    if (! pending) {
+        ctx->msgTimeout = DBL_MAX;
+    } else if (ctx->msgTimeout == DBL_MAX) {
+        ctx->msgTimeout = _LoopTime() + MESSAGE_TIMEOUT;
+        _PeerLoopReschedule(peer, 0);
+    } else ctx->msgTimeout = _LoopTime() + MESSAGE_TIMEOUT; // only a later deadline, the wheel catches up on its own
+
+    return error;
+}
+
+// handles epoll events for peer on the loop thread
+static void _PeerLoopEvent(BRPeer *peer, uint32_t events) {
+    BRPeerContext *ctx = (BRPeerContext *) peer;
+    socklen_t optLen = sizeof(int);
+    size_t count;
+    int error = 0, closed;
+    ssize_t n;
+
+    pthread_mutex_lock(&ctx->outLock); // BRPeerDisconnect() clears ctx->socket from other threads
+    closed = (ctx->connecting && ctx->socket < 0);
+    pthread_mutex_unlock(&ctx->outLock);
+
+    if (closed) { // disconnected locally before the connection was established
+        _PeerLoopClose(peer, 0);
+        return;
+    } else if (ctx->connecting) {
+        if (getsockopt(ctx->loopSocket, SOL_SOCKET, SO_ERROR, &error, &optLen) < 0) error = errno;
+        if (!error && (events & (EPOLLERR | EPOLLHUP))) error = ECONNREFUSED;
+        if (!error && !(events & EPOLLOUT)) return; // still connecting
+
+        if (error) {
+            peer_log(peer, "connect error: %s", strerror(error));
+            _PeerLoopClose(peer, error);
+            return;
+        }
+
+        peer_log(peer, "socket connected");
+        ctx->startTime = _LoopTime();
+        pthread_mutex_lock(&ctx->outLock);
+        ctx->connecting = 0;
+        pthread_mutex_unlock(&ctx->outLock);
+        PeerSendVersionMessage(peer); // stops waiting for writability once the version message is sent
+        events &= ~EPOLLOUT;
+    }
+
+    if (!error && (events & EPOLLOUT)) {
+        pthread_mutex_lock(&ctx->outLock);
+        error = _PeerLoopFlush(peer);
+        pthread_mutex_unlock(&ctx->outLock);
+    }
+
+    if (!error && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        _PeerRecvReserve(peer);
+        count = array_count(ctx->inBuf);
+        n = read(ctx->loopSocket, &ctx->inBuf[count], array_capacity(ctx->inBuf) - count);
+        if (n > 0) array_count(ctx->inBuf) = count + n;
+        if (n == 0) error = ECONNRESET;
+        if (n < 0 && errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) error = errno;
+        if (n < 0 && !error && (events & (EPOLLERR | EPOLLHUP))) error = ECONNRESET;
+        if (n > 0) error = _PeerLoopParse(peer);
+    }
+
+    if (ctx->socket < 0) _PeerLoopClose(peer, 0); // disconnected locally
+    else if (error) _PeerLoopClose(peer, error);
+}
+
+// closes peers whose deadlines passed, and runs their mempool timeout
+static void _PeerLoopExpire(BRPeerEventLoop *loop) {
+    double now = _LoopTime();
+    uint64_t tick = (uint64_t) (now / LOOP_TICK);
+    BRPeerContext *ctx;
+    size_t i, slot;
+
+    array_clear(loop->due);
+    pthread_mutex_lock(&loop->lock);
+    if (tick >= loop->tick + LOOP_WHEEL_SLOTS) loop->tick = tick + 1 - LOOP_WHEEL_SLOTS; // one revolution at most
+    if (loop->tick > tick + LOOP_WHEEL_SLOTS) loop->tick = tick; // clock was set back
+
+    while (loop->tick <= tick) {
+        slot = loop->tick % LOOP_WHEEL_SLOTS;
+
+        while (loop->wheel[slot]) {
+            array_add(loop->due, loop->wheel[slot]);
+            _PeerLoopUnschedule(loop, (BRPeerContext *) loop->wheel[slot]);
+        }
+
+        loop->tick++;
+    }
+
+    pthread_mutex_unlock(&loop->lock);
+
+    for (i = 0; i < array_count(loop->due); i++) {
+        BRPeer *peer = loop->due[i];
+
+        ctx = (BRPeerContext *) peer;
+
+        if (ctx->socket < 0 || ctx->loopError) {
+            _PeerLoopClose(peer, ctx->loopError);
+        } else if (now >= ctx->disconnectTime || now >= ctx->msgTimeout) {
+            _PeerLoopClose(peer, ETIMEDOUT);
+        } else {
+            if (now >= ctx->mempoolTime) {
+                peer_log(peer, "done waiting for mempool response");
+                BRPeerSendPing(peer, ctx->mempoolInfo, ctx->mempoolCallback);
+                ctx->mempoolCallback = NULL;
+                ctx->mempoolTime = DBL_MAX;
+            }
+
+            pthread_mutex_lock(&loop->lock);
+            _PeerLoopSchedule(loop, ctx);
+            pthread_mutex_unlock(&loop->lock);
+        }
+    }
+}
+
+static void *_peerEventLoopRoutine(void *arg) {
+    BRPeerEventLoop *loop = arg;
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    uint64_t count;
+    int i, n;
+
+    while (!loop->stop) {
+        n = epoll_wait(loop->epollFd, events, LOOP_MAX_EVENTS, (int) (LOOP_TICK * 1000));
+
+        for (i = 0; i < n; i++) { // each peer appears at most once, and only its own events can free it
+            if (events[i].data.ptr) _PeerLoopEvent(events[i].data.ptr, events[i].events);
+            else if (read(loop->wakeFd, &count, sizeof(count)) < 0) count = 0; // woken up to look at the wheel
+        }
+
+        _PeerLoopExpire(loop);
+    }
+
+    return NULL;
+}
+
+// starts a non-blocking connect to peer on the event loop, the result is reported from the loop thread
+static void _PeerLoopConnect(BRPeer *peer) {
+    BRPeerContext *ctx = (BRPeerContext *) peer;
+    BRPeerEventLoop *loop = ctx->loop;
+    struct sockaddr_storage addr;
+    struct epoll_event event;
+    int domain = PF_INET6, fd = -1, on = 1, error = 0;
+
+    if (!ctx->outBuf) array_new(ctx->outBuf, 0x1000);
+    ctx->loopError = 0;
+    ctx->msgTimeout = DBL_MAX;
+
+    while (fd < 0 && !error) {
+        socklen_t addrLen = _PeerSocketAddress(peer, domain, &addr);
+
+        fd = socket(domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) error = errno;
+        else setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+
+        if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, addrLen) < 0 && errno != EINPROGRESS) {
+            error = errno;
+            close(fd);
+            fd = -1;
+
+            if (domain == PF_INET6 && _PeerIsIPv4(peer)) { // fallback to IPv4
+                domain = PF_INET;
+                error = 0;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&ctx->outLock);
+    ctx->loopSocket = ctx->socket = fd;
+    ctx->connecting = ctx->waitingForOut = (fd >= 0);
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.ptr = peer;
+    if (fd >= 0 && epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event) < 0) error = errno;
+    pthread_mutex_unlock(&ctx->outLock);
+
+    if (error) {
+        peer_log(peer, "connect error: %s", strerror(error));
+        ctx->loopError = error;
+    }
+
+    pthread_mutex_lock(&loop->lock);
+    _PeerLoopSchedule(loop, ctx);
+    pthread_mutex_unlock(&loop->lock);
+    if (error) _PeerLoopWake(loop);
+}
+
+#else // event loop not available on this platform, peers always run on their own thread
+
+static void _PeerLoopReschedule(BRPeer *peer, int wake) {
+}
+
+static void _PeerLoopSend(BRPeer *peer, const uint8_t *header, const uint8_t *msg, size_t msgLen) {
 }
 
+static void _PeerLoopConnect(BRPeer *peer) {
+}
+
+#endif
+
 static void _dummyThreadCleanup(void *info) {
 }
 
@@ -1174,13 +1682,17 @@ BRPeer *BRPeerNew(uint32_t magicNumber) {
     array_new(ctx->knownBlockHashes, 10);
     array_new(ctx->currentBlockTxHashes, 10);
     array_new(ctx->knownTxHashes, 10);
-    ctx->knownTxHashSet = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
+    ctx->knownTxHashSet = BRSetNewUInt256(10);
     array_new(ctx->pongInfo, 10);
     array_new(ctx->pongCallback, 10);
     ctx->pingTime = DBL_MAX;
     ctx->mempoolTime = DBL_MAX;
     ctx->disconnectTime = DBL_MAX;
     ctx->socket = -1;
+    ctx->loopSocket = -1;
+    ctx->msgTimeout = DBL_MAX;
+    ctx->wheelSlot = SIZE_MAX;
+    pthread_mutex_init(&ctx->outLock, NULL);
     ctx->threadCleanup = _dummyThreadCleanup;
     return &ctx->peer;
 }
@@ -1190,6 +1702,7 @@ BRPeer *BRPeerNew(uint32_t magicNumber) {
 // void disconnected(void *, int) - called when peer connection is closed, error is an errno.h code
 // void relayedPeers(void *, const Peer[], size_t) - called when an "addr" message is received from peer
 // void relayedTx(void *, Transaction *) - called when a "tx" message is received from peer
+//   (the tx is parsed with BRTransactionParseLazy(), call BRTransactionSetAddresses() before using output addresses)
 // void hasTx(void *, UInt256 txHash) - called when an "inv" message with an already-known tx hash is received from peer
 // void rejectedTx(void *, UInt256 txHash, uint8_t) - called when a "reject" message is received from peer
 // void relayedBlock(void *, MerkleBlock *) - called when a "merkleblock" or "headers" message is received from peer
@@ -1233,6 +1746,31 @@ void BRPeerSetEarliestKeyTime(BRPeer *peer, uint32_t earliestKeyTime) {
     ((BRPeerContext *) peer)->earliestKeyTime = earliestKeyTime;
 }
 
+// size_t blockInv(void *, UInt256[], size_t) - called with the block hashes of a getblocks "inv" response before they
+// are requested, must move the hashes this peer should request to the front of the array and return their count
+void BRPeerSetBlockInvCallback(BRPeer *peer, size_t (*blockInv)(void *info, UInt256 blockHashes[], size_t blockCount)) {
+    ((BRPeerContext *) peer)->blockInv = blockInv;
+}
+
+// services peer from loop instead of a thread of its own, call before BRPeerConnect(), set loop to NULL to stop
+// callbacks then run on the loop thread, and threadCleanup is called on it after each disconnect
+void BRPeerSetEventLoop(BRPeer *peer, BRPeerEventLoop *loop) {
+    ((BRPeerContext *) peer)->loop = loop;
+}
+
+// headers that extend the chain from tipHash at tipHeight, and that are more than ASSUME_VALID_WINDOW blocks below height
+// and timestamped more than ASSUME_VALID_WINDOW_TIME before timestamp (a hardcoded checkpoint), take their blockHash from
+// the prevBlock of the next header instead of computing their proof-of-work hash, set tipHash to UINT256_ZERO to hash
+// every header
+void BRPeerSetAssumeValid(BRPeer *peer, UInt256 tipHash, uint32_t tipHeight, uint32_t height, uint32_t timestamp) {
+    BRPeerContext *ctx = (BRPeerContext *) peer;
+
+    ctx->assumeValidTip = tipHash;
+    ctx->assumeValidTipHeight = tipHeight;
+    ctx->assumeValidHeight = height;
+    ctx->assumeValidTime = (UInt256IsZero(tipHash)) ? 0 : timestamp;
+}
+
 // call this when local block height changes (helps detect tarpit nodes)
 void BRPeerSetCurrentBlockHeight(BRPeer *peer, uint32_t currentBlockHeight) {
     ((BRPeerContext *) peer)->currentBlockHeight = currentBlockHeight;
@@ -1262,7 +1800,9 @@ void BRPeerConnect(BRPeer *peer) {
             gettimeofday(&tv, NULL);
             ctx->disconnectTime = tv.tv_sec + (double) tv.tv_usec / 1000000 + CONNECT_TIMEOUT;
 
-            if (pthread_attr_init(&attr) != 0) {
+            if (ctx->loop) {
+                _PeerLoopConnect(peer);
+            } else if (pthread_attr_init(&attr) != 0) {
                 error = ENOMEM;
                 peer_log(peer, "error creating thread");
                 ctx->status = BRPeerStatusDisconnected;
@@ -1282,9 +1822,17 @@ void BRPeerConnect(BRPeer *peer) {
 // close connection to peer
 void BRPeerDisconnect(BRPeer *peer) {
     BRPeerContext *ctx = (BRPeerContext *) peer;
-    int socket = ctx->socket;
+    int socket, error = 0;
 
-    if (socket >= 0) {
+    if (ctx->loop) { // the loop thread closes the socket, under outLock, so the fd can't be reused while it's held
+        pthread_mutex_lock(&ctx->outLock);
+        socket = ctx->socket;
+        ctx->socket = -1;
+        if (socket >= 0 && ctx->loopSocket >= 0 && shutdown(ctx->loopSocket, SHUT_RDWR) < 0) error = errno;
+        pthread_mutex_unlock(&ctx->outLock);
+        if (error && error != ENOTCONN) peer_log(peer, "%s", strerror(error));
+        if (socket >= 0) _PeerLoopReschedule(peer, 1);
+    } else if ((socket = ctx->socket) >= 0) {
         ctx->socket = -1;
         if (shutdown(socket, SHUT_RDWR) < 0) peer_log(peer, "%s", strerror(errno));
         close(socket);
@@ -1298,6 +1846,7 @@ void BRPeerScheduleDisconnect(BRPeer *peer, double seconds) {
 
     gettimeofday(&tv, NULL);
     ctx->disconnectTime = (seconds < 0) ? DBL_MAX : tv.tv_sec + (double) tv.tv_usec / 1000000 + seconds;
+    _PeerLoopReschedule(peer, 0);
 }
 
 // call this when wallet addresses need to be added to bloom filter
@@ -1353,36 +1902,43 @@ void BRPeerSendMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen, const ch
         peer_log(peer, "failed to send %s, length %zu is too long", type, msgLen);
     } else {
         BRPeerContext *ctx = (BRPeerContext *) peer;
-        uint8_t buf[HEADER_LENGTH + msgLen], hash[32];
+        uint8_t header[HEADER_LENGTH], hash[32];
         size_t off = 0;
         ssize_t n = 0;
         struct timeval tv;
         int socket, error = 0;
 
-        UInt32SetLE(&buf[off], ctx->magicNumber);
+        UInt32SetLE(&header[off], ctx->magicNumber);
         off += sizeof(uint32_t);
-        strncpy((char *) &buf[off], type, 12);
+        strncpy((char *) &header[off], type, 12);
         off += 12;
-        UInt32SetLE(&buf[off], (uint32_t) msgLen);
+        UInt32SetLE(&header[off], (uint32_t) msgLen);
         off += sizeof(uint32_t);
         SHA256_2(hash, msg, msgLen);
-        memcpy(&buf[off], hash, sizeof(uint32_t));
-        off += sizeof(uint32_t);
-        memcpy(&buf[off], msg, msgLen);
+        memcpy(&header[off], hash, sizeof(uint32_t));
         peer_log(peer, "sending %s", type);
-        msgLen = 0;
+
+        if (ctx->loop) { // the event loop queues whatever can't be sent right away
+            _PeerLoopSend(peer, header, msg, msgLen);
+            return;
+        }
+
+        off = 0;
+        pthread_mutex_lock(&ctx->outLock); // keeps messages sent from different threads from interleaving
         socket = ctx->socket;
         if (socket < 0) error = ENOTCONN;
 
-        while (socket >= 0 && !error && msgLen < sizeof(buf)) {
-            n = send(socket, &buf[msgLen], sizeof(buf) - msgLen, MSG_NOSIGNAL);
-            if (n >= 0) msgLen += n;
+        while (socket >= 0 && !error && off < HEADER_LENGTH + msgLen) {
+            n = _PeerSendFrame(socket, header, msg, msgLen, off, MSG_NOSIGNAL);
+            if (n >= 0) off += n;
             if (n < 0 && errno != EWOULDBLOCK) error = errno;
             gettimeofday(&tv, NULL);
             if (!error && tv.tv_sec + (double) tv.tv_usec / 1000000 >= ctx->disconnectTime) error = ETIMEDOUT;
             socket = ctx->socket;
         }
 
+        pthread_mutex_unlock(&ctx->outLock);
+
         if (error) {
             peer_log(peer, "%s", strerror(error));
             BRPeerDisconnect(peer);
@@ -1460,6 +2016,7 @@ void BRPeerSendMempool(BRPeer *peer, const UInt256 *knownTxHashes, size_t knownT
             ctx->mempoolTime = tv.tv_sec + (double) tv.tv_usec / 1000000 + 10.0;
             ctx->mempoolInfo = info;
             ctx->mempoolCallback = completionCallback;
+            _PeerLoopReschedule(peer, 0);
         }
 
         BRPeerSendMessage(peer, NULL, 0, MSG_MEMPOOL);
@@ -1638,9 +2195,59 @@ void BRPeerFree(BRPeer *peer) {
     if (ctx->knownTxHashSet) BRSetFree(ctx->knownTxHashSet);
     if (ctx->pongInfo) array_free(ctx->pongInfo);
     if (ctx->pongCallback) array_free(ctx->pongCallback);
+    if (ctx->inBuf) array_free(ctx->inBuf);
+    if (ctx->outBuf) array_free(ctx->outBuf);
+    pthread_mutex_destroy(&ctx->outLock);
     free(ctx);
 }
 
+// returns a newly allocated event loop that services the peers given to it on a single thread, or NULL if the platform
+// has no event loop support, in which case each peer keeps its own thread, must be freed with BRPeerEventLoopFree()
+BRPeerEventLoop *BRPeerEventLoopNew(void) {
+#if PEER_EVENT_LOOP
+    BRPeerEventLoop *loop = calloc(1, sizeof(*loop));
+    struct epoll_event event;
+
+    assert(loop != NULL);
+    loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    loop->tick = (uint64_t) (_LoopTime() / LOOP_TICK);
+    array_new(loop->due, 10);
+    pthread_mutex_init(&loop->lock, NULL);
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // events without a peer are wake ups
+
+    if (loop->epollFd < 0 || loop->wakeFd < 0 || epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->wakeFd, &event) < 0 ||
+        pthread_create(&loop->thread, NULL, _peerEventLoopRoutine, loop) != 0) {
+        if (loop->epollFd >= 0) close(loop->epollFd);
+        if (loop->wakeFd >= 0) close(loop->wakeFd);
+        array_free(loop->due);
+        pthread_mutex_destroy(&loop->lock);
+        free(loop);
+        loop = NULL;
+    }
+
+    return loop;
+#else
+    return NULL;
+#endif
+}
+
+// stops the loop thread and frees loop, all peers using it must be disconnected first, don't call from the loop thread
+void BRPeerEventLoopFree(BRPeerEventLoop *loop) {
+#if PEER_EVENT_LOOP
+    assert(loop != NULL);
+    loop->stop = 1;
+    _PeerLoopWake(loop);
+    pthread_join(loop->thread, NULL);
+    close(loop->wakeFd);
+    close(loop->epollFd);
+    array_free(loop->due);
+    pthread_mutex_destroy(&loop->lock);
+    free(loop);
+#endif
+}
+
 void PeerAcceptMessageTest(BRPeer *peer, const uint8_t *msg, size_t msgLen, const char *type) {
     _PeerAcceptMessage(peer, msg, msgLen, type);
 }
@@ -92,6 +92,9 @@ typedef struct {
 
 #define PEER_NONE ((const BRPeer) { UINT128_ZERO, 0, 0, 0, 0 })
 
+// services the sockets and timeouts of many peers on a single thread, an alternative to one thread per peer
+typedef struct BRPeerEventLoopStruct BRPeerEventLoop;
+
 // NOTE: Peer functions are not thread-safe
 
 // returns a newly allocated Peer struct that must be freed by calling BRPeerFree()
@@ -102,6 +105,7 @@ BRPeer *BRPeerNew(uint32_t magicNumber);
 // void disconnected(void *, int) - called when peer connection is closed, error is an errno.h code
 // void relayedPeers(void *, const Peer[], size_t) - called when an "addr" message is received from peer
 // void relayedTx(void *, Transaction *) - called when a "tx" message is received from peer
+//   (the tx is parsed with BRTransactionParseLazy(), call BRTransactionSetAddresses() before using output addresses)
 // void hasTx(void *, UInt256 txHash) - called when an "inv" message with an already-known tx hash is received from peer
 // void rejectedTx(void *, UInt256 txHash, uint8_t) - called when a "reject" message is received from peer
 // void relayedBlock(void *, MerkleBlock *) - called when a "merkleblock" or "headers" message is received from peer
@@ -127,6 +131,19 @@ void BRPeerSetCallbacks(BRPeer *peer, void *info,
 // set earliestKeyTime to wallet creation time in order to speed up initial sync
 void BRPeerSetEarliestKeyTime(BRPeer *peer, uint32_t earliestKeyTime);
 
+// size_t blockInv(void *, UInt256[], size_t) - called with the block hashes of a getblocks "inv" response before they
+// are requested, must move the hashes this peer should request to the front of the array and return their count
+void BRPeerSetBlockInvCallback(BRPeer *peer, size_t (*blockInv)(void *info, UInt256 blockHashes[], size_t blockCount));
+
+// services peer from loop instead of a thread of its own, call before BRPeerConnect(), set loop to NULL to stop
+// callbacks then run on the loop thread, and threadCleanup is called on it after each disconnect
+void BRPeerSetEventLoop(BRPeer *peer, BRPeerEventLoop *loop);
+
+// headers that extend the chain from tipHash at tipHeight, and that are well below the block at height with timestamp
+// (a hardcoded checkpoint), take their blockHash from the prevBlock of the next header instead of computing their
+// proof-of-work hash, their contents are then not verified, set tipHash to UINT256_ZERO to hash every header
+void BRPeerSetAssumeValid(BRPeer *peer, UInt256 tipHash, uint32_t tipHeight, uint32_t height, uint32_t timestamp);
+
 // call this when local best block height changes (helps detect tarpit nodes)
 void BRPeerSetCurrentBlockHeight(BRPeer *peer, uint32_t currentBlockHeight);
 
@@ -199,6 +216,13 @@ inline static int BRPeerEq(const void *peer, const void *otherPeer)
 // frees memory allocated for peer
 void BRPeerFree(BRPeer *peer);
 
+// returns a newly allocated event loop that services the peers given to it on a single thread, or NULL if the platform
+// has no event loop support, in which case each peer keeps its own thread, must be freed with BRPeerEventLoopFree()
+BRPeerEventLoop *BRPeerEventLoopNew(void);
+
+// stops the loop thread and frees loop, all peers using it must be disconnected first, don't call from the loop thread
+void BRPeerEventLoopFree(BRPeerEventLoop *loop);
+
 #ifdef __cplusplus
 }
 #endif
@@ -12,8 +12,10 @@
 #include "BRSet.h"
 #include "BRArray.h"
 #include "BRInt.h"
+#include "BRCrypto.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <time.h>
@@ -21,12 +23,23 @@
 #include <errno.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define PROTOCOL_TIMEOUT        20.0
 #define MAX_CONNECT_FAILURES    20 // notify user of network problems after this many connect failures in a row
 #define PEER_FLAG_SYNCED        0x01
 #define PEER_FLAG_NEEDSUPDATE   0x02
+#define SYNC_CHUNK_BLOCKS       50  // block hashes handed out at a time when the chain sync is split across peers
+#define SYNC_WINDOW_BLOCKS      100 // max merkleblocks in flight from each helper peer
+#define SYNC_STALL_TIMEOUT      5.0 // seconds without a block before a helper peer's blocks are requested elsewhere
+#define HEADER_FILE_MAGIC       0x46485242 // "BRHF"
+#define HEADER_FILE_VERSION     1
+#define HEADER_FILE_PREFIX      16  // magic, version, chain magicNumber and height of the first record
+#define HEADER_FILE_RECORD      116 // 80 byte header, blockHash and checksum
 #define genesis_block_hash(params) UInt256Reverse((params)->checkpoints[0].hash)
 
 typedef struct {
@@ -53,6 +66,26 @@ typedef struct {
     BRPeer *peers;
 } TxPeerList;
 
+typedef struct {
+    UInt256 blockHash;
+    uint32_t height;
+    UInt256 *txHashes; // wallet tx the block confirmed while it was in the main chain
+} ForkTxList;
+
+typedef struct {
+    BRPeer *peer;
+    UInt256 *hashes; // merkleblocks requested from peer that haven't arrived yet
+    double time; // time of the last block received from peer, or of the first request
+    int stalled;
+} SyncWindow;
+
+// a main chain block header, the blockHash comes first so headers can be indexed by a BRSetNewUInt256() set
+typedef struct {
+    UInt256 blockHash;
+    uint8_t header[80]; // serialized block header
+    uint32_t height;
+} BRChainHeader;
+
 // true if peer is contained in the list of peers associated with txHash
 static int _TxPeerListHasPeer(const TxPeerList *list, UInt256 txHash, const BRPeer *peer) {
     for (size_t i = array_count(list); i > 0; i--) {
@@ -147,15 +180,29 @@ inline static int _BlockHeightEq(const void *block, const void *otherBlock) {
 struct BRPeerManagerStruct {
     const BRChainParams *params;
     BRWallet *wallet;
-    int isConnected, connectFailureCount, missBehavingCount, dnsThreadCount, maxConnectCount;
+    int isConnected, connectFailureCount, missBehavingCount, dnsThreadCount, maxConnectCount, assumeValidHeaders;
     BRPeer *peers, *downloadPeer, fixedPeer, **connectedPeers;
+    BRPeerEventLoop *eventLoop;
     char downloadPeerName[INET6_ADDRSTRLEN + 6];
     uint32_t earliestKeyTime, syncStartHeight, filterUpdateHeight, estimatedHeight;
     BRBloomFilter *bloomFilter;
     double fpRate, averageTxPerBlock;
-    BRSet *blocks, *orphans, *checkpoints;
+    BRSet *blocks, *orphans, *checkpoints; // blocks holds lastBlock, checkpoints and blocks that are off the main chain
     BRMerkleBlock *lastBlock, *lastOrphan;
+    BRChainHeader **chain; // main chain headers in chunks of BLOCK_DIFFICULTY_INTERVAL, looked up by height
+    uint32_t chainStart, chainEnd; // height of the first main chain header, and one past the last one (lastBlock)
+    BRSet *chainIndex; // main chain headers indexed by blockHash
+    int headerFile; // append-only file the main chain headers are written to, or -1
+    uint32_t fileStart, fileEnd; // height of the first header file record, and one past the last one
+    BRDarkGravityWave dgw; // difficulty window of the last verified block's chain
+    size_t workCount; // blocks added and headers visited for the difficulty window, pruning or file loading, for tests
+    BRMerkleBlock **unverified; // copies of the restored main chain headers, hashed in the background after connecting
+    pthread_t verifyThread;
+    int verifyStarted;
     TxPeerList *txRelays, *txRequests;
+    SyncWindow *syncWindows; // helper peers that blocks are requested from while the download peer syncs the chain
+    ForkTxList *forkTxs; // wallet tx of blocks a reorg moved off the main chain, which are only kept as headers
+    int syncSplit; // true once blocks of the current sync were requested from helpers, they may arrive out of order
     PublishedTx *publishedTx;
     UInt256 *publishedTxHashes;
     void *info;
@@ -223,19 +270,310 @@ static void _PeerManagerAddTxToPublishList(BRPeerManager *manager, BRTransaction
     }
 }
 
+// writes block's 80 byte header to header, along with its blockHash and height
+static void _ChainHeaderSet(BRChainHeader *header, const BRMerkleBlock *block) {
+    header->blockHash = block->blockHash;
+    UInt32SetLE(&header->header[0], block->version);
+    UInt256Set(&header->header[4], block->prevBlock);
+    UInt256Set(&header->header[36], block->merkleRoot);
+    UInt32SetLE(&header->header[68], block->timestamp);
+    UInt32SetLE(&header->header[72], block->target);
+    UInt32SetLE(&header->header[76], block->nonce);
+    header->height = block->height;
+}
+
+// fills in block from header, without tx hashes, and returns block
+static BRMerkleBlock *_ChainHeaderGet(const BRChainHeader *header, BRMerkleBlock *block) {
+    *block = BR_MERKLE_BLOCK_NONE;
+    block->blockHash = header->blockHash;
+    block->version = UInt32GetLE(&header->header[0]);
+    block->prevBlock = UInt256Get(&header->header[4]);
+    block->merkleRoot = UInt256Get(&header->header[36]);
+    block->timestamp = UInt32GetLE(&header->header[68]);
+    block->target = UInt32GetLE(&header->header[72]);
+    block->nonce = UInt32GetLE(&header->header[76]);
+    block->height = header->height;
+    return block;
+}
+
+// writes header as a header file record to buf, the checksum covers the record and the header's height
+static void _ChainHeaderRecord(const BRChainHeader *header, uint8_t *buf) {
+    UInt256 md;
+
+    memcpy(buf, header->header, sizeof(header->header));
+    UInt256Set(&buf[80], header->blockHash);
+    UInt32SetLE(&buf[112], header->height);
+    SHA256(&md, buf, HEADER_FILE_RECORD);
+    memcpy(&buf[112], &md, sizeof(uint32_t));
+}
+
+// reads the header file record in buf into header, returns true if its checksum is correct for height
+static int _ChainHeaderRecordGet(BRChainHeader *header, const uint8_t *buf, uint32_t height) {
+    uint8_t rec[HEADER_FILE_RECORD];
+
+    memcpy(header->header, buf, sizeof(header->header));
+    header->blockHash = UInt256Get(&buf[80]);
+    header->height = height;
+    _ChainHeaderRecord(header, rec);
+    return (memcmp(rec, buf, HEADER_FILE_RECORD) == 0);
+}
+
+// stops writing headers to the header file, after it's closed or can't be written
+static void _PeerManagerFileClose(BRPeerManager *manager) {
+    if (manager->headerFile >= 0) close(manager->headerFile);
+    manager->headerFile = -1;
+}
+
+// empties the header file, its next record will be the header at height start
+static void _PeerManagerFileReset(BRPeerManager *manager, uint32_t start) {
+    uint8_t buf[HEADER_FILE_PREFIX];
+
+    UInt32SetLE(&buf[0], HEADER_FILE_MAGIC);
+    UInt32SetLE(&buf[4], HEADER_FILE_VERSION);
+    UInt32SetLE(&buf[8], manager->params->magicNumber);
+    UInt32SetLE(&buf[12], start);
+    manager->fileStart = manager->fileEnd = start;
+
+    if (ftruncate(manager->headerFile, 0) != 0 ||
+        pwrite(manager->headerFile, buf, sizeof(buf), 0) != sizeof(buf)) _PeerManagerFileClose(manager);
+}
+
+// appends header to the header file, the file is started over if header doesn't follow its last record
+static void _PeerManagerFileAppend(BRPeerManager *manager, const BRChainHeader *header) {
+    uint8_t buf[HEADER_FILE_RECORD];
+    off_t off;
+
+    if (manager->headerFile >= 0 && header->height != manager->fileEnd) _PeerManagerFileReset(manager, header->height);
+    if (manager->headerFile < 0) return;
+    _ChainHeaderRecord(header, buf);
+    off = HEADER_FILE_PREFIX + (off_t) (header->height - manager->fileStart) * HEADER_FILE_RECORD;
+
+    if (pwrite(manager->headerFile, buf, sizeof(buf), off) == sizeof(buf)) {
+        manager->fileEnd++;
+    } else _PeerManagerFileClose(manager);
+}
+
+// removes the header file records from height end onward
+static void _PeerManagerFileTruncate(BRPeerManager *manager, uint32_t end) {
+    if (manager->headerFile < 0 || end >= manager->fileEnd) return;
+    if (end < manager->fileStart) end = manager->fileStart;
+
+    if (ftruncate(manager->headerFile, HEADER_FILE_PREFIX + (off_t) (end - manager->fileStart) * HEADER_FILE_RECORD)
+        == 0) {
+        manager->fileEnd = end;
+    } else _PeerManagerFileClose(manager);
+}
+
+// returns the main chain header at height, or NULL if it isn't stored
+static BRChainHeader *_PeerManagerChainHeader(BRPeerManager *manager, uint32_t height) {
+    if (height < manager->chainStart || height >= manager->chainEnd) return NULL;
+    return &manager->chain[height / BLOCK_DIFFICULTY_INTERVAL - manager->chainStart / BLOCK_DIFFICULTY_INTERVAL]
+                          [height % BLOCK_DIFFICULTY_INTERVAL];
+}
+
+// fills in block from the main chain header at height and returns it, or returns NULL if the header isn't stored
+static BRMerkleBlock *_PeerManagerChainBlock(BRPeerManager *manager, uint32_t height, BRMerkleBlock *block) {
+    BRChainHeader *header = _PeerManagerChainHeader(manager, height);
+
+    return (header) ? _ChainHeaderGet(header, block) : NULL;
+}
+
+// true if block is in the main chain
+static int _PeerManagerInChain(BRPeerManager *manager, const BRMerkleBlock *block) {
+    BRChainHeader *header = _PeerManagerChainHeader(manager, block->height);
+
+    return (header && UInt256Eq(header->blockHash, block->blockHash));
+}
+
+// returns the stored block with blockHash, or if there's only a main chain header with blockHash, fills in block from
+// it and returns block, returns NULL if the block is unknown
+static BRMerkleBlock *_PeerManagerBlock(BRPeerManager *manager, UInt256 blockHash, BRMerkleBlock *block) {
+    BRMerkleBlock *b = BRSetGet(manager->blocks, &blockHash);
+    BRChainHeader *header = (b) ? NULL : BRSetGet(manager->chainIndex, &blockHash);
+
+    return (header) ? _ChainHeaderGet(header, block) : b;
+}
+
+// returns the ancestor of block at height, walking back over fork blocks until reaching the main chain, where the
+// ancestor is looked up by height, header is filled in and returned if the ancestor is only stored as a header
+static BRMerkleBlock *_PeerManagerAncestor(BRPeerManager *manager, BRMerkleBlock *block, uint32_t height,
+                                           BRMerkleBlock *header) {
+    while (block && block->height > height && ! _PeerManagerInChain(manager, block)) {
+        block = _PeerManagerBlock(manager, block->prevBlock, header);
+    }
+
+    if (block && block->height > height) block = _PeerManagerChainBlock(manager, height, header);
+    return (block && block->height == height) ? block : NULL;
+}
+
+// returns the height of the last block the fork ending at block has in common with the main chain, or
+// BLOCK_UNKNOWN_HEIGHT if the fork doesn't connect to the stored part of the main chain
+static uint32_t _PeerManagerForkHeight(BRPeerManager *manager, BRMerkleBlock *block) {
+    BRMerkleBlock header;
+
+    while (block && ! _PeerManagerInChain(manager, block)) {
+        block = _PeerManagerBlock(manager, block->prevBlock, &header);
+    }
+
+    return (block) ? block->height : BLOCK_UNKNOWN_HEIGHT;
+}
+
+// appends block's header to the main chain, block->height must be chainEnd unless the chain is empty
+static void _PeerManagerChainAdd(BRPeerManager *manager, const BRMerkleBlock *block) {
+    BRChainHeader *chunk;
+
+    if (manager->chainStart == manager->chainEnd) manager->chainStart = manager->chainEnd = block->height;
+    assert(block->height == manager->chainEnd);
+
+    if (block->height / BLOCK_DIFFICULTY_INTERVAL - manager->chainStart / BLOCK_DIFFICULTY_INTERVAL >=
+        array_count(manager->chain)) {
+        chunk = calloc(BLOCK_DIFFICULTY_INTERVAL, sizeof(*chunk));
+        assert(chunk != NULL);
+        array_add(manager->chain, chunk);
+    }
+
+    manager->chainEnd++;
+    _ChainHeaderSet(_PeerManagerChainHeader(manager, block->height), block);
+    BRSetAdd(manager->chainIndex, _PeerManagerChainHeader(manager, block->height));
+    _PeerManagerFileAppend(manager, _PeerManagerChainHeader(manager, block->height));
+}
+
+// removes the main chain headers from height end onward, freeing chunks that are no longer used
+static void _PeerManagerChainTruncate(BRPeerManager *manager, uint32_t end) {
+    while (manager->chainEnd > manager->chainStart && manager->chainEnd > end) {
+        BRSetRemove(manager->chainIndex, _PeerManagerChainHeader(manager, manager->chainEnd - 1));
+        manager->chainEnd--;
+    }
+
+    _PeerManagerFileTruncate(manager, end);
+
+    if (manager->chainEnd == manager->chainStart) manager->chainStart = manager->chainEnd = 0;
+
+    while (array_count(manager->chain) > 0 && (manager->chainEnd == 0 ||
+           (manager->chainEnd - 1) / BLOCK_DIFFICULTY_INTERVAL - manager->chainStart / BLOCK_DIFFICULTY_INTERVAL <
+           array_count(manager->chain) - 1)) {
+        free(manager->chain[array_count(manager->chain) - 1]);
+        array_count(manager->chain)--;
+    }
+}
+
+// frees block once it's no longer needed, either because its header is in the main chain or because it's too old to
+// matter, checkpoints are kept, and a checkpoint that block took the place of in manager->blocks is put back
+static void _PeerManagerReleaseBlock(BRPeerManager *manager, BRMerkleBlock *block) {
+    BRMerkleBlock *checkpoint = BRSetGet(manager->checkpoints, block);
+
+    if (checkpoint == block) return;
+
+    if (BRSetGet(manager->blocks, block) == block) {
+        BRSetRemove(manager->blocks, block);
+        if (checkpoint && UInt256Eq(checkpoint->blockHash, block->blockHash)) BRSetAdd(manager->blocks, checkpoint);
+    }
+
+    BRMerkleBlockFree(block);
+}
+
+// moves the end of the main chain back to block, which must be a main chain block or a checkpoint
+static void _PeerManagerRewind(BRPeerManager *manager, BRMerkleBlock *block) {
+    BRMerkleBlock *last = manager->lastBlock;
+
+    _PeerManagerChainTruncate(manager, (_PeerManagerInChain(manager, block)) ? block->height + 1 : 0);
+    if (manager->chainStart == manager->chainEnd) _PeerManagerChainAdd(manager, block);
+    BRSetAdd(manager->blocks, block);
+    manager->lastBlock = block;
+    if (last && last != block) _PeerManagerReleaseBlock(manager, last);
+}
+
+// checks the records at the end of the header file in buf, from the start of the difficulty window that pruning keeps,
+// and makes them the main chain if it's longer and they connect to it, sets *from to the height of the first record
+// checked and returns the number of good records from there, earlier records are only followed by their prevBlock links
+static size_t _PeerManagerFileLoad(BRPeerManager *manager, const uint8_t *buf, uint32_t start, size_t count,
+                                   uint32_t *from) {
+    uint32_t end = start + (uint32_t) count, height;
+    BRMerkleBlock key, block, *checkpoint, *last = manager->lastBlock;
+    BRChainHeader *headers, *prev;
+    UInt256 hash;
+    size_t n = 0;
+    int connected = 0;
+
+    *from = start;
+    if (count == 0) return 0;
+    if (end - 1 >= BLOCK_DIFFICULTY_INTERVAL * 2) *from = end - 1 - ((end - 1) % BLOCK_DIFFICULTY_INTERVAL) -
+                                                          BLOCK_DIFFICULTY_INTERVAL; // same window as pruning keeps
+    if (*from < start) *from = start;
+    headers = calloc(end - *from, sizeof(*headers));
+    assert(headers != NULL);
+
+    for (height = *from; height < end; height++, n++) {
+        manager->workCount++;
+        key.height = height;
+        checkpoint = BRSetGet(manager->checkpoints, &key);
+        if (! _ChainHeaderRecordGet(&headers[n], &buf[(size_t) (height - start) * HEADER_FILE_RECORD], height)) break;
+        if (n > 0 && ! UInt256Eq(_ChainHeaderGet(&headers[n], &block)->prevBlock, headers[n - 1].blockHash)) break;
+        if (checkpoint && ! UInt256Eq(checkpoint->blockHash, headers[n].blockHash)) break;
+        if (checkpoint) connected = 1;
+    }
+
+    // the records must connect to the manager's chain, through a checkpoint among them, through the main chain header
+    // before them, or by following prevBlock links back through the file to lastBlock
+    prev = (n > 0 && *from > 0) ? _PeerManagerChainHeader(manager, *from - 1) : NULL;
+    hash = (n > 0) ? _ChainHeaderGet(&headers[0], &block)->prevBlock : UINT256_ZERO;
+    if (prev && UInt256Eq(prev->blockHash, hash)) connected = 1;
+
+    if (n > 0 && ! connected && last->height >= start && last->height < *from) {
+        for (height = *from; height > last->height &&
+             UInt256Eq(UInt256Get(&buf[(size_t) (height - 1 - start) * HEADER_FILE_RECORD + 80]), hash); height--) {
+            hash = UInt256Get(&buf[(size_t) (height - 1 - start) * HEADER_FILE_RECORD + 4]);
+        }
+
+        connected = (height == last->height &&
+                     UInt256Eq(UInt256Get(&buf[(size_t) (height - start) * HEADER_FILE_RECORD + 80]), last->blockHash));
+    }
+
+    // the records are only checked against their checksums, so their proof-of-work hashes are checked by the same
+    // background verifier as restored blocks, or here if it's already running
+    if (connected && *from + n - 1 > last->height && manager->verifyStarted) {
+        BRMerkleBlock **blocks = calloc(n, sizeof(*blocks));
+
+        assert(blocks != NULL);
+        for (size_t i = 0; i < n; i++) blocks[i] = _ChainHeaderGet(&headers[i], BRMerkleBlockNew());
+        count = BRMerkleBlockVerifyHashes(blocks, n);
+        for (size_t i = 0; i < n; i++) BRMerkleBlockFree(blocks[i]);
+        free(blocks);
+        n = count;
+    }
+
+    if (connected && n > 0 && *from + n - 1 > last->height) {
+        _PeerManagerChainTruncate(manager, 0);
+        for (size_t i = 0; i < n; i++) _PeerManagerChainAdd(manager, _ChainHeaderGet(&headers[i], &block));
+        manager->lastBlock = _ChainHeaderGet(&headers[n - 1], BRMerkleBlockNew());
+        BRSetAdd(manager->blocks, manager->lastBlock);
+        _PeerManagerReleaseBlock(manager, last);
+
+        if (! manager->verifyStarted) { // the file's chain takes the place of the one restored blocks made up
+            for (size_t i = array_count(manager->unverified); i > 0; i--) BRMerkleBlockFree(manager->unverified[i - 1]);
+            array_clear(manager->unverified);
+
+            for (size_t i = 0; i < n; i++) {
+                array_add(manager->unverified, _ChainHeaderGet(&headers[i], BRMerkleBlockNew()));
+            }
+        }
+    }
+
+    free(headers);
+    return n;
+}
+
 static size_t _PeerManagerBlockLocators(BRPeerManager *manager, UInt256 *locators, size_t locatorsCount) {
     // append 10 most recent block hashes, decending, then continue appending, doubling the step back each time,
     // finishing with the genesis block (top, -1, -2, -3, -4, -5, -6, -7, -8, -9, -11, -15, -23, -39, -71, -135, ..., 0)
-    BRMerkleBlock *block = manager->lastBlock;
-    int32_t step = 1, i = 0, j;
+    uint32_t height = manager->lastBlock->height, step = 1;
+    BRChainHeader *header = _PeerManagerChainHeader(manager, height);
+    size_t i = 0;
 
-    while (block && block->height > 0) {
-        if (locators && i < locatorsCount) locators[i] = block->blockHash;
+    while (header && height > 0) {
+        if (locators && i < locatorsCount) locators[i] = header->blockHash;
         if (++i >= 10) step *= 2;
-
-        for (j = 0; block && j < step; j++) {
-            block = BRSetGet(manager->blocks, &block->prevBlock);
-        }
+        header = (height > step) ? _PeerManagerChainHeader(manager, height -= step) : NULL;
     }
 
     if (locators && i < locatorsCount) locators[i] = genesis_block_hash(manager->params);
@@ -246,6 +584,19 @@ static void _setApplyFreeBlock(void *info, void *block) {
     BRMerkleBlockFree(block);
 }
 
+// frees a checkpoint that a main chain block with its hash has taken the place of in manager->blocks
+static void _setApplyFreeCheckpoint(void *info, void *checkpoint) {
+    if (BRSetGet(((BRPeerManager *) info)->blocks, checkpoint) != checkpoint) BRMerkleBlockFree(checkpoint);
+}
+
+// sends the current bloom filter to peer without rebuilding it
+static void _PeerManagerSendBloomFilter(BRPeerManager *manager, BRPeer *peer) {
+    uint8_t data[BRBloomFilterSerialize(manager->bloomFilter, NULL, 0)];
+    size_t len = BRBloomFilterSerialize(manager->bloomFilter, data, sizeof(data));
+
+    BRPeerSendFilterload(peer, data, len);
+}
+
 static void _PeerManagerLoadBloomFilter(BRPeerManager *manager, BRPeer *peer) {
     // every time a new wallet address is added, the bloom filter has to be rebuilt, and each address is only used
     // for one transaction, so here we generate some spare addresses to avoid rebuilding the filter each time a
@@ -324,11 +675,78 @@ static void _PeerManagerLoadBloomFilter(BRPeerManager *manager, BRPeer *peer) {
     if (manager->bloomFilter) BRBloomFilterFree(manager->bloomFilter);
     manager->bloomFilter = filter;
     // TODO: XXX if already synced, recursively add inputs of unconfirmed receives
+    _PeerManagerSendBloomFilter(manager, peer);
+}
 
-    uint8_t data[BRBloomFilterSerialize(filter, NULL, 0)];
-    size_t len = BRBloomFilterSerialize(filter, data, sizeof(data));
+// returns the sync window of peer, or NULL if peer isn't helping with the chain sync
+static SyncWindow *_PeerManagerSyncWindow(BRPeerManager *manager, const BRPeer *peer) {
+    for (size_t i = array_count(manager->syncWindows); i > 0; i--) {
+        if (manager->syncWindows[i - 1].peer == peer) return &manager->syncWindows[i - 1];
+    }
 
-    BRPeerSendFilterload(peer, data, len);
+    return NULL;
+}
+
+// removes blockHash from window, returns true if it was requested from the window's peer
+static int _SyncWindowRemove(SyncWindow *window, UInt256 blockHash) {
+    for (size_t i = array_count(window->hashes); i > 0; i--) {
+        if (! UInt256Eq(window->hashes[i - 1], blockHash)) continue;
+        array_rm(window->hashes, i - 1);
+        return 1;
+    }
+
+    return 0;
+}
+
+// requests the blocks still outstanding from a helper peer from the download peer instead
+static void _PeerManagerStealSyncWindow(BRPeerManager *manager, SyncWindow *window) {
+    if (array_count(window->hashes) > 0 && manager->downloadPeer) {
+        peer_log(window->peer, "re-requesting %zu block(s) from download peer", array_count(window->hashes));
+        BRPeerSendGetdata(manager->downloadPeer, NULL, 0, window->hashes, array_count(window->hashes));
+    }
+
+    array_clear(window->hashes);
+}
+
+// takes the outstanding blocks away from helper peers that stopped delivering them, and stops using those peers
+static void _PeerManagerStealStalledSyncWindows(BRPeerManager *manager) {
+    double now = time(NULL);
+
+    for (size_t i = array_count(manager->syncWindows); i > 0; i--) {
+        SyncWindow *window = &manager->syncWindows[i - 1];
+
+        if (array_count(window->hashes) == 0 || window->time + SYNC_STALL_TIMEOUT > now) continue;
+        peer_log(window->peer, "stalled while helping with chain sync");
+        window->stalled = 1;
+        _PeerManagerStealSyncWindow(manager, window);
+    }
+}
+
+// forgets all blocks requested from helper peers, call when the download peer or the bloom filter changes, since the
+// download peer re-requests the chain from the last block, if reloadFilter is true helpers get the current filter
+static void _PeerManagerResetSyncWindows(BRPeerManager *manager, int reloadFilter) {
+    for (size_t i = array_count(manager->syncWindows); i > 0; i--) {
+        SyncWindow *window = &manager->syncWindows[i - 1];
+
+        array_clear(window->hashes);
+        if (reloadFilter && manager->bloomFilter) _PeerManagerSendBloomFilter(manager, window->peer);
+    }
+
+    manager->syncSplit = 0;
+}
+
+static void _PeerManagerRemoveSyncWindow(BRPeerManager *manager, const BRPeer *peer) {
+    for (size_t i = array_count(manager->syncWindows); i > 0; i--) {
+        if (manager->syncWindows[i - 1].peer != peer) continue;
+        array_free(manager->syncWindows[i - 1].hashes);
+        array_rm(manager->syncWindows, i - 1);
+    }
+}
+
+static void _PeerManagerClearSyncWindows(BRPeerManager *manager) {
+    for (size_t i = array_count(manager->syncWindows); i > 0; i--) array_free(manager->syncWindows[i - 1].hashes);
+    array_clear(manager->syncWindows);
+    manager->syncSplit = 0;
 }
 
 static void _updateFilterRerequestDone(void *info, int success) {
@@ -392,6 +810,7 @@ static void _updateFilterPingDone(void *info, int success) {
             manager->estimatedHeight) { // if we're syncing, only update download peer
             if (manager->downloadPeer) {
                 _PeerManagerLoadBloomFilter(manager, manager->downloadPeer);
+                _PeerManagerResetSyncWindows(manager, 1); // blocks in flight from helpers used the old filter
                 BRPeerSendPing(manager->downloadPeer, info,
                                _updateFilterLoadDone); // wait for pong so filter is loaded
             } else free(info);
@@ -596,6 +1015,8 @@ static void _loadBloomFilterDone(void *info, int success) {
 }
 
 static void _PeerManagerLoadMempools(BRPeerManager *manager) {
+    _PeerManagerClearSyncWindows(manager); // helper peers are treated like any other peer once the chain is synced
+
     // after syncing, load filters and get mempools from other peers
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
         BRPeer *peer = manager->connectedPeers[i - 1];
@@ -755,6 +1176,11 @@ static void _peerConnected(void *info) {
             peerInfo->peer = peer;
             peerInfo->manager = manager;
             BRPeerSendPing(peer, peerInfo, _loadBloomFilterDone);
+        } else if (manager->bloomFilter && manager->lastBlock->height < manager->estimatedHeight &&
+                   ! _PeerManagerSyncWindow(manager, peer)) { // help the download peer sync the chain
+            _PeerManagerSendBloomFilter(manager, peer);
+            array_add(manager->syncWindows, ((SyncWindow) { peer, NULL, 0, 0 }));
+            array_new(manager->syncWindows[array_count(manager->syncWindows) - 1].hashes, SYNC_WINDOW_BLOCKS);
         }
     } else { // select the peer with the lowest ping time to download the chain from if we're behind
         // BUG: XXX a malicious peer can report a higher lastblock to make us select them as the download peer, if
@@ -773,7 +1199,9 @@ static void _peerConnected(void *info) {
         manager->downloadPeer = peer;
         manager->isConnected = 1;
         manager->estimatedHeight = BRPeerLastBlock(peer);
+        _PeerManagerRemoveSyncWindow(manager, peer);
         _PeerManagerLoadBloomFilter(manager, peer);
+        _PeerManagerResetSyncWindows(manager, 1);
         BRPeerSetCurrentBlockHeight(peer, manager->lastBlock->height);
         _PeerManagerPublishPendingTx(manager, peer);
 
@@ -804,6 +1232,7 @@ static void _peerDisconnected(void *info, int error) {
     BRPeer *peer = ((PeerCallbackInfo *) info)->peer;
     BRPeerManager *manager = ((PeerCallbackInfo *) info)->manager;
     TxPeerList *peerList;
+    SyncWindow *window;
     int willSave = 0, willReconnect = 0, txError = 0;
     size_t txCount = 0;
 
@@ -842,6 +1271,10 @@ static void _peerDisconnected(void *info, int error) {
         manager->downloadPeer = NULL;
         if (manager->connectFailureCount > MAX_CONNECT_FAILURES)
             manager->connectFailureCount = MAX_CONNECT_FAILURES;
+        _PeerManagerResetSyncWindows(manager, 0);
+    } else if ((window = _PeerManagerSyncWindow(manager, peer))) { // helper peer disconnected
+        _PeerManagerStealSyncWindow(manager, window);
+        _PeerManagerRemoveSyncWindow(manager, peer);
     }
 
     if (!manager->isConnected && manager->connectFailureCount == MAX_CONNECT_FAILURES) {
@@ -1100,42 +1533,45 @@ static void _peerRejectedTx(void *info, UInt256 txHash, uint8_t code) {
     if (manager->txStatusUpdate) manager->txStatusUpdate(manager->info);
 }
 
-static int _PeerManagerVerifyBlock(BRPeerManager *manager, BRMerkleBlock *block, BRMerkleBlock *prev,
-                        BRPeer *peer) {
-    uint32_t transitionTime = 0;
-    int r = 1;
+// rebuilds the difficulty window so that it ends at prev, from prev's ancestors on its fork and in the main chain
+static void _PeerManagerDGWInit(BRPeerManager *manager, BRMerkleBlock *prev) {
+    BRMerkleBlock *window = calloc(DGW_PAST_BLOCKS, sizeof(*window)), *b = prev;
+    BRSet *windowSet = BRSetNewUInt256(DGW_PAST_BLOCKS);
 
-    // check if we hit a difficulty transition, and find previous transition time
-    if ((block->height % (block->height < DGW_START_BLOCK ? BLOCK_DIFFICULTY_INTERVAL : DGW_BLOCK_DIFFICULTY_INTERVAL)) == 0) {
-        BRMerkleBlock *b = block;
-        UInt256 prevBlock;
+    assert(window != NULL);
 
-        for (uint32_t i = 0; b && i < (block->height < DGW_START_BLOCK ? BLOCK_DIFFICULTY_INTERVAL : DGW_BLOCK_DIFFICULTY_INTERVAL); i++) {
-            b = BRSetGet(manager->blocks, &b->prevBlock);
-        }
+    for (size_t i = 0; b && i < DGW_PAST_BLOCKS; i++) {
+        manager->workCount++;
+        if (b != &window[i]) window[i] = *b;
+        BRSetAdd(windowSet, &window[i]);
+        b = (i + 1 < DGW_PAST_BLOCKS && window[i].height > 0) ?
+            _PeerManagerAncestor(manager, &window[i], window[i].height - 1, &window[i + 1]) : NULL;
+    }
 
-        if (!b) {
-            peer_log(peer, "missing previous difficulty tansition time, can't verify blockHash: %s",
-                     u256_hex_encode(block->blockHash));
-            r = 0;
-        } else {
-            transitionTime = b->timestamp;
-            prevBlock = b->prevBlock;
-        }
+    BRDarkGravityWaveInit(&manager->dgw, prev, windowSet);
+    BRSetFree(windowSet);
+    free(window);
+}
 
-        while (b) { // free up some memory
-            b = BRSetGet(manager->blocks, &prevBlock);
-            if (b) prevBlock = b->prevBlock;
+static int _PeerManagerVerifyBlock(BRPeerManager *manager, BRMerkleBlock *block, BRMerkleBlock *prev,
+                        BRPeer *peer) {
+    uint32_t interval = (block->height < DGW_START_BLOCK) ? BLOCK_DIFFICULTY_INTERVAL : DGW_BLOCK_DIFFICULTY_INTERVAL;
+    BRMerkleBlock header;
+    int r = 1;
 
-            if (b && (b->height % (block->height < DGW_START_BLOCK ? BLOCK_DIFFICULTY_INTERVAL : DGW_BLOCK_DIFFICULTY_INTERVAL)) != 0) {
-                BRSetRemove(manager->blocks, b);
-                BRMerkleBlockFree(b);
-            }
-        }
+    // check if we hit a difficulty transition, and make sure the previous transition is available
+    if ((block->height % interval) == 0 &&
+        (block->height < interval || ! _PeerManagerAncestor(manager, prev, block->height - interval, &header))) {
+        peer_log(peer, "missing previous difficulty tansition time, can't verify blockHash: %s",
+                 u256_hex_encode(block->blockHash));
+        r = 0;
     }
 
+    // the difficulty window is rebuilt here when prev isn't the end of it, rather than from the blocks set
+    if (r && ! UInt256Eq(manager->dgw.blockHash, prev->blockHash)) _PeerManagerDGWInit(manager, prev);
+
     // verify block difficulty
-    if (r && !BRMerkleBlockVerifyDifficulty(block, prev, manager->blocks)) {
+    if (r && !BRMerkleBlockVerifyDifficulty(block, prev, manager->blocks, &manager->dgw)) {
         peer_log(peer, "relayed block with invalid difficulty target %x, blockHash: %s",
                  block->target,
                  u256_hex_encode(block->blockHash));
@@ -1153,27 +1589,167 @@ static int _PeerManagerVerifyBlock(BRPeerManager *manager, BRMerkleBlock *block,
                     "expected: %s", block->height, u256_hex_encode(block->blockHash),
                      u256_hex_encode(checkpoint->blockHash));
             r = 0;
+        } else if (checkpoint && manager->assumeValidHeaders && BRMerkleBlockVerifyHashes(&block, 1) != 1) {
+            // with assumevalid headers a block's hash may be the prevBlock of the header after it, so make sure the
+            // block really hashes to the checkpoint
+            peer_log(peer, "relayed a block at checkpoint height %" PRIu32 " that doesn't hash to %s", block->height,
+                     u256_hex_encode(checkpoint->blockHash));
+            r = 0;
         }
     }
 
     return r;
 }
 
-static void _peerRelayedBlock(void *info, BRMerkleBlock *block) {
-    BRPeer *peer = ((PeerCallbackInfo *) info)->peer;
-    BRPeerManager *manager = ((PeerCallbackInfo *) info)->manager;
+// frees main chain headers, and blocks off the main chain, that are older than the previous difficulty transition
+// headers are freed a chunk of BLOCK_DIFFICULTY_INTERVAL at a time, checkpoints are kept
+static void _PeerManagerPruneBlocks(BRPeerManager *manager) {
+    uint32_t height = manager->lastBlock->height, keepHeight, end;
+    BRChainHeader *chunk;
+    size_t i, count;
+
+    // the retained blocks must cover the DGW window and the blocks saved when the chain download completes
+    assert(DGW_PAST_BLOCKS < BLOCK_DIFFICULTY_INTERVAL);
+    if (height < BLOCK_DIFFICULTY_INTERVAL * 2) return;
+    keepHeight = height - (height % BLOCK_DIFFICULTY_INTERVAL) - BLOCK_DIFFICULTY_INTERVAL;
+    end = manager->chainStart - (manager->chainStart % BLOCK_DIFFICULTY_INTERVAL) + BLOCK_DIFFICULTY_INTERVAL;
+    if (array_count(manager->chain) < 2 || end > keepHeight) return;
+
+    while (array_count(manager->chain) > 1 && end <= keepHeight) {
+        chunk = manager->chain[0];
+
+        for (; manager->chainStart < end; manager->chainStart++) {
+            BRSetRemove(manager->chainIndex, &chunk[manager->chainStart % BLOCK_DIFFICULTY_INTERVAL]);
+            manager->workCount++;
+        }
+
+        free(chunk);
+        array_rm(manager->chain, 0);
+        end += BLOCK_DIFFICULTY_INTERVAL;
+    }
+
+    count = BRSetCount(manager->blocks);
+
+    BRMerkleBlock *_blocks[(sizeof(BRMerkleBlock *) * count <= 0x1000) ? count : 0],
+            **blocks = (sizeof(BRMerkleBlock *) * count <= 0x1000) ? _blocks : malloc(count * sizeof(*blocks));
+
+    assert(blocks != NULL);
+    count = BRSetAll(manager->blocks, (void **) blocks, count);
+    manager->workCount += count;
+
+    for (i = 0; i < count; i++) {
+        if (blocks[i]->height < manager->chainStart) _PeerManagerReleaseBlock(manager, blocks[i]);
+    }
+
+    if (blocks != _blocks) free(blocks);
+
+    for (i = array_count(manager->forkTxs); i > 0; i--) {
+        if (manager->forkTxs[i - 1].height >= manager->chainStart) continue;
+        array_free(manager->forkTxs[i - 1].txHashes);
+        array_rm(manager->forkTxs, i - 1);
+    }
+}
+
+// adds block to the end of the main chain as the new lastBlock, advances the difficulty window and prunes blocks no
+// longer needed to verify new ones, the previous lastBlock is only kept as a header
+static void _PeerManagerAddBlock(BRPeerManager *manager, BRMerkleBlock *block) {
+    BRMerkleBlock *last = manager->lastBlock;
+
+    manager->workCount++;
+    _PeerManagerChainAdd(manager, block);
+    BRSetAdd(manager->blocks, block);
+    manager->lastBlock = block;
+    if (last && last != block) _PeerManagerReleaseBlock(manager, last);
+    if (UInt256Eq(block->prevBlock, manager->dgw.blockHash)) BRDarkGravityWaveAddBlock(&manager->dgw, block);
+    _PeerManagerPruneBlocks(manager);
+}
+
+// remembers the wallet tx confirmed in the main chain blocks after forkHeight, which a reorg is about to move off the
+// main chain as headers, so they can be confirmed again if the chain reorgs back
+static void _PeerManagerKeepForkTxs(BRPeerManager *manager, uint32_t forkHeight) {
+    size_t i, j, count = BRWalletTransactions(manager->wallet, NULL, 0);
+    BRTransaction **txs = malloc(count * sizeof(*txs));
+    BRChainHeader *header;
+
+    assert(txs != NULL || count == 0);
+    count = BRWalletTransactions(manager->wallet, txs, count);
+
+    for (i = count; i > 0 && txs[i - 1]->blockHeight > forkHeight; i--) { // wallet tx are sorted by block height
+        header = (txs[i - 1]->blockHeight != TX_UNCONFIRMED) ?
+                 _PeerManagerChainHeader(manager, txs[i - 1]->blockHeight) : NULL;
+        if (! header) continue;
+        for (j = array_count(manager->forkTxs); j > 0; j--) {
+            if (UInt256Eq(manager->forkTxs[j - 1].blockHash, header->blockHash)) break;
+        }
+
+        if (j == 0) {
+            array_add(manager->forkTxs, ((const ForkTxList) { header->blockHash, header->height, NULL }));
+            j = array_count(manager->forkTxs);
+            array_new(manager->forkTxs[j - 1].txHashes, 1);
+        }
+
+        array_add(manager->forkTxs[j - 1].txHashes, txs[i - 1]->txHash);
+    }
+
+    free(txs);
+}
+
+// confirms the wallet tx remembered for blockHash by _PeerManagerKeepForkTxs() at height, now that it's back in the
+// main chain
+static void _PeerManagerRestoreForkTxs(BRPeerManager *manager, UInt256 blockHash, uint32_t height,
+                                       uint32_t timestamp) {
+    for (size_t i = array_count(manager->forkTxs); i > 0; i--) {
+        if (! UInt256Eq(manager->forkTxs[i - 1].blockHash, blockHash)) continue;
+        BRWalletUpdateTransactions(manager->wallet, manager->forkTxs[i - 1].txHashes,
+                                   array_count(manager->forkTxs[i - 1].txHashes), height, timestamp);
+        array_free(manager->forkTxs[i - 1].txHashes);
+        array_rm(manager->forkTxs, i - 1);
+        break;
+    }
+}
+
+// makes the fork ending at block the main chain, the main chain after forkHeight is kept as blocks off the main chain
+static void _PeerManagerReorganize(BRPeerManager *manager, BRMerkleBlock *block, uint32_t forkHeight) {
+    size_t i, count = block->height - forkHeight;
+    BRMerkleBlock *b, *last = manager->lastBlock, **fork;
+
+    for (uint32_t height = forkHeight + 1; height < manager->chainEnd; height++) {
+        if (height == last->height) continue; // lastBlock is already stored
+        b = _PeerManagerChainBlock(manager, height, BRMerkleBlockNew());
+        if (BRSetContains(manager->blocks, b)) BRMerkleBlockFree(b);
+        else BRSetAdd(manager->blocks, b);
+    }
+
+    array_new(fork, count);
+    array_set_count(fork, count);
+
+    for (i = count, b = block; b && i > 0; b = BRSetGet(manager->blocks, &b->prevBlock)) fork[--i] = b;
+    assert(i == 0);
+    _PeerManagerChainTruncate(manager, forkHeight + 1);
+
+    for (i = 0; i < count; i++) {
+        _PeerManagerChainAdd(manager, fork[i]);
+        if (fork[i] != block) _PeerManagerReleaseBlock(manager, fork[i]);
+    }
+
+    array_free(fork);
+    manager->lastBlock = block;
+}
+
+// adds a block relayed by peer to the chain or to the orphans, returns the next block if it was waiting as an orphan
+static BRMerkleBlock *_PeerManagerAcceptBlock(BRPeerManager *manager, BRPeer *peer, BRMerkleBlock *block) {
     size_t txCount = BRMerkleBlockTxHashes(block, NULL, 0);
     UInt256 _txHashes[(sizeof(UInt256) * txCount <= 0x1000) ? txCount : 0],
             *txHashes = (sizeof(UInt256) * txCount <= 0x1000) ? _txHashes : malloc(
             txCount * sizeof(*txHashes));
     size_t i, j, fpCount = 0, saveCount = 0;
-    BRMerkleBlock orphan, *b, *b2, *prev, *next = NULL;
-    uint32_t txTime = 0;
+    BRMerkleBlock orphan, header, *b, *prev, *next = NULL, *unused = NULL;
+    uint32_t txTime = 0, forkHeight;
 
     assert(txHashes != NULL);
     txCount = BRMerkleBlockTxHashes(block, txHashes, txCount);
     pthread_mutex_lock(&manager->lock);
-    prev = BRSetGet(manager->blocks, &block->prevBlock);
+    prev = _PeerManagerBlock(manager, block->prevBlock, &header);
 
     if (prev) {
         txTime = block->timestamp / 2 + prev->timestamp / 2;
@@ -1229,8 +1805,8 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block) {
                  u256_hex_encode(block->blockHash), u256_hex_encode(block->prevBlock),
                  u256_hex_encode(manager->lastBlock->blockHash), manager->lastBlock->height);
 
-        if (block->timestamp + 7 * 24 * 60 * 60 <
-            time(NULL)) { // ignore orphans older than one week ago
+        if (block->timestamp + 7 * 24 * 60 * 60 < time(NULL) &&
+            ! manager->syncSplit) { // ignore orphans older than one week ago, unless the sync is split across peers
             BRMerkleBlockFree(block);
             block = NULL;
         } else {
@@ -1264,14 +1840,14 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block) {
                     ", false positive rate: %f", block->height, manager->fpRate);
         }
 
-        BRSetAdd(manager->blocks, block);
-        manager->lastBlock = block;
+        _PeerManagerAddBlock(manager, block);
         if (txCount > 0) _PeerManagerUpdateTx(manager, txHashes, txCount, block->height, txTime);
         if (manager->downloadPeer)
             BRPeerSetCurrentBlockHeight(manager->downloadPeer, block->height);
 
-        if (block->height < manager->estimatedHeight && peer == manager->downloadPeer) {
-            BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // reschedule sync timeout
+        if (block->height < manager->estimatedHeight && manager->downloadPeer &&
+            (peer == manager->downloadPeer || _PeerManagerSyncWindow(manager, peer))) {
+            BRPeerScheduleDisconnect(manager->downloadPeer, PROTOCOL_TIMEOUT); // reschedule sync timeout
             manager->connectFailureCount = 0; // reset failure count once we know our initial request didn't timeout
         }
 
@@ -1282,30 +1858,27 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block) {
             saveCount = (block->height % BLOCK_DIFFICULTY_INTERVAL) + BLOCK_DIFFICULTY_INTERVAL + 1;
             _PeerManagerLoadMempools(manager);
         }
-    } else if (BRSetContains(manager->blocks,
-                             block)) { // we already have the block (or at least the header)
+    } else if (_PeerManagerInChain(manager, block) ||
+               BRSetContains(manager->blocks, block)) { // we already have the block (or at least the header)
         if ((block->height % 500) == 0 || txCount > 0 || block->height >= BRPeerLastBlock(peer)) {
             peer_log(peer, "relayed existing block #%"
                     PRIu32, block->height);
         }
 
-        b = manager->lastBlock;
-        while (b && b->height > block->height)
-            b = BRSetGet(manager->blocks, &b->prevBlock); // is block in main chain?
-
-        if (BRMerkleBlockEq(b, block)) { // if it's not on a fork, set block heights for its transactions
+        if (_PeerManagerInChain(manager, block)) { // if it's not on a fork, set block heights for its transactions
             if (txCount > 0)
                 _PeerManagerUpdateTx(manager, txHashes, txCount, block->height, txTime);
-            if (block->height == manager->lastBlock->height) manager->lastBlock = block;
         }
 
-        b = BRSetAdd(manager->blocks, block);
+        b = BRSetGet(manager->blocks, block);
 
-        if (b != block) {
+        if (b && b != block && BRSetGet(manager->checkpoints, b) != b) {
+            BRSetAdd(manager->blocks, block);
+            if (manager->lastBlock == b) manager->lastBlock = block;
             if (BRSetGet(manager->orphans, b) == b) BRSetRemove(manager->orphans, b);
             if (manager->lastOrphan == b) manager->lastOrphan = NULL;
             BRMerkleBlockFree(b);
-        }
+        } else if (b != block) unused = block; // the main chain header, or the checkpoint, is all that's kept
     } else if (manager->lastBlock->height < BRPeerLastBlock(peer) &&
                block->height >
                manager->lastBlock->height + 1) { // special case, new block mined durring rescan
@@ -1325,32 +1898,25 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block) {
         peer_log(peer, "chain fork reached height %"
                 PRIu32, block->height);
         BRSetAdd(manager->blocks, block);
+        if (UInt256Eq(block->prevBlock, manager->dgw.blockHash)) BRDarkGravityWaveAddBlock(&manager->dgw, block);
 
-        if (block->height >
-            manager->lastBlock->height) { // check if fork is now longer than main chain
-            b = block;
-            b2 = manager->lastBlock;
-
-            while (b && b2 &&
-                   !BRMerkleBlockEq(b, b2)) { // walk back to where the fork joins the main chain
-                b = BRSetGet(manager->blocks, &b->prevBlock);
-                if (b && b->height < b2->height) b2 = BRSetGet(manager->blocks, &b2->prevBlock);
-            }
-
+        if (block->height > manager->lastBlock->height && // check if fork is now longer than main chain
+            (forkHeight = _PeerManagerForkHeight(manager, block)) != BLOCK_UNKNOWN_HEIGHT) {
             peer_log(peer, "reorganizing chain from height %"
                     PRIu32
                     ", new height is %"
-                    PRIu32, b->height, block->height);
+                    PRIu32, forkHeight, block->height);
 
+            _PeerManagerKeepForkTxs(manager, forkHeight);
             BRWalletSetTxUnconfirmedAfter(manager->wallet,
-                                          b->height); // mark tx after the join point as unconfirmed
+                                          forkHeight); // mark tx after the join point as unconfirmed
 
             b = block;
 
-            while (b && b2 &&
-                   b->height > b2->height) { // set transaction heights for new main chain
+            while (b && b->height > forkHeight) { // set transaction heights for new main chain
                 size_t count = BRMerkleBlockTxHashes(b, NULL, 0);
                 uint32_t height = b->height, timestamp = b->timestamp;
+                UInt256 blockHash = b->blockHash;
 
                 if (count > txCount) {
                     txHashes = (txHashes != _txHashes) ? realloc(txHashes,
@@ -1361,13 +1927,14 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block) {
                 }
 
                 count = BRMerkleBlockTxHashes(b, txHashes, count);
-                b = BRSetGet(manager->blocks, &b->prevBlock);
+                b = _PeerManagerBlock(manager, b->prevBlock, &header);
                 if (b) timestamp = timestamp / 2 + b->timestamp / 2;
                 if (count > 0)
                     BRWalletUpdateTransactions(manager->wallet, txHashes, count, height, timestamp);
+                _PeerManagerRestoreForkTxs(manager, blockHash, height, timestamp);
             }
 
-            manager->lastBlock = block;
+            _PeerManagerReorganize(manager, block, forkHeight);
 
             if (block->height == manager->estimatedHeight) { // chain download is complete
                 saveCount =
@@ -1387,12 +1954,18 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block) {
         next = BRSetRemove(manager->orphans, &orphan);
     }
 
-    BRMerkleBlock *saveBlocks[saveCount];
+    BRMerkleBlock *saveBlocks[saveCount],
+            *headers = (saveCount > 0) ? calloc(saveCount, sizeof(*headers)) : NULL;
+    int notify = (block && block->height != BLOCK_UNKNOWN_HEIGHT && block->height >= BRPeerLastBlock(peer));
 
-    for (i = 0, b = block; b && i < saveCount; i++) {
-        assert(b->height != BLOCK_UNKNOWN_HEIGHT); // verify all blocks to be saved are in the chain
-        saveBlocks[i] = b;
-        b = BRSetGet(manager->blocks, &b->prevBlock);
+    assert(headers != NULL || saveCount == 0);
+    assert(saveCount == 0 || _PeerManagerInChain(manager, block)); // verify all blocks to be saved are in the chain
+
+    // the blocks are saved from copies of their main chain headers, since another peer's block can replace block as
+    // lastBlock and free it once the lock is released
+    for (i = 0; i < saveCount && i <= block->height; i++) {
+        saveBlocks[i] = _PeerManagerChainBlock(manager, block->height - (uint32_t) i, &headers[i]);
+        if (! saveBlocks[i]) break;
     }
 
     // make sure the set of blocks to be saved starts at a difficulty interval
@@ -1403,19 +1976,80 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block) {
     if (i > 0 && manager->saveBlocks)
         manager->saveBlocks(manager->info, (i > 1 ? 1 : 0), saveBlocks, i);
 
-    if (block && block->height != BLOCK_UNKNOWN_HEIGHT && block->height >= BRPeerLastBlock(peer) &&
-        manager->txStatusUpdate) {
+    if (notify && manager->txStatusUpdate) {
         manager->txStatusUpdate(
                 manager->info); // notify that transaction confirmations may have changed
     }
 
-    if (next) _peerRelayedBlock(info, next);
+    if (headers) free(headers);
+    if (unused) BRMerkleBlockFree(unused);
+    return next;
+}
+
+static void _peerRelayedBlock(void *info, BRMerkleBlock *block) {
+    BRPeer *peer = ((PeerCallbackInfo *) info)->peer;
+    BRPeerManager *manager = ((PeerCallbackInfo *) info)->manager;
+    SyncWindow *window;
+
+    pthread_mutex_lock(&manager->lock);
+    window = _PeerManagerSyncWindow(manager, peer);
+
+    if (window && _SyncWindowRemove(window, block->blockHash)) {
+        window->time = time(NULL);
+    } else if (window && manager->lastBlock->height < manager->estimatedHeight) {
+        // while syncing, helpers only send blocks we asked for, anything else may have been matched by an old filter
+        BRMerkleBlockFree(block);
+        block = NULL;
+    }
+
+    if (manager->syncSplit) _PeerManagerStealStalledSyncWindows(manager);
+    pthread_mutex_unlock(&manager->lock);
+
+    // orphans that the block connects are added in a loop, a split sync can leave long runs of them
+    while (block) block = _PeerManagerAcceptBlock(manager, peer, block);
+}
+
+static size_t _peerBlockInv(void *info, UInt256 blockHashes[], size_t blockCount) {
+    BRPeer *peer = ((PeerCallbackInfo *) info)->peer;
+    BRPeerManager *manager = ((PeerCallbackInfo *) info)->manager;
+    size_t i, n, count = 0, slot = 0, helperCount;
+    SyncWindow *window;
+
+    pthread_mutex_lock(&manager->lock);
+    helperCount = array_count(manager->syncWindows);
+
+    if (peer == manager->downloadPeer && manager->bloomFilter && helperCount > 0 &&
+        manager->lastBlock->height < manager->estimatedHeight) {
+        _PeerManagerStealStalledSyncWindows(manager);
+
+        // deal the hashes out in chunks, round robin between the download peer and helpers with room in their window,
+        // the download peer always keeps the first chunk so the chain keeps growing while helpers fetch ahead of it
+        for (i = 0; i < blockCount; i += n, slot = (slot + 1) % (helperCount + 1)) {
+            window = (slot > 0) ? &manager->syncWindows[slot - 1] : NULL;
+            n = (blockCount - i < SYNC_CHUNK_BLOCKS) ? blockCount - i : SYNC_CHUNK_BLOCKS;
+
+            if (window && ! window->stalled && BRPeerConnectStatus(window->peer) == BRPeerStatusConnected &&
+                array_count(window->hashes) + n <= SYNC_WINDOW_BLOCKS) {
+                if (array_count(window->hashes) == 0) window->time = time(NULL);
+                array_add_array(window->hashes, &blockHashes[i], n);
+                BRPeerSendGetdata(window->peer, NULL, 0, &blockHashes[i], n);
+                manager->syncSplit = 1;
+            } else {
+                memmove(&blockHashes[count], &blockHashes[i], n * sizeof(*blockHashes));
+                count += n;
+            }
+        }
+    } else count = blockCount;
+
+    pthread_mutex_unlock(&manager->lock);
+    return count;
 }
 
 static void _peerDataNotfound(void *info, const UInt256 txHashes[], size_t txCount,
                               const UInt256 blockHashes[], size_t blockCount) {
     BRPeer *peer = ((PeerCallbackInfo *) info)->peer;
     BRPeerManager *manager = ((PeerCallbackInfo *) info)->manager;
+    SyncWindow *window;
 
     pthread_mutex_lock(&manager->lock);
 
@@ -1424,6 +2058,14 @@ static void _peerDataNotfound(void *info, const UInt256 txHashes[], size_t txCou
         _TxPeerListRemovePeer(manager->txRequests, txHashes[i], peer);
     }
 
+    window = _PeerManagerSyncWindow(manager, peer);
+
+    if (window && blockCount > 0) { // a helper that is missing blocks can't be relied on for the rest of the sync
+        peer_log(peer, "missing %zu block(s) requested for chain sync", blockCount);
+        window->stalled = 1;
+        _PeerManagerStealSyncWindow(manager, window);
+    }
+
     pthread_mutex_unlock(&manager->lock);
 }
 
@@ -1521,6 +2163,95 @@ static void _peerThreadCleanup(void *info) {
 static void _dummyThreadCleanup(void *info) {
 }
 
+// drops the main chain from the first restored header that doesn't hash to its blockHash onward, along with any stored
+// blocks from there on, fills in saveBlocks, from copies in headers, with the main chain back to its last difficulty
+// transition and sets *saveCount to their number, returns true if the chain was rewound
+static int _PeerManagerDropUnverified(BRPeerManager *manager, const BRMerkleBlock *bad, BRMerkleBlock *saveBlocks[],
+                                      BRMerkleBlock *headers, size_t *saveCount) {
+    BRMerkleBlock *prev = NULL, **blocks;
+    size_t i, count;
+
+    if (! _PeerManagerInChain(manager, bad)) return 0; // the chain has already moved off it
+    if (bad->height > manager->chainStart) prev = BRSetGet(manager->blocks, &bad->prevBlock);
+    if (! prev && bad->height > manager->chainStart)
+        prev = _PeerManagerChainBlock(manager, bad->height - 1, BRMerkleBlockNew());
+
+    for (i = manager->params->checkpointsCount; ! prev && i > 0; i--) { // otherwise start over from a checkpoint
+        UInt256 hash = UInt256Reverse(manager->params->checkpoints[i - 1].hash);
+
+        if (manager->params->checkpoints[i - 1].height < bad->height) prev = BRSetGet(manager->blocks, &hash);
+    }
+
+    if (! prev) return 0;
+    _PeerManagerRewind(manager, prev);
+    count = BRSetCount(manager->blocks);
+    blocks = malloc(count * sizeof(*blocks));
+    assert(blocks != NULL);
+    count = BRSetAll(manager->blocks, (void **) blocks, count);
+
+    for (i = 0; i < count; i++) {
+        if (blocks[i]->height >= bad->height) _PeerManagerReleaseBlock(manager, blocks[i]);
+    }
+
+    free(blocks);
+    count = prev->height % BLOCK_DIFFICULTY_INTERVAL + 1;
+    if (prev->height + 1 - manager->chainStart < count) count = 0; // the chain doesn't reach back to the transition
+    if (count > *saveCount) count = 0;
+
+    for (i = 0; i < count; i++) {
+        saveBlocks[i] = _PeerManagerChainBlock(manager, prev->height - (uint32_t) i, &headers[i]);
+    }
+
+    *saveCount = count;
+    return 1;
+}
+
+// hashes the restored main chain headers off the startup path, if one doesn't match its blockHash the chain is rewound
+// to the block before it, the saved blocks are replaced, and the sync restarts with a new random download peer
+static void *_PeerManagerVerifyRoutine(void *arg) {
+    BRPeerManager *manager = arg;
+    size_t count = array_count(manager->unverified), n, saveCount = BLOCK_DIFFICULTY_INTERVAL;
+    BRMerkleBlock **saveBlocks = NULL, *headers = NULL, *bad;
+    int dropped = 0, needConnect = 0, started;
+
+    n = BRMerkleBlockVerifyHashes(manager->unverified, count);
+    pthread_mutex_lock(&manager->lock);
+    started = manager->verifyStarted;
+
+    if (n < count) {
+        bad = manager->unverified[n];
+        _peer_log("restored block %s at height %"PRIu32" failed verification, dropping it and all later blocks\n",
+                  u256_hex_encode(bad->blockHash), bad->height);
+        saveBlocks = calloc(saveCount, sizeof(*saveBlocks));
+        headers = calloc(saveCount, sizeof(*headers));
+        assert(saveBlocks != NULL && headers != NULL);
+        dropped = _PeerManagerDropUnverified(manager, bad, saveBlocks, headers, &saveCount);
+    }
+
+    if (dropped && manager->isConnected) {
+        if (manager->downloadPeer) { // disconnect the current download peer so a new random one will be selected
+            for (size_t i = array_count(manager->peers); i > 0; i--) {
+                if (BRPeerEq(&manager->peers[i - 1], manager->downloadPeer)) array_rm(manager->peers, i - 1);
+            }
+
+            BRPeerDisconnect(manager->downloadPeer);
+        }
+
+        manager->syncStartHeight = 0; // a syncStartHeight of 0 indicates that syncing hasn't started yet
+        needConnect = 1;
+    }
+
+    for (size_t i = 0; i < count; i++) BRMerkleBlockFree(manager->unverified[i]);
+    array_clear(manager->unverified);
+    pthread_mutex_unlock(&manager->lock);
+    if (dropped && manager->saveBlocks) manager->saveBlocks(manager->info, 1, saveBlocks, saveCount);
+    if (needConnect) BRPeerManagerConnect(manager);
+    if (saveBlocks) free(saveBlocks);
+    if (headers) free(headers);
+    if (started) manager->threadCleanup(manager->info);
+    return NULL;
+}
+
 // returns a newly allocated PeerManager struct that must be freed by calling PeerManagerFree()
 
 BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, uint32_t earliestKeyTime,
@@ -1543,11 +2274,14 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
     qsort(manager->peers, array_count(manager->peers), sizeof(*manager->peers),
           _peerTimestampCompare);
     array_new(manager->connectedPeers, PEER_MAX_CONNECTIONS);
-    manager->blocks = BRSetNew(BRMerkleBlockHash, BRMerkleBlockEq, blocksCount);
+    manager->blocks = BRSetNewUInt256(blocksCount);
     manager->orphans = BRSetNew(_PrevBlockHash, _PrevBlockEq,
                                 blocksCount); // orphans are indexed by prevBlock
     manager->checkpoints = BRSetNew(_BlockHeightHash, _BlockHeightEq,
                                     100); // checkpoints are indexed by height
+    array_new(manager->chain, 4);
+    manager->headerFile = -1;
+    manager->chainIndex = BRSetNewUInt256(BLOCK_DIFFICULTY_INTERVAL * 3);
 
     for (size_t i = 0; i < manager->params->checkpointsCount; i++) {
         block = BRMerkleBlockNew();
@@ -1574,16 +2308,27 @@ BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, u
     }
 
     while (block) {
-        BRSetAdd(manager->blocks, block);
-        manager->lastBlock = block;
         orphan.prevBlock = block->prevBlock;
         BRSetRemove(manager->orphans, &orphan);
+        _PeerManagerAddBlock(manager, block);
         orphan.prevBlock = block->blockHash;
         block = BRSetGet(manager->orphans, &orphan);
     }
 
+    // restored blocks may not have been hashed, see MerkleBlockParseTrusted(), so the main chain they make up is
+    // checked in the background once connected
+    array_new(manager->unverified, manager->chainEnd - manager->chainStart);
+
+    for (uint32_t height = manager->chainStart; height < manager->chainEnd; height++) {
+        array_add(manager->unverified, _PeerManagerChainBlock(manager, height, BRMerkleBlockNew()));
+    }
+
+    if (manager->chainStart == manager->chainEnd) _PeerManagerChainAdd(manager, manager->lastBlock);
+
     array_new(manager->txRelays, 10);
     array_new(manager->txRequests, 10);
+    array_new(manager->syncWindows, PEER_MAX_CONNECTIONS);
+    array_new(manager->forkTxs, 0);
     array_new(manager->publishedTx, 10);
     array_new(manager->publishedTxHashes, 10);
     pthread_mutex_init(&manager->lock, NULL);
@@ -1626,7 +2371,7 @@ void BRPeerManagerSetCallbacks(BRPeerManager *manager, void *info,
 static int _PeerManagerRescan(BRPeerManager *manager, BRMerkleBlock *newLastBlock) {
     if (NULL == newLastBlock) return 0;
 
-    manager->lastBlock = newLastBlock;
+    _PeerManagerRewind(manager, newLastBlock);
 
     if (manager->downloadPeer) { // disconnect the current download peer so a new random one will be selected
         for (size_t i = array_count(manager->peers); i > 0; i--) {
@@ -1651,6 +2396,83 @@ void BRPeerManagerSetFixedPeer(BRPeerManager *manager, UInt128 address, uint16_t
     pthread_mutex_unlock(&manager->lock);
 }
 
+// if assumeValid is true, block headers more than BLOCK_DIFFICULTY_INTERVAL blocks and a week below the last hardcoded
+// checkpoint take their hash from the prevBlock of the header after them instead of computing their proof-of-work hash,
+// which speeds up the initial header download, the contents of those headers are trusted rather than verified, headers
+// at checkpoint heights and near the last checkpoint are still hashed, so the chain is pinned to the real checkpoints
+void BRPeerManagerSetAssumeValidHeaders(BRPeerManager *manager, int assumeValid) {
+    assert(manager != NULL);
+    pthread_mutex_lock(&manager->lock);
+    manager->assumeValidHeaders = assumeValid;
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// services peers connected after this call from loop, which many managers can share, instead of a thread per peer
+// set loop to NULL to revert to default behavior, disconnect the manager before freeing loop
+void BRPeerManagerSetEventLoop(BRPeerManager *manager, BRPeerEventLoop *loop) {
+    assert(manager != NULL);
+    pthread_mutex_lock(&manager->lock);
+    manager->eventLoop = loop;
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// keeps the main chain headers in an append-only file at path, which is memory mapped and, if its chain connects to and
+// is longer than the one the manager was created with, continued from, only the headers needed to do that are checked,
+// their proof-of-work hashes in the background like the blocks given to BRPeerManagerNew()
+// set path to NULL to stop using a file, call before BRPeerManagerConnect(), returns false on error with errno set
+int BRPeerManagerSetHeaderFile(BRPeerManager *manager, const char *path) {
+    struct stat st;
+    uint8_t *buf = MAP_FAILED;
+    size_t count = 0;
+    uint32_t height, from;
+    BRChainHeader *header;
+    UInt256 lastHash = UINT256_ZERO;
+    int fd = -1, r = 1;
+
+    assert(manager != NULL);
+    pthread_mutex_lock(&manager->lock);
+    _PeerManagerFileClose(manager);
+    if (path) fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (path && fd < 0) r = 0;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= HEADER_FILE_PREFIX)
+        buf = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (buf != MAP_FAILED) {
+        if (UInt32GetLE(&buf[0]) == HEADER_FILE_MAGIC && UInt32GetLE(&buf[4]) == HEADER_FILE_VERSION &&
+            UInt32GetLE(&buf[8]) == manager->params->magicNumber) {
+            count = ((size_t) st.st_size - HEADER_FILE_PREFIX) / HEADER_FILE_RECORD;
+            manager->fileStart = UInt32GetLE(&buf[12]);
+            count = _PeerManagerFileLoad(manager, &buf[HEADER_FILE_PREFIX], manager->fileStart, count, &from);
+            manager->fileEnd = from + (uint32_t) count; // records before from are kept, but weren't checked
+            if (count > 0) lastHash = UInt256Get(&buf[HEADER_FILE_PREFIX + (size_t) (manager->fileEnd - 1 -
+                                                      manager->fileStart) * HEADER_FILE_RECORD + 80]);
+        }
+
+        munmap(buf, (size_t) st.st_size);
+    }
+
+    manager->headerFile = fd;
+    header = (count > 0) ? _PeerManagerChainHeader(manager, manager->fileEnd - 1) : NULL;
+
+    // continue the file from its last record if that's in the main chain, otherwise start it over
+    if (fd >= 0 && (! header || ! UInt256Eq(header->blockHash, lastHash))) {
+        _PeerManagerFileReset(manager, manager->chainStart);
+    } else if (fd >= 0) {
+        // drop any torn records after the good ones, left by an interrupted write
+        off_t len = HEADER_FILE_PREFIX + (off_t) (manager->fileEnd - manager->fileStart) * HEADER_FILE_RECORD;
+
+        if (ftruncate(fd, len) != 0) _PeerManagerFileClose(manager);
+    }
+
+    for (height = manager->fileEnd; height < manager->chainEnd; height++) {
+        _PeerManagerFileAppend(manager, _PeerManagerChainHeader(manager, height));
+    }
+
+    if (fd >= 0 && manager->headerFile < 0) r = 0;
+    pthread_mutex_unlock(&manager->lock);
+    return r;
+}
+
 // current connect status
 BRPeerStatus BRPeerManagerConnectStatus(BRPeerManager *manager) {
     BRPeerStatus status = BRPeerStatusDisconnected;
@@ -1688,6 +2510,11 @@ void BRPeerManagerConnect(BRPeerManager *manager) {
     if (manager->connectFailureCount >= MAX_CONNECT_FAILURES)
         manager->connectFailureCount = 0; //this is a manual retry
 
+    if (array_count(manager->unverified) > 0 && ! manager->verifyStarted &&
+        pthread_create(&manager->verifyThread, NULL, _PeerManagerVerifyRoutine, manager) == 0) {
+        manager->verifyStarted = 1;
+    }
+
     if ((!manager->downloadPeer || manager->lastBlock->height < manager->estimatedHeight) &&
         manager->syncStartHeight == 0) {
         manager->syncStartHeight = manager->lastBlock->height + 1;
@@ -1704,6 +2531,7 @@ void BRPeerManagerConnect(BRPeerManager *manager) {
 
     if (array_count(manager->connectedPeers) < manager->maxConnectCount) {
         time_t now = time(NULL);
+        const BRCheckPoint *checkpoint = &manager->params->checkpoints[manager->params->checkpointsCount - 1];
         BRPeer *peers;
 
         if (array_count(manager->peers) < manager->maxConnectCount ||
@@ -1743,7 +2571,12 @@ void BRPeerManagerConnect(BRPeerManager *manager) {
                                    _peerDataNotfound,
                                    _peerSetFeePerKb, _peerRequestedTx, _peerNetworkIsReachable,
                                    _peerThreadCleanup);
+                BRPeerSetBlockInvCallback(info->peer, _peerBlockInv);
+                BRPeerSetEventLoop(info->peer, manager->eventLoop);
                 BRPeerSetEarliestKeyTime(info->peer, manager->earliestKeyTime);
+                if (manager->assumeValidHeaders && manager->lastBlock->height < checkpoint->height)
+                    BRPeerSetAssumeValid(info->peer, manager->lastBlock->blockHash, manager->lastBlock->height,
+                                         checkpoint->height, checkpoint->timestamp);
                 BRPeerConnect(info->peer);
             }
         }
@@ -1789,7 +2622,7 @@ void BRPeerManagerDisconnect(BRPeerManager *manager) {
 static int _BRPeerManagerRescan(BRPeerManager *manager, BRMerkleBlock *newLastBlock) {
     if (NULL == newLastBlock) return 0;
 
-    manager->lastBlock = newLastBlock;
+    _PeerManagerRewind(manager, newLastBlock);
 
     if (manager->downloadPeer) { // disconnect the current download peer so a new random one will be selected
         for (size_t i = array_count(manager->peers); i > 0; i--) {
@@ -1803,6 +2636,20 @@ static int _BRPeerManagerRescan(BRPeerManager *manager, BRMerkleBlock *newLastBl
     return 1;
 }
 
+// the most recent checkpoint that's at least a week older than earliestKeyTime, where a rescan starts the download
+static BRMerkleBlock *_PeerManagerRescanStart(BRPeerManager *manager) {
+    for (size_t i = manager->params->checkpointsCount; i > 0; i--) {
+        if (i - 1 == 0 ||
+            manager->params->checkpoints[i - 1].timestamp + 7 * 24 * 60 * 60 < manager->earliestKeyTime) {
+            UInt256 hash = UInt256Reverse(manager->params->checkpoints[i - 1].hash);
+
+            return BRSetGet(manager->blocks, &hash);
+        }
+    }
+
+    return NULL;
+}
+
 // rescans blocks and transactions after earliestKeyTime (a new random download peer is also selected due to the
 // possibility that a malicious node might lie by omitting transactions that match the bloom filter)
 void BRPeerManagerRescan(BRPeerManager *manager) {
@@ -1810,16 +2657,9 @@ void BRPeerManagerRescan(BRPeerManager *manager) {
     pthread_mutex_lock(&manager->lock);
 
     if (manager->isConnected) {
-        // start the chain download from the most recent checkpoint that's at least a week older than earliestKeyTime
-        for (size_t i = manager->params->checkpointsCount; i > 0; i--) {
-            if (i - 1 == 0 ||
-                manager->params->checkpoints[i - 1].timestamp + 7 * 24 * 60 * 60 < manager->earliestKeyTime) {
-                UInt256 hash = UInt256Reverse(manager->params->checkpoints[i - 1].hash);
+        BRMerkleBlock *block = _PeerManagerRescanStart(manager);
 
-                manager->lastBlock = BRSetGet(manager->blocks, &hash);
-                break;
-            }
-        }
+        if (block) _PeerManagerRewind(manager, block);
 
         if (manager->downloadPeer) { // disconnect the current download peer so a new random one will be selected
             for (size_t i = array_count(manager->peers); i > 0; i--) {
@@ -1856,14 +2696,16 @@ void BRPeerManagerRescanFromLastHardcodedCheckpoint(BRPeerManager *manager)
 
 static BRMerkleBlock *_BRPeerManagerLookupBlockFromBlockNumber(BRPeerManager *manager, uint32_t blockNumber)
 {
-    BRMerkleBlock *block = manager->lastBlock;
+    BRChainHeader *header = _PeerManagerChainHeader(manager, blockNumber);
+    BRMerkleBlock *block = (header) ? BRSetGet(manager->blocks, &header->blockHash) : NULL;
 
-    // walk the chain, looking for blockNumber
-    while (block) {
-        if (block->height == blockNumber) return block;
-        block = BRSetGet (manager->blocks, &block->prevBlock);
+    if (header && ! block) { // the block is only stored as a main chain header
+        block = _ChainHeaderGet(header, BRMerkleBlockNew());
+        BRSetAdd(manager->blocks, block);
     }
 
+    if (block) return block;
+
     // blockNumber not in the (abbreviated) chain - look through checkpoints
     for (int i = 0; i < manager->params->checkpointsCount; i++)
         if (manager->params->checkpoints[i].height == blockNumber) {
@@ -2103,19 +2945,31 @@ void BRPeerManagerFree(BRPeerManager *manager) {
     BRTransaction *tx;
 
     assert(manager != NULL);
+    if (manager->verifyStarted) pthread_join(manager->verifyThread, NULL);
     pthread_mutex_lock(&manager->lock);
     array_free(manager->peers);
+    for (size_t i = array_count(manager->unverified); i > 0; i--) BRMerkleBlockFree(manager->unverified[i - 1]);
+    array_free(manager->unverified);
     for (size_t i = array_count(manager->connectedPeers); i > 0; i--) BRPeerFree(manager->connectedPeers[i - 1]);
     array_free(manager->connectedPeers);
+    BRSetApply(manager->checkpoints, manager, _setApplyFreeCheckpoint);
     BRSetApply(manager->blocks, NULL, _setApplyFreeBlock);
     BRSetFree(manager->blocks);
     BRSetApply(manager->orphans, NULL, _setApplyFreeBlock);
     BRSetFree(manager->orphans);
     BRSetFree(manager->checkpoints);
+    for (size_t i = array_count(manager->chain); i > 0; i--) free(manager->chain[i - 1]);
+    array_free(manager->chain);
+    BRSetFree(manager->chainIndex);
+    _PeerManagerFileClose(manager);
     for (size_t i = array_count(manager->txRelays); i > 0; i--) array_free(manager->txRelays[i - 1].peers);
     array_free(manager->txRelays);
     for (size_t i = array_count(manager->txRequests); i > 0; i--) array_free(manager->txRequests[i - 1].peers);
     array_free(manager->txRequests);
+    _PeerManagerClearSyncWindows(manager);
+    array_free(manager->syncWindows);
+    for (size_t i = array_count(manager->forkTxs); i > 0; i--) array_free(manager->forkTxs[i - 1].txHashes);
+    array_free(manager->forkTxs);
 
     for (size_t i = array_count(manager->publishedTx); i > 0; i--) {
         tx = manager->publishedTx[i - 1].tx;
@@ -2130,3 +2984,89 @@ void BRPeerManagerFree(BRPeerManager *manager) {
     pthread_mutex_destroy(&manager->lock);
     free(manager);
 }
+
+int PeerManagerAddBlockTest(BRPeerManager *manager, BRPeer *peer, BRMerkleBlock *block) {
+    int r = 0;
+
+    pthread_mutex_lock(&manager->lock);
+
+    if (UInt256Eq(block->prevBlock, manager->lastBlock->blockHash)) {
+        block->height = manager->lastBlock->height + 1;
+        r = _PeerManagerVerifyBlock(manager, block, manager->lastBlock, peer);
+    }
+
+    if (r) _PeerManagerAddBlock(manager, block);
+
+    pthread_mutex_unlock(&manager->lock);
+    return r;
+}
+
+// relays blocks from peer, in reverse order, as if their hashes had been handed to it while splitting the chain sync
+// returns true if the blocks were reassembled into the chain
+int PeerManagerSyncWindowTest(BRPeerManager *manager, BRPeer *peer, BRMerkleBlock *blocks[], size_t count) {
+    PeerCallbackInfo info = { peer, manager, UINT256_ZERO };
+    SyncWindow *window;
+    int r;
+
+    pthread_mutex_lock(&manager->lock);
+    if (! manager->bloomFilter) manager->bloomFilter = BRBloomFilterNew(BLOOM_DEFAULT_FALSEPOSITIVE_RATE, 1, 0,
+                                                                        BLOOM_UPDATE_NONE);
+    manager->estimatedHeight = manager->lastBlock->height + (uint32_t) count + 1;
+    manager->syncSplit = 1;
+
+    if (! _PeerManagerSyncWindow(manager, peer)) {
+        array_add(manager->syncWindows, ((SyncWindow) { peer, NULL, 0, 0 }));
+        array_new(manager->syncWindows[array_count(manager->syncWindows) - 1].hashes, count);
+    }
+
+    window = _PeerManagerSyncWindow(manager, peer);
+    window->time = time(NULL);
+    for (size_t i = 0; i < count; i++) array_add(window->hashes, blocks[i]->blockHash);
+    pthread_mutex_unlock(&manager->lock);
+
+    for (size_t i = count; i > 0; i--) _peerRelayedBlock(&info, blocks[i - 1]);
+
+    pthread_mutex_lock(&manager->lock);
+    window = _PeerManagerSyncWindow(manager, peer); // relays may have released or moved the window
+    r = (count == 0 || manager->lastBlock == blocks[count - 1]) && (! window || array_count(window->hashes) == 0) &&
+        BRSetCount(manager->orphans) == 0;
+    pthread_mutex_unlock(&manager->lock);
+    return r;
+}
+
+// relays block from peer outside of a chain sync, returns the chain height afterwards
+uint32_t PeerManagerRelayBlockTest(BRPeerManager *manager, BRPeer *peer, BRMerkleBlock *block) {
+    pthread_mutex_lock(&manager->lock);
+    if (! manager->bloomFilter) manager->bloomFilter = BRBloomFilterNew(BLOOM_DEFAULT_FALSEPOSITIVE_RATE, 1, 0,
+                                                                        BLOOM_UPDATE_NONE);
+    pthread_mutex_unlock(&manager->lock);
+
+    while (block) block = _PeerManagerAcceptBlock(manager, peer, block);
+    return BRPeerManagerLastBlockHeight(manager);
+}
+
+// rewinds the chain as BRPeerManagerRescan() does while connected, returns the chain height afterwards
+uint32_t PeerManagerRescanTest(BRPeerManager *manager) {
+    BRMerkleBlock *block;
+
+    pthread_mutex_lock(&manager->lock);
+    block = _PeerManagerRescanStart(manager);
+    if (block) _PeerManagerRewind(manager, block);
+    pthread_mutex_unlock(&manager->lock);
+    return BRPeerManagerLastBlockHeight(manager);
+}
+
+// checks the restored main chain headers as the background verifier does, returns the chain height afterwards
+uint32_t PeerManagerVerifyTest(BRPeerManager *manager) {
+    if (! manager->verifyStarted) _PeerManagerVerifyRoutine(manager);
+    return BRPeerManagerLastBlockHeight(manager);
+}
+
+size_t PeerManagerWorkCountTest(BRPeerManager *manager) {
+    size_t count;
+
+    pthread_mutex_lock(&manager->lock);
+    count = manager->workCount;
+    pthread_mutex_unlock(&manager->lock);
+    return count;
+}
@@ -38,6 +38,8 @@ typedef struct {
 typedef struct BRPeerManagerStruct BRPeerManager;
 
 // returns a newly allocated PeerManager struct that must be freed by calling PeerManagerFree()
+// the proof-of-work hashes of blocks, which may be restored with MerkleBlockParseTrusted(), are checked in the
+// background after the first PeerManagerConnect(), and the chain is rewound to the block before the first bad one
 BRPeerManager *BRPeerManagerNew(const BRChainParams *params, BRWallet *wallet, uint32_t earliestKeyTime,
                                 BRMerkleBlock *blocks[], size_t blocksCount, const BRPeer peers[], size_t peersCount);
 
@@ -65,6 +67,22 @@ void BRPeerManagerSetCallbacks(BRPeerManager *manager, void *info,
 // set address to UINT128_ZERO to revert to default behavior
 void BRPeerManagerSetFixedPeer(BRPeerManager *manager, UInt128 address, uint16_t port);
 
+// if assumeValid is true, block headers more than BLOCK_DIFFICULTY_INTERVAL blocks and a week below the last hardcoded
+// checkpoint take their hash from the prevBlock of the header after them instead of computing their proof-of-work hash,
+// which speeds up the initial header download, the contents of those headers are trusted rather than verified, headers
+// at checkpoint heights and near the last checkpoint are still hashed, so the chain is pinned to the real checkpoints
+void BRPeerManagerSetAssumeValidHeaders(BRPeerManager *manager, int assumeValid);
+
+// services peers connected after this call from loop, which many managers can share, instead of a thread per peer
+// set loop to NULL to revert to default behavior, disconnect the manager before freeing loop
+void BRPeerManagerSetEventLoop(BRPeerManager *manager, BRPeerEventLoop *loop);
+
+// keeps the main chain headers in an append-only file at path, which is memory mapped and, if its chain connects to and
+// is longer than the one the manager was created with, continued from, only the headers needed to do that are checked,
+// their proof-of-work hashes in the background like the blocks given to BRPeerManagerNew()
+// set path to NULL to stop using a file, call before BRPeerManagerConnect(), returns false on error with errno set
+int BRPeerManagerSetHeaderFile(BRPeerManager *manager, const char *path);
+
 // current connect status
 BRPeerStatus BRPeerManagerConnectStatus(BRPeerManager *manager);
 
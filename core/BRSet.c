@@ -9,29 +9,66 @@
 
 
 #include "BRSet.h"
+#include "BRInt.h"
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
-// linear probed hashtable for good cache performance, maximum load factor is 2/3
+// robin hood hashtable over power of two table sizes for good cache performance, maximum load factor is 3/4
+// each bucket keeps the hash of its item, so probes only call eq() on a hash match and growing never rehashes, and a
+// probe stops as soon as it reaches an item closer to its home bucket than the item being looked for would be
 
-static const size_t tableSizes[] = { // starting with 1, multiply by 3/2, round up, then find next largest prime
-    1, 3, 7, 13, 23, 37, 59, 97, 149, 227, 347, 523, 787, 1187, 1783, 2677, 4019, 6037, 9059, 13591,
-    20389, 30593, 45887, 68863, 103307, 154981, 232487, 348739, 523129, 784697, 1177067, 1765609,
-    2648419, 3972643, 5958971, 8938469, 13407707, 20111563, 30167359, 45251077, 67876637, 101814991,
-    152722489, 229083739, 343625629, 515438447, 773157683, 1159736527, 1739604799, 2609407319, 3914111041
-};
+#define SET_MIN_SIZE 4
 
-#define TABLE_SIZES_LEN (sizeof(tableSizes)/sizeof(*tableSizes))
+typedef struct {
+    void *item;
+    size_t hash; // hash value of item
+} _SetBucket;
 
 struct SetStruct {
-    void **table; // hashtable
-    size_t size; // number of buckets in table
+    _SetBucket *table; // hashtable
+    size_t size; // number of buckets in table, a power of two
     size_t itemCount; // number of items in set
+    int shift; // 64 - log2(size), for mapping a hash value to its home bucket
+    int keyed; // true if items start with a UInt256 key that's hashed and compared inline
     size_t (*hash)(const void *); // hash function
     int (*eq)(const void *, const void *); // equality function
 };
 
+// returns a hash value for an item that starts with a UInt256 key
+static size_t _SetUInt256Hash(const void *item)
+{
+    return (size_t)((const UInt256 *)item)->u32[0];
+}
+
+// true if item and otherItem start with equal UInt256 keys
+static int _SetUInt256Eq(const void *item, const void *otherItem)
+{
+    return (item == otherItem || UInt256Eq(*(const UInt256 *)item, *(const UInt256 *)otherItem));
+}
+
+inline static size_t _SetHash(const BRSet *set, const void *item)
+{
+    return (set->keyed) ? _SetUInt256Hash(item) : set->hash(item);
+}
+
+inline static int _SetEq(const BRSet *set, const void *item, const void *otherItem)
+{
+    return (set->keyed) ? _SetUInt256Eq(item, otherItem) : (item == otherItem || set->eq(item, otherItem));
+}
+
+// returns the home bucket for hash, multiplying by 2^64/phi spreads weak hash values such as block heights
+inline static size_t _SetHome(const BRSet *set, size_t hash)
+{
+    return (size_t)(((uint64_t)hash*0x9e3779b97f4a7c15ULL) >> set->shift);
+}
+
+// returns how far the item in bucket i is from its home bucket
+inline static size_t _SetDistance(const BRSet *set, size_t i)
+{
+    return (i - _SetHome(set, set->table[i].hash)) & (set->size - 1);
+}
+
 static void _SetInit(BRSet *set, size_t (*hash)(const void *), int (*eq)(const void *, const void *), size_t capacity)
 {
     assert(set != NULL);
@@ -39,17 +76,16 @@ static void _SetInit(BRSet *set, size_t (*hash)(const void *), int (*eq)(const v
     assert(eq != NULL);
     assert(capacity >= 0);
 
-    size_t i = 0;
-    
-    while (i < TABLE_SIZES_LEN && tableSizes[i] < capacity) i++;
+    size_t size = SET_MIN_SIZE;
+    int shift = 64 - 2;
 
-    if (i + 1 < TABLE_SIZES_LEN) { // use next larger table size to keep load factor below 2/3 at capacity
-        set->table = calloc(tableSizes[i + 1], sizeof(void *));
-        assert(set->table != NULL);
-        set->size = tableSizes[i + 1];
-    }
-    
+    while (size/4*3 < capacity && size < SIZE_MAX/sizeof(_SetBucket)/2) size *= 2, shift--; // load factor below 3/4
+    set->table = calloc(size, sizeof(*set->table));
+    assert(set->table != NULL);
+    set->size = size;
+    set->shift = shift;
     set->itemCount = 0;
+    set->keyed = (hash == _SetUInt256Hash);
     set->hash = hash;
     set->eq = eq;
 }
@@ -68,38 +104,115 @@ BRSet *BRSetNew(size_t (*hash)(const void *), int (*eq)(const void *, const void
     return set;
 }
 
+// returns a newly allocated empty set of items that each start with a UInt256 key, such as a BRMerkleBlock or a
+// BRTransaction, items are hashed and compared by key without calling through function pointers
+// capacity is the maximum estimated number of items the set will need to hold
+BRSet *BRSetNewUInt256(size_t capacity)
+{
+    return BRSetNew(_SetUInt256Hash, _SetUInt256Eq, capacity);
+}
+
+// returns the bucket holding an item equivalent to item, or SIZE_MAX if there is none, stop is set to the bucket where
+// the probe ended
+static size_t _SetFind(const BRSet *set, const void *item, size_t hash, size_t *stop)
+{
+    size_t i = _SetHome(set, hash), dist = 0, mask = set->size - 1, r = SIZE_MAX;
+
+    while (r == SIZE_MAX && set->table[i].item && _SetDistance(set, i) >= dist) { // probe for item
+        if (set->table[i].hash == hash && _SetEq(set, set->table[i].item, item)) r = i;
+        else i = (i + 1) & mask, dist++;
+    }
+
+    if (stop) *stop = i;
+    return r;
+}
+
+// inserts an item that isn't in set yet, taking the bucket of any item closer to its home bucket along the way
+static void _SetInsert(BRSet *set, void *item, size_t hash)
+{
+    _SetBucket b = { item, hash }, t;
+    size_t i = _SetHome(set, hash), dist = 0, d, mask = set->size - 1;
+
+    while (set->table[i].item) {
+        d = _SetDistance(set, i);
+
+        if (d < dist) { // the probing item is further from home, it takes the bucket and the displaced item moves on
+            t = set->table[i];
+            set->table[i] = b;
+            b = t;
+            dist = d;
+        }
+
+        i = (i + 1) & mask;
+        dist++;
+    }
+
+    set->table[i] = b;
+    set->itemCount++;
+}
+
 // rebuilds hashtable to hold up to capacity items
 static void _SetGrow(BRSet *set, size_t capacity)
 {
     BRSet newSet;
 
     _SetInit(&newSet, set->hash, set->eq, capacity);
-    BRSetUnion(&newSet, set);
+
+    for (size_t i = 0; i < set->size; i++) { // stored hash values are reused, items aren't hashed again
+        if (set->table[i].item) _SetInsert(&newSet, set->table[i].item, set->table[i].hash);
+    }
+
     free(set->table);
     set->table = newSet.table;
     set->size = newSet.size;
+    set->shift = newSet.shift;
     set->itemCount = newSet.itemCount;
 }
 
+static void *_SetAdd(BRSet *set, void *item, size_t hash)
+{
+    size_t i = _SetFind(set, item, hash, NULL);
+    void *t = NULL;
+
+    if (i != SIZE_MAX) {
+        t = set->table[i].item;
+        set->table[i].item = item;
+    } else {
+        if (set->itemCount + 1 > set->size/4*3) _SetGrow(set, set->itemCount + 1); // limit load factor to 3/4
+        _SetInsert(set, item, hash);
+    }
+
+    return t;
+}
+
 // adds given item to set or replaces an equivalent existing item and returns item replaced if any
 void *BRSetAdd(BRSet *set, void *item)
 {
     assert(set != NULL);
     assert(item != NULL);
-    
-    size_t size = set->size;
-    size_t i = set->hash(item) % size;
-    void *t = set->table[i];
 
-    while (t && t != item && ! set->eq(t, item)) { // probe for empty bucket
-        i = (i + 1) % size;
-        t = set->table[i];
+    return _SetAdd(set, item, _SetHash(set, item));
+}
+
+static void *_SetRemove(BRSet *set, const void *item, size_t hash)
+{
+    size_t i = _SetFind(set, item, hash, NULL), j, mask = set->size - 1;
+    void *r = NULL;
+
+    if (i != SIZE_MAX) {
+        r = set->table[i].item;
+        set->itemCount--;
+
+        // shift the rest of the probe sequence back a bucket, ending at an empty bucket or an item in its home bucket
+        for (j = (i + 1) & mask; set->table[j].item && _SetDistance(set, j) > 0; i = j, j = (j + 1) & mask) {
+            set->table[i] = set->table[j];
+        }
+
+        set->table[i].item = NULL;
+        set->table[i].hash = 0;
     }
 
-    if (! t) set->itemCount++;
-    set->table[i] = item;
-    if (set->itemCount > ((size + 2)/3)*2) _SetGrow(set, size); // limit load factor to 2/3
-    return t;
+    return r;
 }
 
 // removes item equivalent to given item from set and returns item removed if any
@@ -107,32 +220,8 @@ void *BRSetRemove(BRSet *set, const void *item)
 {
     assert(set != NULL);
     assert(item != NULL);
-    
-    size_t size = set->size;
-    size_t i = set->hash(item) % size;
-    void *r = set->table[i], *t;
 
-    while (r != item && r && ! set->eq(r, item)) { // probe for item
-        i = (i + 1) % size;
-        r = set->table[i];
-    }
-    
-    if (r) {
-        set->itemCount--;
-        set->table[i] = NULL;
-        i = (i + 1) % size;
-        t = set->table[i];
-        
-        while (t) { // hashtable cleanup
-            set->itemCount--;
-            set->table[i] = NULL;
-            BRSetAdd(set, t);
-            i = (i + 1) % size;
-            t = set->table[i];
-        }
-    }
-    
-    return r;
+    return _SetRemove(set, item, _SetHash(set, item));
 }
 
 // removes all items from set
@@ -165,11 +254,13 @@ int BRSetIntersects(const BRSet *set, const BRSet *otherSet)
     assert(otherSet != NULL);
     
     size_t i = 0, size = otherSet->size;
-    void *t;
+    const _SetBucket *t;
     
     while (i < size) {
-        t = otherSet->table[i++];
-        if (t && BRSetGet(set, t) != NULL) return 1;
+        t = &otherSet->table[i++];
+        if (! t->item) continue;
+        if (_SetFind(set, t->item, (set->hash == otherSet->hash) ? t->hash : _SetHash(set, t->item), NULL) != SIZE_MAX)
+            return 1;
     }
     
     return 0;
@@ -181,16 +272,9 @@ void *BRSetGet(const BRSet *set, const void *item)
     assert(set != NULL);
     assert(item != NULL);
     
-    size_t size = set->size;
-    size_t i = set->hash(item) % size;
-    void *t = set->table[i];
+    size_t i = _SetFind(set, item, _SetHash(set, item), NULL);
 
-    while (t != item && t && ! set->eq(t, item)) { // probe for item
-        i = (i + 1) % size;
-        t = set->table[i];
-    }
-    
-    return t;
+    return (i != SIZE_MAX) ? set->table[i].item : NULL;
 }
 
 // iterates over set and returns the next item after previous, or NULL if no more items are available
@@ -200,21 +284,10 @@ void *BRSetIterate(const BRSet *set, const void *previous)
     assert(set != NULL);
     
     size_t i = 0, size = set->size;
-    void *t, *r = NULL;
-    
-    if (previous != NULL) {
-        i = set->hash(previous) % size;
-        t = set->table[i];
-        
-        while (t != previous && t && ! set->eq(t, previous)) { // probe for item
-            i = (i + 1) % size;
-            t = set->table[i];
-        }
-    
-        i++;
-    }
+    void *r = NULL;
     
-    while (! r && i < size) r = set->table[i++];
+    if (previous != NULL && _SetFind(set, previous, _SetHash(set, previous), &i) != SIZE_MAX) i++;
+    while (! r && i < size) r = set->table[i++].item;
     return r;
 }
 
@@ -229,7 +302,7 @@ size_t BRSetAll(const BRSet *set, void **allItems, size_t count)
     void *t;
     
     while (i < size && j < count) {
-        t = set->table[i++];
+        t = set->table[i++].item;
         if (t) allItems[j++] = t;
     }
     
@@ -246,7 +319,7 @@ void BRSetApply(const BRSet *set, void *info, void (*apply)(void *info, void *it
     void *t;
     
     while (i < size) {
-        t = set->table[i++];
+        t = set->table[i++].item;
         if (t) apply(info, t);
     }
 }
@@ -258,11 +331,11 @@ void BRSetUnion(BRSet *set, const BRSet *otherSet)
     assert(otherSet != NULL);
     
     size_t i = 0, size = otherSet->size;
-    void *t;
+    const _SetBucket *t;
     
     while (i < size) {
-        t = otherSet->table[i++];
-        if (t) BRSetAdd(set, t);
+        t = &otherSet->table[i++];
+        if (t->item) _SetAdd(set, t->item, (set->hash == otherSet->hash) ? t->hash : _SetHash(set, t->item));
     }
 }
 
@@ -273,11 +346,11 @@ void BRSetMinus(BRSet *set, const BRSet *otherSet)
     assert(otherSet != NULL);
 
     size_t i = 0, size = otherSet->size;
-    void *t;
+    const _SetBucket *t;
     
     while (i < size) {
-        t = otherSet->table[i++];
-        if (t) BRSetRemove(set, t);
+        t = &otherSet->table[i++];
+        if (t->item) _SetRemove(set, t->item, (set->hash == otherSet->hash) ? t->hash : _SetHash(set, t->item));
     }
 }
 
@@ -291,10 +364,10 @@ void BRSetIntersect(BRSet *set, const BRSet *otherSet)
     void *t;
     
     while (i < size) {
-        t = set->table[i];
+        t = set->table[i].item;
 
         if (t && !BRSetContains(otherSet, t)) {
-            BRSetRemove(set, t);
+            BRSetRemove(set, t); // the rest of the probe sequence shifts back into bucket i
         }
         else i++;
     }
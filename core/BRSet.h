@@ -26,6 +26,11 @@ typedef struct SetStruct BRSet;
 // capacity is the initial number of items the set can hold, which will be auto-increased as needed
 BRSet *BRSetNew(size_t (*hash)(const void *), int (*eq)(const void *, const void *), size_t capacity);
 
+// returns a newly allocated empty set of items that each start with a UInt256 key, such as a BRMerkleBlock or a
+// BRTransaction, items are hashed and compared by key without calling through function pointers
+// capacity is the initial number of items the set can hold, which will be auto-increased as needed
+BRSet *BRSetNewUInt256(size_t capacity);
+
 // adds given item to set or replaces an equivalent existing item and returns item replaced if any
 void *BRSetAdd(BRSet *set, void *item);
 
@@ -0,0 +1,50 @@
+//
+//  BRTestHooks.h
+//
+//  Copyright (c) 2018 ravencoin core team
+//
+
+#ifndef BRTestHooks_h
+#define BRTestHooks_h
+
+#include "BRPeerManager.h"
+#include "BRWallet.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// test hooks, not part of the public api: defined by the library for test.c, which is the only place to include this
+
+// verifies block as the next block after the chain tip and adds it to the chain, returns true if it was added
+int PeerManagerAddBlockTest(BRPeerManager *manager, BRPeer *peer, BRMerkleBlock *block);
+
+// relays blocks from peer, in reverse order, as if their hashes had been handed to it while splitting the chain sync
+// returns true if the blocks were reassembled into the chain
+int PeerManagerSyncWindowTest(BRPeerManager *manager, BRPeer *peer, BRMerkleBlock *blocks[], size_t count);
+
+// relays block from peer outside of a chain sync, returns the chain height afterwards
+uint32_t PeerManagerRelayBlockTest(BRPeerManager *manager, BRPeer *peer, BRMerkleBlock *block);
+
+// rewinds the chain as BRPeerManagerRescan() does while connected, returns the chain height afterwards
+uint32_t PeerManagerRescanTest(BRPeerManager *manager);
+
+// checks the restored main chain headers as the background verifier does, returns the chain height afterwards
+uint32_t PeerManagerVerifyTest(BRPeerManager *manager);
+
+// number of blocks added to the main chain plus headers visited rebuilding the difficulty window and pruning, and
+// header file records checked
+size_t PeerManagerWorkCountTest(BRPeerManager *manager);
+
+// hands msg to peer as if it had been received with the given type
+void PeerAcceptMessageTest(BRPeer *peer, const uint8_t *msg, size_t msgLen, const char *type);
+
+// number of transactions applied to or taken back from the balance and UTXO entries touched since the wallet was
+// created
+size_t WalletWorkCountTest(BRWallet *wallet);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BRTestHooks_h
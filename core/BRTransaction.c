@@ -79,7 +79,7 @@ void BRTxInputSetScript(BRTxInput *input, const uint8_t *script, size_t scriptLe
     }
 }
 
-void BRTxInputSetSignature(BRTxInput *input, const uint8_t *signature, size_t sigLen) {
+static void _BRTxInputSetSignature(BRTxInput *input, const uint8_t *signature, size_t sigLen, int setAddress) {
     assert(input != NULL);
     assert(signature != NULL || sigLen == 0);
     if (input->signature) array_free(input->signature);
@@ -90,10 +90,15 @@ void BRTxInputSetSignature(BRTxInput *input, const uint8_t *signature, size_t si
         input->sigLen = sigLen;
         array_new(input->signature, sigLen);
         array_add_array(input->signature, signature, sigLen);
-        if (!input->address[0]) BRAddressFromScriptSig(input->address, sizeof(input->address), signature, sigLen);
+        if (setAddress && !input->address[0])
+            BRAddressFromScriptSig(input->address, sizeof(input->address), signature, sigLen);
     }
 }
 
+void BRTxInputSetSignature(BRTxInput *input, const uint8_t *signature, size_t sigLen) {
+    _BRTxInputSetSignature(input, signature, sigLen, 1);
+}
+
 static size_t _TxInputData(const BRTxInput *input, uint8_t *data, size_t dataLen) {
     size_t off = 0;
 
@@ -133,7 +138,7 @@ void BRTxOutputSetAddress(BRTxOutput *output, const char *address) {
     }
 }
 
-void BRTxOutputSetScript(BRTxOutput *output, const uint8_t *script, size_t scriptLen) {
+static void _BRTxOutputSetScript(BRTxOutput *output, const uint8_t *script, size_t scriptLen, int setAddress) {
     assert(output != NULL);
     if (output->script) array_free(output->script);
     output->script = NULL;
@@ -144,10 +149,14 @@ void BRTxOutputSetScript(BRTxOutput *output, const uint8_t *script, size_t scrip
         output->scriptLen = scriptLen;
         array_new(output->script, scriptLen);
         array_add_array(output->script, script, scriptLen);
-        BRAddressFromScriptPubKey(output->address, sizeof(output->address), script, scriptLen);
+        if (setAddress) BRAddressFromScriptPubKey(output->address, sizeof(output->address), script, scriptLen);
     }
 }
 
+void BRTxOutputSetScript(BRTxOutput *output, const uint8_t *script, size_t scriptLen) {
+    _BRTxOutputSetScript(output, script, scriptLen, 1);
+}
+
 // serializes the tx output at index for a signature pre-image
 // an index of SIZE_MAX will serialize all tx outputs for SIGHASH_ALL signatures
 static size_t _TransactionOutputData(const BRTransaction *tx, uint8_t *data, size_t dataLen, size_t index) {
@@ -340,9 +349,7 @@ BRTransaction *BRTransactionCopy(const BRTransaction *tx) {
     return cpy;
 }
 
-// buf must contain a serialized tx
-// returns a transaction that must be freed by calling TransactionFree()
-BRTransaction *BRTransactionParse(const uint8_t *buf, size_t bufLen) {
+static BRTransaction *_BRTransactionParse(const uint8_t *buf, size_t bufLen, int setAddresses) {
     assert(buf != NULL || bufLen == 0);
     if (!buf) return NULL;
 
@@ -351,6 +358,7 @@ BRTransaction *BRTransactionParse(const uint8_t *buf, size_t bufLen) {
     BRTransaction *tx = BRTransactionNew(1);
     BRTxInput *input;
     BRTxOutput *output;
+    BRAddressID id;
 
     tx->version = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
     off += sizeof(uint32_t);
@@ -367,12 +375,12 @@ BRTransaction *BRTransactionParse(const uint8_t *buf, size_t bufLen) {
         sLen = (size_t) BRVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
         off += len;
 
-        if (off + sLen <= bufLen && BRAddressFromScriptPubKey(NULL, 0, &buf[off], sLen) > 0) {
+        if (off + sLen <= bufLen && BRAddressIDFromScriptPubKey(&id, &buf[off], sLen)) {
             BRTxInputSetScript(input, &buf[off], sLen);
             input->amount = (off + sLen + sizeof(uint64_t) <= bufLen) ? UInt64GetLE(&buf[off + sLen]) : 0;
             off += sizeof(uint64_t);
             isSigned = 0;
-        } else if (off + sLen <= bufLen) BRTxInputSetSignature(input, &buf[off], sLen);
+        } else if (off + sLen <= bufLen) _BRTxInputSetSignature(input, &buf[off], sLen, setAddresses);
 
         off += sLen;
         input->sequence = (off + sizeof(uint32_t) <= bufLen) ? UInt32GetLE(&buf[off]) : 0;
@@ -389,7 +397,7 @@ BRTransaction *BRTransactionParse(const uint8_t *buf, size_t bufLen) {
         off += sizeof(uint64_t);
         sLen = (size_t) BRVarInt(&buf[off], (off <= bufLen ? bufLen - off : 0), &len);
         off += len;
-        if (off + sLen <= bufLen) BRTxOutputSetScript(output, &buf[off], sLen);
+        if (off + sLen <= bufLen) _BRTxOutputSetScript(output, &buf[off], sLen, setAddresses);
         off += sLen;
 
         // Get assets output count if assets are activated and if there is any!
@@ -426,6 +434,43 @@ BRTransaction *BRTransactionParse(const uint8_t *buf, size_t bufLen) {
     return tx;
 }
 
+// buf must contain a serialized tx
+// returns a transaction that must be freed by calling TransactionFree()
+BRTransaction *BRTransactionParse(const uint8_t *buf, size_t bufLen) {
+    return _BRTransactionParse(buf, bufLen, 1);
+}
+
+// like BRTransactionParse(), but input and output addresses are left empty until BRTransactionSetAddresses() is
+// called, saving a base58check encode per input and output for transactions that end up being discarded
+BRTransaction *BRTransactionParseLazy(const uint8_t *buf, size_t bufLen) {
+    return _BRTransactionParse(buf, bufLen, 0);
+}
+
+// sets the address of any input or output that has a script or signature but no address yet, such as those of a tx
+// from BRTransactionParseLazy()
+void BRTransactionSetAddresses(BRTransaction *tx) {
+    assert(tx != NULL);
+
+    for (size_t i = 0; tx && i < tx->inCount; i++) {
+        if (tx->inputs[i].address[0] != '\0') continue;
+
+        if (tx->inputs[i].script) {
+            BRAddressFromScriptPubKey(tx->inputs[i].address, sizeof(tx->inputs[i].address), tx->inputs[i].script,
+                                      tx->inputs[i].scriptLen);
+        }
+        else if (tx->inputs[i].signature) {
+            BRAddressFromScriptSig(tx->inputs[i].address, sizeof(tx->inputs[i].address), tx->inputs[i].signature,
+                                   tx->inputs[i].sigLen);
+        }
+    }
+
+    for (size_t i = 0; tx && i < tx->outCount; i++) {
+        if (tx->outputs[i].address[0] != '\0' || !tx->outputs[i].script) continue;
+        BRAddressFromScriptPubKey(tx->outputs[i].address, sizeof(tx->outputs[i].address), tx->outputs[i].script,
+                                  tx->outputs[i].scriptLen);
+    }
+}
+
 // returns number of bytes written to buf, or total bufLen needed if buf is NULL
 // (tx->blockHeight and tx->timestamp are not serialized)
 size_t BRTransactionSerialize(const BRTransaction *tx, uint8_t *buf, size_t bufLen) {
@@ -527,7 +572,7 @@ int BRTransactionIsSigned(const BRTransaction *tx) {
 // returns true if tx is signed
 int BRTransactionSign(BRTransaction *tx, BRKey *keys, size_t keysCount) {
     BRAddress addrs[keysCount], address;
-    size_t i, j;
+    size_t i, j, first = SIZE_MAX, last = 0;
 
     assert(tx != NULL);
     assert(keys != NULL || keysCount == 0);
@@ -536,47 +581,41 @@ int BRTransactionSign(BRTransaction *tx, BRKey *keys, size_t keysCount) {
         if (!BRKeyAddress(&keys[i], addrs[i].s, sizeof(addrs[i]))) addrs[i] = ADDRESS_NONE;
     }
 
-    for (i = 0; tx && i < tx->inCount; i++) {
+    size_t _keyIdxs[(tx->inCount <= 0x1000 / sizeof(size_t)) ? tx->inCount : 0],
+           *keyIdxs = (tx->inCount <= 0x1000 / sizeof(size_t)) ? _keyIdxs : malloc(tx->inCount * sizeof(size_t));
+
+    assert(keyIdxs != NULL);
+
+    for (i = 0; tx && i < tx->inCount; i++) { // match each input with the key that can sign it
         BRTxInput *input = &tx->inputs[i];
 
+        keyIdxs[i] = keysCount;
         if (!BRAddressFromScriptPubKey(address.s, sizeof(address), input->script, input->scriptLen)) continue;
         j = 0;
         while (j < keysCount && !BRAddressEq(&addrs[j], &address)) j++;
+        keyIdxs[i] = j;
         if (j >= keysCount) continue;
+        if (first == SIZE_MAX) first = i;
+        last = i;
+    }
 
-        const uint8_t *elems[BRScriptElements(NULL, 0, input->script, input->scriptLen)];
-        size_t elemsCount = BRScriptElements(elems, sizeof(elems) / sizeof(*elems), input->script, input->scriptLen);
-        uint8_t pubKey[BRKeyPubKey(&keys[j], NULL, 0)];
-        size_t pkLen = BRKeyPubKey(&keys[j], pubKey, sizeof(pubKey));
-        uint8_t sig[73], script[1 + sizeof(sig) + 1 + sizeof(pubKey)];
-        size_t sigLen, scriptLen;
-        UInt256 md = UINT256_ZERO;
+    if (first != SIZE_MAX) { // hash only the range of inputs that will be signed
+        size_t count = last + 1 - first;
+        UInt256 _mds[(count <= 0x1000 / sizeof(UInt256)) ? count : 0],
+                *mds = (count <= 0x1000 / sizeof(UInt256)) ? _mds : malloc(count * sizeof(UInt256));
 
-#warning TODO: OP_EQUALVERIFY condition doesn't trigger for assets input
-        if (elemsCount >= 2 && (*elems[elemsCount - 2] == OP_EQUALVERIFY || *elems[elemsCount - 5] == OP_EQUALVERIFY)) { // pay-to-pubkey-hash
-            //        if (elemsCount >= 2 /*&& *elems[elemsCount - 2] == OP_EQUALVERIFY*/) { // pay-to-pubkey-hash
-            uint8_t data[_TransactionData(tx, NULL, 0, i, 0 | SIGHASH_ALL)];
-            size_t dataLen = _TransactionData(tx, data, sizeof(data), i, 0 | SIGHASH_ALL);
-
-            SHA256_2(&md, data, dataLen);
-            sigLen = BRKeySign(&keys[j], sig, sizeof(sig) - 1, md);
-            sig[sigLen++] = 0 | SIGHASH_ALL;
-            scriptLen = BRScriptPushData(script, sizeof(script), sig, sigLen);
-            scriptLen += BRScriptPushData(&script[scriptLen], sizeof(script) - scriptLen, pubKey, pkLen);
-            BRTxInputSetSignature(input, script, scriptLen);
-
-        } else { // pay-to-pubkey
-            uint8_t data[_TransactionData(tx, NULL, 0, i, 0 | SIGHASH_ALL)];
-            size_t dataLen = _TransactionData(tx, data, sizeof(data), i, 0 | SIGHASH_ALL);
-
-            SHA256_2(&md, data, dataLen);
-            sigLen = BRKeySign(&keys[j], sig, sizeof(sig) - 1, md);
-            sig[sigLen++] = 0 | SIGHASH_ALL;
-            scriptLen = BRScriptPushData(script, sizeof(script), sig, sigLen);
-            BRTxInputSetSignature(input, script, scriptLen);
+        assert(mds != NULL);
+        BRTransactionSigHashes(mds, tx, first, last + 1);
+
+        for (i = first; i <= last; i++) {
+            if (keyIdxs[i] < keysCount) BRTransactionSignInput(tx, i, &keys[keyIdxs[i]], mds[i - first]);
         }
+
+        if (mds != _mds) free(mds);
     }
 
+    if (keyIdxs != _keyIdxs) free(keyIdxs);
+
     if (tx && BRTransactionIsSigned(tx)) {
         uint8_t data[_TransactionData(tx, NULL, 0, SIZE_MAX, 0)];
         size_t len = _TransactionData(tx, data, sizeof(data), SIZE_MAX, 0);
@@ -587,6 +626,87 @@ int BRTransactionSign(BRTransaction *tx, BRKey *keys, size_t keysCount) {
         return 0;
 }
 
+// writes the SIGHASH_ALL signature hashes for the inputs of tx from start up to end to mds[0] through
+// mds[end - start - 1], the pre-image is serialized once and the sha256 midstate of the shared prefix carried from
+// input to input, so disjoint ranges of the same tx can be hashed on separate threads
+void BRTransactionSigHashes(UInt256 *mds, const BRTransaction *tx, size_t start, size_t end) {
+    BRSHA256Context prefix, ctx;
+    BRTxInput input;
+    size_t i, off, inLen, dataLen;
+    uint8_t t[32];
+
+    assert(tx != NULL);
+    assert(mds != NULL || start >= end);
+    assert(end <= tx->inCount);
+    if (start >= end) return;
+
+    // apart from the input being signed every input is serialized with an empty script, so one pre-image with all
+    // scripts empty is shared by every input, and only the signed input is spliced in while hashing
+    dataLen = _TransactionData(tx, NULL, 0, tx->inCount, SIGHASH_ALL);
+
+    uint8_t _data[(dataLen <= 0x1000) ? dataLen : 0], *data = (dataLen <= 0x1000) ? _data : malloc(dataLen);
+
+    assert(data != NULL);
+    dataLen = _TransactionData(tx, data, dataLen, tx->inCount, SIGHASH_ALL);
+    memset(&input, 0, sizeof(input));
+    inLen = _TxInputData(&input, NULL, 0);
+    off = sizeof(uint32_t) + BRVarIntSize(tx->inCount) + inLen * start;
+    SHA256Init(&prefix);
+    SHA256Update(&prefix, data, off);
+
+    for (i = start; i < end; i++) {
+        input = tx->inputs[i];
+        input.signature = input.script; // TODO: handle OP_CODESEPARATOR
+        input.sigLen = input.scriptLen;
+        input.amount = 0;
+
+        uint8_t buf[_TxInputData(&input, NULL, 0)];
+
+        ctx = prefix;
+        SHA256Update(&ctx, buf, _TxInputData(&input, buf, sizeof(buf)));
+        SHA256Update(&ctx, &data[off + inLen], dataLen - (off + inLen));
+        SHA256Final(&ctx, t);
+        SHA256(&mds[i - start], t, sizeof(t));
+        SHA256Update(&prefix, &data[off], inLen); // the midstate for the next input includes this one with no script
+        off += inLen;
+    }
+
+    if (data != _data) free(data);
+}
+
+// signs the input at index with key, given its signature hash md from BRTransactionSigHashes()
+// returns true on success
+int BRTransactionSignInput(BRTransaction *tx, size_t index, BRKey *key, UInt256 md) {
+    BRTxInput *input;
+
+    assert(tx != NULL);
+    assert(index < tx->inCount);
+    assert(key != NULL);
+
+    input = &tx->inputs[index];
+
+    const uint8_t *elems[BRScriptElements(NULL, 0, input->script, input->scriptLen)];
+    size_t elemsCount = BRScriptElements(elems, sizeof(elems) / sizeof(*elems), input->script, input->scriptLen);
+    uint8_t pubKey[BRKeyPubKey(key, NULL, 0)];
+    size_t pkLen = BRKeyPubKey(key, pubKey, sizeof(pubKey));
+    uint8_t sig[73], script[1 + sizeof(sig) + 1 + sizeof(pubKey)];
+    size_t sigLen, scriptLen;
+
+    sigLen = BRKeySign(key, sig, sizeof(sig) - 1, md);
+    if (sigLen == 0) return 0;
+    sig[sigLen++] = 0 | SIGHASH_ALL;
+    scriptLen = BRScriptPushData(script, sizeof(script), sig, sigLen);
+
+#warning TODO: OP_EQUALVERIFY condition doesn't trigger for assets input
+    if (elemsCount >= 2 && (*elems[elemsCount - 2] == OP_EQUALVERIFY || *elems[elemsCount - 5] == OP_EQUALVERIFY)) { // pay-to-pubkey-hash
+        //        if (elemsCount >= 2 /*&& *elems[elemsCount - 2] == OP_EQUALVERIFY*/) { // pay-to-pubkey-hash
+        scriptLen += BRScriptPushData(&script[scriptLen], sizeof(script) - scriptLen, pubKey, pkLen);
+    } // else pay-to-pubkey
+
+    BRTxInputSetSignature(input, script, scriptLen);
+    return 1;
+}
+
 // true if tx meets IsStandard() rules: https://bitcoin.org/en/developer-guide#standard-transactions
 int BRTransactionIsStandard(const BRTransaction *tx) {
     int r = 1;
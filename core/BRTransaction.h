@@ -128,6 +128,14 @@ extern "C" {
     // retuns a transaction that must be freed by calling TransactionFree()
     BRTransaction *BRTransactionParse(const uint8_t *buf, size_t bufLen);
 
+    // like BRTransactionParse(), but input and output addresses are left empty until BRTransactionSetAddresses() is
+    // called, saving a base58check encode per input and output for transactions that end up being discarded
+    BRTransaction *BRTransactionParseLazy(const uint8_t *buf, size_t bufLen);
+
+    // sets the address of any input or output that has a script or signature but no address yet, such as those of a tx
+    // from BRTransactionParseLazy()
+    void BRTransactionSetAddresses(BRTransaction *tx);
+
     // returns number of bytes written to buf, or total bufLen needed if buf is NULL
     // (tx->blockHeight and tx->timestamp are not serialized)
     size_t BRTransactionSerialize(const BRTransaction *tx, uint8_t *buf, size_t bufLen);
@@ -157,6 +165,15 @@ extern "C" {
     // returns true if tx is signed
     int BRTransactionSign(BRTransaction *tx, BRKey *keys, size_t keysCount);
 
+    // writes the SIGHASH_ALL signature hashes for the inputs of tx from start up to end to mds[0] through
+    // mds[end - start - 1], the pre-image is serialized once and the sha256 midstate of the shared prefix carried from
+    // input to input, so disjoint ranges of the same tx can be hashed on separate threads
+    void BRTransactionSigHashes(UInt256 *mds, const BRTransaction *tx, size_t start, size_t end);
+
+    // signs the input at index with key, given its signature hash md from BRTransactionSigHashes()
+    // returns true on success
+    int BRTransactionSignInput(BRTransaction *tx, size_t index, BRKey *key, UInt256 md);
+
     // true if tx meets IsStandard() rules: https://bitcoin.org/en/developer-guide#standard-transactions
     int BRTransactionIsStandard(const BRTransaction *tx);
 
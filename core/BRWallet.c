@@ -10,6 +10,7 @@
 #include "BRWallet.h"
 #include "BRAddress.h"
 #include "BRArray.h"
+#include "BRParallel.h"
 #include <stdlib.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -18,14 +19,39 @@
 #include "BRAssets.h"
 #include "BRScript.h"
 
+#define WALLET_SIGN_MIN_BATCH 16 // minimum inputs per signing thread
+
+typedef struct {
+    UTXO utxo; // first, so that entries hash and compare as the UTXO itself
+    size_t seq; // order utxo was added in, wallet->utxoSeqs holds the seq of each of wallet->utxos
+} _UTXOIndex;
+
+// the steps _BRWalletApplyTx() takes, logged so that _BRWalletRevertTx() can take them back in reverse
+enum {
+    UNDO_SPENT_OUTPUT, UNDO_INVALID_TX, UNDO_PENDING_TX, UNDO_USED_ADDR, UNDO_ADD_UTXO, UNDO_SPEND_UTXO
+};
+
+typedef struct {
+    int op;
+    const void *item; // the input added to spentOutputs, or the tx added to invalidTx or pendingTx
+    _UTXOIndex *entry; // the utxo added or spent, a spent entry is owned by the log until it's put back
+    size_t idx; // position the spent utxo had in wallet->utxos
+} _BRWalletUndo;
+
 struct BRWalletStructure {
     uint64_t balance, totalSent, totalReceived, feePerKb, *balanceHist;
+    size_t signThreads, workCount; // workCount is the number of txs applied or reverted and UTXOs touched, for tests
+    size_t utxoSeq, *utxoSeqs, *undoHist; // undoHist is the length of undoLog before each tx in balanceHist
+    size_t firstPending; // lowest position of a pending or invalid tx in balanceHist, SIZE_MAX if there are none
     uint32_t blockHeight;
     UTXO *utxos;
+    _BRWalletUndo *undoLog;
     BRTransaction **transactions;
     BRMasterPubKey masterPubKey;
+    BRChainPubKey internalChainKey, externalChainKey; // N(m/0H/1) and N(m/0H/0), derived once in WalletNew()
     BRAddress *internalChain, *externalChain;
-    BRSet *allTx, *invalidTx, *pendingTx, *spentOutputs, *usedAddrs, *allAddrs;
+    BRAddressID *internalIDs, *externalIDs, *usedIDs; // allAddrs and usedAddrs point into these
+    BRSet *allTx, *invalidTx, *pendingTx, *spentOutputs, *usedAddrs, *allAddrs, *utxoIndex; // utxoIndex maps utxos
     void *callbackInfo;
 
     void (*balanceChanged)(void *info, uint64_t balance);
@@ -49,17 +75,42 @@ inline static uint64_t _txFee(uint64_t feePerKb, size_t size) {
 }
 
 // chain position of first tx output address that appears in chain
-inline static size_t _txChainIndex(const BRTransaction *tx, const BRAddress *addrChain) {
-    for (size_t i = array_count(addrChain); i > 0; i--) {
-        for (size_t j = 0; j < tx->outCount; j++) {
-            if (BRAddressEq(tx->outputs[j].address, &addrChain[i - 1])) return i - 1;
+inline static size_t _txChainIndex(const BRTransaction *tx, const BRAddressID *idChain) {
+    BRAddressID id;
+    size_t i, r = SIZE_MAX;
+
+    for (size_t j = 0; j < tx->outCount; j++) {
+        if (!BRAddressIDFromScriptPubKey(&id, tx->outputs[j].script, tx->outputs[j].scriptLen)) continue;
+
+        // only chain positions past the best one found so far need checking
+        for (i = array_count(idChain); i > 0 && (r == SIZE_MAX || i - 1 > r); i--) {
+            if (!BRAddressIDEq(&id, &idChain[i - 1])) continue;
+            r = i - 1;
+            break;
         }
     }
 
-    return SIZE_MAX;
+    return r;
 }
 
-inline static int _BRWalletTxIsAscending(BRWallet *wallet, const BRTransaction *tx1, const BRTransaction *tx2) {
+// positions in the internal and external address chains of the highest tx output address that appears in each
+typedef struct {
+    size_t internal, external;
+} BRTxChainIndex;
+
+#define TX_CHAIN_INDEX_NONE ((const BRTxChainIndex) { SIZE_MAX - 1, SIZE_MAX - 1 }) // not looked up yet
+
+inline static const BRTxChainIndex *_txChainIndexes(BRWallet *wallet, const BRTransaction *tx, BRTxChainIndex *idx) {
+    if (idx->internal == SIZE_MAX - 1) idx->internal = _txChainIndex(tx, wallet->internalIDs);
+    if (idx->external == SIZE_MAX - 1) idx->external = _txChainIndex(tx, wallet->externalIDs);
+    return idx;
+}
+
+// visited holds ancestors of the original tx1 already known not to be ascending from tx2, and is created on first use
+static int _BRWalletTxIsAscendingFrom(BRWallet *wallet, const BRTransaction *tx1, const BRTransaction *tx2,
+                                      BRSet **visited) {
+    BRTransaction *t;
+
     if (!tx1 || !tx2) return 0;
     if (tx1->blockHeight > tx2->blockHeight) return 1;
     if (tx1->blockHeight < tx2->blockHeight) return 0;
@@ -72,37 +123,150 @@ inline static int _BRWalletTxIsAscending(BRWallet *wallet, const BRTransaction *
         if (UInt256Eq(tx2->inputs[i].txHash, tx1->txHash)) return 0;
     }
 
+    // without the visited set, a tx with several inputs from the same ancestors would be walked once per path
     for (size_t i = 0; i < tx1->inCount; i++) {
-        if (_BRWalletTxIsAscending(wallet, BRSetGet(wallet->allTx, &(tx1->inputs[i].txHash)), tx2)) return 1;
+        t = BRSetGet(wallet->allTx, &(tx1->inputs[i].txHash));
+        if (!t) continue;
+        if (!*visited) *visited = BRSetNewUInt256(10);
+        if (BRSetContains(*visited, t)) continue;
+        BRSetAdd(*visited, t);
+        if (_BRWalletTxIsAscendingFrom(wallet, t, tx2, visited)) return 1;
     }
 
     return 0;
 }
 
-inline static int _BRWalletTxCompare(BRWallet *wallet, const BRTransaction *tx1, const BRTransaction *tx2) {
+inline static int _BRWalletTxIsAscending(BRWallet *wallet, const BRTransaction *tx1, const BRTransaction *tx2) {
+    BRSet *visited = NULL;
+    int r = _BRWalletTxIsAscendingFrom(wallet, tx1, tx2, &visited);
+
+    if (visited) BRSetFree(visited);
+    return r;
+}
+
+// idx1 and idx2 cache the chain positions of tx1 and tx2 across calls, start them out as TX_CHAIN_INDEX_NONE
+inline static int _BRWalletTxCompare(BRWallet *wallet, const BRTransaction *tx1, BRTxChainIndex *idx1,
+                                     const BRTransaction *tx2, BRTxChainIndex *idx2) {
     size_t i, j;
 
+    // ordering by height doesn't need the ancestry walk
+    if (tx1 && tx2 && tx1->blockHeight != tx2->blockHeight) return (tx1->blockHeight > tx2->blockHeight) ? 1 : -1;
     if (_BRWalletTxIsAscending(wallet, tx1, tx2)) return 1;
     if (_BRWalletTxIsAscending(wallet, tx2, tx1)) return -1;
-    i = _txChainIndex(tx1, wallet->internalChain);
-    j = _txChainIndex(tx2, (i == SIZE_MAX) ? wallet->externalChain : wallet->internalChain);
-    if (i == SIZE_MAX && j != SIZE_MAX) i = _txChainIndex((BRTransaction *) tx1, wallet->externalChain);
+    i = _txChainIndexes(wallet, tx1, idx1)->internal;
+    j = (i == SIZE_MAX) ? _txChainIndexes(wallet, tx2, idx2)->external : _txChainIndexes(wallet, tx2, idx2)->internal;
+    if (i == SIZE_MAX && j != SIZE_MAX) i = idx1->external;
     if (i != SIZE_MAX && j != SIZE_MAX && i != j) return (i > j) ? 1 : -1;
     return 0;
 }
 
 // inserts tx into wallet->transactions, keeping wallet->transactions sorted by date, oldest first (insertion sort)
-inline static void _BRWalletInsertTx(BRWallet *wallet, BRTransaction *tx) {
+// returns the position tx was inserted at
+inline static size_t _BRWalletInsertTx(BRWallet *wallet, BRTransaction *tx) {
     size_t i = array_count(wallet->transactions);
+    BRTxChainIndex idx = TX_CHAIN_INDEX_NONE, prevIdx = TX_CHAIN_INDEX_NONE;
 
     array_set_count(wallet->transactions, i + 1);
 
-    while (i > 0 && _BRWalletTxCompare(wallet, wallet->transactions[i - 1], tx) > 0) {
+    while (i > 0 && _BRWalletTxCompare(wallet, wallet->transactions[i - 1], &prevIdx, tx, &idx) > 0) {
         wallet->transactions[i] = wallet->transactions[i - 1];
+        prevIdx = TX_CHAIN_INDEX_NONE;
         i--;
     }
 
     wallet->transactions[i] = tx;
+    return i;
+}
+
+// stable merge sort of txs by block height, using tmp as scratch space
+static void _BRWalletSortTxByHeight(BRTransaction **txs, BRTransaction **tmp, size_t count) {
+    size_t i, j, k, half = count/2;
+
+    if (count < 2) return;
+    _BRWalletSortTxByHeight(txs, tmp, half);
+    _BRWalletSortTxByHeight(&txs[half], tmp, count - half);
+    if (txs[half - 1]->blockHeight <= txs[half]->blockHeight) return; // already in order
+    memcpy(tmp, txs, half*sizeof(*txs));
+
+    for (i = 0, j = half, k = 0; i < half; k++) {
+        txs[k] = (j < count && txs[j]->blockHeight < tmp[i]->blockHeight) ? txs[j++] : tmp[i++];
+    }
+}
+
+// sorts wallet->transactions the same as inserting each tx in turn with _BRWalletInsertTx(), but only runs the
+// insertion sort within each group of transactions at the same block height
+static void _BRWalletSortTransactions(BRWallet *wallet) {
+    size_t i, j, k, start, count = array_count(wallet->transactions);
+    BRTransaction **txs = wallet->transactions, *tx, **tmp = malloc((count/2 + 1)*sizeof(*tmp));
+    BRTxChainIndex *idx = malloc((count + 1)*sizeof(*idx)), txIdx;
+
+    assert(tmp != NULL);
+    assert(idx != NULL);
+    _BRWalletSortTxByHeight(txs, tmp, count);
+
+    for (start = 0; start < count; start = j) {
+        for (j = start + 1; j < count && txs[j]->blockHeight == txs[start]->blockHeight; j++);
+
+        for (k = start; k < j; k++) idx[k] = TX_CHAIN_INDEX_NONE;
+
+        for (k = start + 1; k < j; k++) {
+            tx = txs[k];
+            txIdx = idx[k];
+
+            for (i = k; i > start && _BRWalletTxCompare(wallet, txs[i - 1], &idx[i - 1], tx, &txIdx) > 0; i--) {
+                txs[i] = txs[i - 1];
+                idx[i] = idx[i - 1];
+            }
+
+            txs[i] = tx;
+            idx[i] = txIdx;
+        }
+    }
+
+    free(idx);
+    free(tmp);
+}
+
+// true if the output pays to an address previously generated by WalletUnusedAddrs()
+static int _BRWalletContainsOutput(BRWallet *wallet, const BRTxOutput *output) {
+    BRAddressID id;
+
+    return (BRAddressIDFromScriptPubKey(&id, output->script, output->scriptLen) &&
+            BRSetContains(wallet->allAddrs, &id));
+}
+
+// looks up the chain and index an address was generated at by WalletUnusedAddrs(), returns false if it wasn't
+// allAddrs points into internalIDs and externalIDs, so the position of the matching element is the index in its chain
+static int _BRWalletAddrChainIndex(BRWallet *wallet, const BRAddressID *id, uint32_t *chain, uint32_t *index) {
+    const BRAddressID *p = BRSetGet(wallet->allAddrs, id);
+
+    if (!p) return 0;
+
+    if (p >= wallet->internalIDs && p < wallet->internalIDs + array_count(wallet->internalIDs)) {
+        *chain = SEQUENCE_INTERNAL_CHAIN, *index = (uint32_t) (p - wallet->internalIDs);
+    } else *chain = SEQUENCE_EXTERNAL_CHAIN, *index = (uint32_t) (p - wallet->externalIDs);
+
+    return 1;
+}
+
+// adds a copy of id to wallet->usedAddrs, returns false if it was already there
+static int _BRWalletAddUsedAddr(BRWallet *wallet, const BRAddressID *id) {
+    BRAddressID *usedIDs = wallet->usedIDs;
+    size_t i;
+
+    if (BRSetContains(wallet->usedAddrs, id)) return 0;
+    array_add(wallet->usedIDs, *id);
+
+    if (wallet->usedIDs != usedIDs) { // usedIDs was moved to a new memory location, so rebuild usedAddrs
+        BRSetClear(wallet->usedAddrs);
+
+        for (i = array_count(wallet->usedIDs); i > 0; i--) {
+            BRSetAdd(wallet->usedAddrs, &wallet->usedIDs[i - 1]);
+        }
+    }
+    else BRSetAdd(wallet->usedAddrs, &wallet->usedIDs[array_count(wallet->usedIDs) - 1]);
+
+    return 1;
 }
 
 // non-threadsafe version of WalletContainsTransaction()
@@ -110,154 +274,326 @@ static int _BRWalletContainsTx(BRWallet *wallet, const BRTransaction *tx) {
     int r = 0;
 
     for (size_t i = 0; !r && i < tx->outCount; i++) {
-        if (BRSetContains(wallet->allAddrs, tx->outputs[i].address)) r = 1;
+        if (_BRWalletContainsOutput(wallet, &tx->outputs[i])) r = 1;
     }
 
     for (size_t i = 0; !r && i < tx->inCount; i++) {
         BRTransaction *t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
         uint32_t n = tx->inputs[i].index;
 
-        if (t && n < t->outCount && BRSetContains(wallet->allAddrs, t->outputs[n].address)) r = 1;
+        if (t && n < t->outCount && _BRWalletContainsOutput(wallet, &t->outputs[n])) r = 1;
     }
 
     return r;
 }
 
-static void _BRWalletUpdateBalance(BRWallet *wallet) {
-    int isInvalid, isPending;
-    uint64_t balance = 0, prevBalance = 0;
-    time_t now = time(NULL);
-    size_t i, j;
-    BRTransaction *tx, *t;
+static void _setApplyFree(void *info, void *entry) {
+    free(entry);
+}
+
+inline static void _BRWalletLogUndo(BRWallet *wallet, int op, const void *item, _UTXOIndex *entry, size_t idx) {
+    array_add(wallet->undoLog, ((const _BRWalletUndo) { op, item, entry, idx }));
+}
+
+// appends the given output to wallet->utxos and indexes it by outpoint
+static void _BRWalletAddUTXO(BRWallet *wallet, UTXO utxo) {
+    _UTXOIndex *entry = malloc(sizeof(*entry));
+
+    assert(entry != NULL);
+    entry->utxo = utxo;
+    entry->seq = wallet->utxoSeq++;
+    array_add(wallet->utxos, utxo);
+    array_add(wallet->utxoSeqs, entry->seq);
+    BRSetAdd(wallet->utxoIndex, entry);
+    _BRWalletLogUndo(wallet, UNDO_ADD_UTXO, NULL, entry, 0);
+    wallet->workCount++;
+}
+
+// removes the given output from wallet->utxos if it's there, and returns the amount deducted from the balance
+// the remaining utxos stay in the order they were added, which is the order transaction inputs are selected in
+static uint64_t _BRWalletSpendUTXO(BRWallet *wallet, const BRTxInput *input) {
+    BRTransaction *t = BRSetGet(wallet->allTx, &input->txHash);
+    _UTXOIndex *entry;
+    size_t i = 0, j = array_count(wallet->utxoSeqs), k;
+
+    entry = (t && input->index < t->outCount) ?
+            BRSetGet(wallet->utxoIndex, &((const UTXO) { input->txHash, input->index })) : NULL;
+    wallet->workCount++;
+    if (!entry) return 0;
+
+    while (i < j) { // utxoSeqs only ever grows at the end, so it's sorted
+        k = i + (j - i)/2;
+        if (wallet->utxoSeqs[k] < entry->seq) i = k + 1;
+        else j = k;
+    }
+
+    assert(i < array_count(wallet->utxoSeqs) && wallet->utxoSeqs[i] == entry->seq);
+    array_rm(wallet->utxos, i);
+    array_rm(wallet->utxoSeqs, i);
+    BRSetRemove(wallet->utxoIndex, entry);
+    _BRWalletLogUndo(wallet, UNDO_SPEND_UTXO, NULL, entry, i);
+    return t->outputs[input->index].amount;
+}
 
+// empties wallet->utxos and its index
+static void _BRWalletClearUTXOs(BRWallet *wallet) {
+    BRSetApply(wallet->utxoIndex, NULL, _setApplyFree);
+    BRSetClear(wallet->utxoIndex);
     array_clear(wallet->utxos);
-    array_clear(wallet->balanceHist);
-    BRSetClear(wallet->spentOutputs);
-    BRSetClear(wallet->invalidTx);
-    BRSetClear(wallet->pendingTx);
-    BRSetClear(wallet->usedAddrs);
-    wallet->totalSent = 0;
-    wallet->totalReceived = 0;
+    array_clear(wallet->utxoSeqs);
+}
+
+// empties wallet->undoLog, freeing the spent utxos it holds
+static void _BRWalletClearUndoLog(BRWallet *wallet) {
+    for (size_t i = array_count(wallet->undoLog); i > 0; i--) {
+        if (wallet->undoLog[i - 1].op == UNDO_SPEND_UTXO) free(wallet->undoLog[i - 1].entry);
+    }
 
-    for (i = 0; i < array_count(wallet->transactions); i++) {
-        tx = wallet->transactions[i];
+    array_clear(wallet->undoLog);
+    array_clear(wallet->undoHist);
+}
 
-        // check if any inputs are invalid or already spent
-        if (tx->blockHeight == TX_UNCONFIRMED) {
-            for (j = 0, isInvalid = 0; !isInvalid && j < tx->inCount; j++) {
-                if (BRSetContains(wallet->spentOutputs, &tx->inputs[j]) ||
-                    BRSetContains(wallet->invalidTx, &tx->inputs[j].txHash))
-                        isInvalid = 1;
-            }
+// applies wallet->transactions[idx] on top of the balance, UTXO and spent output state left by the transactions
+// before it, and appends the resulting balance to wallet->balanceHist and the steps taken to wallet->undoLog
+static void _BRWalletApplyTx(BRWallet *wallet, size_t idx, time_t now) {
+    BRTransaction *tx = wallet->transactions[idx], *t;
+    BRAddressID id;
+    uint64_t balance = wallet->balance, prevBalance = wallet->balance;
+    int isInvalid = 0, isPending = 0;
+    size_t i, j;
 
-            if (isInvalid) {
-                BRSetAdd(wallet->invalidTx, tx);
-                array_add(wallet->balanceHist, balance);
-                continue;
-            }
+    assert(array_count(wallet->balanceHist) == idx);
+    array_add(wallet->undoHist, array_count(wallet->undoLog));
+    wallet->workCount++;
+
+    // check if any inputs are invalid or already spent
+    if (tx->blockHeight == TX_UNCONFIRMED) {
+        for (j = 0; !isInvalid && j < tx->inCount; j++) {
+            if (BRSetContains(wallet->spentOutputs, &tx->inputs[j]) ||
+                BRSetContains(wallet->invalidTx, &tx->inputs[j].txHash))
+                    isInvalid = 1;
         }
 
-        // add inputs to spent output set
-        for (j = 0; j < tx->inCount; j++) {
-            BRSetAdd(wallet->spentOutputs, &tx->inputs[j]);
+        if (isInvalid) {
+            BRSetAdd(wallet->invalidTx, tx);
+            _BRWalletLogUndo(wallet, UNDO_INVALID_TX, tx, NULL, 0);
+            if (idx < wallet->firstPending) wallet->firstPending = idx;
+            array_add(wallet->balanceHist, balance);
+            return;
         }
+    }
 
-        // check if tx is pending
-        if (tx->blockHeight == TX_UNCONFIRMED) {
-            isPending = (BRTransactionSize(tx) > TX_MAX_SIZE) ? 1 : 0; // check tx size is under TX_MAX_SIZE
-
-            //TODO: Remove dust but without affecting assets
-//            for (j = 0; !isPending && j < tx->outCount; j++) {
-//                if (tx->outputs[j].amount < TX_MIN_OUTPUT_AMOUNT) isPending = 1; // check that no outputs are dust
-//            }
-
-            for (j = 0; !isPending && j < tx->inCount; j++) {
-                // Replace by fee removed.
-//                if (tx->inputs[j].sequence < UINT32_MAX - 1) isPending = 1; // check for replace-by-fee
-                if (/*tx->inputs[j].sequence < UINT32_MAX &&*/
-                    tx->lockTime < TX_MAX_LOCK_HEIGHT &&
-                    tx->lockTime > wallet->blockHeight - 180)
-                            isPending = 1; // future lockTime
-                if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime > now) isPending = 1; // future lockTime
-                if (BRSetContains(wallet->pendingTx, &tx->inputs[j].txHash)) isPending = 1; // check for pending inputs
-                 // TODO: XXX handle BIP68 check lock time verify rules
-            }
+    // add inputs to spent output set
+    for (j = 0; j < tx->inCount; j++) {
+        if (BRSetContains(wallet->spentOutputs, &tx->inputs[j])) continue;
+        BRSetAdd(wallet->spentOutputs, &tx->inputs[j]);
+        _BRWalletLogUndo(wallet, UNDO_SPENT_OUTPUT, &tx->inputs[j], NULL, 0);
+    }
 
-            if (isPending) {
-                BRSetAdd(wallet->pendingTx, tx);
-                array_add(wallet->balanceHist, balance);
-                continue;
-            }
+    // check if tx is pending
+    if (tx->blockHeight == TX_UNCONFIRMED) {
+        isPending = (BRTransactionSize(tx) > TX_MAX_SIZE) ? 1 : 0; // check tx size is under TX_MAX_SIZE
+
+        //TODO: Remove dust but without affecting assets
+//        for (j = 0; !isPending && j < tx->outCount; j++) {
+//            if (tx->outputs[j].amount < TX_MIN_OUTPUT_AMOUNT) isPending = 1; // check that no outputs are dust
+//        }
+
+        for (j = 0; !isPending && j < tx->inCount; j++) {
+            // Replace by fee removed.
+//            if (tx->inputs[j].sequence < UINT32_MAX - 1) isPending = 1; // check for replace-by-fee
+            if (/*tx->inputs[j].sequence < UINT32_MAX &&*/
+                tx->lockTime < TX_MAX_LOCK_HEIGHT &&
+                tx->lockTime > wallet->blockHeight - 180)
+                        isPending = 1; // future lockTime
+            if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime > now) isPending = 1; // future lockTime
+            if (BRSetContains(wallet->pendingTx, &tx->inputs[j].txHash)) isPending = 1; // check for pending inputs
+             // TODO: XXX handle BIP68 check lock time verify rules
         }
 
-        // add outputs to UTXO set
-        // TODO: don't add outputs below TX_MIN_OUTPUT_AMOUNT
-        // TODO: don't add coin generation outputs < 100 blocks deep
-        // NOTE: balance/UTXOs will then need to be recalculated when last block changes
-        for (j = 0; j < tx->outCount; j++) {
-            if (tx->outputs[j].address[0] != '\0') {
-                BRSetAdd(wallet->usedAddrs, tx->outputs[j].address);
-
-                if (BRSetContains(wallet->allAddrs, tx->outputs[j].address)) {
-                    array_add(wallet->utxos, ((const UTXO) {tx->txHash, (uint32_t) j}));
-                    balance += tx->outputs[j].amount;
-                }
+        if (isPending) {
+            BRSetAdd(wallet->pendingTx, tx);
+            _BRWalletLogUndo(wallet, UNDO_PENDING_TX, tx, NULL, 0);
+            if (idx < wallet->firstPending) wallet->firstPending = idx;
+            array_add(wallet->balanceHist, balance);
+            return;
+        }
+    }
+
+    // add outputs to UTXO set, unless an earlier transaction in the list already spends them (transaction ordering is
+    // not guaranteed)
+    // TODO: don't add outputs below TX_MIN_OUTPUT_AMOUNT
+    // TODO: don't add coin generation outputs < 100 blocks deep
+    // NOTE: balance/UTXOs will then need to be recalculated when last block changes
+    for (j = 0; j < tx->outCount; j++) {
+        if (BRAddressIDFromScriptPubKey(&id, tx->outputs[j].script, tx->outputs[j].scriptLen)) {
+            if (_BRWalletAddUsedAddr(wallet, &id)) _BRWalletLogUndo(wallet, UNDO_USED_ADDR, NULL, NULL, 0);
+
+            if (BRSetContains(wallet->allAddrs, &id) &&
+                !BRSetContains(wallet->spentOutputs, &((const UTXO) {tx->txHash, (uint32_t) j}))) {
+                _BRWalletAddUTXO(wallet, ((const UTXO) {tx->txHash, (uint32_t) j}));
+                balance += tx->outputs[j].amount;
             }
         }
+    }
+
+    // remove the outputs spent by this tx, and by any pending tx since the last one that was applied
+    for (i = idx + 1; i > 0; i--) {
+        t = wallet->transactions[i - 1];
+        if (i <= idx && !BRSetContains(wallet->pendingTx, t) && !BRSetContains(wallet->invalidTx, t)) break;
+        if (i <= idx && BRSetContains(wallet->invalidTx, t)) continue;
+
+        for (j = 0; j < t->inCount; j++) {
+            balance -= _BRWalletSpendUTXO(wallet, &t->inputs[j]);
+        }
+    }
+
+    if (prevBalance < balance) wallet->totalReceived += balance - prevBalance;
+    if (balance < prevBalance) wallet->totalSent += prevBalance - balance;
+    array_add(wallet->balanceHist, balance);
+    wallet->balance = balance;
+}
+
+// takes back the last tx applied by _BRWalletApplyTx(), leaving the state the transactions before it left
+static void _BRWalletRevertTx(BRWallet *wallet) {
+    size_t idx = array_count(wallet->balanceHist) - 1;
+    uint64_t balance = wallet->balanceHist[idx], prevBalance = (idx > 0) ? wallet->balanceHist[idx - 1] : 0;
+    _BRWalletUndo *u;
+
+    wallet->workCount++;
+
+    while (array_count(wallet->undoLog) > wallet->undoHist[idx]) {
+        u = &wallet->undoLog[array_count(wallet->undoLog) - 1];
+
+        switch (u->op) {
+            case UNDO_SPENT_OUTPUT:
+                BRSetRemove(wallet->spentOutputs, u->item);
+                break;
+
+            case UNDO_INVALID_TX:
+                BRSetRemove(wallet->invalidTx, u->item);
+                break;
 
-        // transaction ordering is not guaranteed, so check the entire UTXO set against the entire spent output set
-        for (j = array_count(wallet->utxos); j > 0; j--) {
-            if (!BRSetContains(wallet->spentOutputs, &wallet->utxos[j - 1]))
-                continue;
-            t = BRSetGet(wallet->allTx, &wallet->utxos[j - 1].hash);
-            balance -= t->outputs[wallet->utxos[j - 1].n].amount;
-            array_rm(wallet->utxos, j - 1);
+            case UNDO_PENDING_TX:
+                BRSetRemove(wallet->pendingTx, u->item);
+                break;
+
+            case UNDO_USED_ADDR:
+                BRSetRemove(wallet->usedAddrs, &wallet->usedIDs[array_count(wallet->usedIDs) - 1]);
+                array_rm_last(wallet->usedIDs);
+                break;
+
+            case UNDO_ADD_UTXO: // the utxos added after this one have all been taken back, so it's the last
+                array_rm_last(wallet->utxos);
+                array_rm_last(wallet->utxoSeqs);
+                BRSetRemove(wallet->utxoIndex, u->entry);
+                free(u->entry);
+                wallet->workCount++;
+                break;
+
+            case UNDO_SPEND_UTXO:
+                array_insert(wallet->utxos, u->idx, u->entry->utxo);
+                array_insert(wallet->utxoSeqs, u->idx, u->entry->seq);
+                BRSetAdd(wallet->utxoIndex, u->entry);
+                wallet->workCount++;
+                break;
         }
 
-        if (prevBalance < balance) wallet->totalReceived += balance - prevBalance;
-        if (balance < prevBalance) wallet->totalSent += prevBalance - balance;
-        array_add(wallet->balanceHist, balance);
-        prevBalance = balance;
+        array_rm_last(wallet->undoLog);
+    }
+
+    if (prevBalance < balance) wallet->totalReceived -= balance - prevBalance;
+    if (balance < prevBalance) wallet->totalSent -= prevBalance - balance;
+    if (wallet->firstPending == idx) wallet->firstPending = SIZE_MAX;
+    array_rm_last(wallet->balanceHist);
+    array_rm_last(wallet->undoHist);
+    wallet->balance = prevBalance;
+}
+
+// takes back the transactions applied from position idx on, along with any pending or invalid tx that may have
+// changed status since, and applies wallet->transactions again from there in its current order
+static void _BRWalletUpdateBalanceFrom(BRWallet *wallet, size_t idx) {
+    time_t now = time(NULL);
+
+    if (wallet->firstPending < idx) idx = wallet->firstPending;
+
+    while (array_count(wallet->balanceHist) > idx) {
+        _BRWalletRevertTx(wallet);
+    }
+
+    for (size_t i = array_count(wallet->balanceHist); i < array_count(wallet->transactions); i++) {
+        _BRWalletApplyTx(wallet, i, now);
     }
 
     assert(array_count(wallet->balanceHist) == array_count(wallet->transactions));
-    wallet->balance = balance;
+}
+
+// recalculates the balance, UTXO set and balance history by replaying every transaction in wallet->transactions
+static void _BRWalletUpdateBalance(BRWallet *wallet) {
+    _BRWalletClearUndoLog(wallet);
+    _BRWalletClearUTXOs(wallet);
+    array_clear(wallet->balanceHist);
+    BRSetClear(wallet->spentOutputs);
+    BRSetClear(wallet->invalidTx);
+    BRSetClear(wallet->pendingTx);
+    BRSetClear(wallet->usedAddrs);
+    array_clear(wallet->usedIDs);
+    wallet->balance = 0;
+    wallet->totalSent = 0;
+    wallet->totalReceived = 0;
+    wallet->firstPending = SIZE_MAX;
+    _BRWalletUpdateBalanceFrom(wallet, 0);
 }
 
 // allocates and populates a Wallet struct which must be freed by calling WalletFree()
 BRWallet *BRWalletNew(BRTransaction **transactions, size_t txCount, BRMasterPubKey mpk) {
     BRWallet *wallet = NULL;
     BRTransaction *tx;
+    BRAddressID id;
 
     assert(transactions != NULL || txCount == 0);
     wallet = calloc(1, sizeof(*wallet));
     assert(wallet != NULL);
     array_new(wallet->utxos, 100);
+    array_new(wallet->utxoSeqs, 100);
     array_new(wallet->transactions, txCount + 100);
     wallet->feePerKb = DEFAULT_FEE_PER_KB;
+    wallet->signThreads = 1;
     wallet->masterPubKey = mpk;
+    wallet->internalChainKey = BRBIP32ChainPubKey(mpk, SEQUENCE_INTERNAL_CHAIN);
+    wallet->externalChainKey = BRBIP32ChainPubKey(mpk, SEQUENCE_EXTERNAL_CHAIN);
     array_new(wallet->internalChain, 100);
     array_new(wallet->externalChain, 100);
+    array_new(wallet->internalIDs, 100);
+    array_new(wallet->externalIDs, 100);
+    array_new(wallet->usedIDs, txCount + 100);
     array_new(wallet->balanceHist, txCount + 100);
-    wallet->allTx = BRSetNew(BRTransactionHash, BRTransactionEq, txCount + 100);
-    wallet->invalidTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
-    wallet->pendingTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
+    array_new(wallet->undoHist, txCount + 100);
+    array_new(wallet->undoLog, txCount*4 + 100);
+    wallet->firstPending = SIZE_MAX;
+    wallet->allTx = BRSetNewUInt256(txCount + 100);
+    wallet->invalidTx = BRSetNewUInt256(10);
+    wallet->pendingTx = BRSetNewUInt256(10);
     wallet->spentOutputs = BRSetNew(BRUTXOHash, BRUTXOEq, txCount + 100);
-    wallet->usedAddrs = BRSetNew(BRAddressHash, BRAddressEq, txCount + 100);
-    wallet->allAddrs = BRSetNew(BRAddressHash, BRAddressEq, txCount + 100);
+    wallet->utxoIndex = BRSetNew(BRUTXOHash, BRUTXOEq, 100);
+    wallet->usedAddrs = BRSetNew(BRAddressIDHash, BRAddressIDEq, txCount + 100);
+    wallet->allAddrs = BRSetNew(BRAddressIDHash, BRAddressIDEq, txCount + 100);
     pthread_mutex_init(&wallet->lock, NULL);
 
     for (size_t i = 0; transactions && i < txCount; i++) {
         tx = transactions[i];
         if (!BRTransactionIsSigned(tx) || BRSetContains(wallet->allTx, tx)) continue;
+        BRTransactionSetAddresses(tx);
         BRSetAdd(wallet->allTx, tx);
-        _BRWalletInsertTx(wallet, tx);
+        array_add(wallet->transactions, tx);
 
         for (size_t j = 0; j < tx->outCount; j++) {
-            if (tx->outputs[j].address[0] != '\0') BRSetAdd(wallet->usedAddrs, tx->outputs[j].address);
+            if (BRAddressIDFromScriptPubKey(&id, tx->outputs[j].script, tx->outputs[j].scriptLen))
+                _BRWalletAddUsedAddr(wallet, &id);
         }
     }
 
+    _BRWalletSortTransactions(wallet);
     BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL, SEQUENCE_EXTERNAL_CHAIN);
     BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL, SEQUENCE_INTERNAL_CHAIN);
     _BRWalletUpdateBalance(wallet);
@@ -299,54 +635,88 @@ void BRWalletSetCallbacks(BRWallet *wallet, void *info,
 // addrs may be NULL to only generate addresses for WalletContainsAddress()
 // returns the number addresses written to addrs
 size_t BRWalletUnusedAddrs(BRWallet *wallet, BRAddress *addrs, uint32_t gapLimit, int internal) {
-    BRAddress *addrChain;
-    size_t i, j = 0, count, startCount;
-    uint32_t chain = (internal) ? SEQUENCE_INTERNAL_CHAIN : SEQUENCE_EXTERNAL_CHAIN;
+    BRAddress *addrChain, *newAddrs;
+    BRAddressID *idChain, *newIDs;
+    BRECPoint *pubKeys;
+    BRChainPubKey chainKey;
+    size_t i, j = 0, k, count, startCount, needed, derived = SIZE_MAX;
 
     assert(wallet != NULL);
     assert(gapLimit > 0);
     pthread_mutex_lock(&wallet->lock);
-    addrChain = (internal) ? wallet->internalChain : wallet->externalChain;
-    i = count = startCount = array_count(addrChain);
 
-    // keep only the trailing contiguous block of addresses with no transactions
-    while (i > 0 && !BRSetContains(wallet->usedAddrs, &addrChain[i - 1])) i--;
+    for (;;) {
+        addrChain = (internal) ? wallet->internalChain : wallet->externalChain;
+        idChain = (internal) ? wallet->internalIDs : wallet->externalIDs;
+        i = count = array_count(addrChain);
 
-    while (i + gapLimit > count) { // generate new addresses up to gapLimit
-        BRKey key;
-        BRAddress address = ADDRESS_NONE;
-        uint8_t pubKey[BRBIP32PubKey(NULL, 0, wallet->masterPubKey, chain, count)];
-        size_t len = BRBIP32PubKey(pubKey, sizeof(pubKey), wallet->masterPubKey, chain, (uint32_t) count);
-
-        if (!BRKeySetPubKey(&key, pubKey, len)) break;
-        if (!BRKeyAddress(&key, address.s, sizeof(address)) || BRAddressEq(&address, &ADDRESS_NONE)) break;
-        array_add(addrChain, address);
-        count++;
-        if (BRSetContains(wallet->usedAddrs, &address)) i = count;
-    }
+        // keep only the trailing contiguous block of addresses with no transactions
+        while (i > 0 && !BRSetContains(wallet->usedAddrs, &idChain[i - 1])) i--;
+        if (i + gapLimit <= count || derived == 0) break;
 
-    if (addrs && i + gapLimit <= count) {
-        for (j = 0; j < gapLimit; j++) {
-            addrs[j] = addrChain[i + j];
+        // derive the missing addresses up to gapLimit without holding the lock, key derivation is the expensive part
+        needed = i + gapLimit - count;
+        chainKey = (internal) ? wallet->internalChainKey : wallet->externalChainKey;
+        pthread_mutex_unlock(&wallet->lock);
+        pubKeys = malloc(needed * sizeof(*pubKeys));
+        newAddrs = malloc(needed * sizeof(*newAddrs));
+        newIDs = malloc(needed * sizeof(*newIDs));
+        assert(pubKeys != NULL && newAddrs != NULL && newIDs != NULL);
+        BRBIP32ChainPubKeyList(pubKeys, needed, &chainKey, (uint32_t) count);
+
+        for (derived = 0; derived < needed; derived++) {
+            BRKey key;
+
+            newAddrs[derived] = ADDRESS_NONE;
+            if (!BRKeySetPubKey(&key, pubKeys[derived].p, sizeof(pubKeys[derived]))) break;
+            if (!BRKeyAddress(&key, newAddrs[derived].s, sizeof(*newAddrs)) ||
+                BRAddressEq(&newAddrs[derived], &ADDRESS_NONE)) break;
+            if (!BRAddressIDFromAddress(&newIDs[derived], newAddrs[derived].s)) break;
         }
-    }
 
-    // was addrChain moved to a new memory location?
-    if (addrChain == (internal ? wallet->internalChain : wallet->externalChain)) {
-        for (i = startCount; i < count; i++) {
-            BRSetAdd(wallet->allAddrs, &addrChain[i]);
+        var_clean(&chainKey.chainCode);
+        pthread_mutex_lock(&wallet->lock);
+        addrChain = (internal) ? wallet->internalChain : wallet->externalChain;
+        idChain = (internal) ? wallet->internalIDs : wallet->externalIDs;
+        startCount = array_count(addrChain);
+
+        // another thread may have extended the chain while the lock was released, so only append what's still missing
+        for (k = startCount - count; k < derived; k++) {
+            array_add(addrChain, newAddrs[k]);
+            array_add(idChain, newIDs[k]);
         }
-    } else {
+
         if (internal) wallet->internalChain = addrChain;
         if (!internal) wallet->externalChain = addrChain;
-        BRSetClear(wallet->allAddrs); // clear and rebuild allAddrs
 
-        for (i = array_count(wallet->internalChain); i > 0; i--) {
-            BRSetAdd(wallet->allAddrs, &wallet->internalChain[i - 1]);
+        // was idChain moved to a new memory location?
+        if (idChain == (internal ? wallet->internalIDs : wallet->externalIDs)) {
+            for (k = startCount; k < array_count(idChain); k++) {
+                BRSetAdd(wallet->allAddrs, &idChain[k]);
+            }
+        } else {
+            if (internal) wallet->internalIDs = idChain;
+            if (!internal) wallet->externalIDs = idChain;
+            BRSetClear(wallet->allAddrs); // clear and rebuild allAddrs
+
+            for (k = array_count(wallet->internalIDs); k > 0; k--) {
+                BRSetAdd(wallet->allAddrs, &wallet->internalIDs[k - 1]);
+            }
+
+            for (k = array_count(wallet->externalIDs); k > 0; k--) {
+                BRSetAdd(wallet->allAddrs, &wallet->externalIDs[k - 1]);
+            }
         }
 
-        for (i = array_count(wallet->externalChain); i > 0; i--) {
-            BRSetAdd(wallet->allAddrs, &wallet->externalChain[i - 1]);
+        free(newIDs);
+        free(newAddrs);
+        free(pubKeys);
+        if (derived < needed) derived = 0; // key derivation failed, don't loop forever
+    }
+
+    if (addrs && i + gapLimit <= count) {
+        for (j = 0; j < gapLimit; j++) {
+            addrs[j] = addrChain[i + j];
         }
     }
 
@@ -454,6 +824,25 @@ void BRWalletSetFeePerKb(BRWallet *wallet, uint64_t feePerKb) {
     pthread_mutex_unlock(&wallet->lock);
 }
 
+// number of threads WalletSignTransaction() spreads the inputs of larger transactions across, 1 (the default) signs on
+// the calling thread, signatures are the same either way since they're deterministic (RFC6979)
+size_t BRWalletSignThreads(BRWallet *wallet) {
+    size_t threadCount;
+
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    threadCount = wallet->signThreads;
+    pthread_mutex_unlock(&wallet->lock);
+    return threadCount;
+}
+
+void BRWalletSetSignThreads(BRWallet *wallet, size_t threadCount) {
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    wallet->signThreads = (threadCount > 0) ? threadCount : 1;
+    pthread_mutex_unlock(&wallet->lock);
+}
+
 // returns the first unused external address
 BRAddress BRWalletReceiveAddress(BRWallet *wallet) {
     BRAddress addr = ADDRESS_NONE;
@@ -470,7 +859,7 @@ size_t BRWalletUsedAddresses(BRWallet *wallet, BRAddress *addrs) {
     pthread_mutex_lock(&wallet->lock);
 
     for (i = 0; i < array_count(wallet->externalChain); i++) {
-        if(BRSetContains(wallet->usedAddrs, wallet->externalChain[i].s)) {
+        if(BRSetContains(wallet->usedAddrs, &wallet->externalIDs[i])) {
             externalCount++;
             if(addrs)
                 addrs[i] = wallet->externalChain[i];
@@ -508,24 +897,26 @@ size_t BRWalletAllAddrs(BRWallet *wallet, BRAddress *addrs, size_t addrsCount) {
 
 // true if the address was previously generated by WalletUnusedAddrs() (even if it's now used)
 int BRWalletContainsAddress(BRWallet *wallet, const char *addr) {
+    BRAddressID id;
     int r = 0;
 
     assert(wallet != NULL);
     assert(addr != NULL);
     pthread_mutex_lock(&wallet->lock);
-    if (addr) r = BRSetContains(wallet->allAddrs, addr);
+    if (addr) r = (BRAddressIDFromAddress(&id, addr) && BRSetContains(wallet->allAddrs, &id));
     pthread_mutex_unlock(&wallet->lock);
     return r;
 }
 
 // true if the address was previously used as an output in any wallet transaction
 int BRWalletAddressIsUsed(BRWallet *wallet, const char *addr) {
+    BRAddressID id;
     int r = 0;
 
     assert(wallet != NULL);
     assert(addr != NULL);
     pthread_mutex_lock(&wallet->lock);
-    if (addr) r = BRSetContains(wallet->usedAddrs, addr);
+    if (addr) r = (BRAddressIDFromAddress(&id, addr) && BRSetContains(wallet->usedAddrs, &id));
     pthread_mutex_unlock(&wallet->lock);
     return r;
 }
@@ -1249,13 +1640,62 @@ BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput out
     return transaction;
 }
 
+typedef struct {
+    BRTransaction *tx;
+    const void *seed;
+    size_t seedLen;
+    const uint32_t *chains, *indexes; // chain and index of the key for each input, chain is UINT32_MAX if none
+    const UInt256 *mds; // signature hash of each input
+} _BRWalletSignJob;
+
+// derives the keys for, and signs, the inputs of job->tx from start up to end, which only writes those inputs
+static void _BRWalletSignRoutine(void *info, size_t start, size_t end) {
+    const _BRWalletSignJob *job = info;
+    size_t i, n = end - start, internalCount = 0, externalCount = 0, k;
+    uint32_t internalIdx[n], externalIdx[n];
+    BRKey _keys[(n * sizeof(BRKey) <= 0x1000) ? n : 0],
+          *keys = (n * sizeof(BRKey) <= 0x1000) ? _keys : malloc(n * sizeof(BRKey));
+
+    assert(keys != NULL);
+
+    for (i = start; i < end; i++) {
+        if (job->chains[i] == SEQUENCE_INTERNAL_CHAIN) internalIdx[internalCount++] = job->indexes[i];
+        if (job->chains[i] == SEQUENCE_EXTERNAL_CHAIN) externalIdx[externalCount++] = job->indexes[i];
+    }
+
+    BRBIP44PrivKeyList(keys, internalCount, job->seed, job->seedLen, 175, 0, SEQUENCE_INTERNAL_CHAIN, internalIdx);
+    BRBIP44PrivKeyList(&keys[internalCount], externalCount, job->seed, job->seedLen, 175, 0, SEQUENCE_EXTERNAL_CHAIN,
+                       externalIdx);
+    k = internalCount + externalCount;
+    externalCount = internalCount, internalCount = 0;
+
+    for (i = start; i < end; i++) { // keys were derived per chain in input order, hand them out that way
+        BRKey *key = NULL;
+        BRAddress keyAddr, address;
+
+        if (job->chains[i] == SEQUENCE_INTERNAL_CHAIN) key = &keys[internalCount++];
+        if (job->chains[i] == SEQUENCE_EXTERNAL_CHAIN) key = &keys[externalCount++];
+        if (!key || !BRKeyAddress(key, keyAddr.s, sizeof(keyAddr))) continue;
+
+        // like TransactionSign(), only sign inputs whose script pays to the key
+        if (BRAddressFromScriptPubKey(address.s, sizeof(address), job->tx->inputs[i].script,
+                                      job->tx->inputs[i].scriptLen) && BRAddressEq(&keyAddr, &address)) {
+            BRTransactionSignInput(job->tx, i, key, job->mds[i]);
+        }
+    }
+
+    for (i = 0; i < k; i++) BRKeyClean(&keys[i]);
+    if (keys != _keys) free(keys);
+}
+
 // signs any inputs in tx that can be signed using private keys from the wallet
 // forkId is 0 for bitcoin, 0x40 for b-cash
 // seed is the master private key (wallet seed) corresponding to the master public key given when the wallet was created
 // returns true if all inputs were signed, or false if there was an error or not all inputs were able to be signed
 int BRWalletSignTransaction(BRWallet *wallet, BRTransaction *tx, const void *seed, size_t seedLen) {
-    uint32_t j, internalIdx[tx->inCount], externalIdx[tx->inCount];
-    size_t i, internalCount = 0, externalCount = 0;
+    uint32_t chains[tx->inCount], indexes[tx->inCount];
+    size_t i, threadCount;
+    BRAddressID id;
     int r = 0;
 
     assert(wallet != NULL);
@@ -1263,26 +1703,28 @@ int BRWalletSignTransaction(BRWallet *wallet, BRTransaction *tx, const void *see
     pthread_mutex_lock(&wallet->lock);
 
     for (i = 0; tx && i < tx->inCount; i++) {
-        for (j = (uint32_t) array_count(wallet->internalChain); j > 0; j--) {
-            if (BRAddressEq(tx->inputs[i].address, &wallet->internalChain[j - 1])) internalIdx[internalCount++] = j - 1;
-        }
-
-        for (j = (uint32_t) array_count(wallet->externalChain); j > 0; j--) {
-            if (BRAddressEq(tx->inputs[i].address, &wallet->externalChain[j - 1])) externalIdx[externalCount++] = j - 1;
-        }
+        chains[i] = UINT32_MAX;
+        if (!BRAddressIDFromScriptPubKey(&id, tx->inputs[i].script, tx->inputs[i].scriptLen)) continue;
+        _BRWalletAddrChainIndex(wallet, &id, &chains[i], &indexes[i]);
     }
 
+    threadCount = wallet->signThreads;
     pthread_mutex_unlock(&wallet->lock);
 
-    BRKey keys[internalCount + externalCount];
+    if (seed) { // each worker derives its own keys and signs its own contiguous range of inputs
+        UInt256 _mds[(tx->inCount <= 0x1000 / sizeof(UInt256)) ? tx->inCount : 0],
+                *mds = (tx->inCount <= 0x1000 / sizeof(UInt256)) ? _mds : malloc(tx->inCount * sizeof(UInt256));
 
-    if (seed) {
-        BRBIP44PrivKeyList(keys, internalCount, seed, seedLen, 175, 0, SEQUENCE_INTERNAL_CHAIN, internalIdx);
-        BRBIP44PrivKeyList(&keys[internalCount], externalCount, seed, seedLen, 175, 0, SEQUENCE_EXTERNAL_CHAIN, externalIdx);
+        assert(mds != NULL || tx->inCount == 0);
+
+        // hashing reads every input of tx, so it's done here before any worker starts writing signatures into it
+        BRTransactionSigHashes(mds, tx, 0, tx->inCount);
+        BRParallelRanges(_BRWalletSignRoutine, &(_BRWalletSignJob) { tx, seed, seedLen, chains, indexes, mds },
+                         tx->inCount, WALLET_SIGN_MIN_BATCH, threadCount);
+        if (mds != _mds) free(mds);
         // TODO: XXX wipe seed callback
         seed = NULL;
-        if (tx) r = BRTransactionSign(tx, keys, internalCount + externalCount);
-        for (i = 0; i < internalCount + externalCount; i++) BRKeyClean(&keys[i]);
+        r = BRTransactionSign(tx, NULL, 0); // no keys left to match, this only checks the signatures and sets txHash
     } else r = -1; // user canceled authentication
 
     return r;
@@ -1315,9 +1757,10 @@ int BRWalletRegisterTransaction(BRWallet *wallet, BRTransaction *tx) {
                 // TODO: verify signatures when possible
                 // TODO: handle tx replacement with input sequence numbers
                 //       (for now, replacements appear invalid until confirmation)
+                BRTransactionSetAddresses(tx); // tx may have been parsed without them
                 BRSetAdd(wallet->allTx, tx);
-                _BRWalletInsertTx(wallet, tx);
-                _BRWalletUpdateBalance(wallet);
+                // tx can't change the state left by the transactions that sort before it
+                _BRWalletUpdateBalanceFrom(wallet, _BRWalletInsertTx(wallet, tx));
                 wasAdded = 1;
             } else { // keep track of unconfirmed non-wallet tx for invalid tx checks and child-pays-for-parent fees
                 // BUG: limit total non-wallet unconfirmed tx to avoid memory exhaustion attack
@@ -1381,10 +1824,10 @@ void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash) {
             for (size_t i = array_count(wallet->transactions); i > 0; i--) {
                 if (!BRTransactionEq(wallet->transactions[i - 1], tx)) continue;
                 array_rm(wallet->transactions, i - 1);
+                _BRWalletUpdateBalanceFrom(wallet, i - 1); // takes back tx before it's freed below
                 break;
             }
 
-            _BRWalletUpdateBalance(wallet);
             pthread_mutex_unlock(&wallet->lock);
 
             // if this is for a transaction we sent, and it wasn't already known to be invalid, notify user
@@ -1539,7 +1982,7 @@ void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 *txHashes, size_
         }
     }
 
-    if (needsUpdate) _BRWalletUpdateBalance(wallet);
+    if (needsUpdate) _BRWalletUpdateBalanceFrom(wallet, wallet->firstPending);
     pthread_mutex_unlock(&wallet->lock);
     if (j > 0 && wallet->txUpdated) wallet->txUpdated(wallet->callbackInfo, hashes, j, blockHeight, timestamp);
 }
@@ -1562,7 +2005,7 @@ void BRWalletSetTxUnconfirmedAfter(BRWallet *wallet, uint32_t blockHeight) {
         hashes[j] = wallet->transactions[i + j]->txHash;
     }
 
-    if (count > 0) _BRWalletUpdateBalance(wallet);
+    if (count > 0) _BRWalletUpdateBalance(wallet); // a re-org is rare enough to replay every tx from scratch
     pthread_mutex_unlock(&wallet->lock);
     if (count > 0 && wallet->txUpdated) wallet->txUpdated(wallet->callbackInfo, hashes, count, TX_UNCONFIRMED, 0);
 }
@@ -1577,7 +2020,7 @@ uint64_t BRWalletAmountReceivedFromTx(BRWallet *wallet, const BRTransaction *tx)
 
     // TODO: don't include outputs below TX_MIN_OUTPUT_AMOUNT
     for (size_t i = 0; tx && i < tx->outCount; i++) {
-        if (BRSetContains(wallet->allAddrs, tx->outputs[i].address)) amount += tx->outputs[i].amount;
+        if (_BRWalletContainsOutput(wallet, &tx->outputs[i])) amount += tx->outputs[i].amount;
     }
 
     pthread_mutex_unlock(&wallet->lock);
@@ -1597,12 +2040,12 @@ size_t BRWalletAssetsReceivedFromTx(BRWallet *wallet, const BRTransaction *tx, B
         for (size_t i = 0; tx && i < tx->outCount; i++)
             if (tx->outputs[i].amount == 0 &&
                 !IsScriptTransferAsset(tx->outputs[i].script, tx->outputs[i].scriptLen) &&
-                BRSetContains(wallet->allAddrs, tx->outputs[i].address)) count++;
+                _BRWalletContainsOutput(wallet, &tx->outputs[i])) count++;
     } else {
         for (size_t i = 0; tx && i < asstCount; i++)
             if (tx->outputs[i].amount == 0 &&
                 !IsScriptTransferAsset(tx->outputs[i].script, tx->outputs[i].scriptLen) &&
-                BRSetContains(wallet->allAddrs, tx->outputs[i].address)) {
+                _BRWalletContainsOutput(wallet, &tx->outputs[i])) {
                 GetAssetData(tx->outputs[i].script, tx->outputs[i].scriptLen, &asset[i]);
                 count++;
             }
@@ -1624,7 +2067,7 @@ uint64_t BRWalletAmountSentByTx(BRWallet *wallet, const BRTransaction *tx) {
         BRTransaction *t = BRSetGet(wallet->allTx, &tx->inputs[i].txHash);
         uint32_t n = tx->inputs[i].index;
 
-        if (t && n < t->outCount && BRSetContains(wallet->allAddrs, t->outputs[n].address)) {
+        if (t && n < t->outCount && _BRWalletContainsOutput(wallet, &t->outputs[n])) {
             amount += t->outputs[n].amount;
         }
     }
@@ -1764,9 +2207,17 @@ void BRWalletFree(BRWallet *wallet) {
     BRSetFree(wallet->invalidTx);
     BRSetFree(wallet->pendingTx);
     BRSetFree(wallet->spentOutputs);
+    _BRWalletClearUndoLog(wallet);
+    _BRWalletClearUTXOs(wallet);
+    BRSetFree(wallet->utxoIndex);
     array_free(wallet->internalChain);
     array_free(wallet->externalChain);
+    array_free(wallet->internalIDs);
+    array_free(wallet->externalIDs);
+    array_free(wallet->usedIDs);
     array_free(wallet->balanceHist);
+    array_free(wallet->undoHist);
+    array_free(wallet->undoLog);
 
     for (size_t i = array_count(wallet->transactions); i > 0; i--) {
         BRTransactionFree(wallet->transactions[i - 1]);
@@ -1774,6 +2225,7 @@ void BRWalletFree(BRWallet *wallet) {
 
     array_free(wallet->transactions);
     array_free(wallet->utxos);
+    array_free(wallet->utxoSeqs);
     pthread_mutex_unlock(&wallet->lock);
     pthread_mutex_destroy(&wallet->lock);
     free(wallet);
@@ -1862,7 +2314,7 @@ size_t BRTransactionDecompose(BRWallet *wallet, const BRTransaction *tx, BRTrans
     for (size_t j = 0; j < tx->outCount; j++) {
         if(IsScriptAsset(tx->outputs[j].script, tx->outputs[j].scriptLen) &&
            !IsScriptTransferAsset(tx->outputs[j].script, tx->outputs[j].scriptLen) &&
-           BRSetContains(wallet->allAddrs, tx->outputs[j].address)) {
+           _BRWalletContainsOutput(wallet, &tx->outputs[j])) {
 
             inputs = txDecomposed[count].inputs;
             outputs = txDecomposed[count].outputs;
@@ -1884,3 +2336,13 @@ size_t BRTransactionDecompose(BRWallet *wallet, const BRTransaction *tx, BRTrans
 
     return count;
 }
+
+size_t WalletWorkCountTest(BRWallet *wallet) {
+    size_t count;
+
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    count = wallet->workCount;
+    pthread_mutex_unlock(&wallet->lock);
+    return count;
+}
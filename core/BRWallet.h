@@ -111,6 +111,11 @@ size_t BRWalletUTXOs(BRWallet *wallet, UTXO *utxos, size_t utxosCount);
 uint64_t BRWalletFeePerKb(BRWallet *wallet);
 void BRWalletSetFeePerKb(BRWallet *wallet, uint64_t feePerKb);
 
+// number of threads WalletSignTransaction() spreads the inputs of larger transactions across, 1 (the default) signs on
+// the calling thread, signatures are the same either way since they're deterministic (RFC6979)
+size_t BRWalletSignThreads(BRWallet *wallet);
+void BRWalletSetSignThreads(BRWallet *wallet, size_t threadCount);
+
 // returns an unsigned transaction that sends the specified amount from the wallet to the given address
 // result must be freed using TransactionFree()
 BRTransaction *BRWalletCreateTransaction(BRWallet *wallet, uint64_t amount, const char *addr);
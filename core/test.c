@@ -11,6 +11,7 @@
 #include "BRBIP44Sequence.h"
 #include "BRPeer.h"
 #include "BRPeerManager.h"
+#include "BRTestHooks.h"
 #include "BRChainParams.h"
 #include "BRInt.h"
 #include "BRArray.h"
@@ -22,7 +23,11 @@
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/time.h>
 #include "BRAssets.h"
 #include "BRScript.h"
 
@@ -149,6 +154,18 @@ inline static int eq_int(const void *a, const void *b) {
     return (*(const int *)a == *(const int *)b);
 }
 
+inline static size_t hash_int_mod7(const void *i) { // lots of collisions, to exercise the probing
+    return (size_t)(*(const unsigned *)i % 7);
+}
+
+inline static size_t hash_u256(const void *u) {
+    return (size_t)((const UInt256 *)u)->u32[0];
+}
+
+inline static int eq_u256(const void *a, const void *b) {
+    return UInt256Eq(*(const UInt256 *)a, *(const UInt256 *)b);
+}
+
 int SetTests() {
     int r = 1;
     int i, x[1000];
@@ -178,7 +195,69 @@ int SetTests() {
     }
 
     if (BRSetCount(s) != 0) r = 0, fprintf(stderr, "***FAILED*** %s: SetCount() test 2\n", __func__);
-    
+
+    BRSet *s2 = BRSetNew(hash_int_mod7, eq_int, 0), *s3 = BRSetNew(hash_int, eq_int, 0);
+    void *all[1000], *t;
+    size_t n;
+
+    for (i = 0; i < 1000; i++) BRSetAdd(s2, &x[(i*389) % 1000]);
+    for (i = 0; i < 1000; i += 3) BRSetRemove(s2, &x[i]);
+    for (i = 0; i < 1000; i += 2) BRSetAdd(s3, &x[i]);
+
+    for (i = 0; i < 1000; i++) {
+        if ((BRSetGet(s2, &i) != NULL) != (i % 3 != 0))
+            r = 0, fprintf(stderr, "***FAILED*** %s: SetRemove() collision test %d\n", __func__, i);
+    }
+
+    for (n = 0, t = BRSetIterate(s2, NULL); t; t = BRSetIterate(s2, t)) n++;
+    if (n != 666 || BRSetAll(s2, all, 1000) != 666)
+        r = 0, fprintf(stderr, "***FAILED*** %s: SetIterate() test\n", __func__);
+
+    BRSetIntersect(s2, s3); // odd items are removed while iterating, the rest of their probe sequences shift back
+
+    for (i = 0; i < 1000; i++) {
+        if ((BRSetGet(s2, &i) != NULL) != (i % 3 != 0 && i % 2 == 0))
+            r = 0, fprintf(stderr, "***FAILED*** %s: SetIntersect() test %d\n", __func__, i);
+    }
+
+    BRSetUnion(s2, s3);
+    BRSetMinus(s3, s2);
+
+    if (BRSetCount(s2) != 500 || BRSetCount(s3) != 0 || BRSetIntersects(s2, s3) || ! BRSetIntersects(s2, s2))
+        r = 0, fprintf(stderr, "***FAILED*** %s: SetUnion() test\n", __func__);
+
+    // a set keyed by UInt256 must behave like one using hash and eq callbacks, items are looked up by key
+    UInt256 *keys = calloc(100000, sizeof(*keys));
+    BRSet *k = BRSetNewUInt256(0), *g = BRSetNew(hash_u256, eq_u256, 0);
+    clock_t start, keyed = 0, generic = 0;
+    size_t hits;
+
+    for (uint32_t j = 0; j < 100000; j++) SHA256(&keys[j], &j, sizeof(j));
+
+    for (int pass = 0; pass < 2; pass++) {
+        BRSet *bench = (pass == 0) ? k : g;
+
+        start = clock();
+        for (n = 0, hits = 0; n < 100000; n++) BRSetAdd(bench, &keys[n]);
+        for (n = 0; n < 100000; n++) hits += (BRSetGet(bench, &keys[(n*7919) % 100000]) != NULL);
+        for (n = 0; n < 100000; n += 2) BRSetRemove(bench, &keys[n]);
+        for (n = 1; n < 100000; n += 2) hits += (BRSetGet(bench, &keys[n]) != NULL);
+        for (n = 0; n < 100000; n += 2) hits += BRSetContains(bench, &keys[n]);
+        if (pass == 0) keyed = clock() - start;
+        else generic = clock() - start;
+
+        if (hits != 150000 || BRSetCount(bench) != 50000)
+            r = 0, fprintf(stderr, "***FAILED*** %s: SetNewUInt256() test %d\n", __func__, pass);
+    }
+
+    printf("%.0fns per keyed op (%.0fns with callbacks) ", (double)keyed*1e9/CLOCKS_PER_SEC/450000,
+           (double)generic*1e9/CLOCKS_PER_SEC/450000);
+    BRSetFree(k);
+    BRSetFree(g);
+    BRSetFree(s);
+    BRSetFree(s2);
+    BRSetFree(s3);
+    free(keys);
     return r;
 }
 
@@ -480,7 +559,120 @@ int HashTests() {
     MD5(md, s, strlen(s));
     if (! UInt128Eq(*(UInt128 *)"\x0c\xc1\x75\xb9\xc0\xf1\xb6\xa8\x31\xc3\x99\xe2\x69\x77\x26\x61",
                     *(UInt128 *)md)) r = 0, fprintf(stderr, "***FAILED*** %s: MD5() test 6\n", __func__);
-    
+
+    // test X16RBatch against X16R and X16Rv2, with batches that are hashed from both stack and heap buffers
+    uint8_t x16rMsgs[100][80];
+    UInt256 x16rHashes[100], x16rHash;
+    void *x16rMd[100];
+    const void *x16rData[100];
+    size_t x16rLens[100];
+    int x16rV2[100];
+
+    for (size_t i = 0; i < 100; i++) {
+        SHA512(x16rMsgs[i], &i, sizeof(i)); // bytes 4-35 are the prevBlock field that selects the algorithm order
+        SHA256(&x16rMsgs[i][48], x16rMsgs[i], 48);
+        x16rMd[i] = &x16rHashes[i];
+        x16rData[i] = x16rMsgs[i];
+        x16rLens[i] = 36 + i % 45;
+        x16rV2[i] = i % 3;
+    }
+
+    for (size_t count = 1; count <= 100; count += 99) {
+        X16RBatch(x16rMd, x16rData, x16rLens, x16rV2, count);
+
+        for (size_t i = 0; i < count; i++) {
+            if (x16rV2[i]) X16Rv2(&x16rHash, x16rMsgs[i], x16rLens[i]);
+            else X16R(&x16rHash, x16rMsgs[i], x16rLens[i]);
+            if (! UInt256Eq(x16rHash, x16rHashes[i]))
+                r = 0, fprintf(stderr, "***FAILED*** %s: X16RBatch() test 1 (%zu, %zu)\n", __func__, count, i);
+        }
+    }
+
+    X16RBatch(x16rMd, x16rData, x16rLens, NULL, 100);
+
+    for (size_t i = 0; i < 100; i++) {
+        X16R(&x16rHash, x16rMsgs[i], x16rLens[i]);
+        if (! UInt256Eq(x16rHash, x16rHashes[i]))
+            r = 0, fprintf(stderr, "***FAILED*** %s: X16RBatch() test 2 (%zu)\n", __func__, i);
+    }
+
+    uint8_t shaData[300];
+    UInt256 shaMd, shaMd2;
+    BRSHA256Context shaCtx, shaCtx2;
+
+    for (size_t i = 0; i < sizeof(shaData); i++) shaData[i] = (uint8_t)(i * 7);
+
+    for (size_t len = 0; len <= sizeof(shaData); len += 23) { // feed uneven chunks that straddle block boundaries
+        SHA256Init(&shaCtx);
+        for (size_t off = 0; off < len; off += 13) {
+            SHA256Update(&shaCtx, &shaData[off], (len - off < 13) ? len - off : 13);
+        }
+
+        SHA256Final(&shaCtx, &shaMd);
+        SHA256(&shaMd2, shaData, len);
+        if (! UInt256Eq(shaMd, shaMd2))
+            r = 0, fprintf(stderr, "***FAILED*** %s: SHA256Update() test %zu\n", __func__, len);
+    }
+
+    SHA256Init(&shaCtx);
+    SHA256Update(&shaCtx, shaData, 100);
+    shaCtx2 = shaCtx; // resume from a copied midstate
+    SHA256Update(&shaCtx2, &shaData[100], 200);
+    SHA256Final(&shaCtx2, &shaMd);
+    SHA256Update(&shaCtx, &shaData[100], 200);
+    SHA256Final(&shaCtx, &shaMd2);
+    if (! UInt256Eq(shaMd, shaMd2)) r = 0, fprintf(stderr, "***FAILED*** %s: SHA256Update() midstate test\n", __func__);
+
+    return r;
+}
+
+const char *SHA256ImplementationTest(int impl);
+
+int SHA256ImplementationTests() {
+    int r = 1, impl;
+    uint8_t data[64*20], buf[64*20], md[32], ref[300][32], ref64[20][32];
+    const char *name;
+    size_t i, count;
+    BRSHA256Context ctx;
+
+    for (i = 0; i < sizeof(data); i++) data[i] = (uint8_t)(i*131 + 7);
+
+    // every implementation the cpu supports must match the portable one
+    SHA256ImplementationTest(0);
+    for (i = 0; i < 300; i++) SHA256(ref[i], data, i);
+    for (i = 0; i < 20; i++) SHA256_2(ref64[i], &data[i*64], 64);
+
+    for (impl = 0; impl < 16; impl++) {
+        if (! (name = SHA256ImplementationTest(impl))) continue;
+
+        for (i = 0; i < 300; i++) {
+            SHA256(md, data, i);
+            if (memcmp(md, ref[i], sizeof(md)) != 0)
+                r = 0, fprintf(stderr, "***FAILED*** %s: SHA256() test %s %zu\n", __func__, name, i);
+        }
+
+        SHA256Init(&ctx);
+        SHA256Update(&ctx, data, 1);
+        SHA256Update(&ctx, &data[1], 70);
+        SHA256Update(&ctx, &data[71], 228);
+        SHA256Final(&ctx, md);
+        if (memcmp(md, ref[299], sizeof(md)) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: SHA256Update() test %s\n", __func__, name);
+
+        for (count = 0; count <= 20; count++) { // covers both the multi-way path and the leftover messages
+            memset(buf, 0, sizeof(buf));
+            SHA256_2_64(buf, data, count);
+            if (memcmp(buf, ref64, count*32) != 0)
+                r = 0, fprintf(stderr, "***FAILED*** %s: SHA256_2_64() test %s %zu\n", __func__, name, count);
+        }
+
+        memcpy(buf, data, sizeof(buf));
+        SHA256_2_64(buf, buf, 20);
+        if (memcmp(buf, ref64, sizeof(ref64)) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: SHA256_2_64() in place test %s\n", __func__, name);
+    }
+
+    SHA256ImplementationTest(-1);
     return r;
 }
 
@@ -1301,6 +1493,22 @@ int AddressTests() {
     if (!BRAddressEq(&addr, &addr2))
         r = 0, fprintf(stderr, "***FAILED*** %s: AddressFromScriptPubKey()\n", __func__);
 
+    BRAddressID id, id2;
+
+    if (!BRAddressIDFromScriptPubKey(&id, script, scriptLen) || !UInt160Eq(id.hash, BRKeyHash160(&k)))
+        r = 0, fprintf(stderr, "***FAILED*** %s: AddressIDFromScriptPubKey() test 1\n", __func__);
+
+    if (!BRAddressIDFromAddress(&id2, addr.s) || !BRAddressIDEq(&id, &id2))
+        r = 0, fprintf(stderr, "***FAILED*** %s: AddressIDFromAddress()\n", __func__);
+
+    BRAddressFromID(addr3.s, sizeof(addr3), &id);
+    if (!BRAddressEq(&addr, &addr3))
+        r = 0, fprintf(stderr, "***FAILED*** %s: AddressFromID()\n", __func__);
+
+    script[0] = OP_HASH160; // not a standard script anymore
+    if (BRAddressIDFromScriptPubKey(&id2, script, scriptLen))
+        r = 0, fprintf(stderr, "***FAILED*** %s: AddressIDFromScriptPubKey() test 2\n", __func__);
+
     // TODO: test AddressFromScriptSig()
     
     return r;
@@ -1451,6 +1659,59 @@ int BIP39MnemonicTests() {
     return r;
 }
 
+// sha-512 that PBKDF2() and HMAC() can't recognize, so they take their generic path
+static void _KeyDerivationTestSHA512(void *md64, const void *data, size_t len) {
+    SHA512(md64, data, len);
+}
+
+int KeyDerivationTests() {
+    int r = 1, i;
+    uint8_t data[300], dk[200], dk2[200], mac[64], mac2[64];
+    const char *phrase = "legal winner thank year wave sausage worth useful legal winner thank yellow";
+    UInt512 key, key2;
+    BRMasterPubKey mpk, mpk2;
+    clock_t start, fast, generic;
+    size_t len;
+
+    for (len = 0; len < sizeof(data); len++) data[len] = (uint8_t)(len*37 + 11);
+
+    // the sha-512 fast paths must match the generic hmac construction
+    for (len = 0; len < sizeof(data); len += 7) {
+        HMAC(mac, SHA512, 64, data, len, &data[len/2], sizeof(data) - len);
+        HMAC(mac2, _KeyDerivationTestSHA512, 64, data, len, &data[len/2], sizeof(data) - len);
+        if (memcmp(mac, mac2, sizeof(mac)) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: HMAC() sha512 test %zu\n", __func__, len);
+    }
+
+    for (len = 0; len < sizeof(data); len += 37) {
+        PBKDF2(dk, len % sizeof(dk), SHA512, 64, data, len, &data[3], len/2, 1 + (unsigned)len % 4);
+        PBKDF2(dk2, len % sizeof(dk), _KeyDerivationTestSHA512, 64, data, len, &data[3], len/2, 1 + (unsigned)len % 4);
+        if (memcmp(dk, dk2, len % sizeof(dk)) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: PBKDF2() sha512 test %zu\n", __func__, len);
+    }
+
+    // seed and master public key of a wallet restored from its recovery phrase
+    start = clock();
+
+    for (i = 0; i < 10; i++) {
+        BRBIP39DeriveKey(key.u8, phrase, "TREZOR");
+        mpk = BRBIP32MasterPubKey(&key, sizeof(key));
+    }
+
+    fast = clock() - start;
+    start = clock();
+    PBKDF2(key2.u8, sizeof(key2), _KeyDerivationTestSHA512, 64, phrase, strlen(phrase), "mnemonicTREZOR", 14, 2048);
+    mpk2 = BRBIP32MasterPubKey(&key2, sizeof(key2));
+    generic = clock() - start;
+
+    if (! UInt512Eq(key, key2) || memcmp(&mpk, &mpk2, sizeof(mpk)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRBIP39DeriveKey() test\n", __func__);
+
+    printf("%.1fms per seed and master pubkey (%.1fms without hmac key states) ",
+           (double)fast*1000/CLOCKS_PER_SEC/10, (double)generic*1000/CLOCKS_PER_SEC);
+    return r;
+}
+
 int BIP32SequenceTests() {
     int r = 1;
 
@@ -1492,6 +1753,43 @@ int BIP32SequenceTests() {
                     u256_hex_decode("7b6a7dd645507d775215a9035be06700e1ed8c541da9351b4bd14bd50ab61428")))
         r = 0, fprintf(stderr, "***FAILED*** %s: BIP32PubKey() test\n", __func__);
 
+    BRChainPubKey cpk = BRBIP32ChainPubKey(mpk, SEQUENCE_INTERNAL_CHAIN);
+    BRECPoint pubKeys[100];
+
+    BRBIP32ChainPubKeyList(pubKeys, 100, &cpk, 5);
+
+    for (uint32_t i = 0; i < 100; i++) {
+        BRBIP32PubKey(pubKey, sizeof(pubKey), mpk, SEQUENCE_INTERNAL_CHAIN, i + 5);
+        if (memcmp(pubKey, pubKeys[i].p, sizeof(pubKey)) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BIP32ChainPubKeyList() test %u\n", __func__, i);
+    }
+
+    BRBIP32ChainChildPubKey(pubKey, sizeof(pubKey), &cpk, 104);
+    if (memcmp(pubKey, pubKeys[99].p, sizeof(pubKey)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BIP32ChainChildPubKey() test\n", __func__);
+
+    uint32_t keyIdxs[] = { 0, 1, 7, 1000, 7 | BIP32_HARD };
+    BRKey keyList[sizeof(keyIdxs) / sizeof(*keyIdxs)], pathKey;
+
+    BRBIP32PrivKeyList(keyList, sizeof(keyIdxs) / sizeof(*keyIdxs), &seed, sizeof(seed), SEQUENCE_INTERNAL_CHAIN,
+                       keyIdxs);
+
+    for (size_t i = 0; i < sizeof(keyIdxs) / sizeof(*keyIdxs); i++) {
+        BRBIP32PrivKeyPath(&pathKey, &seed, sizeof(seed), 3, 0 | BIP32_HARD, SEQUENCE_INTERNAL_CHAIN, keyIdxs[i]);
+        if (! UInt256Eq(keyList[i].secret, pathKey.secret))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BIP32PrivKeyList() test %zu\n", __func__, i);
+    }
+
+    BRBIP44PrivKeyList(keyList, sizeof(keyIdxs) / sizeof(*keyIdxs), &seed, sizeof(seed), 175, 0,
+                       SEQUENCE_EXTERNAL_CHAIN, keyIdxs);
+
+    for (size_t i = 0; i < sizeof(keyIdxs) / sizeof(*keyIdxs); i++) {
+        BRBIP32PrivKeyPath(&pathKey, &seed, sizeof(seed), 5, BIP44_PURPOSE | BIP32_HARD, 175 | BIP32_HARD,
+                           0 | BIP32_HARD, SEQUENCE_EXTERNAL_CHAIN, keyIdxs[i]);
+        if (! UInt256Eq(keyList[i].secret, pathKey.secret))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BIP44PrivKeyList() test %zu\n", __func__, i);
+    }
+
     UInt512 dk;
     BRAddress addr;
 
@@ -1585,6 +1883,30 @@ int TransactionTests() {
     if (!BRTransactionIsSigned(tx) || !BRAddressEq(&address, &addr))
         r = 0, fprintf(stderr, "***FAILED*** %s: TransactionSign() test 2\n", __func__);
 
+    BRTransaction *sigTx = BRTransactionNew(1);
+    UInt256 mds[50], mds2[50];
+
+    for (uint32_t i = 0; i < 50; i++) {
+        UInt256 h = UINT256_ZERO;
+
+        h.u32[0] = i + 1;
+        BRTransactionAddInput(sigTx, h, i % 3, 1, script, scriptLen, NULL, 0, TXIN_SEQUENCE - (i % 2));
+    }
+
+    BRTransactionAddOutput(sigTx, 100000000, script, scriptLen);
+    BRTransactionAddOutput(sigTx, 4900000000, script, scriptLen);
+    BRTransactionSigHashes(mds, sigTx, 0, 50);
+    BRTransactionSigHashes(mds2, sigTx, 0, 17); // disjoint ranges must hash the same as the whole tx
+    BRTransactionSigHashes(&mds2[17], sigTx, 17, 50);
+    if (memcmp(mds, mds2, sizeof(mds)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: TransactionSigHashes() test\n", __func__);
+
+    BRTransactionSign(sigTx, &k[1], 1); // txHash is from signing each input's fully serialized pre-image
+    if (! BRTransactionIsSigned(sigTx) ||
+        ! UInt256Eq(sigTx->txHash, u256_hex_decode("15e4c392341d1b75d6461afd274948f4cc05829624b52fe387632adc3db87ec0")))
+        r = 0, fprintf(stderr, "***FAILED*** %s: TransactionSign() test 3\n", __func__);
+    BRTransactionFree(sigTx);
+
     uint8_t buf4[BRTransactionSerialize(tx, NULL, 0)];
     size_t len4 = BRTransactionSerialize(tx, buf4, sizeof(buf4));
 
@@ -1599,6 +1921,27 @@ int TransactionTests() {
     
     if (len4 != len5 || memcmp(buf4, buf5, len4) != 0)
         r = 0, fprintf(stderr, "***FAILED*** %s: TransactionSerialize() test 2\n", __func__);
+
+    BRTransaction *tx2 = BRTransactionParseLazy(buf4, len4);
+
+    if (! tx2 || ! UInt256Eq(tx->txHash, tx2->txHash) || tx2->inputs[0].address[0] != '\0' ||
+        tx2->outputs[0].address[0] != '\0')
+        r = 0, fprintf(stderr, "***FAILED*** %s: TransactionParseLazy() test\n", __func__);
+    if (! tx2) return r;
+
+    BRTransactionSetAddresses(tx2);
+
+    for (size_t i = 0; i < tx->inCount; i++) {
+        if (! BRAddressEq(tx->inputs[i].address, tx2->inputs[i].address))
+            r = 0, fprintf(stderr, "***FAILED*** %s: TransactionSetAddresses() test 1 (%zu)\n", __func__, i);
+    }
+
+    for (size_t i = 0; i < tx->outCount; i++) {
+        if (! BRAddressEq(tx->outputs[i].address, tx2->outputs[i].address))
+            r = 0, fprintf(stderr, "***FAILED*** %s: TransactionSetAddresses() test 2 (%zu)\n", __func__, i);
+    }
+
+    BRTransactionFree(tx2);
     BRTransactionFree(tx);
     
     return r;
@@ -1920,7 +2263,160 @@ int MerkleBlockTests() {
                     u256_hex_decode("c9ab658448c10b6921b7a4ce3021eb22ed6bb6a7fde1e5bcc4b1db6615c6abc5")))
         r = 0, fprintf(stderr, "***FAILED*** %s: MerkleBlockTxHashes() test 4\n", __func__);
     
-    // TODO: test a block with an odd number of tree rows both at the tx level and merkle node level
+    uint8_t headers[81 * 200];
+    BRMerkleBlock *headerBlocks[200], *h;
+
+    for (size_t i = 0; i < 200; i++) { // headers on both sides of the X16Rv2 activation time
+        memcpy(&headers[81 * i], block, 80);
+        UInt32SetLE(&headers[81 * i + 68], X16RV2ActivationTime - 100 + (uint32_t) i);
+        UInt32SetLE(&headers[81 * i + 76], (uint32_t) i);
+        headers[81 * i + 80] = 0;
+    }
+
+    if (BRMerkleBlockParseHeaders(headerBlocks, 200, headers, sizeof(headers), 81, 0) != 200)
+        r = 0, fprintf(stderr, "***FAILED*** %s: MerkleBlockParseHeaders() test 1\n", __func__);
+
+    for (size_t i = 0; i < 200; i++) {
+        h = BRMerkleBlockParse(&headers[81 * i], 81);
+
+        if (! UInt256Eq(h->blockHash, headerBlocks[i]->blockHash) || h->timestamp != headerBlocks[i]->timestamp ||
+            h->nonce != headerBlocks[i]->nonce)
+            r = 0, fprintf(stderr, "***FAILED*** %s: MerkleBlockParseHeaders() test 2 (%zu)\n", __func__, i);
+
+        BRMerkleBlockFree(h);
+        BRMerkleBlockFree(headerBlocks[i]);
+    }
+
+    for (size_t i = 1; i < 200; i++) { // link the headers so that all but the last can take their hash from the next
+        h = BRMerkleBlockParse(&headers[81 * (i - 1)], 81);
+        UInt256Set(&headers[81 * i + 4], h->blockHash);
+        BRMerkleBlockFree(h);
+    }
+
+    if (BRMerkleBlockParseHeaders(headerBlocks, 200, headers, sizeof(headers), 81, 200) != 200)
+        r = 0, fprintf(stderr, "***FAILED*** %s: MerkleBlockParseHeaders() test 3\n", __func__);
+
+    for (size_t i = 0; i < 200; i++) {
+        h = BRMerkleBlockParse(&headers[81 * i], 81);
+
+        if (! UInt256Eq(h->blockHash, headerBlocks[i]->blockHash) ||
+            ! UInt256Eq(h->prevBlock, headerBlocks[i]->prevBlock))
+            r = 0, fprintf(stderr, "***FAILED*** %s: MerkleBlockParseHeaders() test 4 (%zu)\n", __func__, i);
+
+        BRMerkleBlockFree(h);
+        BRMerkleBlockFree(headerBlocks[i]);
+    }
+
+    uint8_t trusted[sizeof(block) - 1 + MERKLE_BLOCK_TRUSTED_LENGTH];
+
+    b->height = 10001;
+
+    if (BRMerkleBlockSerializeTrusted(b, trusted, sizeof(trusted)) != sizeof(trusted))
+        r = 0, fprintf(stderr, "***FAILED*** %s: MerkleBlockSerializeTrusted() test\n", __func__);
+
+    h = BRMerkleBlockParseTrusted(trusted, sizeof(trusted));
+
+    if (! h || ! UInt256Eq(h->blockHash, b->blockHash) || h->height != b->height ||
+        BRMerkleBlockSerialize(h, block2, sizeof(block2)) != sizeof(block2) || memcmp(block, block2, sizeof(block2)))
+        r = 0, fprintf(stderr, "***FAILED*** %s: MerkleBlockParseTrusted() test 1\n", __func__);
+
+    if (h) BRMerkleBlockFree(h);
+    trusted[70] ^= 0x01;
+    h = BRMerkleBlockParseTrusted(trusted, sizeof(trusted));
+
+    if (h) // a corrupted serialization must be rejected rather than restored with a stale hash
+        r = 0, fprintf(stderr, "***FAILED*** %s: MerkleBlockParseTrusted() test 2\n", __func__), BRMerkleBlockFree(h);
+
+    if (BRMerkleBlockParseHeaders(headerBlocks, 200, headers, sizeof(headers), 81, 0) != 200)
+        r = 0, fprintf(stderr, "***FAILED*** %s: MerkleBlockParseHeaders() test 5\n", __func__);
+
+    if (BRMerkleBlockVerifyHashes(headerBlocks, 200) != 200)
+        r = 0, fprintf(stderr, "***FAILED*** %s: MerkleBlockVerifyHashes() test 1\n", __func__);
+
+    headerBlocks[150]->blockHash.u8[0] ^= 0x01;
+
+    if (BRMerkleBlockVerifyHashes(headerBlocks, 200) != 150)
+        r = 0, fprintf(stderr, "***FAILED*** %s: MerkleBlockVerifyHashes() test 2\n", __func__);
+
+    for (size_t i = 0; i < 200; i++) BRMerkleBlockFree(headerBlocks[i]);
+
+    BRMerkleBlock dgwBlocks[DGW_PAST_BLOCKS*2 + 20];
+    BRSet *dgwSet = BRSetNew(BRMerkleBlockHash, BRMerkleBlockEq, sizeof(dgwBlocks)/sizeof(*dgwBlocks));
+    BRDarkGravityWave dgw;
+    const size_t dgwHeights[] = { 0, 1, 99, 179, 180, 181, 250, 379 };
+    const uint32_t dgwTargets[] = { 0x1b029a68, 0x1b046230, 0x1b082187, 0x1b08276e, 0x1b082562, 0x1b082355,
+                                    0x1b081aa9, 0x1b082854 };
+
+    for (size_t i = 0; i < sizeof(dgwBlocks)/sizeof(*dgwBlocks); i++) {
+        memset(&dgwBlocks[i], 0, sizeof(*dgwBlocks));
+        SHA256(&dgwBlocks[i].blockHash, &i, sizeof(i));
+        if (i > 0) dgwBlocks[i].prevBlock = dgwBlocks[i - 1].blockHash;
+        dgwBlocks[i].height = DGW_START_BLOCK + 1 + (uint32_t) i;
+        dgwBlocks[i].timestamp = 1535599185 + (uint32_t) (i*60 + (i*i*7) % 97);
+        dgwBlocks[i].target = 0x1b07cf3a + (uint32_t) (i % 13)*0x1000;
+        BRSetAdd(dgwSet, &dgwBlocks[i]);
+    }
+
+    for (size_t i = 0; i < sizeof(dgwHeights)/sizeof(*dgwHeights); i++) {
+        if (DarkGravityWaveTarget(&dgwBlocks[dgwHeights[i]], dgwSet) != dgwTargets[i])
+            r = 0, fprintf(stderr, "***FAILED*** %s: DarkGravityWaveTarget() test (%zu)\n", __func__, i);
+    }
+
+    // the rolling window must match recomputing it from the block set, including after rewinding to a fork point
+    BRDarkGravityWaveInit(&dgw, &dgwBlocks[0], dgwSet);
+
+    for (size_t i = 1, j = 0; i < sizeof(dgwBlocks)/sizeof(*dgwBlocks); i++) {
+        if (i == DGW_PAST_BLOCKS + 50 && j++ == 0) BRDarkGravityWaveInit(&dgw, &dgwBlocks[i - 40], dgwSet), i -= 39;
+        BRDarkGravityWaveAddBlock(&dgw, &dgwBlocks[i]);
+
+        if (BRDarkGravityWaveTarget(&dgw) != DarkGravityWaveTarget(&dgwBlocks[i], dgwSet))
+            r = 0, fprintf(stderr, "***FAILED*** %s: DarkGravityWaveAddBlock() test (%zu)\n", __func__, i);
+    }
+
+    BRSetFree(dgwSet);
+
+    // five tx, so both the tx row and the row above it have an odd number of nodes, matching only the last tx
+    UInt256 tx[5], row1[6], row2[4], root, treeHashes[2], matched[2];
+    uint8_t treeFlags[] = { 0x1d }, treeBuf[80 + 4 + 1 + sizeof(treeHashes) + 1 + sizeof(treeFlags)];
+
+    for (uint32_t i = 0; i < 5; i++) SHA256(&tx[i], &i, sizeof(i));
+    memcpy(row1, tx, sizeof(tx));
+    row1[5] = tx[4];
+    SHA256_2_64(row1, row1, 3);
+    row1[3] = row1[2];
+    SHA256_2_64(row2, row1, 2);
+    row2[2] = row2[1];
+    SHA256_2_64(&root, row2, 1);
+    treeHashes[0] = row2[0], treeHashes[1] = tx[4];
+    h = BRMerkleBlockNew();
+    h->merkleRoot = root;
+    h->totalTx = 5;
+    BRMerkleBlockSetTxHashes(h, treeHashes, 2, treeFlags, sizeof(treeFlags));
+
+    if (BRMerkleBlockSerialize(h, treeBuf, sizeof(treeBuf)) != sizeof(treeBuf))
+        r = 0, fprintf(stderr, "***FAILED*** %s: MerkleBlockSerialize() test 2\n", __func__);
+
+    if (h->treeState != 0 || BRMerkleBlockTxHashes(h, matched, 2) != 1 || ! UInt256Eq(matched[0], tx[4]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: MerkleBlockTxHashes() test 5\n", __func__);
+
+    BRMerkleBlockFree(h);
+    h = BRMerkleBlockParse(treeBuf, sizeof(treeBuf));
+
+    if (h->treeState != 1 || BRMerkleBlockTxHashes(h, NULL, 0) != 1 || BRMerkleBlockTxHashes(h, matched, 2) != 1 ||
+        ! UInt256Eq(matched[0], tx[4]))
+        r = 0, fprintf(stderr, "***FAILED*** %s: MerkleBlockTxHashes() test 6\n", __func__);
+
+    BRMerkleBlockFree(h);
+    treeBuf[80 + 4 + 1] ^= 0x01; // corrupt the hash of the left branch
+    h = BRMerkleBlockParse(treeBuf, sizeof(treeBuf));
+
+    if (h->treeState != -1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: MerkleBlockIsValid() merkle tree test\n", __func__);
+
+    BRMerkleBlockFree(h);
+
+    if (b->treeState != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: MerkleBlockParse() merkle tree test\n", __func__);
 
     // TODO: XXX test MerkleBlockVerifyDifficulty()
     
@@ -1930,8 +2426,6 @@ int MerkleBlockTests() {
     return r;
 }
 
-void PeerAcceptMessageTest(BRPeer *peer, const uint8_t *msg, size_t len, const char *type);
-
 int PeerTests() {
     int r = 1;
     BRPeer *p = BRPeerNew(BR_CHAIN_PARAMS.magicNumber);
@@ -1941,6 +2435,752 @@ int PeerTests() {
     return r;
 }
 
+static void _PeerEventLoopTestDisconnected(void *info, int error) {
+    *(volatile int *)info = (error) ? error : -1;
+}
+
+// waits up to seconds for the peer disconnected callback, returns its error code, -1 for none, 0 if it wasn't called
+static int _PeerEventLoopTestWait(volatile int *disconnected, int seconds) {
+    for (int i = 0; *disconnected == 0 && i < seconds*100; i++) usleep(10000);
+    return *disconnected;
+}
+
+int PeerEventLoopTests() {
+    int r = 1, listener = socket(AF_INET, SOCK_STREAM, 0), fd = -1;
+    volatile int disconnected = 0;
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    struct timeval tv = { 5, 0 };
+    uint8_t header[24];
+    BRPeerEventLoop *loop = BRPeerEventLoopNew();
+    BRPeer *p = BRPeerNew(BR_CHAIN_PARAMS.magicNumber);
+
+    if (! loop) { // no event loop on this platform
+        BRPeerFree(p);
+        close(listener);
+        return r;
+    }
+
+    // a local socket stands in for the remote node
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 1) < 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &addrLen) < 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: listen test\n", __func__);
+
+    setsockopt(listener, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    p->address = ((UInt128) { .u8 = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 127, 0, 0, 1 } });
+    p->port = ntohs(addr.sin_port);
+    BRPeerSetCallbacks(p, (void *)&disconnected, NULL, _PeerEventLoopTestDisconnected, NULL, NULL, NULL, NULL, NULL,
+                       NULL, NULL, NULL, NULL, NULL);
+    BRPeerSetEventLoop(p, loop);
+
+    // the version message is sent once the non-blocking connect completes
+    if (r) BRPeerConnect(p);
+    if (r) fd = accept(listener, NULL, NULL);
+    if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (fd < 0 || recv(fd, header, sizeof(header), MSG_WAITALL) != sizeof(header) ||
+        UInt32GetLE(header) != BR_CHAIN_PARAMS.magicNumber || strcmp((const char *)&header[4], MSG_VERSION) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerConnect() test\n", __func__);
+
+    // the loop notices when the remote node hangs up
+    if (fd >= 0) close(fd);
+    fd = -1;
+
+    if (r && (_PeerEventLoopTestWait(&disconnected, 5) <= 0 || disconnected == ETIMEDOUT))
+        r = 0, fprintf(stderr, "***FAILED*** %s: remote disconnect test\n", __func__);
+
+    // a scheduled disconnect fires from the timer wheel while the handshake is pending
+    disconnected = 0;
+    if (r) BRPeerConnect(p);
+    if (r) BRPeerScheduleDisconnect(p, 0.5);
+    if (r) fd = accept(listener, NULL, NULL);
+
+    if (r && _PeerEventLoopTestWait(&disconnected, 5) != ETIMEDOUT)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerScheduleDisconnect() test\n", __func__);
+
+    // a local disconnect is reported without an error
+    disconnected = 0;
+    if (fd >= 0) close(fd);
+    if (r) BRPeerConnect(p);
+    if (r) fd = accept(listener, NULL, NULL);
+    if (r) BRPeerDisconnect(p);
+
+    if (r && _PeerEventLoopTestWait(&disconnected, 5) != -1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerDisconnect() test\n", __func__);
+
+    if (_PeerEventLoopTestWait(&disconnected, 5) == 0) BRPeerDisconnect(p), _PeerEventLoopTestWait(&disconnected, 5);
+    if (fd >= 0) close(fd);
+    close(listener);
+    BRPeerEventLoopFree(loop);
+    BRPeerFree(p);
+    return r;
+}
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define FRAMING_TEST_MSGS   32
+#define FRAMING_TEST_LENGTH 0x100000
+
+struct PeerFramingTestInfo {
+    BRPeer *peer;
+    const uint8_t *msg;
+};
+
+static void *_PeerFramingTestSend(void *arg) {
+    struct PeerFramingTestInfo *info = arg;
+
+    for (int i = 0; i < FRAMING_TEST_MSGS; i++) BRPeerSendMessage(info->peer, info->msg, FRAMING_TEST_LENGTH, "bench");
+    return NULL;
+}
+
+// frames msg the way the remote node would, returns the number of bytes written to buf
+static size_t _PeerFramingTestFrame(uint8_t *buf, const char *type, const uint8_t *msg, size_t msgLen) {
+    uint8_t hash[32];
+
+    SHA256_2(hash, msg, msgLen);
+    UInt32SetLE(buf, BR_CHAIN_PARAMS.magicNumber);
+    memset(&buf[4], 0, 12);
+    strncpy((char *)&buf[4], type, 12);
+    UInt32SetLE(&buf[16], (uint32_t)msgLen);
+    memcpy(&buf[20], hash, sizeof(uint32_t));
+    memcpy(&buf[24], msg, msgLen);
+    return 24 + msgLen;
+}
+
+// reads the next message sent to the remote node, returns its payload length, or -1 on error
+static ssize_t _PeerFramingTestRecv(int fd, uint8_t *header, uint8_t *buf, size_t bufLen) {
+    size_t msgLen;
+
+    if (recv(fd, header, 24, MSG_WAITALL) != 24 || UInt32GetLE(header) != BR_CHAIN_PARAMS.magicNumber) return -1;
+    msgLen = UInt32GetLE(&header[16]);
+    if (msgLen > bufLen || (msgLen > 0 && recv(fd, buf, msgLen, MSG_WAITALL) != (ssize_t)msgLen)) return -1;
+    return (ssize_t)msgLen;
+}
+
+// measures message throughput in MB/s each way between a peer, run from loop if set, and a local stand-in node
+static int _PeerFramingTest(BRPeerEventLoop *loop, double *inRate, double *outRate) {
+    int r = 1, listener = socket(AF_INET, SOCK_STREAM, 0), fd = -1, i;
+    volatile int disconnected = 0;
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    struct timeval tv = { 5, 0 }, start, end;
+    size_t streamLen = 5 + (24 + FRAMING_TEST_LENGTH)*FRAMING_TEST_MSGS + 24 + sizeof(uint64_t), off = 0;
+    uint8_t *stream = malloc(streamLen), *msg = malloc(FRAMING_TEST_LENGTH), *buf = malloc(FRAMING_TEST_LENGTH),
+            header[24], nonce[sizeof(uint64_t)] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    struct PeerFramingTestInfo info;
+    pthread_t thread;
+    ssize_t n = 0;
+    BRPeer *p = BRPeerNew(BR_CHAIN_PARAMS.magicNumber);
+
+    // the stand-in node sends something that only starts like a message header, bulk messages, and then a ping
+    for (i = 0; i < FRAMING_TEST_LENGTH; i++) msg[i] = (uint8_t)(i*7);
+    UInt32SetLE(stream, BR_CHAIN_PARAMS.magicNumber);
+    stream[3] = 0;
+    stream[4] = stream[0];
+    off = 5;
+    for (i = 0; i < FRAMING_TEST_MSGS; i++) {
+        off += _PeerFramingTestFrame(&stream[off], "bench", msg, FRAMING_TEST_LENGTH);
+    }
+
+    off += _PeerFramingTestFrame(&stream[off], MSG_PING, nonce, sizeof(nonce));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 1) < 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &addrLen) < 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: listen test\n", __func__);
+
+    setsockopt(listener, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    p->address = ((UInt128) { .u8 = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 127, 0, 0, 1 } });
+    p->port = ntohs(addr.sin_port);
+    BRPeerSetCallbacks(p, (void *)&disconnected, NULL, _PeerEventLoopTestDisconnected, NULL, NULL, NULL, NULL, NULL,
+                       NULL, NULL, NULL, NULL, NULL);
+    BRPeerSetEventLoop(p, loop);
+    if (r) BRPeerConnect(p);
+    if (r) BRPeerScheduleDisconnect(p, -1); // there's no handshake
+    if (r) fd = accept(listener, NULL, NULL);
+    if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (fd < 0 || _PeerFramingTestRecv(fd, header, buf, FRAMING_TEST_LENGTH) < 0 ||
+        strcmp((const char *)&header[4], MSG_VERSION) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerConnect() test\n", __func__);
+
+    // the peer has accepted everything before the ping once the pong comes back
+    gettimeofday(&start, NULL);
+
+    for (off = 0; r && off < streamLen; off += n) {
+        n = send(fd, &stream[off], streamLen - off, MSG_NOSIGNAL);
+        if (n <= 0) r = 0, fprintf(stderr, "***FAILED*** %s: stand-in send test\n", __func__);
+    }
+
+    while (r && (n = _PeerFramingTestRecv(fd, header, buf, FRAMING_TEST_LENGTH)) >= 0 &&
+           strcmp((const char *)&header[4], MSG_PONG) != 0);
+
+    if (r && (n != sizeof(nonce) || memcmp(buf, nonce, sizeof(nonce)) != 0))
+        r = 0, fprintf(stderr, "***FAILED*** %s: receive test\n", __func__);
+
+    gettimeofday(&end, NULL);
+    *inRate = streamLen/((end.tv_sec - start.tv_sec)*1e6 + (end.tv_usec - start.tv_usec));
+
+    // messages sent by the peer arrive intact and in order
+    info.peer = p;
+    info.msg = msg;
+    gettimeofday(&start, NULL);
+
+    if (r && pthread_create(&thread, NULL, _PeerFramingTestSend, &info) != 0) {
+        r = 0, fprintf(stderr, "***FAILED*** %s: pthread_create() test\n", __func__);
+    }
+    else if (r) {
+        for (i = 0; r && i < FRAMING_TEST_MSGS; i++) {
+            if (_PeerFramingTestRecv(fd, header, buf, FRAMING_TEST_LENGTH) != FRAMING_TEST_LENGTH ||
+                strcmp((const char *)&header[4], "bench") != 0 || memcmp(buf, msg, FRAMING_TEST_LENGTH) != 0)
+                r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerSendMessage() test %d\n", __func__, i);
+        }
+
+        if (! r) close(fd), fd = -1; // lets the sender give up
+        pthread_join(thread, NULL);
+    }
+
+    gettimeofday(&end, NULL);
+    *outRate = (24 + FRAMING_TEST_LENGTH)*FRAMING_TEST_MSGS/
+               ((end.tv_sec - start.tv_sec)*1e6 + (end.tv_usec - start.tv_usec));
+
+    if (_PeerEventLoopTestWait(&disconnected, 0) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: connection test\n", __func__);
+
+    BRPeerDisconnect(p);
+    _PeerEventLoopTestWait(&disconnected, 5);
+    if (fd >= 0) close(fd);
+    close(listener);
+    BRPeerFree(p);
+    free(stream);
+    free(msg);
+    free(buf);
+    return r;
+}
+
+int PeerFramingTests() {
+    int r = 1;
+    double inRate = 0, outRate = 0;
+    BRPeerEventLoop *loop = BRPeerEventLoopNew();
+
+    if (! _PeerFramingTest(NULL, &inRate, &outRate))
+        r = 0, fprintf(stderr, "***FAILED*** %s: peer thread test\n", __func__);
+    else printf("thread in/out %.0f/%.0fMB/s ", inRate, outRate);
+
+    if (loop && ! _PeerFramingTest(loop, &inRate, &outRate))
+        r = 0, fprintf(stderr, "***FAILED*** %s: event loop test\n", __func__);
+    else if (loop) printf("loop in/out %.0f/%.0fMB/s ", inRate, outRate);
+
+    if (loop) BRPeerEventLoopFree(loop);
+    return r;
+}
+
+int WalletBalanceTests() {
+    int r = 1;
+    BRMasterPubKey mpk = BRBIP32MasterPubKey("", 1);
+    BRWallet *w = BRWalletNew(NULL, 0, mpk);
+    UInt256 secret = u256_hex_decode("0000000000000000000000000000000000000000000000000000000000000001");
+    uint8_t sig[] = { 0 };
+    BRKey k;
+    BRAddress addr, recvAddr = BRWalletReceiveAddress(w);
+    BRTransaction *tx, *prev = NULL, *txs[4];
+    uint64_t balance = 0, hist[4];
+    size_t i, utxoCount;
+
+    BRKeySetSecret(&k, &secret, 1);
+    BRKeyAddress(&k, addr.s, sizeof(addr));
+
+    uint8_t inScript[BRAddressScriptPubKey(NULL, 0, addr.s)];
+    size_t inScriptLen = BRAddressScriptPubKey(inScript, sizeof(inScript), addr.s);
+    uint8_t outScript[BRAddressScriptPubKey(NULL, 0, recvAddr.s)];
+    size_t outScriptLen = BRAddressScriptPubKey(outScript, sizeof(outScript), recvAddr.s);
+
+    // per tx registration work must stay flat as the wallet grows, every fourth tx spends the one before it
+    for (i = 1; r && i <= 50000; i++) {
+        tx = BRTransactionNew(1);
+
+        if ((i % 4) == 0) {
+            BRTransactionAddInput(tx, prev->txHash, 0, CORBIES, outScript, outScriptLen, sig, sizeof(sig),
+                                  TXIN_SEQUENCE);
+            BRTransactionAddOutput(tx, CORBIES/2, inScript, inScriptLen);
+            balance -= CORBIES;
+        }
+        else {
+            BRTransactionAddInput(tx, secret, (uint32_t)i, CORBIES, inScript, inScriptLen, sig, sizeof(sig),
+                                  TXIN_SEQUENCE);
+            BRTransactionAddOutput(tx, CORBIES, outScript, outScriptLen);
+            balance += CORBIES;
+        }
+
+        SHA256(&tx->txHash, &i, sizeof(i));
+        tx->blockHeight = (uint32_t)i;
+        tx->timestamp = 1 + (uint32_t)i;
+        if (i > 50000 - 4) txs[i - (50000 - 3)] = tx;
+        prev = tx;
+
+        if (! BRWalletRegisterTransaction(w, tx)) {
+            r = 0, fprintf(stderr, "***FAILED*** %s: WalletRegisterTransaction() test 1 (%zu)\n", __func__, i);
+            BRTransactionFree(tx);
+            break;
+        }
+
+        if (BRWalletBalance(w) != balance)
+            r = 0, fprintf(stderr, "***FAILED*** %s: WalletRegisterTransaction() test 2 (%zu)\n", __func__, i);
+    }
+
+    // each tx is applied once, and adds or spends a single UTXO without a search through the others
+    if (r && WalletWorkCountTest(w) > 50000*4)
+        r = 0, fprintf(stderr, "***FAILED*** %s: WalletRegisterTransaction() test 3 (%zu)\n", __func__,
+                       WalletWorkCountTest(w));
+
+    utxoCount = BRWalletUTXOs(w, NULL, 0);
+    if (r && utxoCount != 50000/2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: WalletUTXOs() test\n", __func__);
+
+    for (i = 0; r && i < 4; i++) hist[i] = BRWalletBalanceAfterTx(w, txs[i]);
+
+    // a re-org falls back to a full replay, which must end up in the same state
+    BRWalletSetTxUnconfirmedAfter(w, 50000 - 6);
+
+    if (r && (BRWalletBalance(w) != balance || BRWalletUTXOs(w, NULL, 0) != utxoCount))
+        r = 0, fprintf(stderr, "***FAILED*** %s: WalletSetTxUnconfirmedAfter() test\n", __func__);
+
+    if (! BRWalletContainsAddress(w, recvAddr.s) || ! BRWalletAddressIsUsed(w, recvAddr.s) ||
+        BRWalletContainsAddress(w, addr.s) || ! BRWalletAddressIsUsed(w, addr.s))
+        r = 0, fprintf(stderr, "***FAILED*** %s: WalletAddressIsUsed() test\n", __func__);
+
+    for (i = 0; r && i < 4; i++) {
+        if (BRWalletBalanceAfterTx(w, txs[i]) != hist[i])
+            r = 0, fprintf(stderr, "***FAILED*** %s: WalletBalanceAfterTx() test (%zu)\n", __func__, i);
+    }
+
+    BRWalletFree(w);
+
+    // loading a wallet sorts by height, and within a height by ancestry, whatever order the transactions come in
+    BRTransaction **loaded = calloc(20000, sizeof(*loaded));
+
+    for (i = 0; i < 20000; i++) {
+        tx = BRTransactionNew(1);
+
+        if (i > 0 && (i % 100) == 0) { // spends the tx that follows it, at the same height
+            BRTransactionAddInput(tx, secret, 0, CORBIES, outScript, outScriptLen, sig, sizeof(sig),
+                                  TXIN_SEQUENCE);
+            tx->blockHeight = (uint32_t)(20000 - i);
+        }
+        else {
+            BRTransactionAddInput(tx, secret, (uint32_t)i, CORBIES, inScript, inScriptLen, sig, sizeof(sig),
+                                  TXIN_SEQUENCE);
+            tx->blockHeight = (uint32_t)(20000 - i + ((i % 100) == 1 ? 1 : 0));
+        }
+
+        BRTransactionAddOutput(tx, CORBIES, outScript, outScriptLen);
+        SHA256(&tx->txHash, &i, sizeof(i));
+        if (i > 0 && (i % 100) == 1) loaded[i - 1]->inputs[0].txHash = tx->txHash;
+        loaded[i] = tx;
+    }
+
+    w = BRWalletNew(loaded, 20000, mpk);
+    if (! w) r = 0, fprintf(stderr, "***FAILED*** %s: WalletNew() test\n", __func__);
+    if (! w) return r;
+    BRWalletTransactions(w, loaded, 20000);
+
+    for (i = 1; r && i < 20000; i++) {
+        if (loaded[i - 1]->blockHeight <= loaded[i]->blockHeight &&
+            (loaded[i - 1]->blockHeight < loaded[i]->blockHeight ||
+             UInt256Eq(loaded[i]->inputs[0].txHash, loaded[i - 1]->txHash))) continue;
+        r = 0, fprintf(stderr, "***FAILED*** %s: WalletTransactions() test (%zu)\n", __func__, i);
+    }
+
+    free(loaded);
+    BRWalletFree(w);
+
+    // registering below the tip, confirming a pending tx and removing a tx only take back and apply again the tx from
+    // where the change sorts to, which must leave the same state, utxo order included, as replaying every tx anew
+    BRTransaction *mixed[200], *copies[200];
+    UTXO utxos1[200], utxos2[200];
+    BRWallet *replayed;
+    size_t j, txCount;
+
+    w = BRWalletNew(NULL, 0, mpk);
+
+    for (i = 0; r && i < 200; i++) {
+        tx = BRTransactionNew(1);
+
+        if ((i % 5) == 4) { // spends the tx three before it
+            BRTransactionAddInput(tx, mixed[i - 3]->txHash, 0, CORBIES, outScript, outScriptLen, sig, sizeof(sig),
+                                  TXIN_SEQUENCE);
+            BRTransactionAddOutput(tx, CORBIES/2, inScript, inScriptLen);
+            tx->blockHeight = (uint32_t)(300 + i);
+        }
+        else {
+            BRTransactionAddInput(tx, secret, (uint32_t)i, CORBIES, inScript, inScriptLen, sig, sizeof(sig),
+                                  TXIN_SEQUENCE);
+            BRTransactionAddOutput(tx, CORBIES, outScript, outScriptLen);
+            tx->blockHeight = (uint32_t)(1 + (i*37) % 200);
+        }
+
+        if (i == 151) tx->lockTime = (uint32_t)time(NULL) + 100000, tx->inputs[0].sequence = 0; // future lockTime
+        if (i == 151 || i == 154) tx->blockHeight = TX_UNCONFIRMED;
+        SHA256(&tx->txHash, &i, sizeof(i));
+        tx->timestamp = 1 + (uint32_t)i;
+        mixed[i] = tx;
+
+        if (! BRWalletRegisterTransaction(w, tx)) {
+            r = 0, fprintf(stderr, "***FAILED*** %s: WalletRegisterTransaction() test 4 (%zu)\n", __func__, i);
+            BRTransactionFree(tx);
+        }
+    }
+
+    if (r && (! BRWalletTransactionIsPending(w, mixed[151]) || ! BRWalletTransactionIsPending(w, mixed[154])))
+        r = 0, fprintf(stderr, "***FAILED*** %s: WalletTransactionIsPending() test\n", __func__);
+
+    if (r) BRWalletUpdateTransactions(w, &mixed[151]->txHash, 1, 500, 501); // still sorts before mixed[154]
+    if (r) BRWalletRemoveTransaction(w, mixed[11]->txHash); // along with mixed[14], which spends it
+    txCount = (r) ? BRWalletTransactions(w, copies, 200) : 0;
+    if (r && txCount != 198) r = 0, fprintf(stderr, "***FAILED*** %s: WalletRemoveTransaction() test\n", __func__);
+    for (i = 0; i < txCount; i++) copies[i] = BRTransactionCopy(copies[i]);
+    replayed = (r) ? BRWalletNew(copies, txCount, mpk) : NULL;
+
+    if (replayed) {
+        if (BRWalletBalance(w) != BRWalletBalance(replayed) || BRWalletTotalSent(w) != BRWalletTotalSent(replayed) ||
+            BRWalletTotalReceived(w) != BRWalletTotalReceived(replayed))
+            r = 0, fprintf(stderr, "***FAILED*** %s: WalletBalance() test\n", __func__);
+
+        utxoCount = BRWalletUTXOs(w, utxos1, 200);
+        if (BRWalletUTXOs(replayed, utxos2, 200) != utxoCount)
+            r = 0, fprintf(stderr, "***FAILED*** %s: WalletUTXOs() test 2\n", __func__);
+
+        for (i = 0; r && i < utxoCount; i++) {
+            if (UInt256Eq(utxos1[i].hash, utxos2[i].hash) && utxos1[i].n == utxos2[i].n) continue;
+            r = 0, fprintf(stderr, "***FAILED*** %s: WalletUTXOs() order test (%zu)\n", __func__, i);
+        }
+
+        // spending a utxo leaves the rest in the order of the transactions that added them
+        for (i = 0, j = 0; r && i < txCount && j < utxoCount; i++) {
+            if (UInt256Eq(copies[i]->txHash, utxos1[j].hash)) j++;
+        }
+
+        if (r && j != utxoCount) r = 0, fprintf(stderr, "***FAILED*** %s: WalletUTXOs() order test 2\n", __func__);
+
+        for (i = 0; r && i < txCount; i++) {
+            if (BRWalletBalanceAfterTx(w, BRWalletTransactionForHash(w, copies[i]->txHash)) ==
+                BRWalletBalanceAfterTx(replayed, copies[i])) continue;
+            r = 0, fprintf(stderr, "***FAILED*** %s: WalletBalanceAfterTx() test 2 (%zu)\n", __func__, i);
+        }
+
+        BRWalletFree(replayed);
+    }
+    else if (r) r = 0, fprintf(stderr, "***FAILED*** %s: WalletNew() test 2\n", __func__);
+
+    BRWalletFree(w);
+
+    // parallel signing must produce the same signatures as signing on the calling thread
+    BRAddress signAddrs[100];
+    BRTransaction *signTx[2];
+    int signed1, signed2;
+
+    w = BRWalletNew(NULL, 0, BRBIP44MasterPubKey("", 1, 175, 0, 1));
+    BRWalletUnusedAddrs(w, signAddrs, 50, SEQUENCE_EXTERNAL_CHAIN);
+    BRWalletUnusedAddrs(w, &signAddrs[50], 50, SEQUENCE_INTERNAL_CHAIN);
+
+    for (i = 0; i < 2; i++) {
+        signTx[i] = BRTransactionNew(1);
+
+        for (uint32_t j = 0; j < 100; j++) {
+            uint8_t script[BRAddressScriptPubKey(NULL, 0, signAddrs[(j * 7) % 100].s)];
+            size_t scriptLen = BRAddressScriptPubKey(script, sizeof(script), signAddrs[(j * 7) % 100].s);
+
+            BRTransactionAddInput(signTx[i], secret, j, CORBIES, script, scriptLen, NULL, 0, TXIN_SEQUENCE);
+        }
+
+        BRTransactionAddOutput(signTx[i], CORBIES, inScript, inScriptLen);
+    }
+
+    signed1 = BRWalletSignTransaction(w, signTx[0], "", 1);
+    BRWalletSetSignThreads(w, 4);
+    signed2 = BRWalletSignTransaction(w, signTx[1], "", 1);
+
+    uint8_t signBuf1[BRTransactionSerialize(signTx[0], NULL, 0)], signBuf2[BRTransactionSerialize(signTx[1], NULL, 0)];
+
+    if (! signed1 || ! signed2 || ! UInt256Eq(signTx[0]->txHash, signTx[1]->txHash) ||
+        sizeof(signBuf1) != sizeof(signBuf2) ||
+        BRTransactionSerialize(signTx[0], signBuf1, sizeof(signBuf1)) != sizeof(signBuf1) ||
+        BRTransactionSerialize(signTx[1], signBuf2, sizeof(signBuf2)) != sizeof(signBuf2) ||
+        memcmp(signBuf1, signBuf2, sizeof(signBuf1)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: WalletSignTransaction() parallel test\n", __func__);
+
+    BRTransactionFree(signTx[0]);
+    BRTransactionFree(signTx[1]);
+    BRWalletFree(w);
+    return r;
+}
+
+int PeerManagerTests() {
+    int r = 1;
+    BRChainParams params = BR_CHAIN_PARAMS;
+    BRMasterPubKey mpk = BRBIP32MasterPubKey("", 1);
+    BRWallet *w = BRWalletNew(NULL, 0, mpk);
+    BRPeer *p = BRPeerNew(params.magicNumber);
+    BRMerkleBlock window[DGW_PAST_BLOCKS + 3], *prev = &window[0], *b; // room for the window of a fork below the tip
+    BRSet *windowSet = BRSetNew(BRMerkleBlockHash, BRMerkleBlockEq, DGW_PAST_BLOCKS + 3);
+    BRPeerManager *manager;
+    char path[] = "/tmp/PeerManagerTestsXXXXXX";
+    int fd = mkstemp(path);
+    uint32_t height;
+    size_t i;
+
+    // start the chain at the last checkpoint before DGW activation, with no saved blocks
+    while (params.checkpointsCount > 1 && params.checkpoints[params.checkpointsCount - 1].height > DGW_START_BLOCK)
+        params.checkpointsCount--;
+
+    manager = BRPeerManagerNew(&params, w, UINT32_MAX, NULL, 0, NULL, 0);
+
+    if (fd < 0 || ! BRPeerManagerSetHeaderFile(manager, path))
+        r = 0, fprintf(stderr, "***FAILED*** %s: PeerManagerSetHeaderFile() test 1\n", __func__);
+    memset(window, 0, sizeof(window));
+    window[0].blockHash = UInt256Reverse(params.checkpoints[params.checkpointsCount - 1].hash);
+    window[0].height = params.checkpoints[params.checkpointsCount - 1].height;
+    window[0].timestamp = params.checkpoints[params.checkpointsCount - 1].timestamp;
+    window[0].target = params.checkpoints[params.checkpointsCount - 1].target;
+    BRSetAdd(windowSet, &window[0]);
+    height = window[0].height;
+
+    // per block verification work must stay flat as the chain grows past DGW activation
+    for (i = 1; r && i <= BLOCK_DIFFICULTY_INTERVAL*10; i++) {
+        b = BRMerkleBlockNew();
+        SHA256(&b->blockHash, &i, sizeof(i));
+        b->prevBlock = prev->blockHash;
+        b->timestamp = prev->timestamp + 45 + (uint32_t)(i % 31); // vary block times to move the target
+        b->target = (uint32_t)DarkGravityWaveTarget(prev, windowSet);
+
+        if (! PeerManagerAddBlockTest(manager, p, b)) {
+            r = 0, fprintf(stderr, "***FAILED*** %s: PeerManagerAddBlock() test 1 (%zu)\n", __func__, i);
+            BRMerkleBlockFree(b);
+            break;
+        }
+
+        BRSetRemove(windowSet, &window[i % (DGW_PAST_BLOCKS + 3)]);
+        window[i % (DGW_PAST_BLOCKS + 3)] = *b;
+        prev = &window[i % (DGW_PAST_BLOCKS + 3)];
+        BRSetAdd(windowSet, prev);
+    }
+
+    // the difficulty window is advanced a block at a time, and each header is pruned once
+    if (r && PeerManagerWorkCountTest(manager) > BLOCK_DIFFICULTY_INTERVAL*10*3 + DGW_PAST_BLOCKS)
+        r = 0, fprintf(stderr, "***FAILED*** %s: PeerManagerAddBlock() test 2 (%zu)\n", __func__,
+                       PeerManagerWorkCountTest(manager));
+
+    if (BRPeerManagerLastBlockHeight(manager) != height + i - 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: PeerManagerLastBlockHeight() test\n", __func__);
+
+    // blocks handed to a helper peer during a split sync are reassembled in order, even if they arrive newest first
+    BRMerkleBlock *syncBlocks[20];
+    size_t j, syncCount = sizeof(syncBlocks)/sizeof(*syncBlocks);
+
+    height = BRPeerManagerLastBlockHeight(manager);
+
+    for (j = 0; r && j < syncCount; j++, i++) {
+        b = syncBlocks[j] = BRMerkleBlockNew();
+        SHA256(&b->blockHash, &i, sizeof(i));
+        b->prevBlock = prev->blockHash;
+        b->height = prev->height + 1;
+        b->timestamp = prev->timestamp + 45 + (uint32_t)(i % 31);
+        b->target = (uint32_t)DarkGravityWaveTarget(prev, windowSet);
+        b->totalTx = 1;
+        BRSetRemove(windowSet, &window[i % (DGW_PAST_BLOCKS + 3)]);
+        window[i % (DGW_PAST_BLOCKS + 3)] = *b;
+        prev = &window[i % (DGW_PAST_BLOCKS + 3)];
+        BRSetAdd(windowSet, prev);
+    }
+
+    if (r && ! PeerManagerSyncWindowTest(manager, p, syncBlocks, syncCount))
+        r = 0, fprintf(stderr, "***FAILED*** %s: PeerManagerSyncWindow() test 1\n", __func__);
+
+    if (r && BRPeerManagerLastBlockHeight(manager) != height + syncCount)
+        r = 0, fprintf(stderr, "***FAILED*** %s: PeerManagerSyncWindow() test 2\n", __func__);
+
+    // a fork from below the tip becomes the main chain once it's longer, its difficulty is checked against a window
+    // rebuilt from the main chain headers
+    BRMerkleBlock fork[3];
+    BRSet *forkSet = BRSetNew(BRMerkleBlockHash, BRMerkleBlockEq, DGW_PAST_BLOCKS + 3);
+
+    height = BRPeerManagerLastBlockHeight(manager);
+    BRSetUnion(forkSet, windowSet);
+    BRSetRemove(forkSet, prev);
+    prev = &window[(i - 2) % (DGW_PAST_BLOCKS + 3)];
+
+    for (j = 0; r && j < 3; j++, i++) {
+        b = BRMerkleBlockNew();
+        SHA256(&b->blockHash, &i, sizeof(i));
+        b->prevBlock = prev->blockHash;
+        b->timestamp = prev->timestamp + 60;
+        b->target = (uint32_t)DarkGravityWaveTarget(prev, forkSet);
+        b->totalTx = 1;
+        fork[j] = *b;
+        fork[j].height = prev->height + 1;
+        prev = &fork[j];
+        BRSetAdd(forkSet, prev);
+
+        if (PeerManagerRelayBlockTest(manager, p, b) != height + j)
+            r = 0, fprintf(stderr, "***FAILED*** %s: PeerManagerRelayBlock() fork test (%zu)\n", __func__, j);
+    }
+
+    // a wallet tx in a main chain block that a reorg moves onto a fork is confirmed again when the chain reorgs back,
+    // though the block is only kept as a header by then, branch[0..1] and [5..6] are one branch, [2..4] the other
+    BRMerkleBlock branch[7];
+    const size_t branchPrev[] = { SIZE_MAX, 0, SIZE_MAX, 2, 3, 1, 5 }; // SIZE_MAX for fork[2]
+    UInt256 secret = UINT256_ZERO, inHash = UINT256_ZERO;
+    BRAddress inAddr, recvAddr = BRWalletReceiveAddress(w);
+    BRTransaction *tx = BRTransactionNew(1), *wtx;
+    BRKey k;
+
+    secret.u8[31] = inHash.u8[31] = 1;
+    BRKeySetSecret(&k, &secret, 1);
+    BRKeyAddress(&k, inAddr.s, sizeof(inAddr));
+
+    uint8_t inScript[BRAddressScriptPubKey(NULL, 0, inAddr.s)], outScript[BRAddressScriptPubKey(NULL, 0, recvAddr.s)];
+
+    BRTransactionAddInput(tx, inHash, 0, 1, inScript, BRAddressScriptPubKey(inScript, sizeof(inScript), inAddr.s),
+                          NULL, 0, TXIN_SEQUENCE);
+    BRTransactionAddOutput(tx, 1000000, outScript, BRAddressScriptPubKey(outScript, sizeof(outScript), recvAddr.s));
+    BRTransactionSign(tx, &k, 1);
+    BRWalletRegisterTransaction(w, tx);
+    height = BRPeerManagerLastBlockHeight(manager) + 1;
+
+    for (j = 0; r && j < 7; j++, i++) {
+        prev = (branchPrev[j] == SIZE_MAX) ? &fork[2] : &branch[branchPrev[j]];
+        b = BRMerkleBlockNew();
+        SHA256(&b->blockHash, &i, sizeof(i));
+        b->prevBlock = prev->blockHash;
+        b->timestamp = prev->timestamp + 60;
+        b->target = (uint32_t)DarkGravityWaveTarget(prev, forkSet);
+        b->totalTx = 1;
+        if (j == 0) BRMerkleBlockSetTxHashes(b, &tx->txHash, 1, (const uint8_t *)"\x01", 1);
+        branch[j] = *b;
+        branch[j].hashes = branch[j].matchedHashes = NULL, branch[j].flags = NULL;
+        branch[j].height = prev->height + 1;
+        BRSetAdd(forkSet, &branch[j]);
+        PeerManagerRelayBlockTest(manager, p, b);
+        wtx = BRWalletTransactionForHash(w, tx->txHash);
+
+        if (! wtx || wtx->blockHeight != ((j < 4 || j == 6) ? height : TX_UNCONFIRMED))
+            r = 0, fprintf(stderr, "***FAILED*** %s: PeerManagerRelayBlock() reorg tx test (%zu)\n", __func__, j);
+    }
+
+    if (r && BRPeerManagerLastBlockHeight(manager) != height + 3)
+        r = 0, fprintf(stderr, "***FAILED*** %s: PeerManagerRelayBlock() reorg test\n", __func__);
+
+    BRSetFree(forkSet);
+
+    // a manager created later continues the chain from the header file, which a torn last record is dropped from, and
+    // only the records from the difficulty window before the last one are checked
+    BRPeerManager *restored = BRPeerManagerNew(&params, w, UINT32_MAX, NULL, 0, NULL, 0);
+    size_t work = PeerManagerWorkCountTest(restored);
+
+    height = BRPeerManagerLastBlockHeight(manager);
+
+    if (r && (! BRPeerManagerSetHeaderFile(restored, path) || BRPeerManagerLastBlockHeight(restored) != height ||
+              PeerManagerWorkCountTest(restored) - work > BLOCK_DIFFICULTY_INTERVAL*2))
+        r = 0, fprintf(stderr, "***FAILED*** %s: PeerManagerSetHeaderFile() test 2\n", __func__);
+
+    // the test chain's block hashes aren't proof-of-work hashes, so once the chain read from the file is verified it's
+    // dropped back to the checkpoint it started from, the file is let go of first so the tests below can still use it
+    if (r && (! BRPeerManagerSetHeaderFile(restored, NULL) ||
+              PeerManagerVerifyTest(restored) != params.checkpoints[params.checkpointsCount - 1].height))
+        r = 0, fprintf(stderr, "***FAILED*** %s: PeerManagerSetHeaderFile() verify test\n", __func__);
+
+    BRPeerManagerFree(restored);
+    restored = BRPeerManagerNew(&params, w, UINT32_MAX, NULL, 0, NULL, 0);
+
+    if (r && (ftruncate(fd, lseek(fd, 0, SEEK_END) - 1) != 0 || ! BRPeerManagerSetHeaderFile(restored, path) ||
+              BRPeerManagerLastBlockHeight(restored) != height - 1))
+        r = 0, fprintf(stderr, "***FAILED*** %s: PeerManagerSetHeaderFile() test 3\n", __func__);
+
+    if (r) { // the restored chain is extended by the block that was cut off
+        b = BRMerkleBlockNew();
+        *b = branch[6];
+        b->height = BLOCK_UNKNOWN_HEIGHT;
+
+        if (! PeerManagerAddBlockTest(restored, p, b)) {
+            r = 0, fprintf(stderr, "***FAILED*** %s: PeerManagerSetHeaderFile() test 4\n", __func__);
+            BRMerkleBlockFree(b);
+        }
+    }
+
+    BRPeerManagerFree(restored);
+    restored = BRPeerManagerNew(&params, w, UINT32_MAX, NULL, 0, NULL, 0);
+
+    // a header file chain that doesn't connect back to the manager's isn't continued from, the prevBlock of the second
+    // record, below the records that get checked, no longer links it to the first one at the checkpoint
+    if (r && (pwrite(fd, "\xff", 1, 16 + 116 + 4) != 1 || ! BRPeerManagerSetHeaderFile(restored, path) ||
+              BRPeerManagerLastBlockHeight(restored) != params.checkpoints[params.checkpointsCount - 1].height))
+        r = 0, fprintf(stderr, "***FAILED*** %s: PeerManagerSetHeaderFile() test 5\n", __func__);
+
+    BRPeerManagerFree(restored);
+    if (fd >= 0) close(fd), unlink(path);
+
+    // a rescan still finds the checkpoint after the main chain block with its hash has been released from the stored
+    // blocks, the loaded chain starts at the last checkpoint on a difficulty transition
+    BRMerkleBlock *loaded[3];
+    const BRCheckPoint *checkpoint = &params.checkpoints[params.checkpointsCount - 1];
+
+    while (checkpoint > params.checkpoints && (checkpoint->height % BLOCK_DIFFICULTY_INTERVAL) != 0) checkpoint--;
+
+    for (j = 0; j < 3; j++) {
+        b = loaded[j] = BRMerkleBlockNew();
+        if (j == 0) b->blockHash = UInt256Reverse(checkpoint->hash);
+        else SHA256(&b->blockHash, &j, sizeof(j)), b->prevBlock = loaded[j - 1]->blockHash;
+        b->height = checkpoint->height + (uint32_t)j;
+        b->timestamp = checkpoint->timestamp + (uint32_t)j*60;
+        b->target = checkpoint->target;
+    }
+
+    restored = BRPeerManagerNew(&params, w, checkpoint->timestamp + 7*24*60*60 + 1, loaded, 3, NULL, 0);
+
+    if (BRPeerManagerLastBlockHeight(restored) != checkpoint->height + 2 ||
+        PeerManagerRescanTest(restored) != checkpoint->height)
+        r = 0, fprintf(stderr, "***FAILED*** %s: PeerManagerRescan() checkpoint test\n", __func__);
+
+    BRPeerManagerFree(restored);
+
+    // a restored block whose header doesn't hash to its blockHash is dropped, along with the blocks after it, once the
+    // restored chain is verified
+    uint8_t header[80];
+
+    height = (params.checkpoints[params.checkpointsCount - 1].height / BLOCK_DIFFICULTY_INTERVAL + 1) *
+             BLOCK_DIFFICULTY_INTERVAL;
+
+    for (j = 0; j < 3; j++) {
+        BRMerkleBlockSerialize(&(BRMerkleBlock) { .version = 0x20000000, .timestamp = (uint32_t)time(NULL),
+            .prevBlock = (j > 0) ? loaded[j - 1]->blockHash : UINT256_ZERO, .nonce = (uint32_t)j }, header, 80);
+        loaded[j] = BRMerkleBlockParse(header, sizeof(header));
+        loaded[j]->height = height + (uint32_t)j;
+    }
+
+    loaded[1]->nonce++;
+    restored = BRPeerManagerNew(&params, w, UINT32_MAX, loaded, 3, NULL, 0);
+
+    if (BRPeerManagerLastBlockHeight(restored) != height + 2 || PeerManagerVerifyTest(restored) != height)
+        r = 0, fprintf(stderr, "***FAILED*** %s: PeerManagerVerifyTest() test\n", __func__);
+
+    BRPeerManagerFree(restored);
+
+    BRPeerManagerFree(manager);
+    BRSetFree(windowSet);
+    BRPeerFree(p);
+    BRWalletFree(w);
+    return r;
+}
+
 int scriptValidationTest() {
 
     int fails = 0;
@@ -2133,6 +3373,8 @@ int RunTests() {
     printf("%s\n", (Base58Tests()) ? "success" : (fail++, "***FAIL***"));
     printf("HashTests...                      ");
     printf("%s\n", (HashTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("SHA256ImplementationTests...      ");
+    printf("%s\n", (SHA256ImplementationTests()) ? "success" : (fail++, "***FAIL***"));
     printf("MacTests...                       ");
     printf("%s\n", (MacTests()) ? "success" : (fail++, "***FAIL***"));
     printf("DrbgTests...                      ");
@@ -2153,16 +3395,26 @@ int RunTests() {
     printf("%s\n", (AddressTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BIP39MnemonicTests...             ");
     printf("%s\n", (BIP39MnemonicTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("KeyDerivationTests...             ");
+    printf("%s\n", (KeyDerivationTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BIP32SequenceTests...             ");
     printf("%s\n", (BIP32SequenceTests()) ? "success" : (fail++, "***FAIL***"));
     printf("TransactionTests...               ");
     printf("%s\n", (TransactionTests()) ? "success" : (fail++, "***FAIL***"));
     printf("WalletTests...                    ");
     printf("%s\n", (WalletTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("WalletBalanceTests...             ");
+    printf("%s\n", (WalletBalanceTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BloomFilterTests...               ");
     printf("%s\n", (BloomFilterTests()) ? "success" : (fail++, "***FAIL***"));
     printf("MerkleBlockTests...               ");
     printf("%s\n", (MerkleBlockTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("PeerEventLoopTests...             ");
+    printf("%s\n", (PeerEventLoopTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("PeerFramingTests...               ");
+    printf("%s\n", (PeerFramingTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("PeerManagerTests...               ");
+    printf("%s\n", (PeerManagerTests()) ? "success" : (fail++, "***FAIL***"));
     printf("\n");
     printf("%s\n", (scriptValidationTest()) ? "success" : (fail++, "***FAIL***"));
     printf("\n");